@@ -50,5 +50,92 @@ run_trial user 2001::1 somehost ::2 1234 nomatch "IP6 network"
 run_trial user ::5 somehost ::1 1234 match3 "IP6 localaddress"
 run_trial user ::5 somehost ::2 5678 match4 "IP6 localport"
 
+# Overlapping networks, negation in either order and a mix of families
+# and wildcards in one list.
+cp $OBJ/sshd_proxy_bak $OBJ/sshd_proxy
+cat >>$OBJ/sshd_proxy <<EOD
+ForceCommand nomatch
+Match Address 10.0.0.0/8,10.1.0.0/16,!10.1.2.0/24,10.1.2.3
+	ForceCommand overlap
+Match Address !172.16.1.0/24,172.16.0.0/12
+	ForceCommand negfirst
+Match Address 2001:db8::/32,!2001:db8:1::/48,198.51.100.0/24,!198.51.100.7,198.18.0.*,!198.18.0.5
+	ForceCommand mixed
+EOD
+
+run_trial user 10.9.9.9 somehost 1.2.3.4 1234 overlap "overlap outer"
+run_trial user 10.1.3.1 somehost 1.2.3.4 1234 overlap "overlap inner"
+run_trial user 10.1.2.4 somehost 1.2.3.4 1234 nomatch "overlap negated"
+run_trial user 10.1.2.3 somehost 1.2.3.4 1234 nomatch "host in negated net"
+run_trial user 172.20.0.1 somehost 1.2.3.4 1234 negfirst "negation first"
+run_trial user 172.16.1.5 somehost 1.2.3.4 1234 nomatch "negated first"
+run_trial user 172.32.0.1 somehost 1.2.3.4 1234 nomatch "past network"
+run_trial user 2001:db8::1 somehost 1.2.3.4 1234 mixed "mixed IP6"
+run_trial user 2001:db8:1::1 somehost 1.2.3.4 1234 nomatch "mixed IP6 negated"
+run_trial user 2001:db9::1 somehost 1.2.3.4 1234 nomatch "mixed IP6 no match"
+run_trial user 198.51.100.1 somehost 1.2.3.4 1234 mixed "mixed IP4"
+run_trial user 198.51.100.7 somehost 1.2.3.4 1234 nomatch "mixed IP4 negated"
+run_trial user 198.18.0.9 somehost 1.2.3.4 1234 mixed "mixed wildcard"
+run_trial user 198.18.0.5 somehost 1.2.3.4 1234 nomatch "mixed wildcard negated"
+
+# An IPv4 network must not match IPv6 addresses and vice versa.
+cp $OBJ/sshd_proxy_bak $OBJ/sshd_proxy
+cat >>$OBJ/sshd_proxy <<EOD
+ForceCommand nomatch
+Match Address 0.0.0.0/0
+	ForceCommand allv4
+Match Address ::/0
+	ForceCommand allv6
+EOD
+
+run_trial user 203.0.113.1 somehost 1.2.3.4 1234 allv4 "all IP4"
+run_trial user 2001:db8::1 somehost 1.2.3.4 1234 allv6 "all IP6"
+run_trial user ::1 somehost 1.2.3.4 1234 allv6 "IP6 loopback"
+
+# Compiled lists are cached by their text. A list that is seen again
+# must give the same answer, whether it is still cached or was evicted
+# by later lists, and a changed list must not reuse the old one.
+cp $OBJ/sshd_proxy_bak $OBJ/sshd_proxy
+cat >>$OBJ/sshd_proxy <<EOD
+ForceCommand nomatch
+Match Address 10.0.0.0/8,!10.1.0.0/16 LocalPort 1111
+	ForceCommand unused1
+Match Address 10.0.0.0/8,!10.2.0.0/16
+	ForceCommand changed
+Match Address 10.0.0.0/8,!10.1.0.0/16
+	ForceCommand cached
+Match Address 172.16.0.0/12,!172.17.0.0/16 LocalPort 1111
+	ForceCommand unused2
+EOD
+n=1
+while [ $n -le 20 ]; do
+	printf "Match Address 192.0.2.$n\n\tForceCommand filler$n\n"
+	n=`expr $n + 1`
+done >>$OBJ/sshd_proxy
+cat >>$OBJ/sshd_proxy <<EOD
+Match Address 172.16.0.0/12,!172.17.0.0/16
+	ForceCommand evicted
+EOD
+
+run_trial user 10.1.0.1 somehost 1.2.3.4 1234 changed "changed list"
+run_trial user 10.2.0.1 somehost 1.2.3.4 1234 cached "cached list"
+run_trial user 10.3.0.1 somehost 1.2.3.4 1111 unused1 "cached list first"
+run_trial user 172.16.0.1 somehost 1.2.3.4 1234 evicted "evicted list"
+run_trial user 172.17.0.1 somehost 1.2.3.4 1234 nomatch "evicted list negated"
+run_trial user 192.0.2.20 somehost 1.2.3.4 1234 filler20 "last filler"
+
+# Malformed lists are errors wherever the bad entry is.
+for list in "10.0.0.0/8,10.1.2.3/8" "10.0.0.0/8,,192.168.0.1" \
+    "10.0.0.0/8,1.2.3.4/33" "10.0.0.0/8,!" "2001:db8::/129,10.0.0.0/8"; do
+	cp $OBJ/sshd_proxy_bak $OBJ/sshd_proxy
+	cat >>$OBJ/sshd_proxy <<EOD
+ForceCommand nomatch
+Match Address $list
+	ForceCommand malformed
+EOD
+	run_trial user 10.0.0.1 somehost 1.2.3.4 1234 "" "malformed $list" \
+	    2>/dev/null
+done
+
 cp $OBJ/sshd_proxy_bak $OBJ/sshd_proxy
 rm $OBJ/sshd_proxy_bak
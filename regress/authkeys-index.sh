@@ -0,0 +1,86 @@
+#	Placed in the Public Domain.
+
+tid="authorized_keys index"
+
+AK=$OBJ/authorized_keys_$USER
+IDX=$AK.idx
+
+cp $AK $OBJ/authorized_keys_$USER.orig
+cp $OBJ/sshd_proxy $OBJ/sshd_proxy_bak
+
+# Filler lines hold another key of the same type and size as the user
+# key, without comments, so that a line of one can replace the other.
+bits=`${SSHKEYGEN} -l -f $OBJ/rsa.pub | awk '{ print $1 }'`
+rm -f $OBJ/ak-other $OBJ/ak-other.pub
+${SSHKEYGEN} -q -N '' -t rsa -b $bits -f $OBJ/ak-other ||
+	fatal "ssh-keygen failed"
+OTHER=`cut -d' ' -f1,2 $OBJ/ak-other.pub`
+MINE=`cut -d' ' -f1,2 $OBJ/rsa.pub`
+test ${#OTHER} -eq ${#MINE} || fatal "key lines differ in length"
+
+filler() {
+	n=0
+	while [ $n -lt 100 ]; do
+		echo "$OTHER"
+		n=`expr $n + 1`
+	done
+}
+
+trial() {
+	expect=$1
+	what=$2
+
+	trace "$what"
+	${SSH} -2 -F $OBJ/ssh_proxy somehost true
+	r=$?
+	if [ $expect = ok -a $r -ne 0 ]; then
+		fail "$what: connect failed"
+	elif [ $expect = fail -a $r -eq 0 ]; then
+		fail "$what: connect succeeded"
+	fi
+}
+
+(filler; echo "$MINE"; filler) > $AK
+
+rm -f $IDX
+(cat $OBJ/sshd_proxy_bak; echo AuthorizedKeysIndex no) > $OBJ/sshd_proxy
+trial ok "index disabled"
+test -f $IDX && fail "index saved while disabled"
+
+(cat $OBJ/sshd_proxy_bak; echo AuthorizedKeysIndex yes) > $OBJ/sshd_proxy
+trial ok "index build"
+test -f $IDX || fail "index not saved"
+cp $IDX $OBJ/ak-idx
+trial ok "index load"
+cmp -s $IDX $OBJ/ak-idx || fail "current index rewritten"
+
+# Editing the file makes the saved index stale.
+(filler; filler) > $AK
+trial fail "stale index, key removed"
+cmp -s $IDX $OBJ/ak-idx && fail "stale index not rebuilt"
+(filler; echo "$MINE"; filler; filler) > $AK
+trial ok "stale index, key added"
+
+# An index that matches the size and times of the file but not its
+# contents, as the user could make by restoring the times after an
+# edit, must be rebuilt too.
+(filler; echo "$OTHER"; filler) > $AK
+touch -t 201301010000 $AK
+trial fail "forged index setup"
+(filler; echo "$MINE"; filler) > $AK
+touch -t 201301010000 $AK
+cp $IDX $OBJ/ak-idx
+trial ok "forged index"
+cmp -s $IDX $OBJ/ak-idx && fail "forged index not rebuilt"
+
+# Neither is one that lists the key at the wrong line.
+(echo "$MINE"; filler; echo "$OTHER"; filler) > $AK
+touch -t 201301010000 $AK
+trial ok "forged index, moved key setup"
+(echo "$OTHER"; filler; echo "$MINE"; filler) > $AK
+touch -t 201301010000 $AK
+trial ok "forged index, moved key"
+
+cp $OBJ/sshd_proxy_bak $OBJ/sshd_proxy
+cp $OBJ/authorized_keys_$USER.orig $AK
+rm -f $IDX $OBJ/ak-idx $OBJ/ak-other $OBJ/ak-other.pub
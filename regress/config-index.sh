@@ -0,0 +1,75 @@
+#	Placed in the Public Domain.
+
+tid="ssh_config index"
+
+CFG=$OBJ/cf-config
+IDX=$CFG.idx
+
+# $1 goes before the first Host line; $2 is the last line of a block for
+# another host. "Bogus" lines are the same length as "Port" ones, so that
+# a file that only a full read finds fault with can be forged.
+mkconfig() {
+	(echo "$1"; cat $OBJ/ssh_proxy; echo "Host other"; echo "$2") > $CFG
+	touch -t 201301010000 $CFG
+}
+
+trial() {
+	expect=$1
+	what=$2
+	shift 2
+
+	trace "$what"
+	${SSH} -F $CFG "$@" somehost true
+	r=$?
+	if [ $expect = ok -a $r -ne 0 ]; then
+		fail "$what: connect failed"
+	elif [ $expect = fail -a $r -eq 0 ]; then
+		fail "$what: connect succeeded"
+	fi
+}
+
+rm -f $IDX
+mkconfig "" "	Port 4242"
+trial ok "index disabled" -o ConfigIndex=no
+test -f $IDX && fail "index saved while disabled"
+trial ok "index not enabled"
+test -f $IDX && fail "index saved by default"
+
+trial ok "index build" -o ConfigIndex=yes
+test -f $IDX || fail "index not saved"
+cp $IDX $OBJ/cf-idx
+
+# With the block for the other host broken behind the index's back, the
+# connection only succeeds if that block is skipped.
+mkconfig "" "	Bogus 242"
+trial ok "index used" -o ConfigIndex=yes
+cmp -s $IDX $OBJ/cf-idx || fail "current index rewritten"
+trial fail "index disabled, index present" -o ConfigIndex=no
+trial fail "index not enabled, index present"
+
+# Enabling it before the first Host line of the file counts too.
+rm -f $IDX
+mkconfig "ConfigIndex yes" "	Port 4242"
+trial ok "index build from file"
+test -f $IDX || fail "index not saved from file"
+mkconfig "ConfigIndex yes" "	Bogus 242"
+trial ok "index used from file"
+mkconfig "ConfigIndex no " "	Bogus 242"
+trial fail "index disabled from file"
+
+# A changed file makes the index stale.
+mkconfig "" "	Port 4242"
+trial ok "stale index setup" -o ConfigIndex=yes
+cp $IDX $OBJ/cf-idx
+(cat $CFG; echo "	Bogus 242") > $OBJ/cf-tmp
+cat $OBJ/cf-tmp > $CFG
+touch -t 201301010000 $CFG
+trial fail "stale index" -o ConfigIndex=yes
+mkconfig "" "	Port 4242"
+(cat $CFG; echo "Host another"; echo "	Port 4242") > $OBJ/cf-tmp
+cat $OBJ/cf-tmp > $CFG
+touch -t 201301010000 $CFG
+trial ok "stale index rebuilt" -o ConfigIndex=yes
+cmp -s $IDX $OBJ/cf-idx && fail "stale index not rebuilt"
+
+rm -f $CFG $IDX $OBJ/cf-idx $OBJ/cf-tmp
@@ -0,0 +1,88 @@
+#	Placed in the Public Domain.
+
+tid="known_hosts index"
+
+KH=$OBJ/known_hosts
+IDX=$OBJ/known_hosts.idx
+
+cp $KH $OBJ/kh-orig
+
+rm -f $OBJ/kh-other $OBJ/kh-other.pub
+${SSHKEYGEN} -q -N '' -t rsa -f $OBJ/kh-other || fatal "ssh-keygen failed"
+OTHER=`cat $OBJ/kh-other.pub`
+
+# Filler for other hosts: plain names, hashed names and patterns.
+rm -f $OBJ/kh-filler $OBJ/kh-filler.old
+n=0
+while [ $n -lt 200 ]; do
+	echo "host$n.example.com,10.0.`expr $n / 250`.`expr $n % 250` $OTHER"
+	n=`expr $n + 1`
+done > $OBJ/kh-filler
+${SSHKEYGEN} -q -H -f $OBJ/kh-filler >/dev/null || fatal "ssh-keygen -H failed"
+rm -f $OBJ/kh-filler.old
+echo "*.example.org $OTHER" >> $OBJ/kh-filler
+echo "!foo.example.net,*.example.net $OTHER" >> $OBJ/kh-filler
+echo "# comment" >> $OBJ/kh-filler
+
+# A revocation for the real host key on a line that is too long to be
+# read; every lookup path must skip it the same way.
+longline() {
+	printf '@revoked localhost-with-alias '
+	tr -d '\n' < $OBJ/rsa.pub
+	awk 'BEGIN { for (i = 0; i < 1500; i++) printf " padding"; print "" }'
+}
+
+# Connect once with the index disabled and twice with it enabled (the
+# first builds and saves the index, the second reads it back); all three
+# must agree.
+check() {
+	expect=$1
+	what=$2
+
+	rm -f $IDX
+	trace "$what: no index"
+	${SSH} -F $OBJ/ssh_proxy -oKnownHostsIndex=no somehost true
+	r=$?
+	if [ $expect = ok -a $r -ne 0 ]; then
+		fail "$what: connect without index failed"
+	elif [ $expect = fail -a $r -eq 0 ]; then
+		fail "$what: connect without index succeeded"
+	fi
+	test -f $IDX && fail "$what: index saved while disabled"
+
+	for pass in build load; do
+		trace "$what: index $pass"
+		${SSH} -F $OBJ/ssh_proxy -oKnownHostsIndex=yes somehost true
+		r=$?
+		if [ $expect = ok -a $r -ne 0 ]; then
+			fail "$what: connect with index ($pass) failed"
+		elif [ $expect = fail -a $r -eq 0 ]; then
+			fail "$what: connect with index ($pass) succeeded"
+		fi
+		test -f $IDX || fail "$what: index not saved"
+	done
+
+	# A stale index must be ignored.
+	echo "# touched" >> $KH
+	trace "$what: stale index"
+	${SSH} -F $OBJ/ssh_proxy -oKnownHostsIndex=yes somehost true
+	r=$?
+	if [ $expect = ok -a $r -ne 0 ]; then
+		fail "$what: connect with stale index failed"
+	elif [ $expect = fail -a $r -eq 0 ]; then
+		fail "$what: connect with stale index succeeded"
+	fi
+}
+
+(cat $OBJ/kh-filler; longline; cat $OBJ/kh-orig) > $KH
+check ok "known key"
+
+(cat $OBJ/kh-filler; cat $OBJ/kh-orig; longline) > $KH
+check ok "known key before long line"
+
+(cat $OBJ/kh-filler; longline; printf 'localhost-with-alias,127.0.0.1,::1 '
+    echo "$OTHER") > $KH
+check fail "changed key"
+
+cp $OBJ/kh-orig $KH
+rm -f $IDX $OBJ/kh-orig $OBJ/kh-filler $OBJ/kh-other $OBJ/kh-other.pub
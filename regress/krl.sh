@@ -33,6 +33,17 @@ serial: 799
 serial: 599-701
 EOF
 
+# The same serials in ascending order, as the streamed writer prefers them.
+cat << EOF >> $OBJ/revoked-serials-sorted
+serial: 1-4
+serial: 10
+serial: 15
+serial: 30
+serial: 50
+serial: 500-799
+serial: 999
+EOF
+
 # A specification that revokes some certificated by key ID.
 touch $OBJ/revoked-keyid
 for n in 1 2 3 4 10 15 30 50 `jot 500 300` 999 1000 1001 1002; do
@@ -93,6 +104,8 @@ $SSHKEYGEN $OPTS -kf $OBJ/krl-serial -s $OBJ/revoked-ca $OBJ/revoked-serials \
 	>/dev/null || fatal "$SSHKEYGEN KRL failed"
 $SSHKEYGEN $OPTS -kf $OBJ/krl-keyid -s $OBJ/revoked-ca.pub $OBJ/revoked-keyid \
 	>/dev/null || fatal "$SSHKEYGEN KRL failed"
+$SSHKEYGEN $OPTS -kf $OBJ/krl-sorted -s $OBJ/revoked-ca.pub \
+    $OBJ/revoked-serials-sorted >/dev/null || fatal "$SSHKEYGEN KRL failed"
 }
 
 verbose "$tid: generating KRLs"
@@ -149,3 +162,89 @@ test_all    "$REVOKED_KEYS"    "revoked keys" yes  yes     no     no     no   no
 test_all  "$UNREVOKED_KEYS"  "unrevoked keys"  no   no     no     no     no   no
 test_all   "$REVOKED_CERTS"   "revoked certs" yes  yes    yes    yes    yes  yes
 test_all "$UNREVOKED_CERTS" "unrevoked certs"  no   no     no     no     no  yes
+
+# KRL contents without the generation date, which follows the magic,
+# format version and KRL version.
+krl_nodate() {
+	dd if=$1 bs=20 count=1 2>/dev/null
+	tail -c +29 $1
+}
+
+# Streamed KRLs should be identical to those written from memory, apart
+# from krl-serial whose serials are out of order and so encoded as
+# separate runs; it must still revoke the same certificates.
+KRLS="empty keys cert all ca keyid sorted"
+same_krls() {
+	for f in $KRLS ; do
+		krl_nodate $OBJ/krl-$f.mem > $OBJ/krl-cmp.mem
+		krl_nodate $OBJ/krl-$f > $OBJ/krl-cmp
+		cmp -s $OBJ/krl-cmp.mem $OBJ/krl-cmp ||
+			fail "streamed KRL $f differs from in-memory KRL: $1"
+	done
+	rm -f $OBJ/krl-cmp.mem $OBJ/krl-cmp
+}
+
+verbose "$tid: testing streamed KRLs"
+genkrls
+for f in $KRLS serial ; do
+	cp -f $OBJ/krl-$f $OBJ/krl-$f.mem
+done
+# Sorted and unsorted serials give the same KRL when merged in memory.
+cmp -s $OBJ/krl-serial.mem $OBJ/krl-sorted.mem ||
+	fail "in-memory KRL depends on serial order"
+genkrls "-O stream"
+same_krls "new"
+#                                            keys  all serial  keyid  certs   CA
+test_all    "$REVOKED_KEYS"    "revoked keys" yes  yes     no     no     no   no
+test_all  "$UNREVOKED_KEYS"  "unrevoked keys"  no   no     no     no     no   no
+test_all   "$REVOKED_CERTS"   "revoked certs" yes  yes    yes    yes    yes  yes
+test_all "$UNREVOKED_CERTS" "unrevoked certs"  no   no     no     no     no  yes
+for f in $REVOKED_CERTS ; do
+	check_krl $f $OBJ/krl-sorted yes "streamed sorted serials"
+done
+
+verbose "$tid: testing streamed KRL update"
+for f in $OBJ/krl-keys $OBJ/krl-cert $OBJ/krl-all $OBJ/krl-ca \
+    $OBJ/krl-serial $OBJ/krl-keyid $OBJ/krl-sorted ; do
+	cp -f $OBJ/krl-empty $f
+	genkrls "-u -O stream"
+done
+same_krls "update"
+#                                            keys  all serial  keyid  certs   CA
+test_all    "$REVOKED_KEYS"    "revoked keys" yes  yes     no     no     no   no
+test_all  "$UNREVOKED_KEYS"  "unrevoked keys"  no   no     no     no     no   no
+test_all   "$REVOKED_CERTS"   "revoked certs" yes  yes    yes    yes    yes  yes
+test_all "$UNREVOKED_CERTS" "unrevoked certs"  no   no     no     no     no  yes
+
+# An update appends new serials after those already in the KRL.
+verbose "$tid: testing streamed KRL append"
+head -4 $OBJ/revoked-serials-sorted > $OBJ/revoked-serials-1
+tail -n +5 $OBJ/revoked-serials-sorted > $OBJ/revoked-serials-2
+$SSHKEYGEN -O stream -kf $OBJ/krl-append -s $OBJ/revoked-ca.pub \
+    $OBJ/revoked-serials-1 >/dev/null || fatal "$SSHKEYGEN KRL failed"
+$SSHKEYGEN -O stream -ukf $OBJ/krl-append -s $OBJ/revoked-ca.pub \
+    $OBJ/revoked-serials-2 >/dev/null || fatal "$SSHKEYGEN KRL failed"
+for f in $REVOKED_CERTS ; do
+	check_krl $f $OBJ/krl-append yes "streamed append"
+done
+for f in $UNREVOKED_CERTS ; do
+	check_krl $f $OBJ/krl-append no "streamed append"
+done
+
+# Updates must not be limited to the size of a key file. Far apart serials
+# are listed individually, so these make a KRL of over 1MB.
+verbose "$tid: testing streamed update of a large KRL"
+awk 'BEGIN { for (i = 1; i <= 150000; i++) print "serial: " 100000 + i * 1000 }' \
+    > $OBJ/revoked-serials-large
+$SSHKEYGEN -O stream -kf $OBJ/krl-large -s $OBJ/revoked-ca.pub \
+    $OBJ/revoked-serials-large >/dev/null || fatal "$SSHKEYGEN KRL failed"
+size=`wc -c < $OBJ/krl-large`
+test $size -gt 1048576 || fatal "large KRL is only $size bytes"
+$SSHKEYGEN -O stream -ukf $OBJ/krl-large -s $OBJ/revoked-ca.pub \
+    $OBJ/revoked-serials-sorted >/dev/null || fail "large KRL update failed"
+for f in $REVOKED_CERTS ; do
+	check_krl $f $OBJ/krl-large yes "streamed large update"
+done
+for f in $UNREVOKED_CERTS ; do
+	check_krl $f $OBJ/krl-large no "streamed large update"
+done
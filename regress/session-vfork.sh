@@ -0,0 +1,46 @@
+#	Placed in the Public Domain.
+
+tid="vfork session start"
+
+if [ -z "$SUDO" ]; then
+	fatal "need SUDO to run sshd as root, test won't work without"
+fi
+
+# The command line of the shell, its directory and its environment.
+CMD='ps -o args= -p $$; pwd; env | sort'
+
+cp $OBJ/sshd_proxy $OBJ/sshd_proxy.bak
+
+# With privilege separation the session runs as the user and may be
+# started with vfork(); without it sshd is still root and do_child()
+# has to switch users in a forked child. Both must start the same thing.
+for privsep in yes no; do
+	trace "privsep $privsep"
+	(
+		grep -vi UsePrivilegeSeparation $OBJ/sshd_proxy.bak
+		echo UsePrivilegeSeparation $privsep
+	) > $OBJ/sshd_proxy
+	before=`grep -c "without fork" $TEST_SSHD_LOGFILE`
+	_XXX_TEST=session ${SSH} -F $OBJ/ssh_proxy -oSendEnv=_XXX_TEST \
+	    somehost "$CMD" > $OBJ/session-$privsep
+	r=$?
+	after=`grep -c "without fork" $TEST_SSHD_LOGFILE`
+	if [ $r -ne 0 ]; then
+		fail "privsep $privsep: connect failed"
+	fi
+	if [ $privsep = yes -a $before -eq $after ]; then
+		fail "privsep $privsep: command was not started with vfork"
+	elif [ $privsep = no -a $before -ne $after ]; then
+		fail "privsep $privsep: command was started with vfork"
+	fi
+	egrep -v '^SSH_(CLIENT|CONNECTION)=' $OBJ/session-$privsep \
+	    > $OBJ/session-$privsep.out
+done
+
+grep -q '^_XXX_TEST=session$' $OBJ/session-yes.out || \
+	fail "accepted environment not passed"
+diff $OBJ/session-no.out $OBJ/session-yes.out || \
+	fail "vfork and fork started different commands"
+
+cp $OBJ/sshd_proxy.bak $OBJ/sshd_proxy
+rm -f $OBJ/session-yes* $OBJ/session-no*
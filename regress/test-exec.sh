@@ -214,6 +214,20 @@ fatal ()
 	exit $RESULT
 }
 
+# Write an integer of $1 bytes, big-endian as sshbuf stores it
+put_int ()
+{
+	_n=$1
+	_v=$(($2))
+	_s=""
+	while [ $_n -gt 0 ]; do
+		_s="$(printf '\\%03o' $((_v & 255)))$_s"
+		_v=$((_v >> 8))
+		_n=$((_n - 1))
+	done
+	printf "$_s"
+}
+
 RESULT=0
 PIDFILE=$OBJ/pidfile
 
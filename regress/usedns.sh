@@ -0,0 +1,124 @@
+#	Placed in the Public Domain.
+
+tid="background reverse lookups"
+
+if [ -z "$SUDO" ]; then
+	fatal "need SUDO to write /var/db/sshd_dns, test won't work without"
+fi
+
+DNSDIR=/var/db/sshd_dns
+MAGIC=0x535348444e530001
+ADDR=127.0.0.1
+DNSFILE=$DNSDIR/`printf '%s' $ADDR | openssl dgst -sha256 | sed 's/^.*= *//'`
+SSHD_ORIG=$SSHD
+
+# Plant a cached name $3 for $ADDR, looked up at time $1 and owned by $2.
+plant() {
+	(put_int 8 $MAGIC; put_int 8 $1
+	    printf '%s' $ADDR | openssl dgst -sha256 -binary
+	    put_int 4 ${#3}; printf '%s' "$3") > $OBJ/dnscache
+	$SUDO mkdir -p -m 700 $DNSDIR
+	$SUDO cp $OBJ/dnscache $DNSFILE
+	$SUDO chmod 600 $DNSFILE
+	$SUDO chown $2 $DNSFILE
+}
+
+# The forced command tells which name sshd found for the client.
+trial() {
+	expect=$1
+	what=$2
+
+	trace "$what"
+	got=`${SSH} -F $OBJ/ssh_config somehost echo name`
+	if [ "$got" != "$expect" ]; then
+		fail "$what: expected \"$expect\", got \"$got\""
+	fi
+}
+
+stop_sshd() {
+	$SUDO kill `$SUDO cat $PIDFILE`
+	i=0
+	while [ -f $PIDFILE -a $i -lt 10 ]; do
+		i=`expr $i + 1`
+		sleep $i
+	done
+	rm -f $PIDFILE
+}
+
+cp $OBJ/sshd_config $OBJ/sshd_config.bak
+cat << EOF >> $OBJ/sshd_config
+UseDNS yes
+DNSCacheTime 1h
+Match Host planted.example.com
+	ForceCommand echo planted
+Match Host $ADDR
+	ForceCommand echo address
+EOF
+
+$SUDO rm -rf $DNSDIR
+start_sshd
+
+# Whatever the resolver says, it must not be the planted name.
+trace "uncached lookup"
+base=`${SSH} -F $OBJ/ssh_config somehost echo name`
+test -z "$base" && fatal "connect failed"
+test "$base" = planted && fatal "uncached lookup found planted name"
+$SUDO test -f $DNSFILE || fail "lookup not saved"
+perm=`$SUDO ls -ln $DNSFILE | awk '{ print $1, $3 }'`
+test "$perm" = "-rw------- 0" || fail "lookup saved as $perm"
+
+now=`date +%s`
+plant $now root planted.example.com
+trial planted "cache hit"
+
+plant $((now - 7200)) root planted.example.com
+trial $base "stale entry"
+$SUDO grep -q planted $DNSFILE && fail "stale entry not replaced"
+
+plant $((now + 7200)) root planted.example.com
+trial $base "entry from the future"
+
+plant $now $USER planted.example.com
+trial $base "entry not owned by root"
+
+# The listener empties the cache when it is restarted.
+plant $now root planted.example.com
+$SUDO kill -HUP `$SUDO cat $PIDFILE`
+sleep 1
+i=0
+while [ ! -f $PIDFILE -a $i -lt 10 ]; do
+	i=`expr $i + 1`
+	sleep $i
+done
+test -f $PIDFILE || fatal "sshd did not restart"
+$SUDO test -f $DNSFILE && fail "cached name kept across SIGHUP"
+stop_sshd
+
+# A resolver that never answers: the lookup must be abandoned after
+# DNSTimeout and the address used instead.
+cp $OBJ/sshd_config.bak $OBJ/sshd_config
+cat << EOF >> $OBJ/sshd_config
+UseDNS yes
+DNSTimeout 2
+Match Host $ADDR
+	ForceCommand echo address
+EOF
+cat << EOF > $OBJ/resolv.conf
+nameserver 192.0.2.1
+lookup bind
+EOF
+SSHD="env ASR_CONFIG=$OBJ/resolv.conf $SSHD_ORIG"
+start_sshd
+SSHD=$SSHD_ORIG
+start=`date +%s`
+trial address "lookup timeout"
+end=`date +%s`
+if [ $((end - start)) -gt 10 ]; then
+	fail "lookup timeout: waited $((end - start)) seconds"
+fi
+grep -q "Reverse mapping of $ADDR timed out" $TEST_SSHD_LOGFILE || \
+	fail "lookup timeout: lookup did not time out"
+
+cp $OBJ/sshd_config.bak $OBJ/sshd_config
+$SUDO rm -rf $DNSDIR
+rm -f $OBJ/dnscache $OBJ/resolv.conf $OBJ/sshd_config.bak
@@ -0,0 +1,135 @@
+#	Placed in the Public Domain.
+
+tid="group cache"
+
+if [ -z "$SUDO" ]; then
+	fatal "need SUDO to write /var/db/sshd_groups, test won't work without"
+fi
+
+GRDIR=/var/db/sshd_groups
+GROUP=sshtest-nosuchgroup
+MAGIC=0x5353484752505301
+
+# The cache key: the user name and primary group.
+grkey() {
+	put_int 4 ${#USER}
+	printf '%s' "$USER"
+	put_int 4 `id -g`
+}
+GRFILE=$GRDIR/`grkey | openssl dgst -sha256 | sed 's/^.*= *//'`
+
+# Plant a cached group list containing $GROUP, fetched at time $1, with
+# mode $2 and owner $3.
+plant() {
+	(put_int 8 $MAGIC; put_int 8 $1; grkey | openssl dgst -sha256 -binary
+	    put_int 4 1; put_int 4 ${#GROUP}; printf '%s' "$GROUP") > $OBJ/grcache
+	$SUDO mkdir -p -m 700 $GRDIR
+	$SUDO sh -c "rm -f $GRDIR/*"
+	$SUDO cp $OBJ/grcache $GRFILE
+	$SUDO chmod $2 $GRFILE
+	$SUDO chown $3 $GRFILE
+}
+
+# Unknown users are keyed by name alone.
+UNMAGIC=0x53534855534e4b01
+unkey() {
+	put_int 4 ${#1}
+	printf '%s' "$1"
+}
+UNFILE=$GRDIR/`unkey $USER | openssl dgst -sha256 | sed 's/^.*= *//'`
+NOUSER=sshtest-nosuchuser
+NOFILE=$GRDIR/`unkey $NOUSER | openssl dgst -sha256 | sed 's/^.*= *//'`
+
+# Plant a record that $USER does not exist, made at time $1 and owned by $2.
+plant_unknown() {
+	(put_int 8 $UNMAGIC; put_int 8 $1
+	    unkey $USER | openssl dgst -sha256 -binary) > $OBJ/grcache
+	$SUDO mkdir -p -m 700 $GRDIR
+	$SUDO sh -c "rm -f $GRDIR/*"
+	$SUDO cp $OBJ/grcache $UNFILE
+	$SUDO chmod 600 $UNFILE
+	$SUDO chown $2 $UNFILE
+}
+
+trial() {
+	expect=$1
+	what=$2
+
+	trace "$what"
+	${SSH} -F $OBJ/ssh_proxy somehost true
+	r=$?
+	if [ $expect = ok -a $r -ne 0 ]; then
+		fail "$what: connect failed"
+	elif [ $expect = fail -a $r -eq 0 ]; then
+		fail "$what: connect succeeded"
+	fi
+}
+
+cp $OBJ/sshd_proxy $OBJ/sshd_proxy.bak
+cp $OBJ/sshd_config $OBJ/sshd_config.bak
+(
+	cat $OBJ/sshd_proxy.bak
+	echo UserCacheTime 1h
+	echo AllowGroups $GROUP
+) > $OBJ/sshd_proxy
+echo UserCacheTime 1h >> $OBJ/sshd_config
+
+# Only a cached list can put the user in $GROUP.
+$SUDO rm -rf $GRDIR
+trial fail "no cache"
+$SUDO test -f $GRFILE || fail "group list not saved"
+perm=`$SUDO ls -ln $GRFILE | awk '{ print $1, $3 }'`
+test "$perm" = "-rw------- 0" || fail "group list saved as $perm"
+
+now=`date +%s`
+plant $now 600 root
+trial ok "fresh list"
+
+plant $((now - 7200)) 600 root
+trial fail "stale list"
+
+plant $((now + 7200)) 600 root
+trial fail "list from the future"
+
+plant $now 644 root
+trial fail "group readable list"
+
+plant $now 600 $USER
+trial fail "list not owned by root"
+
+# The listener empties the cache when it is restarted.
+plant $now 600 root
+start_sshd
+$SUDO kill -HUP `$SUDO cat $PIDFILE`
+sleep 1
+i=0
+while [ ! -f $PIDFILE -a $i -lt 10 ]; do
+	i=`expr $i + 1`
+	sleep $i
+done
+test -f $PIDFILE || fatal "sshd did not restart"
+$SUDO test -f $GRFILE && fail "group list kept across SIGHUP"
+
+# Unknown users are remembered for at most a minute.
+(cat $OBJ/sshd_proxy.bak; echo UserCacheTime 1h) > $OBJ/sshd_proxy
+$SUDO rm -rf $GRDIR
+trace "unknown user"
+${SSH} -F $OBJ/ssh_proxy -l $NOUSER somehost true &&
+	fail "unknown user: connect succeeded"
+$SUDO test -f $NOFILE || fail "unknown user not saved"
+trial ok "known user not saved as unknown"
+$SUDO test -f $UNFILE && fail "known user saved as unknown"
+
+plant_unknown $now root
+trial fail "cached unknown user"
+
+plant_unknown $((now - 120)) root
+trial ok "stale unknown user"
+
+plant_unknown $now $USER
+trial ok "unknown user not owned by root"
+
+cp $OBJ/sshd_proxy.bak $OBJ/sshd_proxy
+cp $OBJ/sshd_config.bak $OBJ/sshd_config
+$SUDO rm -rf $GRDIR
+rm -f $OBJ/grcache $OBJ/sshd_config.bak
@@ -18,6 +18,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/queue.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -30,6 +31,14 @@
 #include "match.h"
 #include "log.h"
 
+#define ADDR_LIST_CACHE		16
+#define ADDR_LIST_MAX_NODES	(1024 * 1024)
+#define VALID_CIDR_CHARS	"0123456789abcdefABCDEF.:/"
+
+/* Node flags */
+#define ADDR_NODE_MATCH		0x01
+#define ADDR_NODE_NEGATE	0x02
+
 struct xaddr {
 	sa_family_t	af;
 	union {
@@ -357,6 +366,235 @@ addr_netmatch(const struct xaddr *host, const struct xaddr *net, u_int masklen)
 	return addr_cmp(&tmp_result, net);
 }
 
+/*
+ * A compiled address list. CIDR entries are held in a binary trie with
+ * one level per address bit, rooted at node 0 for IPv4 and node 1 for
+ * IPv6, so that an address is matched against all of them in a single
+ * walk. Wildcard patterns and scoped IPv6 networks are checked one by
+ * one. Only well-formed lists are compiled; lists with errors are left
+ * to the scanning code below, which reports them.
+ */
+struct addr_trie_node {
+	u_int		child[2];	/* 0 if absent */
+	u_int		flags;		/* ADDR_NODE_* */
+};
+
+struct addr_list_entry {
+	char		*pattern;	/* wildcard pattern, or NULL */
+	struct xaddr	addr;		/* otherwise a scoped network */
+	u_int		masklen;
+	int		negate;
+};
+
+struct addr_list {
+	char		*list;
+	int		cidr_only;
+	struct addr_trie_node *nodes;
+	u_int		nnodes;
+	struct addr_list_entry *entries;
+	u_int		nentries;
+	TAILQ_ENTRY(addr_list) next;
+};
+
+static TAILQ_HEAD(addr_list_head, addr_list) addr_list_cache =
+    TAILQ_HEAD_INITIALIZER(addr_list_cache);
+static u_int addr_list_ncache;
+
+static void
+addr_list_free(struct addr_list *al)
+{
+	u_int i;
+
+	if (al == NULL)
+		return;
+	for (i = 0; i < al->nentries; i++)
+		free(al->entries[i].pattern);
+	free(al->entries);
+	free(al->nodes);
+	free(al->list);
+	free(al);
+}
+
+static int
+addr_list_add_node(struct addr_list *al, u_int *nodep)
+{
+	struct addr_trie_node *tmp;
+
+	if (al->nnodes >= ADDR_LIST_MAX_NODES)
+		return -1;
+	if ((tmp = realloc(al->nodes,
+	    (al->nnodes + 1) * sizeof(*al->nodes))) == NULL)
+		return -1;
+	al->nodes = tmp;
+	memset(&al->nodes[al->nnodes], '\0', sizeof(*al->nodes));
+	*nodep = al->nnodes++;
+	return 0;
+}
+
+static int
+addr_list_add_net(struct addr_list *al, const struct xaddr *net,
+    u_int masklen, int negate)
+{
+	u_int i, bit, node, child;
+
+	node = net->af == AF_INET ? 0 : 1;
+	for (i = 0; i < masklen; i++) {
+		bit = (net->addr8[i / 8] >> (7 - (i % 8))) & 1;
+		if (al->nodes[node].child[bit] == 0) {
+			if (addr_list_add_node(al, &child) != 0)
+				return -1;
+			al->nodes[node].child[bit] = child;
+		}
+		node = al->nodes[node].child[bit];
+	}
+	al->nodes[node].flags |= negate ? ADDR_NODE_NEGATE : ADDR_NODE_MATCH;
+	return 0;
+}
+
+static int
+addr_list_add_entry(struct addr_list *al, const char *pattern,
+    const struct xaddr *net, u_int masklen, int negate)
+{
+	struct addr_list_entry *tmp, *e;
+
+	if ((tmp = realloc(al->entries,
+	    (al->nentries + 1) * sizeof(*al->entries))) == NULL)
+		return -1;
+	al->entries = tmp;
+	e = &al->entries[al->nentries];
+	memset(e, '\0', sizeof(*e));
+	if (pattern != NULL && (e->pattern = strdup(pattern)) == NULL)
+		return -1;
+	if (net != NULL)
+		memcpy(&e->addr, net, sizeof(e->addr));
+	e->masklen = masklen;
+	e->negate = negate;
+	al->nentries++;
+	return 0;
+}
+
+/*
+ * Compile a list in the format accepted by addr_match_list() or, if
+ * cidr_only is set, addr_match_cidr_list(). Returns NULL if the list is
+ * not well-formed or memory is exhausted.
+ */
+static struct addr_list *
+addr_list_compile(const char *_list, int cidr_only)
+{
+	struct addr_list *al;
+	struct xaddr net;
+	char *list, *cp, *o;
+	u_int masklen, root;
+	int r, neg, ok = 0;
+
+	if ((al = calloc(1, sizeof(*al))) == NULL)
+		return NULL;
+	al->cidr_only = cidr_only;
+	if ((al->list = strdup(_list)) == NULL ||
+	    addr_list_add_node(al, &root) != 0 ||
+	    addr_list_add_node(al, &root) != 0 ||
+	    (o = list = strdup(_list)) == NULL) {
+		addr_list_free(al);
+		return NULL;
+	}
+	while ((cp = strsep(&list, ",")) != NULL) {
+		neg = !cidr_only && *cp == '!';
+		if (neg)
+			cp++;
+		if (*cp == '\0')
+			goto out;
+		if (cidr_only && (strlen(cp) > INET6_ADDRSTRLEN + 3 ||
+		    strspn(cp, VALID_CIDR_CHARS) != strlen(cp)))
+			goto out;
+		r = addr_pton_cidr(cp, &net, &masklen);
+		if (r == -1 && !cidr_only) {
+			if (addr_list_add_entry(al, cp, NULL, 0, neg) != 0)
+				goto out;
+			continue;
+		}
+		if (r != 0)
+			goto out;
+		if (net.af == AF_INET6 && net.scope_id != 0)
+			r = addr_list_add_entry(al, NULL, &net, masklen, neg);
+		else
+			r = addr_list_add_net(al, &net, masklen, neg);
+		if (r != 0)
+			goto out;
+	}
+	ok = 1;
+ out:
+	free(o);
+	if (!ok) {
+		addr_list_free(al);
+		return NULL;
+	}
+	return al;
+}
+
+/* Look up or compile a list, returning NULL if it could not be compiled */
+static struct addr_list *
+addr_list_get(const char *list, int cidr_only)
+{
+	struct addr_list *al;
+
+	TAILQ_FOREACH(al, &addr_list_cache, next) {
+		if (al->cidr_only == cidr_only && strcmp(al->list, list) == 0) {
+			TAILQ_REMOVE(&addr_list_cache, al, next);
+			TAILQ_INSERT_HEAD(&addr_list_cache, al, next);
+			return al;
+		}
+	}
+	if ((al = addr_list_compile(list, cidr_only)) == NULL)
+		return NULL;
+	if (addr_list_ncache >= ADDR_LIST_CACHE) {
+		struct addr_list *last;
+
+		last = TAILQ_LAST(&addr_list_cache, addr_list_head);
+		TAILQ_REMOVE(&addr_list_cache, last, next);
+		addr_list_free(last);
+		addr_list_ncache--;
+	}
+	TAILQ_INSERT_HEAD(&addr_list_cache, al, next);
+	addr_list_ncache++;
+	return al;
+}
+
+/*
+ * Match an address against a compiled list. Returns 1 on match, -1 on
+ * negated match or 0 if no entry matched.
+ */
+static int
+addr_list_match(const struct addr_list *al, const struct xaddr *try_addr,
+    const char *addr)
+{
+	const struct addr_list_entry *e;
+	u_int i, bit, node, nbits, flags = 0;
+
+	/* Scoped addresses can only match scoped networks */
+	if (try_addr->af == AF_INET || (try_addr->af == AF_INET6 &&
+	    try_addr->scope_id == 0)) {
+		node = try_addr->af == AF_INET ? 0 : 1;
+		nbits = addr_unicast_masklen(try_addr->af);
+		flags = al->nodes[node].flags;
+		for (i = 0; i < nbits; i++) {
+			bit = (try_addr->addr8[i / 8] >> (7 - (i % 8))) & 1;
+			if ((node = al->nodes[node].child[bit]) == 0)
+				break;
+			flags |= al->nodes[node].flags;
+		}
+	}
+	for (i = 0; i < al->nentries && !(flags & ADDR_NODE_NEGATE); i++) {
+		e = &al->entries[i];
+		if (e->pattern != NULL ?
+		    match_pattern(addr, e->pattern) == 1 :
+		    addr_netmatch(try_addr, &e->addr, e->masklen) == 0)
+			flags |= e->negate ? ADDR_NODE_NEGATE : ADDR_NODE_MATCH;
+	}
+	if (flags & ADDR_NODE_NEGATE)
+		return -1;
+	return (flags & ADDR_NODE_MATCH) ? 1 : 0;
+}
+
 /*
  * Match "addr" against list pattern list "_list", which may contain a
  * mix of CIDR addresses and old-school wildcards.
@@ -374,6 +612,7 @@ addr_match_list(const char *addr, const char *_list)
 {
 	char *list, *cp, *o;
 	struct xaddr try_addr, match_addr;
+	struct addr_list *al;
 	u_int masklen, neg;
 	int ret = 0, r;
 
@@ -381,6 +620,8 @@ addr_match_list(const char *addr, const char *_list)
 		debug2("%s: couldn't parse address %.100s", __func__, addr);
 		return 0;
 	}
+	if (addr != NULL && (al = addr_list_get(_list, 0)) != NULL)
+		return addr_list_match(al, &try_addr, addr);
 	if ((o = list = strdup(_list)) == NULL)
 		return -1;
 	while ((cp = strsep(&list, ",")) != NULL) {
@@ -434,6 +675,7 @@ addr_match_cidr_list(const char *addr, const char *_list)
 {
 	char *list, *cp, *o;
 	struct xaddr try_addr, match_addr;
+	struct addr_list *al;
 	u_int masklen;
 	int ret = 0, r;
 
@@ -441,6 +683,8 @@ addr_match_cidr_list(const char *addr, const char *_list)
 		debug2("%s: couldn't parse address %.100s", __func__, addr);
 		return 0;
 	}
+	if (addr != NULL && (al = addr_list_get(_list, 1)) != NULL)
+		return addr_list_match(al, &try_addr, addr);
 	if ((o = list = strdup(_list)) == NULL)
 		return -1;
 	while ((cp = strsep(&list, ",")) != NULL) {
@@ -464,7 +708,6 @@ addr_match_cidr_list(const char *addr, const char *_list)
 			ret = -1;
 			break;
 		}
-#define VALID_CIDR_CHARS "0123456789abcdefABCDEF.:/"
 		if (strspn(cp, VALID_CIDR_CHARS) != strlen(cp)) {
 			error("%s: list entry \"%.100s\" contains invalid "
 			    "characters", __func__, cp);
@@ -0,0 +1,319 @@
+/* $OpenBSD$ */
+/*
+ * Cache of AuthorizedKeysCommand output.
+ *
+ * The output of the command is kept for a configurable time, keyed by
+ * the command, the user being authenticated and the user the command
+ * runs as. Every connection has its own monitor, so besides a small
+ * in-process cache the output is also stored in a root-only directory,
+ * one file per key. The file is locked while the command runs, so that
+ * concurrent logins for the same user wait for a single invocation and
+ * then read its result instead of running the command themselves.
+ *
+ * Placed in the public domain
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/queue.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include "xmalloc.h"
+#include "log.h"
+#include "atomicio.h"
+#include "pathnames.h"
+#include "sshbuf.h"
+#include "err.h"
+#include "auth-cmdcache.h"
+
+#define CMDCACHE_MAGIC		0x53534841434d4401ULL	/* "SSHACMD\1" */
+#define CMDCACHE_ENTRIES	4
+#define CMDCACHE_HEADER_LEN	(8 + 8 + SHA256_DIGEST_LENGTH + 4)
+
+struct cmdcache_entry {
+	u_char	digest[SHA256_DIGEST_LENGTH];
+	time_t	fetched;
+	struct sshbuf *output;
+	TAILQ_ENTRY(cmdcache_entry) next;
+};
+
+static TAILQ_HEAD(cmdcache_head, cmdcache_entry) cmdcache =
+    TAILQ_HEAD_INITIALIZER(cmdcache);
+static u_int cmdcache_nentries;
+
+static int
+cmdcache_digest(const char *command, const char *user, const char *runas,
+    u_char *digest)
+{
+	struct sshbuf *b;
+	int r;
+
+	if ((b = sshbuf_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	if ((r = sshbuf_put_cstring(b, command)) != 0 ||
+	    (r = sshbuf_put_cstring(b, user)) != 0 ||
+	    (r = sshbuf_put_cstring(b, runas)) != 0)
+		goto out;
+	SHA256(sshbuf_ptr(b), sshbuf_len(b), digest);
+ out:
+	sshbuf_free(b);
+	return r;
+}
+
+static int
+cmdcache_fresh(time_t fetched, time_t now, u_int ttl)
+{
+	return fetched <= now && (u_int64_t)(now - fetched) < ttl;
+}
+
+static void
+cmdcache_entry_free(struct cmdcache_entry *e)
+{
+	if (e == NULL)
+		return;
+	sshbuf_free(e->output);
+	free(e);
+}
+
+static struct cmdcache_entry *
+cmdcache_lookup(const u_char *digest, time_t now, u_int ttl)
+{
+	struct cmdcache_entry *e;
+
+	TAILQ_FOREACH(e, &cmdcache, next) {
+		if (memcmp(e->digest, digest, sizeof(e->digest)) != 0)
+			continue;
+		TAILQ_REMOVE(&cmdcache, e, next);
+		if (!cmdcache_fresh(e->fetched, now, ttl)) {
+			cmdcache_nentries--;
+			cmdcache_entry_free(e);
+			return NULL;
+		}
+		TAILQ_INSERT_HEAD(&cmdcache, e, next);
+		return e;
+	}
+	return NULL;
+}
+
+/* Takes ownership of output */
+static void
+cmdcache_insert(const u_char *digest, time_t fetched, struct sshbuf *output)
+{
+	struct cmdcache_entry *e;
+
+	if (cmdcache_nentries >= CMDCACHE_ENTRIES) {
+		e = TAILQ_LAST(&cmdcache, cmdcache_head);
+		TAILQ_REMOVE(&cmdcache, e, next);
+		cmdcache_nentries--;
+		cmdcache_entry_free(e);
+	}
+	e = xcalloc(1, sizeof(*e));
+	memcpy(e->digest, digest, sizeof(e->digest));
+	e->fetched = fetched;
+	e->output = output;
+	TAILQ_INSERT_HEAD(&cmdcache, e, next);
+	cmdcache_nentries++;
+}
+
+/*
+ * Open and lock the shared file for digest, creating the cache directory
+ * if necessary. Returns -1 if the shared cache cannot be used.
+ */
+static int
+cmdcache_lock(const u_char *digest)
+{
+	char path[sizeof(_PATH_SSH_KEYS_COMMAND_CACHE) +
+	    SHA256_DIGEST_LENGTH * 2 + 1];
+	struct stat st;
+	size_t i, len;
+	int fd;
+
+	if (mkdir(_PATH_SSH_KEYS_COMMAND_CACHE, 0700) == -1 &&
+	    errno != EEXIST) {
+		debug("%s: mkdir %s: %s", __func__,
+		    _PATH_SSH_KEYS_COMMAND_CACHE, strerror(errno));
+		return -1;
+	}
+	if (lstat(_PATH_SSH_KEYS_COMMAND_CACHE, &st) == -1 ||
+	    !S_ISDIR(st.st_mode) || st.st_uid != 0 ||
+	    (st.st_mode & 077) != 0) {
+		error("%s: bad ownership or modes for directory %s",
+		    __func__, _PATH_SSH_KEYS_COMMAND_CACHE);
+		return -1;
+	}
+	len = strlcpy(path, _PATH_SSH_KEYS_COMMAND_CACHE "/", sizeof(path));
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		len += snprintf(path + len, sizeof(path) - len, "%02x",
+		    digest[i]);
+
+	if ((fd = open(path, O_RDWR|O_CREAT|O_NOFOLLOW, 0600)) == -1) {
+		debug("%s: open %s: %s", __func__, path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    st.st_uid != 0 || st.st_nlink != 1) {
+		error("%s: bad cache file %s", __func__, path);
+		close(fd);
+		return -1;
+	}
+	while (flock(fd, LOCK_EX) == -1) {
+		if (errno != EINTR) {
+			debug("%s: flock %s: %s", __func__, path,
+			    strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/* Read a fresh entry for digest from a locked cache file */
+static int
+cmdcache_read(int fd, const u_char *digest, time_t now, u_int ttl,
+    time_t *fetchedp, struct sshbuf *output)
+{
+	struct sshbuf *b = NULL;
+	struct stat st;
+	u_int64_t magic, fetched;
+	const u_char *d;
+	u_char *p;
+	size_t len;
+	int r;
+
+	if (fstat(fd, &st) == -1)
+		return SSH_ERR_SYSTEM_ERROR;
+	if (st.st_size < CMDCACHE_HEADER_LEN ||
+	    st.st_size > CMDCACHE_HEADER_LEN + AUTH_CMDCACHE_MAX_OUTPUT)
+		return SSH_ERR_INVALID_FORMAT;
+	if ((b = sshbuf_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	len = (size_t)st.st_size;
+	if ((r = sshbuf_reserve(b, len, &p)) != 0)
+		goto out;
+	if (lseek(fd, 0, SEEK_SET) == -1 ||
+	    atomicio(read, fd, p, len) != len) {
+		r = SSH_ERR_SYSTEM_ERROR;
+		goto out;
+	}
+	if ((r = sshbuf_get_u64(b, &magic)) != 0 ||
+	    (r = sshbuf_get_u64(b, &fetched)) != 0)
+		goto out;
+	if (magic != CMDCACHE_MAGIC || sshbuf_len(b) < SHA256_DIGEST_LENGTH ||
+	    memcmp(sshbuf_ptr(b), digest, SHA256_DIGEST_LENGTH) != 0) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	if ((r = sshbuf_consume(b, SHA256_DIGEST_LENGTH)) != 0 ||
+	    (r = sshbuf_get_string_direct(b, &d, &len)) != 0)
+		goto out;
+	if (sshbuf_len(b) != 0) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	if (!cmdcache_fresh((time_t)fetched, now, ttl)) {
+		r = SSH_ERR_KEY_NOT_FOUND;
+		goto out;
+	}
+	if ((r = sshbuf_put(output, d, len)) != 0)
+		goto out;
+	*fetchedp = (time_t)fetched;
+ out:
+	sshbuf_free(b);
+	return r;
+}
+
+/* Replace the contents of a locked cache file */
+static void
+cmdcache_write(int fd, const u_char *digest, time_t fetched,
+    const struct sshbuf *output)
+{
+	struct sshbuf *b;
+	int r;
+
+	if ((b = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_put_u64(b, CMDCACHE_MAGIC)) != 0 ||
+	    (r = sshbuf_put_u64(b, (u_int64_t)fetched)) != 0 ||
+	    (r = sshbuf_put(b, digest, SHA256_DIGEST_LENGTH)) != 0 ||
+	    (r = sshbuf_put_stringb(b, output)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	if (ftruncate(fd, 0) == -1 || lseek(fd, 0, SEEK_SET) == -1 ||
+	    atomicio(vwrite, fd, (void *)sshbuf_ptr(b),
+	    sshbuf_len(b)) != sshbuf_len(b)) {
+		debug("%s: write failed: %s", __func__, strerror(errno));
+		/* Leave an empty file rather than a partial entry */
+		if (ftruncate(fd, 0) == -1)
+			debug("%s: ftruncate: %s", __func__, strerror(errno));
+	}
+	sshbuf_free(b);
+}
+
+/*
+ * Return in output the output of command for user, running as runas, if
+ * it was fetched less than ttl seconds ago. Otherwise call fill to run
+ * the command and cache what it stores if it returns 0. Failed runs are
+ * not cached. Returns 0 on success or -1 if fill failed.
+ */
+int
+auth_cmdcache_get(const char *command, const char *user, const char *runas,
+    u_int ttl, struct sshbuf *output,
+    int (*fill)(struct sshbuf *, void *), void *ctx)
+{
+	u_char digest[SHA256_DIGEST_LENGTH];
+	struct cmdcache_entry *e;
+	struct sshbuf *b;
+	time_t now, fetched;
+	int r, fd;
+
+	if ((r = cmdcache_digest(command, user, runas, digest)) != 0)
+		fatal("%s: digest: %s", __func__, ssh_err(r));
+	now = time(NULL);
+	if ((e = cmdcache_lookup(digest, now, ttl)) != NULL) {
+		debug3("%s: using cached output of %s for %s", __func__,
+		    command, user);
+		if ((r = sshbuf_putb(output, e->output)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		return 0;
+	}
+
+	if ((b = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	/* Blocks while another process runs the command for this key */
+	fd = cmdcache_lock(digest);
+	now = time(NULL);
+	if (fd != -1 && cmdcache_read(fd, digest, now, ttl, &fetched, b) == 0) {
+		debug3("%s: using shared output of %s for %s", __func__,
+		    command, user);
+		close(fd);
+	} else {
+		sshbuf_reset(b);
+		if ((r = sshbuf_set_max_size(b,
+		    AUTH_CMDCACHE_MAX_OUTPUT)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		if (fill(b, ctx) != 0) {
+			if (fd != -1)
+				close(fd);
+			sshbuf_free(b);
+			return -1;
+		}
+		fetched = time(NULL);
+		if (fd != -1) {
+			cmdcache_write(fd, digest, fetched, b);
+			close(fd);
+		}
+	}
+	if ((r = sshbuf_putb(output, b)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	cmdcache_insert(digest, fetched, b);
+	return 0;
+}
@@ -0,0 +1,16 @@
+/* $OpenBSD$ */
+/*
+ * Placed in the public domain
+ */
+
+#ifndef AUTH_CMDCACHE_H
+#define AUTH_CMDCACHE_H
+
+#define AUTH_CMDCACHE_MAX_OUTPUT	(4 * 1024 * 1024)
+
+struct sshbuf;
+
+int	 auth_cmdcache_get(const char *, const char *, const char *, u_int,
+    struct sshbuf *, int (*)(struct sshbuf *, void *), void *);
+
+#endif
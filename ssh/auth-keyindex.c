@@ -0,0 +1,447 @@
+/* $OpenBSD$ */
+/*
+ * Compiled index for authorized_keys files.
+ *
+ * Checking a key against authorized_keys normally parses every key in
+ * the file on every attempt. The index maps a digest of each key to the
+ * offset and number of the line holding it, so that only the lines that
+ * can match the offered key have to be read and checked. Indexes are
+ * cached by (device, inode, mtime, size) of the file and may optionally
+ * be saved next to it as "<file>.idx". Since the user can write a saved
+ * index and set the times of the file, it also records a hash of the
+ * contents it was built from and is rebuilt if they have changed.
+ *
+ * Placed in the public domain
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include "xmalloc.h"
+#include "ssh.h"
+#include "key.h"
+#include "log.h"
+#include "misc.h"
+#include "atomicio.h"
+#include "sshbuf.h"
+#include "err.h"
+#include "auth-keyindex.h"
+
+#define KEYINDEX_MAGIC		0x535348414b494458ULL	/* "SSHAKIDX" */
+#define KEYINDEX_VERSION	2
+#define KEYINDEX_SUFFIX		".idx"
+#define KEYINDEX_CACHE		4
+#define KEYINDEX_MAX_ENTRIES	(1024 * 1024)
+#define KEYINDEX_HEADER_LEN	(8 + 4 + 8 + 8 + 8 + 4 + 8 + \
+				    SHA256_DIGEST_LENGTH + 4)
+#define KEYINDEX_ENTRY_LEN	(AUTH_KEYINDEX_DIGEST_LEN + 8 + 4)
+
+struct auth_keyindex {
+	dev_t	dev;
+	ino_t	ino;
+	off_t	size;
+	time_t	mtime;
+	long	mtime_nsec;
+	struct auth_keyindex_entry *entries;
+	size_t	nentries;
+	TAILQ_ENTRY(auth_keyindex) next;
+};
+
+static TAILQ_HEAD(auth_keyindex_head, auth_keyindex) keyindex_cache =
+    TAILQ_HEAD_INITIALIZER(keyindex_cache);
+static u_int keyindex_ncache;
+
+/*
+ * Skip the options at the start of an authorized_keys line and the
+ * whitespace that follows them.
+ */
+char *
+auth_skip_key_options(char *cp)
+{
+	int quoted = 0;
+
+	for (; *cp && (quoted || (*cp != ' ' && *cp != '\t')); cp++) {
+		if (*cp == '\\' && cp[1] == '"')
+			cp++;	/* Skip both */
+		else if (*cp == '"')
+			quoted = !quoted;
+	}
+	/* Skip remaining whitespace. */
+	for (; *cp == ' ' || *cp == '\t'; cp++)
+		;
+	return cp;
+}
+
+static int
+keyindex_digest(const struct sshkey *key, u_char *digest)
+{
+	u_char *blob, md[SHA256_DIGEST_LENGTH];
+	size_t blen;
+	int r;
+
+	if ((r = sshkey_plain_to_blob(key, &blob, &blen)) != 0)
+		return r;
+	SHA256(blob, blen, md);
+	memcpy(digest, md, AUTH_KEYINDEX_DIGEST_LEN);
+	bzero(md, sizeof(md));
+	free(blob);
+	return 0;
+}
+
+/* Hash the contents of the file that an index describes */
+static int
+keyindex_hash_file(FILE *f, u_char *digest)
+{
+	SHA256_CTX ctx;
+	char buf[8192];
+	size_t n;
+
+	rewind(f);
+	SHA256_Init(&ctx);
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		SHA256_Update(&ctx, buf, n);
+	SHA256_Final(digest, &ctx);
+	bzero(&ctx, sizeof(ctx));
+	if (ferror(f)) {
+		clearerr(f);
+		return -1;
+	}
+	rewind(f);
+	return 0;
+}
+
+static int
+keyindex_entry_cmp(const void *a, const void *b)
+{
+	const struct auth_keyindex_entry *ea = a, *eb = b;
+	int r;
+
+	if ((r = memcmp(ea->digest, eb->digest, sizeof(ea->digest))) != 0)
+		return r;
+	if (ea->offset != eb->offset)
+		return ea->offset < eb->offset ? -1 : 1;
+	return 0;
+}
+
+static void
+keyindex_free(struct auth_keyindex *idx)
+{
+	if (idx == NULL)
+		return;
+	free(idx->entries);
+	free(idx);
+}
+
+static void
+keyindex_set_stat(struct auth_keyindex *idx, const struct stat *st)
+{
+	idx->dev = st->st_dev;
+	idx->ino = st->st_ino;
+	idx->size = st->st_size;
+	idx->mtime = st->st_mtim.tv_sec;
+	idx->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static int
+keyindex_matches(const struct auth_keyindex *idx, const struct stat *st)
+{
+	return idx->dev == st->st_dev && idx->ino == st->st_ino &&
+	    idx->size == st->st_size && idx->mtime == st->st_mtim.tv_sec &&
+	    idx->mtime_nsec == st->st_mtim.tv_nsec;
+}
+
+/* Parse every key in the file, the same way check_authkeys_file() does */
+static struct auth_keyindex *
+keyindex_build(FILE *f, const char *file)
+{
+	char line[SSH_MAX_PUBKEY_BYTES], *cp;
+	struct auth_keyindex *idx;
+	struct auth_keyindex_entry *e;
+	struct sshkey *k;
+	size_t nalloc = 0;
+	u_long linenum = 0;
+	off_t offset;
+
+	if ((idx = calloc(1, sizeof(*idx))) == NULL)
+		return NULL;
+	rewind(f);
+	while (read_keyfile_line(f, file, line, sizeof(line), &linenum) != -1) {
+		offset = ftello(f) - strlen(line);
+
+		/* Skip leading whitespace, empty and comment lines. */
+		for (cp = line; *cp == ' ' || *cp == '\t'; cp++)
+			;
+		if (!*cp || *cp == '\n' || *cp == '#')
+			continue;
+
+		if ((k = sshkey_new(KEY_UNSPEC)) == NULL)
+			goto fail;
+		if (sshkey_read(k, &cp) != 0) {
+			cp = auth_skip_key_options(cp);
+			if (sshkey_read(k, &cp) != 0) {
+				sshkey_free(k);
+				continue;
+			}
+		}
+		if (idx->nentries >= KEYINDEX_MAX_ENTRIES) {
+			sshkey_free(k);
+			goto fail;
+		}
+		if (idx->nentries >= nalloc) {
+			nalloc = nalloc == 0 ? 256 : nalloc * 2;
+			if (reallocn((void **)&idx->entries, nalloc,
+			    sizeof(*idx->entries)) != 0) {
+				sshkey_free(k);
+				goto fail;
+			}
+		}
+		e = &idx->entries[idx->nentries];
+		if (keyindex_digest(k, e->digest) != 0) {
+			sshkey_free(k);
+			continue;
+		}
+		sshkey_free(k);
+		e->offset = offset;
+		e->linenum = linenum;
+		idx->nentries++;
+	}
+	if (idx->nentries > 0)
+		qsort(idx->entries, idx->nentries, sizeof(*idx->entries),
+		    keyindex_entry_cmp);
+	debug2("%s: %s: indexed %zu keys in %lu lines", __func__, file,
+	    idx->nentries, linenum);
+	return idx;
+ fail:
+	keyindex_free(idx);
+	return NULL;
+}
+
+static struct auth_keyindex *
+keyindex_load(const char *file, struct passwd *pw, const struct stat *kst,
+    const u_char *hash)
+{
+	struct auth_keyindex *idx = NULL;
+	struct auth_keyindex_entry *e;
+	struct sshbuf *b = NULL;
+	struct stat st;
+	char *path;
+	u_char *cp, ihash[SHA256_DIGEST_LENGTH];
+	u_int64_t magic, dev, ino, size, mtime, offset;
+	u_int32_t version, nsec, n, linenum, i;
+	int fd, r;
+
+	xasprintf(&path, "%s%s", file, KEYINDEX_SUFFIX);
+	fd = open(path, O_RDONLY|O_NOFOLLOW|O_NONBLOCK);
+	free(path);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    (st.st_uid != 0 && st.st_uid != pw->pw_uid) ||
+	    (st.st_mode & 022) != 0 || st.st_size < KEYINDEX_HEADER_LEN ||
+	    st.st_size > KEYINDEX_HEADER_LEN +
+	    (off_t)KEYINDEX_MAX_ENTRIES * KEYINDEX_ENTRY_LEN)
+		goto out;
+	if ((b = sshbuf_new()) == NULL ||
+	    sshbuf_reserve(b, st.st_size, &cp) != 0 ||
+	    atomicio(read, fd, cp, st.st_size) != (size_t)st.st_size)
+		goto out;
+	if ((r = sshbuf_get_u64(b, &magic)) != 0 ||
+	    (r = sshbuf_get_u32(b, &version)) != 0 ||
+	    (r = sshbuf_get_u64(b, &dev)) != 0 ||
+	    (r = sshbuf_get_u64(b, &ino)) != 0 ||
+	    (r = sshbuf_get_u64(b, &mtime)) != 0 ||
+	    (r = sshbuf_get_u32(b, &nsec)) != 0 ||
+	    (r = sshbuf_get_u64(b, &size)) != 0 ||
+	    (r = sshbuf_get(b, ihash, sizeof(ihash))) != 0 ||
+	    (r = sshbuf_get_u32(b, &n)) != 0)
+		goto out;
+	if (magic != KEYINDEX_MAGIC || version != KEYINDEX_VERSION ||
+	    dev != (u_int64_t)kst->st_dev || ino != (u_int64_t)kst->st_ino ||
+	    mtime != (u_int64_t)kst->st_mtim.tv_sec ||
+	    nsec != (u_int32_t)kst->st_mtim.tv_nsec ||
+	    size != (u_int64_t)kst->st_size ||
+	    timingsafe_bcmp(ihash, hash, sizeof(ihash)) != 0 ||
+	    n > KEYINDEX_MAX_ENTRIES ||
+	    sshbuf_len(b) != (size_t)n * KEYINDEX_ENTRY_LEN) {
+		debug2("%s: %s: stale index", __func__, file);
+		goto out;
+	}
+	if ((idx = calloc(1, sizeof(*idx))) == NULL ||
+	    (n > 0 && (idx->entries = calloc(n, sizeof(*e))) == NULL))
+		goto fail;
+	for (i = 0; i < n; i++) {
+		e = &idx->entries[i];
+		if (sshbuf_get(b, e->digest, sizeof(e->digest)) != 0 ||
+		    sshbuf_get_u64(b, &offset) != 0 ||
+		    sshbuf_get_u32(b, &linenum) != 0 ||
+		    offset > size)
+			goto fail;
+		e->offset = offset;
+		e->linenum = linenum;
+		/* lookups depend on the sort order */
+		if (i > 0 && keyindex_entry_cmp(e - 1, e) >= 0)
+			goto fail;
+	}
+	idx->nentries = n;
+	keyindex_set_stat(idx, kst);
+	debug2("%s: %s: loaded index of %u keys", __func__, file, n);
+	goto out;
+ fail:
+	debug2("%s: %s: corrupt index", __func__, file);
+	keyindex_free(idx);
+	idx = NULL;
+ out:
+	close(fd);
+	sshbuf_free(b);
+	return idx;
+}
+
+/* Called with the uid of the user, who owns the saved index */
+static void
+keyindex_save(const struct auth_keyindex *idx, const char *file,
+    const u_char *hash)
+{
+	const struct auth_keyindex_entry *e;
+	struct sshbuf *b;
+	char *path = NULL, *tmp = NULL;
+	size_t i;
+	int fd, r;
+
+	if ((b = sshbuf_new()) == NULL)
+		return;
+	if ((r = sshbuf_put_u64(b, KEYINDEX_MAGIC)) != 0 ||
+	    (r = sshbuf_put_u32(b, KEYINDEX_VERSION)) != 0 ||
+	    (r = sshbuf_put_u64(b, idx->dev)) != 0 ||
+	    (r = sshbuf_put_u64(b, idx->ino)) != 0 ||
+	    (r = sshbuf_put_u64(b, idx->mtime)) != 0 ||
+	    (r = sshbuf_put_u32(b, idx->mtime_nsec)) != 0 ||
+	    (r = sshbuf_put_u64(b, idx->size)) != 0 ||
+	    (r = sshbuf_put(b, hash, SHA256_DIGEST_LENGTH)) != 0 ||
+	    (r = sshbuf_put_u32(b, idx->nentries)) != 0)
+		goto out;
+	for (i = 0; i < idx->nentries; i++) {
+		e = &idx->entries[i];
+		if ((r = sshbuf_put(b, e->digest, sizeof(e->digest))) != 0 ||
+		    (r = sshbuf_put_u64(b, e->offset)) != 0 ||
+		    (r = sshbuf_put_u32(b, e->linenum)) != 0)
+			goto out;
+	}
+	xasprintf(&path, "%s%s", file, KEYINDEX_SUFFIX);
+	xasprintf(&tmp, "%s.XXXXXXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1) {
+		debug("%s: mkstemp %s: %s", __func__, tmp, strerror(errno));
+		goto out;
+	}
+	if (atomicio(vwrite, fd, (void *)sshbuf_ptr(b),
+	    sshbuf_len(b)) != sshbuf_len(b) || close(fd) != 0 ||
+	    rename(tmp, path) == -1) {
+		debug("%s: write %s: %s", __func__, path, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+	debug2("%s: saved index %s", __func__, path);
+ out:
+	free(path);
+	free(tmp);
+	sshbuf_free(b);
+}
+
+/*
+ * Return the index for the open authorized_keys file f, building it if
+ * neither the cache nor (if 'persist' is set) a saved index is current.
+ * The index stays owned by the cache.
+ */
+struct auth_keyindex *
+auth_keyindex_get(FILE *f, const char *file, struct passwd *pw, int persist)
+{
+	struct auth_keyindex *idx;
+	struct stat st;
+	u_char hash[SHA256_DIGEST_LENGTH];
+
+	if (fstat(fileno(f), &st) == -1)
+		return NULL;
+	TAILQ_FOREACH(idx, &keyindex_cache, next) {
+		if (keyindex_matches(idx, &st)) {
+			TAILQ_REMOVE(&keyindex_cache, idx, next);
+			TAILQ_INSERT_HEAD(&keyindex_cache, idx, next);
+			return idx;
+		}
+	}
+	if (persist && keyindex_hash_file(f, hash) != 0)
+		persist = 0;
+	idx = persist ? keyindex_load(file, pw, &st, hash) : NULL;
+	if (idx == NULL) {
+		if ((idx = keyindex_build(f, file)) == NULL)
+			return NULL;
+		keyindex_set_stat(idx, &st);
+		if (persist)
+			keyindex_save(idx, file, hash);
+	}
+	TAILQ_INSERT_HEAD(&keyindex_cache, idx, next);
+	if (++keyindex_ncache > KEYINDEX_CACHE) {
+		struct auth_keyindex *old = TAILQ_LAST(&keyindex_cache,
+		    auth_keyindex_head);
+
+		TAILQ_REMOVE(&keyindex_cache, old, next);
+		keyindex_free(old);
+		keyindex_ncache--;
+	}
+	return idx;
+}
+
+/*
+ * Find the entries for a key. Entries for the same key are adjacent and
+ * in file order; their number is returned in *np.
+ */
+const struct auth_keyindex_entry *
+auth_keyindex_lookup(const struct auth_keyindex *idx,
+    const struct sshkey *key, size_t *np)
+{
+	u_char digest[AUTH_KEYINDEX_DIGEST_LEN];
+	size_t lo = 0, hi = idx->nentries, mid;
+
+	*np = 0;
+	if (keyindex_digest(key, digest) != 0)
+		return NULL;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(idx->entries[mid].digest, digest,
+		    sizeof(digest)) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (hi = lo; hi < idx->nentries && memcmp(idx->entries[hi].digest,
+	    digest, sizeof(digest)) == 0; hi++)
+		;
+	if (hi == lo)
+		return NULL;
+	*np = hi - lo;
+	return &idx->entries[lo];
+}
+
+/*
+ * Position f at the start of an indexed line. An offset is only trusted
+ * if it follows a newline, so that an index that does not match the
+ * file can never cause a line to be parsed from its middle.
+ */
+int
+auth_keyindex_seek(FILE *f, off_t offset)
+{
+	if (offset <= 0)
+		return offset == 0 ? fseeko(f, 0, SEEK_SET) : -1;
+	if (fseeko(f, offset - 1, SEEK_SET) == -1 || fgetc(f) != '\n')
+		return -1;
+	return 0;
+}
@@ -0,0 +1,26 @@
+/* $OpenBSD$ */
+/*
+ * Placed in the public domain
+ */
+
+#ifndef AUTH_KEYINDEX_H
+#define AUTH_KEYINDEX_H
+
+#define AUTH_KEYINDEX_DIGEST_LEN	16
+
+struct auth_keyindex_entry {
+	u_char	digest[AUTH_KEYINDEX_DIGEST_LEN];	/* of the plain key */
+	off_t	offset;					/* start of line */
+	u_long	linenum;
+};
+
+struct auth_keyindex;
+
+char	*auth_skip_key_options(char *);
+struct auth_keyindex *auth_keyindex_get(FILE *, const char *,
+    struct passwd *, int);
+const struct auth_keyindex_entry *auth_keyindex_lookup(
+    const struct auth_keyindex *, const struct sshkey *, size_t *);
+int	 auth_keyindex_seek(FILE *, off_t);
+
+#endif
@@ -60,6 +60,7 @@
 #include "err.h"
 #include "krl.h"
 #include "compat.h"
+#include "pwcache.h"
 
 /* import */
 extern ServerOptions options;
@@ -509,7 +510,16 @@ getpwnamallow(const char *user)
 	ci->user = user;
 	parse_server_match_config(&options, ci);
 
-	pw = getpwnam(user);
+	if (pwcache_user_unknown(user))
+		pw = NULL;
+	else {
+		errno = 0;
+		pw = getpwnam(user);
+		/* Don't let a failing directory service lock users out */
+		if (pw == NULL && (errno == 0 || errno == ENOENT ||
+		    errno == ESRCH))
+			pwcache_user_unknown_put(user);
+	}
 	if (pw == NULL) {
 		logit("Invalid user %.100s from %.100s",
 		    user, ssh_remote_ipaddr(ssh));
@@ -111,7 +111,11 @@ int	 auth_rhosts_rsa_key_allowed(struct passwd *, char *, char *,
     struct sshkey *);
 int	 hostbased_key_allowed(struct passwd *, const char *, char *,
     struct sshkey *);
+int	 hostbased_key_allowed_verify(struct passwd *, const char *, char *,
+    struct sshkey *, const u_char *, size_t, const u_char *, size_t, u_int);
 int	 user_key_allowed(struct passwd *, struct sshkey *);
+int	 user_key_allowed_verify(struct passwd *, struct sshkey *,
+    const u_char *, size_t, const u_char *, size_t, u_int);
 void	 pubkey_auth_info(struct authctxt *, const struct sshkey *,
     const char *, ...)
 	    __attribute__((__format__ (printf, 3, 4)));
@@ -91,7 +91,7 @@ userauth_hostbased(struct ssh *ssh)
 		    __func__, pkalg);
 		goto done;
 	}
-	if ((r = sshkey_from_blob(pkblob, blen, &key)) != 0) {
+	if ((r = sshkey_from_blob_cached(pkblob, blen, &key)) != 0) {
 		error("%s: key_from_blob: %s", __func__, ssh_err(r));
 		goto done;
 	}
@@ -127,11 +127,9 @@ userauth_hostbased(struct ssh *ssh)
 	    "client user \"%.100s\", client host \"%.100s\"", cuser, chost);
 
 	/* test for allowed key and correct signature */
-	authenticated = 0;
-	if (PRIVSEP(hostbased_key_allowed(authctxt->pw, cuser, chost, key)) &&
-	    PRIVSEP(sshkey_verify(key, sig, slen,
-	    sshbuf_ptr(b), sshbuf_len(b), ssh->compat)) == 0)
-		authenticated = 1;
+	authenticated = PRIVSEP(hostbased_key_allowed_verify(authctxt->pw,
+	    cuser, chost, key, sig, slen, sshbuf_ptr(b), sshbuf_len(b),
+	    ssh->compat));
 
 	sshbuf_free(b);
 done:
@@ -223,6 +221,16 @@ hostbased_key_allowed(struct passwd *pw, const char *cuser, char *chost,
 	return (host_status == HOST_OK);
 }
 
+/* return 1 if hostkey is allowed and made the signature over data */
+int
+hostbased_key_allowed_verify(struct passwd *pw, const char *cuser,
+    char *chost, struct sshkey *key, const u_char *sig, size_t siglen,
+    const u_char *data, size_t datalen, u_int compat)
+{
+	return hostbased_key_allowed(pw, cuser, chost, key) &&
+	    sshkey_verify(key, sig, siglen, data, datalen, compat) == 0;
+}
+
 struct authmethod method_hostbased = {
 	"hostbased",
 	userauth_hostbased,
@@ -62,6 +62,8 @@
 #include "authfile.h"
 #include "match.h"
 #include "err.h"
+#include "auth-keyindex.h"
+#include "auth-cmdcache.h"
 
 /* import */
 extern ServerOptions options;
@@ -110,7 +112,7 @@ userauth_pubkey(struct ssh *ssh)
 		    pkalg);
 		goto done;
 	}
-	if ((r = sshkey_from_blob(pkblob, blen, &key)) != 0) {
+	if ((r = sshkey_from_blob_cached(pkblob, blen, &key)) != 0) {
 		error("%s: could not parse key: %s", __func__, ssh_err(r));
 		goto done;
 	}
@@ -170,11 +172,9 @@ userauth_pubkey(struct ssh *ssh)
 		pubkey_auth_info(authctxt, key, NULL);
 
 		/* test for correct signature */
-		authenticated = 0;
-		if (PRIVSEP(user_key_allowed(authctxt->pw, key)) &&
-		    PRIVSEP(sshkey_verify(key, sig, slen, sshbuf_ptr(b),
-		    sshbuf_len(b), ssh->compat)) == 0)
-			authenticated = 1;
+		authenticated = PRIVSEP(user_key_allowed_verify(authctxt->pw,
+		    key, sig, slen, sshbuf_ptr(b), sshbuf_len(b),
+		    ssh->compat));
 		sshbuf_free(b);
 		free(sig);
 	} else {
@@ -326,6 +326,99 @@ match_principals_file(char *file, struct passwd *pw, struct sshkey_cert *cert)
 	return 0;
 }
 
+/*
+ * Checks whether key is allowed by a single authorized_keys-format line,
+ * returns 1 if the key is allowed, 0 if not and -1 on error.
+ */
+static int
+check_authkeys_line(char *line, char *file, u_long linenum,
+    struct sshkey *key, struct passwd *pw)
+{
+	const char *reason;
+	int found_key = 0;
+	struct sshkey *found;
+	char *cp, *fp, *key_options = NULL;
+
+	found = sshkey_new(sshkey_is_cert(key) ? KEY_UNSPEC : key->type);
+	if (found == NULL)
+		return -1;
+	auth_clear_options();
+
+	/* Skip leading whitespace, empty and comment lines. */
+	for (cp = line; *cp == ' ' || *cp == '\t'; cp++)
+		;
+	if (!*cp || *cp == '\n' || *cp == '#')
+		goto done;
+
+	if (sshkey_read(found, &cp) != 0) {
+		/* no key?  check if there are options for this key */
+		debug2("user_key_allowed: check options: '%s'", cp);
+		key_options = cp;
+		cp = auth_skip_key_options(cp);
+		if (sshkey_read(found, &cp) != 0) {
+			debug2("user_key_allowed: advance: '%s'", cp);
+			/* still no key?  advance to next line*/
+			goto done;
+		}
+	}
+	if (sshkey_is_cert(key)) {
+		if (!sshkey_equal(found, key->cert->signature_key))
+			goto done;
+		if (auth_parse_options(pw, key_options, file,
+		    linenum) != 1)
+			goto done;
+		if (!key_is_cert_authority)
+			goto done;
+		fp = sshkey_fingerprint(found, SSH_FP_MD5,
+		    SSH_FP_HEX);
+		debug("matching CA found: file %s, line %lu, %s %s",
+		    file, linenum, sshkey_type(found), fp);
+		/*
+		 * If the user has specified a list of principals as
+		 * a key option, then prefer that list to matching
+		 * their username in the certificate principals list.
+		 */
+		if (authorized_principals != NULL &&
+		    !match_principals_option(authorized_principals,
+		    key->cert)) {
+			reason = "Certificate does not contain an "
+			    "authorized principal";
+ fail_reason:
+			free(fp);
+			error("%s", reason);
+			auth_debug_add("%s", reason);
+			goto done;
+		}
+		if (sshkey_cert_check_authority(key, 0, 0,
+		    authorized_principals == NULL ? pw->pw_name : NULL,
+		    &reason) != 0)
+			goto fail_reason;
+		if (auth_cert_options(key, pw) != 0) {
+			free(fp);
+			goto done;
+		}
+		verbose("Accepted certificate ID \"%s\" "
+		    "signed by %s CA %s via %s", key->cert->key_id,
+		    sshkey_type(found), fp, file);
+		free(fp);
+		found_key = 1;
+	} else if (sshkey_equal(found, key)) {
+		if (auth_parse_options(pw, key_options, file,
+		    linenum) != 1)
+			goto done;
+		if (key_is_cert_authority)
+			goto done;
+		found_key = 1;
+		fp = sshkey_fingerprint(found, SSH_FP_MD5, SSH_FP_HEX);
+		debug("matching key found: file %s, line %lu %s %s",
+		    file, linenum, sshkey_type(found), fp);
+		free(fp);
+	}
+ done:
+	sshkey_free(found);
+	return found_key;
+}
+
 /*
  * Checks whether key is allowed in authorized_keys-format file,
  * returns 1 if the key is allowed or 0 otherwise.
@@ -334,108 +427,65 @@ static int
 check_authkeys_file(FILE *f, char *file, struct sshkey *key, struct passwd *pw)
 {
 	char line[SSH_MAX_PUBKEY_BYTES];
-	const char *reason;
-	int found_key = 0;
+	int r, found_key = 0;
 	u_long linenum = 0;
-	struct sshkey *found = NULL;
-	char *fp;
 
-	found_key = 0;
-	found = NULL;
 	while (read_keyfile_line(f, file, line, sizeof(line), &linenum) != -1) {
-		char *cp, *key_options = NULL;
-		if (found != NULL)
-			sshkey_free(found);
-		found = sshkey_new(sshkey_is_cert(key) ? KEY_UNSPEC : key->type);
-		if (found == NULL)
-			goto done;
-		auth_clear_options();
-
-		/* Skip leading whitespace, empty and comment lines. */
-		for (cp = line; *cp == ' ' || *cp == '\t'; cp++)
-			;
-		if (!*cp || *cp == '\n' || *cp == '#')
-			continue;
+		if ((r = check_authkeys_line(line, file, linenum,
+		    key, pw)) != 0) {
+			found_key = r == 1;
+			break;
+		}
+	}
+	if (!found_key)
+		debug2("key not found");
+	return found_key;
+}
 
-		if (sshkey_read(found, &cp) != 0) {
-			/* no key?  check if there are options for this key */
-			int quoted = 0;
-			debug2("user_key_allowed: check options: '%s'", cp);
-			key_options = cp;
-			for (; *cp && (quoted || (*cp != ' ' && *cp != '\t')); cp++) {
-				if (*cp == '\\' && cp[1] == '"')
-					cp++;	/* Skip both */
-				else if (*cp == '"')
-					quoted = !quoted;
-			}
-			/* Skip remaining whitespace. */
-			for (; *cp == ' ' || *cp == '\t'; cp++)
-				;
-			if (sshkey_read(found, &cp) != 0) {
-				debug2("user_key_allowed: advance: '%s'", cp);
-				/* still no key?  advance to next line*/
-				continue;
-			}
+/*
+ * As check_authkeys_file(), but only reads the lines that the index of
+ * the file lists for the key. Falls back to a full scan if the index
+ * cannot be used.
+ */
+static int
+check_authkeys_indexed(FILE *f, char *file, struct sshkey *key,
+    struct passwd *pw)
+{
+	char line[SSH_MAX_PUBKEY_BYTES];
+	const struct auth_keyindex_entry *e;
+	struct auth_keyindex *idx;
+	struct sshkey *k;
+	size_t i, n;
+	u_long linenum;
+	int r, found_key = 0;
+
+	if ((idx = auth_keyindex_get(f, file, pw,
+	    options.authorized_keys_index)) == NULL) {
+		rewind(f);
+		return check_authkeys_file(f, file, key, pw);
+	}
+	auth_clear_options();
+	k = sshkey_is_cert(key) ? key->cert->signature_key : key;
+	if ((e = auth_keyindex_lookup(idx, k, &n)) == NULL) {
+		debug2("key not found");
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		if (auth_keyindex_seek(f, e[i].offset) != 0) {
+			debug("%s: index for %s is stale", __func__, file);
+			rewind(f);
+			return check_authkeys_file(f, file, key, pw);
 		}
-		if (sshkey_is_cert(key)) {
-			if (!sshkey_equal(found, key->cert->signature_key))
-				continue;
-			if (auth_parse_options(pw, key_options, file,
-			    linenum) != 1)
-				continue;
-			if (!key_is_cert_authority)
-				continue;
-			fp = sshkey_fingerprint(found, SSH_FP_MD5,
-			    SSH_FP_HEX);
-			debug("matching CA found: file %s, line %lu, %s %s",
-			    file, linenum, sshkey_type(found), fp);
-			/*
-			 * If the user has specified a list of principals as
-			 * a key option, then prefer that list to matching
-			 * their username in the certificate principals list.
-			 */
-			if (authorized_principals != NULL &&
-			    !match_principals_option(authorized_principals,
-			    key->cert)) {
-				reason = "Certificate does not contain an "
-				    "authorized principal";
- fail_reason:
-				free(fp);
-				error("%s", reason);
-				auth_debug_add("%s", reason);
-				continue;
-			}
-			if (sshkey_cert_check_authority(key, 0, 0,
-			    authorized_principals == NULL ? pw->pw_name : NULL,
-			    &reason) != 0)
-				goto fail_reason;
-			if (auth_cert_options(key, pw) != 0) {
-				free(fp);
-				continue;
-			}
-			verbose("Accepted certificate ID \"%s\" "
-			    "signed by %s CA %s via %s", key->cert->key_id,
-			    sshkey_type(found), fp, file);
-			free(fp);
-			found_key = 1;
-			break;
-		} else if (sshkey_equal(found, key)) {
-			if (auth_parse_options(pw, key_options, file,
-			    linenum) != 1)
-				continue;
-			if (key_is_cert_authority)
-				continue;
-			found_key = 1;
-			fp = sshkey_fingerprint(found, SSH_FP_MD5, SSH_FP_HEX);
-			debug("matching key found: file %s, line %lu %s %s",
-			    file, linenum, sshkey_type(found), fp);
-			free(fp);
+		linenum = e[i].linenum - 1;
+		if (read_keyfile_line(f, file, line, sizeof(line),
+		    &linenum) == -1)
+			continue;
+		if ((r = check_authkeys_line(line, file, linenum,
+		    key, pw)) != 0) {
+			found_key = r == 1;
 			break;
 		}
 	}
- done:
-	if (found != NULL)
-		sshkey_free(found);
 	if (!found_key)
 		debug2("key not found");
 	return found_key;
@@ -516,7 +566,7 @@ user_key_allowed2(struct passwd *pw, struct sshkey *key, char *file)
 
 	debug("trying public key file %s", file);
 	if ((f = auth_openkeyfile(file, pw, options.strict_modes)) != NULL) {
-		found_key = check_authkeys_file(f, file, key, pw);
+		found_key = check_authkeys_indexed(f, file, key, pw);
 		fclose(f);
 	}
 
@@ -525,56 +575,37 @@ user_key_allowed2(struct passwd *pw, struct sshkey *key, char *file)
 }
 
 /*
- * Checks whether key is allowed in output of command.
- * returns 1 if the key is allowed or 0 otherwise.
+ * Start AuthorizedKeysCommand for user_pw, running as pw. Returns the pid
+ * of the command and a stream of its output in *fp, or -1 on error.
  */
-static int
-user_key_command_allowed2(struct passwd *user_pw, struct sshkey *key)
+static pid_t
+keys_command_start(struct passwd *user_pw, struct passwd *pw, FILE **fp)
 {
 	FILE *f;
-	int ok, found_key = 0;
-	struct passwd *pw;
 	struct stat st;
-	int status, devnull, p[2], i;
+	int devnull, p[2], i;
 	pid_t pid;
-	char *username, errmsg[512];
-
-	if (options.authorized_keys_command == NULL ||
-	    options.authorized_keys_command[0] != '/')
-		return 0;
-
-	if (options.authorized_keys_command_user == NULL) {
-		error("No user for AuthorizedKeysCommand specified, skipping");
-		return 0;
-	}
-
-	username = percent_expand(options.authorized_keys_command_user,
-	    "u", user_pw->pw_name, (char *)NULL);
-	pw = getpwnam(username);
-	if (pw == NULL) {
-		error("AuthorizedKeysCommandUser \"%s\" not found: %s",
-		    username, strerror(errno));
-		free(username);
-		return 0;
-	}
-	free(username);
+	char errmsg[512];
 
 	temporarily_use_uid(pw);
 
 	if (stat(options.authorized_keys_command, &st) < 0) {
 		error("Could not stat AuthorizedKeysCommand \"%s\": %s",
 		    options.authorized_keys_command, strerror(errno));
-		goto out;
+		restore_uid();
+		return -1;
 	}
 	if (auth_secure_path(options.authorized_keys_command, &st, NULL, 0,
 	    errmsg, sizeof(errmsg)) != 0) {
 		error("Unsafe AuthorizedKeysCommand: %s", errmsg);
-		goto out;
+		restore_uid();
+		return -1;
 	}
 
 	if (pipe(p) != 0) {
 		error("%s: pipe: %s", __func__, strerror(errno));
-		goto out;
+		restore_uid();
+		return -1;
 	}
 
 	debug3("Running AuthorizedKeysCommand: \"%s %s\" as \"%s\"",
@@ -591,7 +622,7 @@ user_key_command_allowed2(struct passwd *user_pw, struct sshkey *key)
 		error("%s: fork: %s", __func__, strerror(errno));
 		close(p[0]);
 		close(p[1]);
-		return 0;
+		return -1;
 	case 0: /* child */
 		for (i = 0; i < NSIG; i++)
 			signal(i, SIG_DFL);
@@ -636,8 +667,6 @@ user_key_command_allowed2(struct passwd *user_pw, struct sshkey *key)
 		break;
 	}
 
-	temporarily_use_uid(pw);
-
 	close(p[1]);
 	if ((f = fdopen(p[0], "r")) == NULL) {
 		error("%s: fdopen: %s", __func__, strerror(errno));
@@ -646,28 +675,175 @@ user_key_command_allowed2(struct passwd *user_pw, struct sshkey *key)
 		kill(pid, SIGTERM);
 		while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
 			;
-		goto out;
+		return -1;
 	}
-	ok = check_authkeys_file(f, options.authorized_keys_command, key, pw);
-	fclose(f);
+	*fp = f;
+	return pid;
+}
+
+/*
+ * Reap AuthorizedKeysCommand, returns 0 if it exited successfully or -1
+ * otherwise.
+ */
+static int
+keys_command_wait(pid_t pid)
+{
+	int status;
 
 	while (waitpid(pid, &status, 0) == -1) {
 		if (errno != EINTR) {
 			error("%s: waitpid: %s", __func__, strerror(errno));
-			goto out;
+			return -1;
 		}
 	}
 	if (WIFSIGNALED(status)) {
 		error("AuthorizedKeysCommand %s exited on signal %d",
 		    options.authorized_keys_command, WTERMSIG(status));
-		goto out;
+		return -1;
 	} else if (WEXITSTATUS(status) != 0) {
 		error("AuthorizedKeysCommand %s returned status %d",
 		    options.authorized_keys_command, WEXITSTATUS(status));
-		goto out;
+		return -1;
 	}
-	found_key = ok;
- out:
+	return 0;
+}
+
+struct keys_command_ctx {
+	struct passwd *user_pw;
+	struct passwd *pw;
+};
+
+/* Run AuthorizedKeysCommand and collect its output for the cache */
+static int
+keys_command_fill(struct sshbuf *out, void *arg)
+{
+	struct keys_command_ctx *ctx = arg;
+	FILE *f;
+	char buf[8192];
+	size_t n;
+	pid_t pid;
+	int r, ret = 0;
+
+	if ((pid = keys_command_start(ctx->user_pw, ctx->pw, &f)) == -1)
+		return -1;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		if ((r = sshbuf_put(out, buf, n)) != 0) {
+			error("AuthorizedKeysCommand %s: output: %s",
+			    options.authorized_keys_command, ssh_err(r));
+			ret = -1;
+			break;
+		}
+	}
+	/* A command still writing is killed by SIGPIPE */
+	fclose(f);
+	if (keys_command_wait(pid) != 0)
+		ret = -1;
+	return ret;
+}
+
+/*
+ * As check_authkeys_file(), but for authorized_keys-format lines held
+ * in a buffer.
+ */
+static int
+check_authkeys_buf(struct sshbuf *b, char *file, struct sshkey *key,
+    struct passwd *pw)
+{
+	char line[SSH_MAX_PUBKEY_BYTES];
+	const u_char *cp, *nl, *end;
+	size_t len;
+	int r, found_key = 0;
+	u_long linenum = 0;
+
+	cp = sshbuf_ptr(b);
+	end = cp + sshbuf_len(b);
+	while (cp < end) {
+		if ((nl = memchr(cp, '\n', end - cp)) != NULL)
+			nl++;
+		else
+			nl = end;
+		len = nl - cp;
+		linenum++;
+		if (len >= sizeof(line)) {
+			debug("%s: %s line %lu exceeds size limit", __func__,
+			    file, linenum);
+			cp = nl;
+			continue;
+		}
+		memcpy(line, cp, len);
+		line[len] = '\0';
+		cp = nl;
+		if ((r = check_authkeys_line(line, file, linenum,
+		    key, pw)) != 0) {
+			found_key = r == 1;
+			break;
+		}
+	}
+	if (!found_key)
+		debug2("key not found");
+	return found_key;
+}
+
+/*
+ * Checks whether key is allowed in output of command.
+ * returns 1 if the key is allowed or 0 otherwise.
+ */
+static int
+user_key_command_allowed2(struct passwd *user_pw, struct sshkey *key)
+{
+	FILE *f;
+	int ok, found_key = 0;
+	struct passwd *pw;
+	struct keys_command_ctx ctx;
+	struct sshbuf *b;
+	pid_t pid;
+	char *username;
+
+	if (options.authorized_keys_command == NULL ||
+	    options.authorized_keys_command[0] != '/')
+		return 0;
+
+	if (options.authorized_keys_command_user == NULL) {
+		error("No user for AuthorizedKeysCommand specified, skipping");
+		return 0;
+	}
+
+	username = percent_expand(options.authorized_keys_command_user,
+	    "u", user_pw->pw_name, (char *)NULL);
+	pw = getpwnam(username);
+	if (pw == NULL) {
+		error("AuthorizedKeysCommandUser \"%s\" not found: %s",
+		    username, strerror(errno));
+		free(username);
+		return 0;
+	}
+	free(username);
+
+	if (options.authorized_keys_command_cache_time > 0) {
+		if ((b = sshbuf_new()) == NULL)
+			fatal("%s: sshbuf_new failed", __func__);
+		ctx.user_pw = user_pw;
+		ctx.pw = pw;
+		if (auth_cmdcache_get(options.authorized_keys_command,
+		    user_pw->pw_name, pw->pw_name,
+		    options.authorized_keys_command_cache_time, b,
+		    keys_command_fill, &ctx) == 0) {
+			temporarily_use_uid(pw);
+			found_key = check_authkeys_buf(b,
+			    options.authorized_keys_command, key, pw);
+			restore_uid();
+		}
+		sshbuf_free(b);
+		return found_key;
+	}
+
+	if ((pid = keys_command_start(user_pw, pw, &f)) == -1)
+		return 0;
+	temporarily_use_uid(pw);
+	ok = check_authkeys_file(f, options.authorized_keys_command, key, pw);
+	fclose(f);
+	if (keys_command_wait(pid) == 0)
+		found_key = ok;
 	restore_uid();
 	return found_key;
 }
@@ -709,6 +885,16 @@ user_key_allowed(struct passwd *pw, struct sshkey *key)
 	return success;
 }
 
+/* return 1 if key is allowed and made the signature over data */
+int
+user_key_allowed_verify(struct passwd *pw, struct sshkey *key,
+    const u_char *sig, size_t siglen, const u_char *data, size_t datalen,
+    u_int compat)
+{
+	return user_key_allowed(pw, key) &&
+	    sshkey_verify(key, sig, siglen, data, datalen, compat) == 0;
+}
+
 struct authmethod method_pubkey = {
 	"publickey",
 	userauth_pubkey,
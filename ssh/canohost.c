@@ -12,27 +12,55 @@
  * called by a name other than "ssh" or "Secure Shell".
  */
 
+#include <sys/param.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <netinet/in.h>
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <openssl/sha.h>
+
 #include "xmalloc.h"
 #include "packet.h"
 #include "log.h"
 #include "canohost.h"
 #include "misc.h"
+#include "atomicio.h"
+#include "pathnames.h"
+#include "sshbuf.h"
+#include "err.h"
+
+#define DNS_CACHE_MAGIC		0x535348444e530001ULL	/* "SSHDNS\0\1" */
 
 static void check_ip_options(int, char *);
+static char *resolve_hostname(struct sockaddr *, socklen_t, const char *);
+
+/* Reverse lookup of the peer started by canohost_dns_start() */
+static struct {
+	pid_t	 owner;		/* process that may collect the result */
+	pid_t	 pid;		/* helper doing the lookup, or -1 */
+	int	 fd;		/* helper writes the name here, or -1 */
+	time_t	 deadline;	/* monotime() to give up at; 0 for none */
+	u_int	 cache_time;	/* to share the result for, or 0 */
+	char	*ntop;
+	char	*name;		/* result, once known */
+} dns_lookup = { -1, -1, -1, 0, 0, NULL, NULL };
 
 /*
  * Return the canonical name of the host at the other end of the socket. The
@@ -43,10 +71,8 @@ static char *
 get_remote_hostname(int sock, int use_dns)
 {
 	struct sockaddr_storage from;
-	int i;
 	socklen_t fromlen;
-	struct addrinfo hints, *ai, *aitop;
-	char name[NI_MAXHOST], ntop[NI_MAXHOST], ntop2[NI_MAXHOST];
+	char ntop[NI_MAXHOST];
 
 	/* Get IP address of client. */
 	fromlen = sizeof(from);
@@ -66,9 +92,23 @@ get_remote_hostname(int sock, int use_dns)
 	if (!use_dns)
 		return xstrdup(ntop);
 
+	return resolve_hostname((struct sockaddr *)&from, fromlen, ntop);
+}
+
+/*
+ * Map the address from to a host name that maps back to it, falling back
+ * to its numeric form ntop.  The caller should free the returned string.
+ */
+static char *
+resolve_hostname(struct sockaddr *from, socklen_t fromlen, const char *ntop)
+{
+	int i;
+	struct addrinfo hints, *ai, *aitop;
+	char name[NI_MAXHOST], ntop2[NI_MAXHOST];
+
 	debug3("Trying to reverse map address %.100s.", ntop);
 	/* Map the IP address to a host name. */
-	if (getnameinfo((struct sockaddr *)&from, fromlen, name, sizeof(name),
+	if (getnameinfo(from, fromlen, name, sizeof(name),
 	    NULL, 0, NI_NAMEREQD) != 0) {
 		/* Host name not found.  Use ip address. */
 		return xstrdup(ntop);
@@ -106,7 +146,7 @@ get_remote_hostname(int sock, int use_dns)
 	 * the domain).
 	 */
 	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = from.ss_family;
+	hints.ai_family = from->sa_family;
 	hints.ai_socktype = SOCK_STREAM;
 	if (getaddrinfo(name, NULL, &hints, &aitop) != 0) {
 		logit("reverse mapping checking getaddrinfo for %.700s "
@@ -170,6 +210,275 @@ check_ip_options(int sock, char *ipaddr)
 	}
 }
 
+static void
+dns_cache_path(const char *ntop, u_char *digest, char *path, size_t len)
+{
+	size_t i, l;
+
+	SHA256((const u_char *)ntop, strlen(ntop), digest);
+	l = strlcpy(path, _PATH_SSH_DNS_CACHE "/", len);
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		l += snprintf(path + l, len - l, "%02x", digest[i]);
+}
+
+/* Return the name recorded for ntop less than ttl seconds ago, or NULL */
+static char *
+dns_cache_load(const char *ntop, u_int ttl)
+{
+	char path[sizeof(_PATH_SSH_DNS_CACHE) + SHA256_DIGEST_LENGTH * 2 + 1];
+	u_char digest[SHA256_DIGEST_LENGTH], *p;
+	struct sshbuf *b = NULL;
+	struct stat st;
+	u_int64_t magic, fetched;
+	char *name = NULL;
+	time_t now = time(NULL);
+	int fd;
+
+	dns_cache_path(ntop, digest, path, sizeof(path));
+	if ((fd = open(path, O_RDONLY|O_NOFOLLOW|O_NONBLOCK)) == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    st.st_uid != 0 || (st.st_mode & 077) != 0 || st.st_nlink != 1 ||
+	    st.st_size > NI_MAXHOST + 256)
+		goto out;
+	if ((b = sshbuf_new()) == NULL ||
+	    sshbuf_reserve(b, st.st_size, &p) != 0 ||
+	    atomicio(read, fd, p, st.st_size) != (size_t)st.st_size)
+		goto out;
+	if (sshbuf_get_u64(b, &magic) != 0 ||
+	    sshbuf_get_u64(b, &fetched) != 0 || magic != DNS_CACHE_MAGIC ||
+	    sshbuf_len(b) < SHA256_DIGEST_LENGTH ||
+	    memcmp(sshbuf_ptr(b), digest, SHA256_DIGEST_LENGTH) != 0 ||
+	    sshbuf_consume(b, SHA256_DIGEST_LENGTH) != 0 ||
+	    (time_t)fetched > now || (u_int64_t)(now - fetched) >= ttl)
+		goto out;
+	if (sshbuf_get_cstring(b, &name, NULL) != 0 || sshbuf_len(b) != 0) {
+		free(name);
+		name = NULL;
+	}
+ out:
+	sshbuf_free(b);
+	close(fd);
+	return name;
+}
+
+/* Record name as the result of the lookup for ntop, if we are root */
+static void
+dns_cache_store(const char *ntop, const char *name)
+{
+	char path[sizeof(_PATH_SSH_DNS_CACHE) + SHA256_DIGEST_LENGTH * 2 + 1];
+	char tmp[sizeof(path) + 11];
+	u_char digest[SHA256_DIGEST_LENGTH];
+	struct sshbuf *b;
+	struct stat st;
+	int fd;
+
+	if (geteuid() != 0)
+		return;
+	if (mkdir(_PATH_SSH_DNS_CACHE, 0700) == -1 && errno != EEXIST)
+		return;
+	if (lstat(_PATH_SSH_DNS_CACHE, &st) == -1 || !S_ISDIR(st.st_mode) ||
+	    st.st_uid != 0 || (st.st_mode & 077) != 0) {
+		error("%s: bad ownership or modes for directory %s",
+		    __func__, _PATH_SSH_DNS_CACHE);
+		return;
+	}
+	dns_cache_path(ntop, digest, path, sizeof(path));
+	if ((b = sshbuf_new()) == NULL ||
+	    sshbuf_put_u64(b, DNS_CACHE_MAGIC) != 0 ||
+	    sshbuf_put_u64(b, (u_int64_t)time(NULL)) != 0 ||
+	    sshbuf_put(b, digest, sizeof(digest)) != 0 ||
+	    sshbuf_put_cstring(b, name) != 0)
+		goto out;
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1)
+		goto out;
+	if (atomicio(vwrite, fd, (void *)sshbuf_ptr(b),
+	    sshbuf_len(b)) != sshbuf_len(b) || close(fd) != 0 ||
+	    rename(tmp, path) == -1) {
+		debug("%s: write %s: %s", __func__, path, strerror(errno));
+		unlink(tmp);
+	}
+ out:
+	sshbuf_free(b);
+}
+
+/* Forget the names shared between processes */
+void
+canohost_dns_flush(void)
+{
+	char path[MAXPATHLEN];
+	struct dirent *dp;
+	DIR *dirp;
+
+	if ((dirp = opendir(_PATH_SSH_DNS_CACHE)) == NULL)
+		return;
+	while ((dp = readdir(dirp)) != NULL) {
+		if (dp->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", _PATH_SSH_DNS_CACHE,
+		    dp->d_name);
+		if (unlink(path) == -1)
+			debug("%s: unlink %s: %s", __func__, path,
+			    strerror(errno));
+	}
+	closedir(dirp);
+}
+
+/*
+ * Start mapping the address of the peer to a host name in a helper
+ * process, so that the lookup overlaps with the protocol exchange.  The
+ * result is collected by the first get_canonical_hostname(1) call in this
+ * process.  The lookup is abandoned after timeout seconds unless timeout
+ * is 0.  Results are shared through a cache for cache_time seconds.
+ *
+ * The helper keeps only the pipe for the result and standard descriptors
+ * open, then calls child_setup, if not NULL, to shed whatever else it
+ * should not hold, e.g. keys and privileges; it gives up if that fails.
+ */
+void
+canohost_dns_start(u_int timeout, u_int cache_time, int (*child_setup)(void))
+{
+	struct ssh *ssh = active_state;	/* XXX */
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	char ntop[NI_MAXHOST], *name;
+	int pfd[2];
+
+	if (dns_lookup.owner != -1 || !ssh_packet_connection_is_on_socket(ssh))
+		return;
+	fromlen = sizeof(from);
+	memset(&from, 0, sizeof(from));
+	if (getpeername(ssh_packet_get_connection_in(ssh),
+	    (struct sockaddr *)&from, &fromlen) < 0 ||
+	    getnameinfo((struct sockaddr *)&from, fromlen, ntop, sizeof(ntop),
+	    NULL, 0, NI_NUMERICHOST) != 0)
+		return;
+
+	dns_lookup.owner = getpid();
+	dns_lookup.ntop = xstrdup(ntop);
+	dns_lookup.cache_time = cache_time;
+	if (cache_time != 0 &&
+	    (dns_lookup.name = dns_cache_load(ntop, cache_time)) != NULL) {
+		debug3("%s: cached name %.200s for %.100s", __func__,
+		    dns_lookup.name, ntop);
+		return;
+	}
+	if (timeout != 0)
+		dns_lookup.deadline = monotime() + timeout;
+	if (pipe(pfd) == -1) {
+		error("%s: pipe: %s", __func__, strerror(errno));
+		return;
+	}
+	if ((dns_lookup.pid = fork()) == -1) {
+		error("%s: fork: %s", __func__, strerror(errno));
+		close(pfd[0]);
+		close(pfd[1]);
+		return;
+	}
+	if (dns_lookup.pid == 0) {
+		/*
+		 * Don't keep the connection, the listener's startup pipe or
+		 * anything else open after the session ends.
+		 */
+		close(pfd[0]);
+		close(ssh_packet_get_connection_in(ssh));
+		close(ssh_packet_get_connection_out(ssh));
+		if (pfd[1] != STDERR_FILENO + 1) {
+			if (dup2(pfd[1], STDERR_FILENO + 1) == -1)
+				_exit(1);
+			close(pfd[1]);
+		}
+		closefrom(STDERR_FILENO + 2);
+		if (child_setup != NULL && child_setup() != 0)
+			_exit(1);
+		signal(SIGPIPE, SIG_IGN);
+		signal(SIGALRM, SIG_DFL);
+		alarm(timeout);
+		name = resolve_hostname((struct sockaddr *)&from, fromlen,
+		    ntop);
+		(void)atomicio(vwrite, STDERR_FILENO + 1, name, strlen(name));
+		_exit(0);
+	}
+	close(pfd[1]);
+	dns_lookup.fd = pfd[0];
+}
+
+/*
+ * Return the result of the lookup started by canohost_dns_start(), waiting
+ * for it if necessary, or NULL if none was started by this process.
+ */
+static char *
+canohost_dns_result(void)
+{
+	char buf[NI_MAXHOST];
+	struct pollfd pfd;
+	size_t len = 0;
+	ssize_t n;
+	time_t now;
+	int r, timo, done = 0;
+
+	if (dns_lookup.owner != getpid() || dns_lookup.ntop == NULL)
+		return NULL;
+	if (dns_lookup.name != NULL)
+		return xstrdup(dns_lookup.name);
+
+	pfd.fd = dns_lookup.fd;
+	pfd.events = POLLIN;
+	while (dns_lookup.fd != -1 && len < sizeof(buf) - 1) {
+		timo = -1;
+		if (dns_lookup.deadline != 0) {
+			now = monotime();
+			timo = now < dns_lookup.deadline ?
+			    (dns_lookup.deadline - now) * 1000 : 0;
+		}
+		if ((r = poll(&pfd, 1, timo)) == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			error("%s: poll: %s", __func__, strerror(errno));
+			len = 0;
+			break;
+		}
+		if (r == 0) {
+			logit("Reverse mapping of %.100s timed out",
+			    dns_lookup.ntop);
+			len = 0;
+			break;
+		}
+		if ((n = read(dns_lookup.fd, buf + len,
+		    sizeof(buf) - 1 - len)) == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			len = 0;
+			break;
+		}
+		if (n == 0) {
+			done = 1;
+			break;
+		}
+		len += n;
+	}
+	buf[len] = '\0';
+	if (dns_lookup.fd != -1)
+		close(dns_lookup.fd);
+	dns_lookup.fd = -1;
+	if (dns_lookup.pid > 0) {
+		if (!done)
+			kill(dns_lookup.pid, SIGTERM);
+		while (waitpid(dns_lookup.pid, NULL, 0) == -1 &&
+		    errno == EINTR)
+			;
+		dns_lookup.pid = -1;
+	}
+	/* The helper runs unprivileged, so only we may share its result */
+	if (!done || strlen(buf) != len)
+		len = 0;
+	if (len > 0 && dns_lookup.cache_time != 0)
+		dns_cache_store(dns_lookup.ntop, buf);
+	dns_lookup.name = xstrdup(len > 0 ? buf : dns_lookup.ntop);
+	return xstrdup(dns_lookup.name);
+}
+
 /*
  * Return the canonical name of the host in the other side of the current
  * connection.  The host name is cached, so it is efficient to call this
@@ -191,7 +500,9 @@ get_canonical_hostname(int use_dns)
 		return remote_ip;
 
 	/* Get the real hostname if socket; otherwise return UNKNOWN. */
-	if (ssh_packet_connection_is_on_socket(ssh))
+	if (use_dns && (host = canohost_dns_result()) != NULL)
+		;
+	else if (ssh_packet_connection_is_on_socket(ssh))
 		host = get_remote_hostname(
 		   ssh_packet_get_connection_in(ssh), use_dns);
 	else
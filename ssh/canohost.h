@@ -15,6 +15,8 @@
 struct ssh;
 const char	*get_canonical_hostname(int);
 const char	*get_remote_name_or_ip(u_int, int);
+void		 canohost_dns_start(u_int, u_int, int (*)(void));
+void		 canohost_dns_flush(void);
 
 char		*get_peer_ipaddr(int);
 int		 get_peer_port(int);
@@ -123,6 +123,8 @@ ssh_err(int n)
 		return "KRL file has invalid magic number";
 	case SSH_ERR_KEY_REVOKED:
 		return "Key is revoked";
+	case SSH_ERR_TICKET_INVALID:
+		return "resumption ticket invalid or expired";
 	default:
 		return "unknown error";
 	}
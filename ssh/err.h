@@ -72,6 +72,7 @@
 #define SSH_ERR_BUFFER_READ_ONLY		-48
 #define SSH_ERR_KRL_BAD_MAGIC			-49
 #define SSH_ERR_KEY_REVOKED			-50
+#define SSH_ERR_TICKET_INVALID			-51
 
 /* Translate a numeric error code to a human-readable error string */
 const char *ssh_err(int n);
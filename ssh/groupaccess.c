@@ -36,6 +36,7 @@
 #include "groupaccess.h"
 #include "match.h"
 #include "log.h"
+#include "pwcache.h"
 
 static int ngroups;
 static char *groups_byname[NGROUPS_MAX + 1];	/* +1 for base/primary group */
@@ -54,12 +55,16 @@ ga_init(const char *user, gid_t base)
 	if (ngroups > 0)
 		ga_free();
 
+	if ((ngroups = pwcache_groups_get(user, base, groups_byname,
+	    NGROUPS_MAX + 1)) != -1)
+		return ngroups;
 	ngroups = sizeof(groups_bygid) / sizeof(gid_t);
 	if (getgrouplist(user, base, groups_bygid, &ngroups) == -1)
 		logit("getgrouplist: groups list too small");
 	for (i = 0, j = 0; i < ngroups; i++)
 		if ((gr = getgrgid(groups_bygid[i])) != NULL)
 			groups_byname[j++] = xstrdup(gr->gr_name);
+	pwcache_groups_put(user, base, groups_byname, j);
 	return (ngroups = j);
 }
 
@@ -86,20 +91,28 @@ ga_match(char * const *groups, int n)
 int
 ga_match_pattern_list(const char *group_pattern)
 {
+	struct match_patterns *mp;
 	int i, found = 0;
 	size_t len = strlen(group_pattern);
 
+	/* Compile the list once for all of the groups */
+	mp = match_patterns_compile(group_pattern, len, 0);
 	for (i = 0; i < ngroups; i++) {
-		switch (match_pattern_list(groups_byname[i],
+		switch (mp != NULL ?
+		    match_patterns_match(mp, groups_byname[i]) :
+		    match_pattern_list(groups_byname[i],
 		    group_pattern, len, 0)) {
 		case -1:
-			return 0;	/* Negated match wins */
+			found = 0;	/* Negated match wins */
+			goto out;
 		case 0:
 			continue;
 		case 1:
 			found = 1;
 		}
 	}
+ out:
+	match_patterns_free(mp);
 	return found;
 }
 
@@ -37,16 +37,22 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
 
 #include <netinet/in.h>
 
 #include <openssl/hmac.h>
 #include <openssl/sha.h>
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <resolv.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "xmalloc.h"
 #include "match.h"
@@ -54,6 +60,8 @@
 #include "hostfile.h"
 #include "log.h"
 #include "misc.h"
+#include "atomicio.h"
+#include "sshbuf.h"
 #include "err.h"
 
 struct hostkeys {
@@ -235,93 +243,725 @@ init_hostkeys(void)
 	return ret;
 }
 
+/*
+ * known_hosts index.
+ *
+ * Lines with plain host names are indexed by each (lower-cased) name,
+ * lines with hashed names by their decoded salt and HMAC, and lines with
+ * wildcard or negated patterns are candidates for every host. Every salt
+ * is random, so a lookup still computes one HMAC per hashed line, but it
+ * does not have to read the file, decode the salts or parse any keys.
+ * The candidate lines it returns are re-read and checked in full, so the
+ * index only has to be a superset.
+ *
+ * Indexes are cached per process by the device, inode, size and mtime
+ * of the file.  If KnownHostsIndex is set they are also saved next to it
+ * as "<file>.idx" and read back from there.
+ */
+
+#define HOSTFILE_INDEX_MAGIC	0x5353484b48494458ULL	/* "SSHKHIDX" */
+#define HOSTFILE_INDEX_VERSION	2
+#define HOSTFILE_INDEX_SUFFIX	".idx"
+#define HOSTFILE_LINE_MAX	8192	/* longer lines are skipped */
+#define HOSTFILE_INDEX_CACHE	4
+#define HOSTFILE_INDEX_MAX	(4 * 1024 * 1024)
+
+struct hostfile_index_line {
+	off_t	offset;
+	u_long	linenum;
+};
+
+struct hostfile_index_name {
+	char	*name;
+	u_int	line;
+};
+
+struct hostfile_index_hash {
+	u_char	salt[SHA_DIGEST_LENGTH];
+	u_char	hash[SHA_DIGEST_LENGTH];
+	u_int	line;
+};
+
+struct hostfile_index {
+	dev_t	dev;
+	ino_t	ino;
+	off_t	size;
+	time_t	mtime;
+	long	mtime_nsec;
+	struct hostfile_index_line *lines;
+	u_int	nlines;
+	struct hostfile_index_name *names;
+	u_int	nnames;
+	u_int	*patterns;
+	u_int	npatterns;
+	struct hostfile_index_hash *hashes;
+	u_int	nhashes;
+	TAILQ_ENTRY(hostfile_index) next;
+};
+
+static TAILQ_HEAD(hostfile_index_head, hostfile_index) hostfile_index_cache =
+    TAILQ_HEAD_INITIALIZER(hostfile_index_cache);
+static u_int hostfile_index_ncache;
+static int hostfile_index_save_enabled;
+
+/* Sets whether indexes are saved next to the files they were built from */
 void
-load_hostkeys(struct hostkeys *hostkeys, const char *host, const char *path)
+hostfile_index_persist(int enable)
 {
-	FILE *f;
-	char line[8192];
-	u_long linenum = 0, num_loaded = 0;
-	char *cp, *cp2, *hashed_host;
-	HostkeyMarker marker;
-	struct sshkey *key;
-	u_int kbits;
+	hostfile_index_save_enabled = enable;
+}
 
-	if ((f = fopen(path, "r")) == NULL)
+static void
+hostfile_index_free(struct hostfile_index *idx)
+{
+	u_int i;
+
+	if (idx == NULL)
 		return;
-	debug3("%s: loading entries for host \"%.100s\" from file \"%s\"",
-	    __func__, host, path);
+	for (i = 0; i < idx->nnames; i++)
+		free(idx->names[i].name);
+	free(idx->names);
+	free(idx->lines);
+	free(idx->patterns);
+	free(idx->hashes);
+	free(idx);
+}
+
+static int
+hostfile_index_name_cmp(const void *a, const void *b)
+{
+	const struct hostfile_index_name *na = a, *nb = b;
+	int r;
+
+	if ((r = strcmp(na->name, nb->name)) != 0)
+		return r;
+	return na->line < nb->line ? -1 : na->line > nb->line;
+}
+
+static int
+hostfile_index_line_cmp(const void *a, const void *b)
+{
+	u_int la = *(const u_int *)a, lb = *(const u_int *)b;
+
+	return la < lb ? -1 : la > lb;
+}
+
+/* Decodes a "|1|salt|hash" name; returns 0 on success */
+static int
+hostfile_index_decode_hash(const char *s, u_int l,
+    struct hostfile_index_hash *h)
+{
+	u_char salt[256], hash[256];
+	char b64hash[1024];
+	const char *p;
+	u_int b64len;
+
+	if (extract_salt(s, l, salt, sizeof(salt)) != 0)
+		return -1;
+	/* extract_salt() has checked that the magic and salt are present */
+	p = memchr(s + sizeof(HASH_MAGIC) - 1, HASH_DELIM,
+	    l - (sizeof(HASH_MAGIC) - 1));
+	b64len = l - (++p - s);
+	if (b64len == 0 || b64len >= sizeof(b64hash))
+		return -1;
+	memcpy(b64hash, p, b64len);
+	b64hash[b64len] = '\0';
+	if (__b64_pton(b64hash, hash, sizeof(hash)) != SHA_DIGEST_LENGTH)
+		return -1;
+	memcpy(h->salt, salt, sizeof(h->salt));
+	memcpy(h->hash, hash, sizeof(h->hash));
+	return 0;
+}
+
+#define HOSTFILE_INDEX_GROW(arr, n, nalloc) do { \
+		if ((n) >= (nalloc)) { \
+			(nalloc) = (nalloc) == 0 ? 256 : (nalloc) * 2; \
+			(arr) = xrealloc((arr), (nalloc), sizeof(*(arr))); \
+		} \
+	} while (0)
+
+static struct hostfile_index *
+hostfile_index_build(FILE *f, const char *path)
+{
+	struct hostfile_index *idx = xcalloc(1, sizeof(*idx));
+	struct hostfile_index_hash h;
+	HostkeyMarker marker;
+	char line[HOSTFILE_LINE_MAX], *cp, *cp2, *name, *names, *sp;
+	u_int nlalloc = 0, nnalloc = 0, npalloc = 0, nhalloc = 0;
+	u_long linenum = 0;
+	off_t offset;
+
+	rewind(f);
 	while (read_keyfile_line(f, path, line, sizeof(line), &linenum) == 0) {
-		cp = line;
+		offset = ftello(f) - strlen(line);
 
 		/* Skip any leading whitespace, comments and empty lines. */
-		for (; *cp == ' ' || *cp == '\t'; cp++)
+		for (cp = line; *cp == ' ' || *cp == '\t'; cp++)
 			;
 		if (!*cp || *cp == '#' || *cp == '\n')
 			continue;
-
-		if ((marker = check_markers(&cp)) == MRK_ERROR) {
-			verbose("%s: invalid marker at %s:%lu",
-			    __func__, path, linenum);
-			continue;
+		if (idx->nlines >= HOSTFILE_INDEX_MAX) {
+			hostfile_index_free(idx);
+			return NULL;
 		}
+		HOSTFILE_INDEX_GROW(idx->lines, idx->nlines, nlalloc);
+		idx->lines[idx->nlines].offset = offset;
+		idx->lines[idx->nlines].linenum = linenum;
 
+		marker = check_markers(&cp);
 		/* Find the end of the host name portion. */
 		for (cp2 = cp; *cp2 && *cp2 != ' ' && *cp2 != '\t'; cp2++)
 			;
 
-		/* Check if the host name matches. */
-		if (match_hostname(host, cp, (u_int) (cp2 - cp)) != 1) {
-			if (*cp != HASH_DELIM)
-				continue;
-			hashed_host = host_hash(host, cp, (u_int) (cp2 - cp));
-			if (hashed_host == NULL) {
-				debug("Invalid hashed host line %lu of %s",
-				    linenum, path);
-				continue;
+		if (marker != MRK_ERROR && *cp == HASH_DELIM &&
+		    hostfile_index_decode_hash(cp, cp2 - cp, &h) == 0) {
+			h.line = idx->nlines;
+			HOSTFILE_INDEX_GROW(idx->hashes, idx->nhashes, nhalloc);
+			idx->hashes[idx->nhashes++] = h;
+		} else if (marker == MRK_ERROR || cp2 == cp ||
+		    *cp == HASH_DELIM ||
+		    strcspn(cp, "*?! \t") < (size_t)(cp2 - cp)) {
+			/* leave anything unusual to the full line check */
+			HOSTFILE_INDEX_GROW(idx->patterns, idx->npatterns,
+			    npalloc);
+			idx->patterns[idx->npatterns++] = idx->nlines;
+		} else {
+			*cp2 = '\0';
+			names = cp;
+			while ((name = strsep(&names, ",")) != NULL) {
+				if (*name == '\0')
+					continue;
+				HOSTFILE_INDEX_GROW(idx->names, idx->nnames,
+				    nnalloc);
+				idx->names[idx->nnames].name = xstrdup(name);
+				for (sp = idx->names[idx->nnames].name;
+				    *sp != '\0'; sp++)
+					*sp = tolower((u_char)*sp);
+				idx->names[idx->nnames++].line = idx->nlines;
 			}
-			if (strncmp(hashed_host, cp, (u_int) (cp2 - cp)) != 0)
-				continue;
 		}
+		idx->nlines++;
+	}
+	if (idx->nnames > 0)
+		qsort(idx->names, idx->nnames, sizeof(*idx->names),
+		    hostfile_index_name_cmp);
+	debug3("%s: %s: indexed %u lines: %u names, %u hashed, %u patterns",
+	    __func__, path, idx->nlines, idx->nnames, idx->nhashes,
+	    idx->npatterns);
+	return idx;
+}
+
+static void
+hostfile_index_set_stat(struct hostfile_index *idx, const struct stat *st)
+{
+	idx->dev = st->st_dev;
+	idx->ino = st->st_ino;
+	idx->size = st->st_size;
+	idx->mtime = st->st_mtim.tv_sec;
+	idx->mtime_nsec = st->st_mtim.tv_nsec;
+}
 
-		/* Got a match.  Skip host name. */
-		cp = cp2;
+static int
+hostfile_index_matches(const struct hostfile_index *idx,
+    const struct stat *st)
+{
+	return idx->dev == st->st_dev && idx->ino == st->st_ino &&
+	    idx->size == st->st_size && idx->mtime == st->st_mtim.tv_sec &&
+	    idx->mtime_nsec == st->st_mtim.tv_nsec;
+}
+
+static struct hostfile_index *
+hostfile_index_load(const char *path, const struct stat *kst)
+{
+	struct hostfile_index *idx = NULL;
+	struct sshbuf *b = NULL;
+	struct stat st;
+	char *ipath;
+	u_char *cp;
+	u_int64_t magic, dev, ino, size, mtime, offset;
+	u_int32_t version, nsec, linenum, line, i;
+	int fd, r;
+
+	xasprintf(&ipath, "%s%s", path, HOSTFILE_INDEX_SUFFIX);
+	fd = open(ipath, O_RDONLY|O_NOFOLLOW|O_NONBLOCK);
+	free(ipath);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    (st.st_uid != 0 && st.st_uid != getuid()) ||
+	    (st.st_mode & 022) != 0 || st.st_size > 1024 * 1024 * 1024)
+		goto out;
+	if ((b = sshbuf_new()) == NULL ||
+	    sshbuf_reserve(b, st.st_size, &cp) != 0 ||
+	    atomicio(read, fd, cp, st.st_size) != (size_t)st.st_size)
+		goto out;
+	if ((r = sshbuf_get_u64(b, &magic)) != 0 ||
+	    (r = sshbuf_get_u32(b, &version)) != 0 ||
+	    (r = sshbuf_get_u64(b, &dev)) != 0 ||
+	    (r = sshbuf_get_u64(b, &ino)) != 0 ||
+	    (r = sshbuf_get_u64(b, &mtime)) != 0 ||
+	    (r = sshbuf_get_u32(b, &nsec)) != 0 ||
+	    (r = sshbuf_get_u64(b, &size)) != 0)
+		goto out;
+	if (magic != HOSTFILE_INDEX_MAGIC ||
+	    version != HOSTFILE_INDEX_VERSION ||
+	    dev != (u_int64_t)kst->st_dev || ino != (u_int64_t)kst->st_ino ||
+	    mtime != (u_int64_t)kst->st_mtim.tv_sec ||
+	    nsec != (u_int32_t)kst->st_mtim.tv_nsec ||
+	    size != (u_int64_t)kst->st_size) {
+		debug3("%s: %s: stale index", __func__, path);
+		goto out;
+	}
+	idx = xcalloc(1, sizeof(*idx));
+
+	if (sshbuf_get_u32(b, &idx->nlines) != 0 ||
+	    idx->nlines > HOSTFILE_INDEX_MAX)
+		goto fail;
+	idx->lines = xcalloc(idx->nlines + 1, sizeof(*idx->lines));
+	for (i = 0; i < idx->nlines; i++) {
+		if (sshbuf_get_u64(b, &offset) != 0 ||
+		    sshbuf_get_u32(b, &linenum) != 0 || offset >= size)
+			goto fail;
+		idx->lines[i].offset = offset;
+		idx->lines[i].linenum = linenum;
+	}
+
+	if (sshbuf_get_u32(b, &idx->nnames) != 0 ||
+	    idx->nnames > HOSTFILE_INDEX_MAX)
+		goto fail;
+	idx->names = xcalloc(idx->nnames + 1, sizeof(*idx->names));
+	for (i = 0; i < idx->nnames; i++) {
+		if (sshbuf_get_cstring(b, &idx->names[i].name, NULL) != 0) {
+			idx->nnames = i;
+			goto fail;
+		}
+		if (sshbuf_get_u32(b, &line) != 0 || line >= idx->nlines) {
+			idx->nnames = i + 1;
+			goto fail;
+		}
+		idx->names[i].line = line;
+		/* lookups depend on the sort order */
+		if (i > 0 && hostfile_index_name_cmp(&idx->names[i - 1],
+		    &idx->names[i]) >= 0) {
+			idx->nnames = i + 1;
+			goto fail;
+		}
+	}
+
+	if (sshbuf_get_u32(b, &idx->npatterns) != 0 ||
+	    idx->npatterns > idx->nlines)
+		goto fail;
+	idx->patterns = xcalloc(idx->npatterns + 1, sizeof(*idx->patterns));
+	for (i = 0; i < idx->npatterns; i++) {
+		if (sshbuf_get_u32(b, &idx->patterns[i]) != 0 ||
+		    idx->patterns[i] >= idx->nlines)
+			goto fail;
+	}
 
-		/*
-		 * Extract the key from the line.  This will skip any leading
-		 * whitespace.  Ignore badly formatted lines.
-		 */
-		if ((key = sshkey_new(KEY_UNSPEC)) == NULL) {
+	if (sshbuf_get_u32(b, &idx->nhashes) != 0 ||
+	    idx->nhashes > idx->nlines)
+		goto fail;
+	idx->hashes = xcalloc(idx->nhashes + 1, sizeof(*idx->hashes));
+	for (i = 0; i < idx->nhashes; i++) {
+		if (sshbuf_get(b, idx->hashes[i].salt,
+		    sizeof(idx->hashes[i].salt)) != 0 ||
+		    sshbuf_get(b, idx->hashes[i].hash,
+		    sizeof(idx->hashes[i].hash)) != 0 ||
+		    sshbuf_get_u32(b, &idx->hashes[i].line) != 0 ||
+		    idx->hashes[i].line >= idx->nlines)
+			goto fail;
+		/* hashed lines are kept in file order */
+		if (i > 0 && idx->hashes[i - 1].line >= idx->hashes[i].line)
+			goto fail;
+	}
+	if (sshbuf_len(b) != 0)
+		goto fail;
+	hostfile_index_set_stat(idx, kst);
+	debug3("%s: %s: loaded index of %u lines", __func__, path,
+	    idx->nlines);
+	goto out;
+ fail:
+	debug("%s: %s: corrupt index", __func__, path);
+	hostfile_index_free(idx);
+	idx = NULL;
+ out:
+	close(fd);
+	sshbuf_free(b);
+	return idx;
+}
+
+static void
+hostfile_index_save(const struct hostfile_index *idx, const char *path)
+{
+	struct sshbuf *b;
+	char *ipath = NULL, *tmp = NULL;
+	u_int i;
+	int fd, r;
+
+	if ((b = sshbuf_new()) == NULL)
+		return;
+	if ((r = sshbuf_put_u64(b, HOSTFILE_INDEX_MAGIC)) != 0 ||
+	    (r = sshbuf_put_u32(b, HOSTFILE_INDEX_VERSION)) != 0 ||
+	    (r = sshbuf_put_u64(b, idx->dev)) != 0 ||
+	    (r = sshbuf_put_u64(b, idx->ino)) != 0 ||
+	    (r = sshbuf_put_u64(b, idx->mtime)) != 0 ||
+	    (r = sshbuf_put_u32(b, idx->mtime_nsec)) != 0 ||
+	    (r = sshbuf_put_u64(b, idx->size)) != 0 ||
+	    (r = sshbuf_put_u32(b, idx->nlines)) != 0)
+		goto out;
+	for (i = 0; i < idx->nlines; i++) {
+		if ((r = sshbuf_put_u64(b, idx->lines[i].offset)) != 0 ||
+		    (r = sshbuf_put_u32(b, idx->lines[i].linenum)) != 0)
+			goto out;
+	}
+	if ((r = sshbuf_put_u32(b, idx->nnames)) != 0)
+		goto out;
+	for (i = 0; i < idx->nnames; i++) {
+		if ((r = sshbuf_put_cstring(b, idx->names[i].name)) != 0 ||
+		    (r = sshbuf_put_u32(b, idx->names[i].line)) != 0)
+			goto out;
+	}
+	if ((r = sshbuf_put_u32(b, idx->npatterns)) != 0)
+		goto out;
+	for (i = 0; i < idx->npatterns; i++) {
+		if ((r = sshbuf_put_u32(b, idx->patterns[i])) != 0)
+			goto out;
+	}
+	if ((r = sshbuf_put_u32(b, idx->nhashes)) != 0)
+		goto out;
+	for (i = 0; i < idx->nhashes; i++) {
+		if ((r = sshbuf_put(b, idx->hashes[i].salt,
+		    sizeof(idx->hashes[i].salt))) != 0 ||
+		    (r = sshbuf_put(b, idx->hashes[i].hash,
+		    sizeof(idx->hashes[i].hash))) != 0 ||
+		    (r = sshbuf_put_u32(b, idx->hashes[i].line)) != 0)
+			goto out;
+	}
+	xasprintf(&ipath, "%s%s", path, HOSTFILE_INDEX_SUFFIX);
+	xasprintf(&tmp, "%s.XXXXXXXXXX", ipath);
+	if ((fd = mkstemp(tmp)) == -1) {
+		debug("%s: mkstemp %s: %s", __func__, tmp, strerror(errno));
+		goto out;
+	}
+	if (atomicio(vwrite, fd, (void *)sshbuf_ptr(b),
+	    sshbuf_len(b)) != sshbuf_len(b) || close(fd) != 0 ||
+	    rename(tmp, ipath) == -1) {
+		debug("%s: write %s: %s", __func__, ipath, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+	debug3("%s: saved index %s", __func__, ipath);
+ out:
+	free(ipath);
+	free(tmp);
+	sshbuf_free(b);
+}
+
+/* Returns the index for the open known_hosts file f, owned by the cache */
+static struct hostfile_index *
+hostfile_index_get(FILE *f, const char *path)
+{
+	struct hostfile_index *idx, *old;
+	struct stat st;
+
+	if (fstat(fileno(f), &st) == -1 || !S_ISREG(st.st_mode))
+		return NULL;
+	TAILQ_FOREACH(idx, &hostfile_index_cache, next) {
+		if (hostfile_index_matches(idx, &st)) {
+			TAILQ_REMOVE(&hostfile_index_cache, idx, next);
+			TAILQ_INSERT_HEAD(&hostfile_index_cache, idx, next);
+			return idx;
+		}
+	}
+	if (!hostfile_index_save_enabled ||
+	    (idx = hostfile_index_load(path, &st)) == NULL) {
+		if ((idx = hostfile_index_build(f, path)) == NULL)
+			return NULL;
+		hostfile_index_set_stat(idx, &st);
+		if (hostfile_index_save_enabled)
+			hostfile_index_save(idx, path);
+	}
+	TAILQ_INSERT_HEAD(&hostfile_index_cache, idx, next);
+	if (++hostfile_index_ncache > HOSTFILE_INDEX_CACHE) {
+		old = TAILQ_LAST(&hostfile_index_cache, hostfile_index_head);
+		TAILQ_REMOVE(&hostfile_index_cache, old, next);
+		hostfile_index_free(old);
+		hostfile_index_ncache--;
+	}
+	return idx;
+}
+
+/*
+ * Returns the sorted, unique indexes into idx->lines of the lines that
+ * may match host in *linesp.
+ */
+static int
+hostfile_index_lookup(const struct hostfile_index *idx, const char *host,
+    u_int **linesp, u_int *nlinesp)
+{
+	const EVP_MD *md = EVP_sha1();
+	u_char mac[EVP_MAX_MD_SIZE];
+	u_int *lines, n = 0, nalloc = 0, i, j, lo, hi, mid;
+	size_t hostlen = strlen(host);
+
+	*linesp = NULL;
+	*nlinesp = 0;
+	lines = NULL;
+
+	/* plain names */
+	lo = 0;
+	hi = idx->nnames;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(idx->names[mid].name, host) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < idx->nnames && strcmp(idx->names[lo].name, host) == 0;
+	    lo++) {
+		HOSTFILE_INDEX_GROW(lines, n, nalloc);
+		lines[n++] = idx->names[lo].line;
+	}
+
+	/* hashed names */
+	for (i = 0; i < idx->nhashes; i++) {
+		if (HMAC(md, idx->hashes[i].salt, sizeof(idx->hashes[i].salt),
+		    (const u_char *)host, hostlen, mac, NULL) == NULL) {
+			free(lines);
+			return -1;
+		}
+		if (memcmp(idx->hashes[i].hash, mac,
+		    sizeof(idx->hashes[i].hash)) != 0)
+			continue;
+		HOSTFILE_INDEX_GROW(lines, n, nalloc);
+		lines[n++] = idx->hashes[i].line;
+	}
+
+	/* wildcards and anything else needing a full check */
+	for (i = 0; i < idx->npatterns; i++) {
+		HOSTFILE_INDEX_GROW(lines, n, nalloc);
+		lines[n++] = idx->patterns[i];
+	}
+
+	if (n > 1) {
+		qsort(lines, n, sizeof(*lines), hostfile_index_line_cmp);
+		for (i = j = 1; i < n; i++) {
+			if (lines[i] != lines[j - 1])
+				lines[j++] = lines[i];
+		}
+		n = j;
+	}
+	*linesp = lines;
+	*nlinesp = n;
+	return 0;
+}
+
+/*
+ * Positions f at the start of an indexed line. Offsets that do not follow
+ * a newline are refused, so a bad index never splits a line.
+ */
+static int
+hostfile_index_seek(FILE *f, off_t offset)
+{
+	if (offset <= 0)
+		return offset == 0 ? fseeko(f, 0, SEEK_SET) : -1;
+	if (fseeko(f, offset - 1, SEEK_SET) == -1 || fgetc(f) != '\n')
+		return -1;
+	return 0;
+}
+
+/*
+ * Finds the numbers of the lines of a known_hosts file that may hold
+ * keys for host, in file order. Returns 0 on success or -1 if no index
+ * is available, in which case the caller must check every line.
+ */
+int
+hostfile_find_lines(const char *path, const char *host,
+    u_long **linenumsp, u_int *nlinenumsp)
+{
+	struct hostfile_index *idx;
+	FILE *f;
+	u_long *linenums;
+	u_int *lines, n, i;
+
+	*linenumsp = NULL;
+	*nlinenumsp = 0;
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	idx = hostfile_index_get(f, path);
+	fclose(f);
+	if (idx == NULL || hostfile_index_lookup(idx, host, &lines, &n) != 0)
+		return -1;
+	linenums = xcalloc(n + 1, sizeof(*linenums));
+	for (i = 0; i < n; i++)
+		linenums[i] = idx->lines[lines[i]].linenum;
+	free(lines);
+	*linenumsp = linenums;
+	*nlinenumsp = n;
+	return 0;
+}
+
+/*
+ * Adds the key on a known_hosts line to hostkeys if the line matches host.
+ * Returns 1 if a key was added, 0 if not and -1 on fatal errors.
+ */
+static int
+load_hostkeys_line(struct hostkeys *hostkeys, const char *host,
+    const char *path, char *line, u_long linenum)
+{
+	char *cp, *cp2, *hashed_host;
+	HostkeyMarker marker;
+	struct sshkey *key;
+	u_int kbits;
+
+	cp = line;
+
+	/* Skip any leading whitespace, comments and empty lines. */
+	for (; *cp == ' ' || *cp == '\t'; cp++)
+		;
+	if (!*cp || *cp == '#' || *cp == '\n')
+		return 0;
+
+	if ((marker = check_markers(&cp)) == MRK_ERROR) {
+		verbose("%s: invalid marker at %s:%lu",
+		    __func__, path, linenum);
+		return 0;
+	}
+
+	/* Find the end of the host name portion. */
+	for (cp2 = cp; *cp2 && *cp2 != ' ' && *cp2 != '\t'; cp2++)
+		;
+
+	/* Check if the host name matches. */
+	if (match_hostname(host, cp, (u_int) (cp2 - cp)) != 1) {
+		if (*cp != HASH_DELIM)
+			return 0;
+		hashed_host = host_hash(host, cp, (u_int) (cp2 - cp));
+		if (hashed_host == NULL) {
+			debug("Invalid hashed host line %lu of %s",
+			    linenum, path);
+			return 0;
+		}
+		if (strncmp(hashed_host, cp, (u_int) (cp2 - cp)) != 0)
+			return 0;
+	}
+
+	/* Got a match.  Skip host name. */
+	cp = cp2;
+
+	/*
+	 * Extract the key from the line.  This will skip any leading
+	 * whitespace.  Ignore badly formatted lines.
+	 */
+	if ((key = sshkey_new(KEY_UNSPEC)) == NULL) {
+		error("%s: sshkey_new failed", __func__);
+		return -1;
+	}
+	if (!hostfile_read_key(&cp, &kbits, key)) {
+		sshkey_free(key);
+		if ((key = sshkey_new(KEY_RSA1)) == NULL) {
 			error("%s: sshkey_new failed", __func__);
-			break;
+			return -1;
 		}
 		if (!hostfile_read_key(&cp, &kbits, key)) {
 			sshkey_free(key);
-			if ((key = sshkey_new(KEY_RSA1)) == NULL) {
-				error("%s: sshkey_new failed", __func__);
-				break;
-			}
-			if (!hostfile_read_key(&cp, &kbits, key)) {
-				sshkey_free(key);
-				continue;
-			}
+			return 0;
 		}
-		if (!hostfile_check_key(kbits, key, host, path, linenum))
+	}
+	if (!hostfile_check_key(kbits, key, host, path, linenum))
+		return 0;
+
+	debug3("%s: found %skey type %s in file %s:%lu", __func__,
+	    marker == MRK_NONE ? "" :
+	    (marker == MRK_CA ? "ca " : "revoked "),
+	    sshkey_type(key), path, linenum);
+	hostkeys->entries = xrealloc(hostkeys->entries,
+	    hostkeys->num_entries + 1, sizeof(*hostkeys->entries));
+	hostkeys->entries[hostkeys->num_entries].host = xstrdup(host);
+	hostkeys->entries[hostkeys->num_entries].file = xstrdup(path);
+	hostkeys->entries[hostkeys->num_entries].line = linenum;
+	hostkeys->entries[hostkeys->num_entries].key = key;
+	hostkeys->entries[hostkeys->num_entries].marker = marker;
+	hostkeys->num_entries++;
+	return 1;
+}
+
+/* Drop the entries added to hostkeys after the first 'keep' */
+static void
+truncate_hostkeys(struct hostkeys *hostkeys, u_int keep)
+{
+	while (hostkeys->num_entries > keep) {
+		hostkeys->num_entries--;
+		free(hostkeys->entries[hostkeys->num_entries].host);
+		free(hostkeys->entries[hostkeys->num_entries].file);
+		sshkey_free(hostkeys->entries[hostkeys->num_entries].key);
+	}
+}
+
+/*
+ * Loads only the lines the index of the file lists as candidates for host.
+ * Returns the number of keys loaded or -1 if the index could not be used.
+ */
+static long
+load_hostkeys_indexed(struct hostkeys *hostkeys, const char *host,
+    const char *path, FILE *f)
+{
+	struct hostfile_index *idx;
+	char line[HOSTFILE_LINE_MAX];
+	u_int *lines = NULL, nlines, i, keep = hostkeys->num_entries;
+	u_long linenum;
+	long num_loaded = 0;
+	int r;
+
+	if ((idx = hostfile_index_get(f, path)) == NULL ||
+	    hostfile_index_lookup(idx, host, &lines, &nlines) != 0)
+		return -1;
+	for (i = 0; i < nlines; i++) {
+		if (hostfile_index_seek(f, idx->lines[lines[i]].offset) != 0) {
+			debug("%s: index for %s is stale", __func__, path);
+			truncate_hostkeys(hostkeys, keep);
+			num_loaded = -1;
+			break;
+		}
+		linenum = idx->lines[lines[i]].linenum - 1;
+		if (read_keyfile_line(f, path, line, sizeof(line),
+		    &linenum) != 0)
 			continue;
+		if ((r = load_hostkeys_line(hostkeys, host, path, line,
+		    linenum)) == -1)
+			break;
+		num_loaded += r;
+	}
+	free(lines);
+	return num_loaded;
+}
+
+void
+load_hostkeys(struct hostkeys *hostkeys, const char *host, const char *path)
+{
+	FILE *f;
+	char line[HOSTFILE_LINE_MAX];
+	u_long linenum = 0, num_loaded = 0;
+	long n;
+	int r;
 
-		debug3("%s: found %skey type %s in file %s:%lu", __func__,
-		    marker == MRK_NONE ? "" :
-		    (marker == MRK_CA ? "ca " : "revoked "),
-		    sshkey_type(key), path, linenum);
-		hostkeys->entries = xrealloc(hostkeys->entries,
-		    hostkeys->num_entries + 1, sizeof(*hostkeys->entries));
-		hostkeys->entries[hostkeys->num_entries].host = xstrdup(host);
-		hostkeys->entries[hostkeys->num_entries].file = xstrdup(path);
-		hostkeys->entries[hostkeys->num_entries].line = linenum;
-		hostkeys->entries[hostkeys->num_entries].key = key;
-		hostkeys->entries[hostkeys->num_entries].marker = marker;
-		hostkeys->num_entries++;
-		num_loaded++;
+	if ((f = fopen(path, "r")) == NULL)
+		return;
+	debug3("%s: loading entries for host \"%.100s\" from file \"%s\"",
+	    __func__, host, path);
+	if ((n = load_hostkeys_indexed(hostkeys, host, path, f)) != -1) {
+		num_loaded = n;
+		goto done;
+	}
+	rewind(f);
+	while (read_keyfile_line(f, path, line, sizeof(line), &linenum) == 0) {
+		if ((r = load_hostkeys_line(hostkeys, host, path, line,
+		    linenum)) == -1)
+			break;
+		num_loaded += r;
 	}
+ done:
 	debug3("%s: loaded %lu keys", __func__, num_loaded);
 	fclose(f);
 	return;
@@ -51,6 +51,7 @@
 /* prototype */
 static int kex_choose_conf(struct ssh *);
 static int kex_input_newkeys(int, u_int32_t, struct ssh *);
+static int kex_input_ticket_new(int, u_int32_t, struct ssh *);
 
 struct kexalg {
 	char *name;
@@ -69,6 +70,13 @@ static const struct kexalg kexalgs[] = {
 	{ NULL, -1, -1, NULL},
 };
 
+/*
+ * Like KEX_RESUME, the ticket method is never configured by name: it is
+ * added to the proposal by kex_ticket_offer(), which ssh_api uses.
+ */
+static const struct kexalg kexticket =
+	{ KEX_TICKET_SHA256, KEX_TICKET, 0, EVP_sha256 };
+
 char *
 kex_alg_list(void)
 {
@@ -227,6 +235,10 @@ kex_send_newkeys(struct ssh *ssh)
 	    (r = sshpkt_send(ssh)) != 0)
 		return r;
 	debug("SSH2_MSG_NEWKEYS sent");
+	if (ssh->kex->server && ssh->kex->ticket_ok &&
+	    ssh->kex->ticket_key != NULL &&
+	    (r = kex_ticket_send(ssh)) != 0)
+		return r;
 	debug("expecting SSH2_MSG_NEWKEYS");
 	ssh_dispatch_set(ssh, SSH2_MSG_NEWKEYS, &kex_input_newkeys);
 	return 0;
@@ -243,6 +255,9 @@ kex_input_newkeys(int type, u_int32_t seq, struct ssh *ssh)
 	if ((r = sshpkt_get_end(ssh)) != 0)
 		return r;
 	kex->done = 1;
+	if (!kex->server && kex->ticket_ok)
+		ssh_dispatch_set(ssh, SSH2_MSG_KEX_TICKET_NEW,
+		    &kex_input_ticket_new);
 	sshbuf_reset(kex->peer);
 	/* sshbuf_reset(kex->my); */
 	kex->flags &= ~KEX_INIT_SENT;
@@ -251,6 +266,13 @@ kex_input_newkeys(int type, u_int32_t seq, struct ssh *ssh)
 	return 0;
 }
 
+static int
+kex_input_ticket_new(int type, u_int32_t seq, struct ssh *ssh)
+{
+	ssh_dispatch_set(ssh, SSH2_MSG_KEX_TICKET_NEW, &kex_protocol_error);
+	return kex_ticket_input(ssh);
+}
+
 int
 kex_send_kexinit(struct ssh *ssh)
 {
@@ -264,6 +286,9 @@ kex_send_kexinit(struct ssh *ssh)
 		return 0;
 	kex->done = 0;
 
+	if ((r = kex_ticket_prepare(kex)) != 0)
+		return r;
+
 	/* generate a random cookie */
 	if (sshbuf_len(kex->my) < KEX_COOKIE_LEN)
 		return SSH_ERR_INVALID_FORMAT;
@@ -415,6 +440,16 @@ kex_free(struct kex *kex)
 		free(kex->client_version_string);
 	if (kex->server_version_string)
 		free(kex->server_version_string);
+	if (kex->ticket_secret) {
+		bzero(kex->ticket_secret, KEX_TICKET_SECRET_LEN);
+		free(kex->ticket_secret);
+	}
+	if (kex->ticket_key) {
+		bzero(kex->ticket_key, sizeof(*kex->ticket_key));
+		free(kex->ticket_key);
+	}
+	if (kex->ticket != NULL)
+		sshbuf_free(kex->ticket);
 	free(kex);
 }
 
@@ -499,7 +534,11 @@ choose_kex(struct kex *k, char *client, char *server)
 
 	if (k->name == NULL)
 		return SSH_ERR_INTERNAL_ERROR;
-	if ((kexalg = kex_alg_by_name(k->name)) == NULL)
+	if (strcmp(k->name, KEX_TICKET_SHA256) == 0) {
+		if (!k->ticket_ok || k->kex[KEX_TICKET] == NULL)
+			return SSH_ERR_NO_KEX_ALG_MATCH;
+		kexalg = &kexticket;
+	} else if ((kexalg = kex_alg_by_name(k->name)) == NULL)
 		return SSH_ERR_INTERNAL_ERROR;
 	k->kex_type = kexalg->type;
 	k->evp_md = kexalg->mdfunc();
@@ -550,7 +589,7 @@ kex_choose_conf(struct ssh *ssh)
 {
 	struct newkeys *newkeys;
 	char **my = NULL, **peer = NULL;
-	char **cprop, **sprop;
+	char **cprop, **sprop, *ticket;
 	int nenc, nmac, ncomp;
 	u_int mode, ctos, need, authlen;
 	int r, first_kex_follows;
@@ -579,6 +618,18 @@ kex_choose_conf(struct ssh *ssh)
 		}
 	}
 
+	/* Check whether both sides offer resumption tickets */
+	kex->ticket_ok = 0;
+	if ((ticket = match_list(KEX_TICKET_SHA256,
+	    my[PROPOSAL_KEX_ALGS], NULL)) != NULL) {
+		free(ticket);
+		if ((ticket = match_list(KEX_TICKET_SHA256,
+		    peer[PROPOSAL_KEX_ALGS], NULL)) != NULL) {
+			kex->ticket_ok = 1;
+			free(ticket);
+		}
+	}
+
 	/* Algorithm Negotiation */
 	for (mode = 0; mode < MODE_MAX; mode++) {
 		if ((newkeys = calloc(1, sizeof(*newkeys))) == NULL) {
@@ -730,6 +781,17 @@ kex_derive_keys(struct ssh *ssh, u_char *hash, u_int hashlen,
 		kex->newkeys[mode]->enc.key = keys[ctos ? 2 : 3];
 		kex->newkeys[mode]->mac.key = keys[ctos ? 4 : 5];
 	}
+	/* resumption secret: HASH(K || H || "R" || session_id) */
+	if (kex->ticket_ok) {
+		if (kex->ticket_secret != NULL) {
+			bzero(kex->ticket_secret, KEX_TICKET_SECRET_LEN);
+			free(kex->ticket_secret);
+			kex->ticket_secret = NULL;
+		}
+		if ((r = derive_key(ssh, 'R', KEX_TICKET_SECRET_LEN, hash,
+		    hashlen, shared_secret, &kex->ticket_secret)) != 0)
+			return r;
+	}
 	return 0;
 }
 
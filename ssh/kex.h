@@ -44,6 +44,7 @@
 #define	KEX_ECDH_SHA2_NISTP256	"ecdh-sha2-nistp256"
 #define	KEX_ECDH_SHA2_NISTP384	"ecdh-sha2-nistp384"
 #define	KEX_ECDH_SHA2_NISTP521	"ecdh-sha2-nistp521"
+#define	KEX_TICKET_SHA256	"ticket-sha256@openssh.com"
 
 #define COMP_NONE	0
 #define COMP_ZLIB	1
@@ -75,11 +76,24 @@ enum kex_exchange {
 	KEX_DH_GEX_SHA1,
 	KEX_DH_GEX_SHA256,
 	KEX_ECDH_SHA2,
+	KEX_TICKET,
 	KEX_MAX
 };
 
 #define KEX_INIT_SENT	0x0001
 
+#define KEX_TICKET_NAME_LEN	16	/* identifies the ticket key */
+#define KEX_TICKET_KEY_LEN	32	/* aes256-gcm ticket key */
+#define KEX_TICKET_SECRET_LEN	32	/* resumption secret */
+#define KEX_TICKET_NONCE_LEN	32
+#define KEX_TICKET_SLACK	30	/* seconds a ticket must have left */
+
+struct kex_ticket_key {
+	u_char	name[KEX_TICKET_NAME_LEN];
+	u_char	key[KEX_TICKET_KEY_LEN];
+	u_int	lifetime;
+};
+
 struct sshenc {
 	char	*name;
 	const struct sshcipher *cipher;
@@ -131,6 +145,14 @@ struct kex {
 	u_int	min, max, nbits;	/* GEX */
 	EC_KEY	*ec_client_key;		/* ECH */
 	const EC_GROUP *ec_group;	/* ECH */
+	/* session resumption */
+	int	ticket_ok;		/* both sides offered tickets */
+	u_char	*ticket_secret;		/* resumption secret of this kex */
+	struct kex_ticket_key *ticket_key;	/* server: sealing key */
+	u_int64_t ticket_expiry;	/* server: expiry of resumed ticket */
+	struct sshbuf *ticket;		/* client: ticket, secret, expiry */
+	int	ticket_resume;		/* client: prefer the ticket */
+	u_char	ticket_nonce[KEX_TICKET_NONCE_LEN];	/* client nonce */
 };
 
 int	 kex_names_valid(const char *);
@@ -156,6 +178,17 @@ int	 kexgex_client(struct ssh *);
 int	 kexgex_server(struct ssh *);
 int	 kexecdh_client(struct ssh *);
 int	 kexecdh_server(struct ssh *);
+int	 kexticket_client(struct ssh *);
+int	 kexticket_server(struct ssh *);
+
+int	 kex_ticket_send(struct ssh *);
+int	 kex_ticket_input(struct ssh *);
+int	 kex_ticket_open(const struct kex_ticket_key *, const u_char *, size_t,
+    u_char **, u_int64_t *);
+int	 kex_ticket_parse(const struct sshbuf *, const u_char **, size_t *,
+    const u_char **, u_int64_t *);
+int	 kex_ticket_offer(struct kex *, int);
+int	 kex_ticket_prepare(struct kex *);
 
 int	 kex_dh_hash(const char *, const char *,
     const u_char *, size_t, const u_char *, size_t, const u_char *, size_t,
@@ -172,6 +205,11 @@ int kex_ecdh_hash(const EVP_MD *, const EC_GROUP *, const char *, const char *,
     const u_char *, size_t, const u_char *, size_t, const u_char *, size_t,
     const EC_POINT *, const EC_POINT *, const BIGNUM *, u_char **, size_t *);
 
+int	 kex_ticket_hash(const EVP_MD *, const char *, const char *,
+    const u_char *, size_t, const u_char *, size_t, const u_char *, size_t,
+    const u_char *, size_t, const u_char *, size_t, const BIGNUM *,
+    u_char **, size_t *);
+
 int	kex_ecdh_name_to_nid(const char *);
 const EVP_MD *kex_ecdh_name_to_evpmd(const char *);
 
@@ -0,0 +1,369 @@
+/* $OpenBSD$ */
+/*
+ * Session resumption tickets (ticket-sha256@openssh.com).
+ *
+ * Placed in the public domain
+ */
+
+#include <sys/types.h>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/bn.h>
+#include <openssl/evp.h>
+
+#include "ssh2.h"
+#include "key.h"
+#include "cipher.h"
+#include "kex.h"
+#include "log.h"
+#include "packet.h"
+#include "err.h"
+#include "sshbuf.h"
+
+#define TICKET_CIPHER	"aes256-gcm@openssh.com"
+#define TICKET_IV_LEN	12
+#define TICKET_AAD_LEN	(KEX_TICKET_NAME_LEN + TICKET_IV_LEN)
+
+int
+kex_ticket_hash(
+    const EVP_MD *evp_md,
+    const char *client_version_string,
+    const char *server_version_string,
+    const u_char *ckexinit, size_t ckexinitlen,
+    const u_char *skexinit, size_t skexinitlen,
+    const u_char *ticket, size_t ticketlen,
+    const u_char *client_nonce, size_t cnoncelen,
+    const u_char *server_nonce, size_t snoncelen,
+    const BIGNUM *shared_secret,
+    u_char **hash, size_t *hashlen)
+{
+	struct sshbuf *b;
+	EVP_MD_CTX md;
+	static u_char digest[EVP_MAX_MD_SIZE];
+	int r;
+
+	if ((b = sshbuf_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	if ((r = sshbuf_put_cstring(b, client_version_string)) != 0 ||
+	    (r = sshbuf_put_cstring(b, server_version_string)) != 0 ||
+	    /* kexinit messages: fake header: len+SSH2_MSG_KEXINIT */
+	    (r = sshbuf_put_u32(b, ckexinitlen+1)) != 0 ||
+	    (r = sshbuf_put_u8(b, SSH2_MSG_KEXINIT)) != 0 ||
+	    (r = sshbuf_put(b, ckexinit, ckexinitlen)) != 0 ||
+	    (r = sshbuf_put_u32(b, skexinitlen+1)) != 0 ||
+	    (r = sshbuf_put_u8(b, SSH2_MSG_KEXINIT)) != 0 ||
+	    (r = sshbuf_put(b, skexinit, skexinitlen)) != 0 ||
+	    (r = sshbuf_put_string(b, ticket, ticketlen)) != 0 ||
+	    (r = sshbuf_put_string(b, client_nonce, cnoncelen)) != 0 ||
+	    (r = sshbuf_put_string(b, server_nonce, snoncelen)) != 0 ||
+	    (r = sshbuf_put_bignum2(b, shared_secret)) != 0) {
+		sshbuf_free(b);
+		return r;
+	}
+#ifdef DEBUG_KEX
+	sshbuf_dump(b, stderr);
+#endif
+	if (EVP_DigestInit(&md, evp_md) != 1 ||
+	    EVP_DigestUpdate(&md, sshbuf_ptr(b), sshbuf_len(b)) != 1 ||
+	    EVP_DigestFinal(&md, digest, NULL) != 1) {
+		sshbuf_free(b);
+		return SSH_ERR_LIBCRYPTO_ERROR;
+	}
+	sshbuf_free(b);
+#ifdef DEBUG_KEX
+	dump_digest("hash", digest, EVP_MD_size(evp_md));
+#endif
+	*hash = digest;
+	*hashlen = EVP_MD_size(evp_md);
+	return 0;
+}
+
+/*
+ * A sealed ticket is the key name and a random IV, followed by the
+ * aes256-gcm encrypted expiry time and resumption secret. The name
+ * and IV are authenticated as additional data.
+ */
+static int
+ticket_seal(const struct kex_ticket_key *tk, const u_char *secret,
+    u_int64_t expiry, struct sshbuf *ticket)
+{
+	const struct sshcipher *cipher;
+	struct sshcipher_ctx cc;
+	struct sshbuf *b;
+	u_char iv[TICKET_IV_LEN], *cp;
+	u_int authlen, len;
+	int r;
+
+	if ((cipher = cipher_by_name(TICKET_CIPHER)) == NULL)
+		return SSH_ERR_INTERNAL_ERROR;
+	authlen = cipher_authlen(cipher);
+	if ((b = sshbuf_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	arc4random_buf(iv, sizeof(iv));
+	if ((r = sshbuf_put(b, tk->name, sizeof(tk->name))) != 0 ||
+	    (r = sshbuf_put(b, iv, sizeof(iv))) != 0 ||
+	    (r = sshbuf_put_u64(b, expiry)) != 0 ||
+	    (r = sshbuf_put_string(b, secret, KEX_TICKET_SECRET_LEN)) != 0)
+		goto out;
+	while ((sshbuf_len(b) - TICKET_AAD_LEN) % cipher_blocksize(cipher))
+		if ((r = sshbuf_put_u8(b, 0)) != 0)
+			goto out;
+	len = sshbuf_len(b) - TICKET_AAD_LEN;
+	if ((r = sshbuf_reserve(ticket, TICKET_AAD_LEN + len + authlen,
+	    &cp)) != 0)
+		goto out;
+	if ((r = cipher_init(&cc, cipher, tk->key, sizeof(tk->key),
+	    iv, sizeof(iv), CIPHER_ENCRYPT)) != 0)
+		goto out;
+	r = cipher_crypt(&cc, cp, sshbuf_ptr(b), len, TICKET_AAD_LEN, authlen);
+	cipher_cleanup(&cc);
+ out:
+	sshbuf_free(b);
+	return r;
+}
+
+/*
+ * Decrypt a ticket sealed with ticket_seal() and return its resumption
+ * secret. Tickets for other keys, forged or expired tickets are all
+ * reported as SSH_ERR_TICKET_INVALID.
+ */
+int
+kex_ticket_open(const struct kex_ticket_key *tk, const u_char *ticket,
+    size_t len, u_char **secretp, u_int64_t *expiryp)
+{
+	const struct sshcipher *cipher;
+	struct sshcipher_ctx cc;
+	struct sshbuf *b;
+	u_char *cp, *secret = NULL;
+	u_int64_t expiry;
+	u_int authlen, blocksize;
+	size_t slen = 0;
+	int r;
+
+	*secretp = NULL;
+	*expiryp = 0;
+	if ((cipher = cipher_by_name(TICKET_CIPHER)) == NULL)
+		return SSH_ERR_INTERNAL_ERROR;
+	authlen = cipher_authlen(cipher);
+	blocksize = cipher_blocksize(cipher);
+	if (len < TICKET_AAD_LEN + blocksize + authlen ||
+	    (len - TICKET_AAD_LEN - authlen) % blocksize != 0 ||
+	    timingsafe_bcmp(ticket, tk->name, sizeof(tk->name)) != 0)
+		return SSH_ERR_TICKET_INVALID;
+	if ((b = sshbuf_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	if ((r = sshbuf_reserve(b, len - authlen, &cp)) != 0)
+		goto out;
+	if ((r = cipher_init(&cc, cipher, tk->key, sizeof(tk->key),
+	    ticket + KEX_TICKET_NAME_LEN, TICKET_IV_LEN, CIPHER_DECRYPT)) != 0)
+		goto out;
+	r = cipher_crypt(&cc, cp, ticket, len - TICKET_AAD_LEN - authlen,
+	    TICKET_AAD_LEN, authlen);
+	cipher_cleanup(&cc);
+	if (r == SSH_ERR_MAC_INVALID)
+		r = SSH_ERR_TICKET_INVALID;
+	if (r != 0)
+		goto out;
+	if ((r = sshbuf_consume(b, TICKET_AAD_LEN)) != 0 ||
+	    (r = sshbuf_get_u64(b, &expiry)) != 0 ||
+	    (r = sshbuf_get_string(b, &secret, &slen)) != 0)
+		goto out;
+	if (slen != KEX_TICKET_SECRET_LEN ||
+	    expiry < (u_int64_t)time(NULL)) {
+		r = SSH_ERR_TICKET_INVALID;
+		goto out;
+	}
+	*secretp = secret;
+	secret = NULL;
+	*expiryp = expiry;
+	r = 0;
+ out:
+	if (secret != NULL) {
+		bzero(secret, slen);
+		free(secret);
+	}
+	sshbuf_free(b);
+	return r;
+}
+
+/*
+ * Parse a client ticket as returned by ssh_get_ticket(): the opaque
+ * ticket, the resumption secret and the local expiry time. The returned
+ * pointers point into 'entry'.
+ */
+int
+kex_ticket_parse(const struct sshbuf *entry, const u_char **ticketp,
+    size_t *ticketlenp, const u_char **secretp, u_int64_t *expiryp)
+{
+	struct sshbuf *b;
+	size_t slen;
+	int r;
+
+	if ((b = sshbuf_from(sshbuf_ptr(entry), sshbuf_len(entry))) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	if ((r = sshbuf_get_string_direct(b, ticketp, ticketlenp)) != 0 ||
+	    (r = sshbuf_get_string_direct(b, secretp, &slen)) != 0 ||
+	    (r = sshbuf_get_u64(b, expiryp)) != 0)
+		goto out;
+	if (slen != KEX_TICKET_SECRET_LEN) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	if (*expiryp < (u_int64_t)time(NULL)) {
+		r = SSH_ERR_TICKET_INVALID;
+		goto out;
+	}
+	r = 0;
+ out:
+	sshbuf_free(b);
+	return r;
+}
+
+/*
+ * Server: issue a ticket for the resumption secret of the key exchange
+ * that just completed. Resumed sessions do not extend the lifetime of
+ * the ticket they were resumed from.
+ */
+int
+kex_ticket_send(struct ssh *ssh)
+{
+	struct kex *kex = ssh->kex;
+	struct sshbuf *ticket;
+	u_int64_t now, expiry;
+	int r;
+
+	if (kex->ticket_key == NULL || kex->ticket_secret == NULL)
+		return SSH_ERR_INTERNAL_ERROR;
+	now = time(NULL);
+	expiry = now + kex->ticket_key->lifetime;
+	if (kex->ticket_expiry != 0 && kex->ticket_expiry < expiry)
+		expiry = kex->ticket_expiry;
+	if (expiry <= now)
+		return 0;
+	if ((ticket = sshbuf_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	if ((r = ticket_seal(kex->ticket_key, kex->ticket_secret, expiry,
+	    ticket)) != 0 ||
+	    (r = sshpkt_start(ssh, SSH2_MSG_KEX_TICKET_NEW)) != 0 ||
+	    (r = sshpkt_put_stringb(ssh, ticket)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, expiry - now)) != 0 ||
+	    (r = sshpkt_send(ssh)) != 0)
+		goto out;
+	debug("SSH2_MSG_KEX_TICKET_NEW sent");
+ out:
+	sshbuf_free(ticket);
+	return r;
+}
+
+/* Client: store a ticket received after NEWKEYS together with its secret */
+int
+kex_ticket_input(struct ssh *ssh)
+{
+	struct kex *kex = ssh->kex;
+	const u_char *ticket;
+	size_t len;
+	u_int32_t lifetime;
+	int r;
+
+	debug("SSH2_MSG_KEX_TICKET_NEW received");
+	if ((r = sshpkt_get_string_direct(ssh, &ticket, &len)) != 0 ||
+	    (r = sshpkt_get_u32(ssh, &lifetime)) != 0 ||
+	    (r = sshpkt_get_end(ssh)) != 0)
+		return r;
+	if (kex->ticket_secret == NULL)
+		return SSH_ERR_INTERNAL_ERROR;
+	if (kex->ticket == NULL && (kex->ticket = sshbuf_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	sshbuf_reset(kex->ticket);
+	if ((r = sshbuf_put_string(kex->ticket, ticket, len)) != 0 ||
+	    (r = sshbuf_put_string(kex->ticket, kex->ticket_secret,
+	    KEX_TICKET_SECRET_LEN)) != 0 ||
+	    (r = sshbuf_put_u64(kex->ticket,
+	    (u_int64_t)time(NULL) + lifetime)) != 0) {
+		sshbuf_reset(kex->ticket);
+		return r;
+	}
+	return 0;
+}
+
+/*
+ * Offer resumption tickets in KEXINIT: preferred if we are about to resume
+ * from a ticket, otherwise last so they are only used to receive one.
+ */
+int
+kex_ticket_offer(struct kex *kex, int prefer)
+{
+	char *orig, *avail, *oavail = NULL, *alg, *replace = NULL;
+	char **proposal;
+	size_t maxlen;
+	int r;
+
+	/* XXX we de-serialize kex->my, modify it, and change it */
+	if ((r = kex_buf2prop(kex->my, NULL, &proposal)) != 0)
+		return r;
+	orig = proposal[PROPOSAL_KEX_ALGS];
+	if ((oavail = avail = strdup(orig)) == NULL) {
+		r = SSH_ERR_ALLOC_FAIL;
+		goto out;
+	}
+	maxlen = strlen(orig) + strlen(KEX_TICKET_SHA256) + 2;
+	if ((replace = calloc(1, maxlen)) == NULL) {
+		r = SSH_ERR_ALLOC_FAIL;
+		goto out;
+	}
+	if (prefer)
+		strlcpy(replace, KEX_TICKET_SHA256, maxlen);
+	while ((alg = strsep(&avail, ",")) && *alg != '\0') {
+		if (strcmp(alg, KEX_TICKET_SHA256) == 0)
+			continue;
+		if (*replace != '\0')
+			strlcat(replace, ",", maxlen);
+		strlcat(replace, alg, maxlen);
+	}
+	if (!prefer) {
+		if (*replace != '\0')
+			strlcat(replace, ",", maxlen);
+		strlcat(replace, KEX_TICKET_SHA256, maxlen);
+	}
+	debug2("%s: orig/%d    %s", __func__, kex->server, orig);
+	debug2("%s: replace/%d %s", __func__, kex->server, replace);
+	free(orig);
+	proposal[PROPOSAL_KEX_ALGS] = replace;
+	replace = NULL;	/* owned by proposal */
+	r = kex_prop2buf(kex->my, proposal);
+ out:
+	if (oavail)
+		free(oavail);
+	if (replace)
+		free(replace);
+	kex_prop_free(proposal);
+	return r;
+}
+
+/*
+ * Client: called before sending KEXINIT.  A ticket is only used for the
+ * first key exchange, so that rekeying runs a fresh key agreement, and is
+ * dropped early if it would expire before the server sees it.
+ */
+int
+kex_ticket_prepare(struct kex *kex)
+{
+	const u_char *ticket, *secret;
+	size_t ticketlen;
+	u_int64_t expiry;
+
+	if (kex->server || !kex->ticket_resume)
+		return 0;
+	if (kex->session_id == NULL && kex->ticket != NULL &&
+	    kex_ticket_parse(kex->ticket, &ticket, &ticketlen,
+	    &secret, &expiry) == 0 &&
+	    expiry > (u_int64_t)time(NULL) + KEX_TICKET_SLACK)
+		return 0;
+	debug("%s: not resuming from ticket", __func__);
+	kex->ticket_resume = 0;
+	return kex_ticket_offer(kex, 0);
+}
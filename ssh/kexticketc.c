@@ -0,0 +1,122 @@
+/* $OpenBSD$ */
+/*
+ * Client side of ticket-sha256@openssh.com session resumption.
+ *
+ * Placed in the public domain
+ */
+
+#include <sys/types.h>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/bn.h>
+
+#include "key.h"
+#include "cipher.h"
+#include "kex.h"
+#include "log.h"
+#include "packet.h"
+#include "ssh2.h"
+#include "dispatch.h"
+#include "compat.h"
+#include "err.h"
+#include "sshbuf.h"
+
+static int input_kex_ticket_reply(int, u_int32_t, struct ssh *);
+
+int
+kexticket_client(struct ssh *ssh)
+{
+	struct kex *kex = ssh->kex;
+	const u_char *ticket, *secret;
+	size_t ticketlen;
+	u_int64_t expiry;
+	int r;
+
+	if (kex->ticket == NULL)
+		return SSH_ERR_TICKET_INVALID;
+	if ((r = kex_ticket_parse(kex->ticket, &ticket, &ticketlen,
+	    &secret, &expiry)) != 0)
+		return r;
+	arc4random_buf(kex->ticket_nonce, sizeof(kex->ticket_nonce));
+	if ((r = sshpkt_start(ssh, SSH2_MSG_KEX_TICKET_INIT)) != 0 ||
+	    (r = sshpkt_put_string(ssh, ticket, ticketlen)) != 0 ||
+	    (r = sshpkt_put_string(ssh, kex->ticket_nonce,
+	    sizeof(kex->ticket_nonce))) != 0 ||
+	    (r = sshpkt_send(ssh)) != 0)
+		return r;
+	debug("sending SSH2_MSG_KEX_TICKET_INIT");
+
+	debug("expecting SSH2_MSG_KEX_TICKET_REPLY");
+	ssh_dispatch_set(ssh, SSH2_MSG_KEX_TICKET_REPLY,
+	    &input_kex_ticket_reply);
+	return 0;
+}
+
+static int
+input_kex_ticket_reply(int type, u_int32_t seq, struct ssh *ssh)
+{
+	struct kex *kex = ssh->kex;
+	const u_char *ticket, *secret, *server_nonce;
+	BIGNUM *shared_secret = NULL;
+	u_char *hash;
+	size_t ticketlen, noncelen, hashlen;
+	u_int64_t expiry;
+	int r;
+
+	if ((r = sshpkt_get_string_direct(ssh, &server_nonce,
+	    &noncelen)) != 0 ||
+	    (r = sshpkt_get_end(ssh)) != 0)
+		goto out;
+	if (noncelen != KEX_TICKET_NONCE_LEN) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	/* the secret may have expired while we waited for the reply */
+	if ((r = kex_ticket_parse(kex->ticket, &ticket, &ticketlen,
+	    &secret, &expiry)) != 0)
+		goto out;
+	if ((shared_secret = BN_new()) == NULL) {
+		r = SSH_ERR_ALLOC_FAIL;
+		goto out;
+	}
+	if (BN_bin2bn(secret, KEX_TICKET_SECRET_LEN, shared_secret) == NULL) {
+		r = SSH_ERR_LIBCRYPTO_ERROR;
+		goto out;
+	}
+
+	/* calc H */
+	if ((r = kex_ticket_hash(
+	    kex->evp_md,
+	    kex->client_version_string,
+	    kex->server_version_string,
+	    sshbuf_ptr(kex->my), sshbuf_len(kex->my),
+	    sshbuf_ptr(kex->peer), sshbuf_len(kex->peer),
+	    ticket, ticketlen,
+	    kex->ticket_nonce, sizeof(kex->ticket_nonce),
+	    server_nonce, noncelen,
+	    shared_secret,
+	    &hash, &hashlen)) != 0)
+		goto out;
+
+	/* save session id */
+	if (kex->session_id == NULL) {
+		kex->session_id_len = hashlen;
+		kex->session_id = malloc(kex->session_id_len);
+		if (kex->session_id == NULL) {
+			r = SSH_ERR_ALLOC_FAIL;
+			goto out;
+		}
+		memcpy(kex->session_id, hash, kex->session_id_len);
+	}
+
+	if ((r = kex_derive_keys(ssh, hash, hashlen, shared_secret)) == 0)
+		r = kex_send_newkeys(ssh);
+ out:
+	bzero(kex->ticket_nonce, sizeof(kex->ticket_nonce));
+	if (shared_secret)
+		BN_clear_free(shared_secret);
+	return r;
+}
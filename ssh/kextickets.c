@@ -0,0 +1,120 @@
+/* $OpenBSD$ */
+/*
+ * Server side of ticket-sha256@openssh.com session resumption.
+ *
+ * Placed in the public domain
+ */
+
+#include <sys/types.h>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/bn.h>
+
+#include "key.h"
+#include "cipher.h"
+#include "kex.h"
+#include "log.h"
+#include "packet.h"
+#include "ssh2.h"
+#include "dispatch.h"
+#include "compat.h"
+#include "err.h"
+#include "sshbuf.h"
+
+static int input_kex_ticket_init(int, u_int32_t, struct ssh *);
+
+int
+kexticket_server(struct ssh *ssh)
+{
+	if (ssh->kex->ticket_key == NULL)
+		return SSH_ERR_TICKET_INVALID;
+	debug("expecting SSH2_MSG_KEX_TICKET_INIT");
+	ssh_dispatch_set(ssh, SSH2_MSG_KEX_TICKET_INIT, &input_kex_ticket_init);
+	return 0;
+}
+
+static int
+input_kex_ticket_init(int type, u_int32_t seq, struct ssh *ssh)
+{
+	struct kex *kex = ssh->kex;
+	const u_char *ticket, *client_nonce;
+	u_char server_nonce[KEX_TICKET_NONCE_LEN];
+	u_char *secret = NULL, *hash;
+	BIGNUM *shared_secret = NULL;
+	size_t ticketlen, noncelen, hashlen;
+	u_int64_t expiry;
+	int r;
+
+	if ((r = sshpkt_get_string_direct(ssh, &ticket, &ticketlen)) != 0 ||
+	    (r = sshpkt_get_string_direct(ssh, &client_nonce,
+	    &noncelen)) != 0 ||
+	    (r = sshpkt_get_end(ssh)) != 0)
+		goto out;
+	if (noncelen != KEX_TICKET_NONCE_LEN) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	if ((r = kex_ticket_open(kex->ticket_key, ticket, ticketlen,
+	    &secret, &expiry)) != 0) {
+		if (r == SSH_ERR_TICKET_INVALID)
+			sshpkt_disconnect(ssh, "invalid resumption ticket");
+		goto out;
+	}
+	kex->ticket_expiry = expiry;
+
+	if ((shared_secret = BN_new()) == NULL) {
+		r = SSH_ERR_ALLOC_FAIL;
+		goto out;
+	}
+	if (BN_bin2bn(secret, KEX_TICKET_SECRET_LEN, shared_secret) == NULL) {
+		r = SSH_ERR_LIBCRYPTO_ERROR;
+		goto out;
+	}
+	arc4random_buf(server_nonce, sizeof(server_nonce));
+
+	/* calc H */
+	if ((r = kex_ticket_hash(
+	    kex->evp_md,
+	    kex->client_version_string,
+	    kex->server_version_string,
+	    sshbuf_ptr(kex->peer), sshbuf_len(kex->peer),
+	    sshbuf_ptr(kex->my), sshbuf_len(kex->my),
+	    ticket, ticketlen,
+	    client_nonce, noncelen,
+	    server_nonce, sizeof(server_nonce),
+	    shared_secret,
+	    &hash, &hashlen)) != 0)
+		goto out;
+
+	/* save session id := H */
+	if (kex->session_id == NULL) {
+		kex->session_id_len = hashlen;
+		kex->session_id = malloc(kex->session_id_len);
+		if (kex->session_id == NULL) {
+			r = SSH_ERR_ALLOC_FAIL;
+			goto out;
+		}
+		memcpy(kex->session_id, hash, kex->session_id_len);
+	}
+
+	/* no host key signature: only the ticket key holder knows K */
+	if ((r = sshpkt_start(ssh, SSH2_MSG_KEX_TICKET_REPLY)) != 0 ||
+	    (r = sshpkt_put_string(ssh, server_nonce,
+	    sizeof(server_nonce))) != 0 ||
+	    (r = sshpkt_send(ssh)) != 0)
+		goto out;
+
+	if ((r = kex_derive_keys(ssh, hash, hashlen, shared_secret)) == 0)
+		r = kex_send_newkeys(ssh);
+ out:
+	if (secret != NULL) {
+		bzero(secret, KEX_TICKET_SECRET_LEN);
+		free(secret);
+	}
+	if (shared_secret)
+		BN_clear_free(shared_secret);
+	return r;
+}
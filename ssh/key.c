@@ -27,12 +27,16 @@
 
 #include <sys/param.h>
 #include <sys/types.h>
+#include <sys/queue.h>
 
 #include <openssl/evp.h>
+#include <openssl/sha.h>
 
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "ssh2.h"
 #include "err.h"
@@ -413,6 +417,11 @@ sshkey_free(struct sshkey *k)
 {
 	if (k == NULL)
 		return;
+	/* shared through the key cache: drop a reference only */
+	if (k->refcnt > 0) {
+		k->refcnt--;
+		return;
+	}
 	switch (k->type) {
 	case KEY_RSA1:
 	case KEY_RSA:
@@ -1507,13 +1516,102 @@ sshkey_names_valid2(const char *names)
 	return 1;
 }
 
+/*
+ * Table of certificates whose CA signature has been verified, keyed by
+ * the SHA256 digest of the certificate blob. It lives in memory supplied
+ * by the caller, which sshd shares between the privileged processes of
+ * its connections so that repeat logins skip the signature check. Only
+ * the signature is vouched for; validity, principals and revocation are
+ * still checked by the callers every time.
+ *
+ * Entries are written without locking. A torn entry can only fail to
+ * match, since no certificate has a digest mixing those of two others,
+ * and an entry's expiry only bounds how long it is kept.
+ */
+#define SSHKEY_CERTCACHE_PROBES	4
+
+struct sshkey_certcache_entry {
+	u_char		digest[SHA256_DIGEST_LENGTH];
+	u_int64_t	valid_before;
+};
+
+static struct sshkey_certcache_entry *certcache;
+static size_t certcache_nentries;
+static pid_t certcache_pid;
+
+/* Bytes of memory needed for a table of nentries certificates */
+size_t
+sshkey_certcache_size(u_int nentries)
+{
+	return (size_t)nentries * sizeof(struct sshkey_certcache_entry);
+}
+
+/*
+ * Use a table in len bytes at mem, initially zeroed, or none if NULL.
+ * The table is only used by this process and not by any it forks.
+ */
+void
+sshkey_certcache_set(void *mem, size_t len)
+{
+	certcache = mem;
+	certcache_nentries = mem == NULL ? 0 : len / sizeof(*certcache);
+	certcache_pid = getpid();
+}
+
+static int
+certcache_usable(void)
+{
+	return certcache_nentries != 0 && certcache_pid == getpid();
+}
+
+static int
+certcache_lookup(const u_char *digest, u_int64_t now)
+{
+	struct sshkey_certcache_entry e;
+	size_t i, slot;
+
+	slot = PEEK_U32(digest) % certcache_nentries;
+	for (i = 0; i < SSHKEY_CERTCACHE_PROBES; i++) {
+		memcpy(&e, &certcache[(slot + i) % certcache_nentries],
+		    sizeof(e));
+		if (e.valid_before > now &&
+		    memcmp(e.digest, digest, sizeof(e.digest)) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* Store in the first free slot probed, else replace the soonest to expire */
+static void
+certcache_store(const u_char *digest, u_int64_t valid_before, u_int64_t now)
+{
+	struct sshkey_certcache_entry *e, *victim = NULL;
+	size_t i, slot;
+
+	if (valid_before <= now)
+		return;
+	slot = PEEK_U32(digest) % certcache_nentries;
+	for (i = 0; i < SSHKEY_CERTCACHE_PROBES; i++) {
+		e = &certcache[(slot + i) % certcache_nentries];
+		if (e->valid_before <= now) {
+			victim = e;
+			break;
+		}
+		if (victim == NULL || e->valid_before < victim->valid_before)
+			victim = e;
+	}
+	memcpy(victim->digest, digest, sizeof(victim->digest));
+	victim->valid_before = valid_before;
+}
+
 static int
 cert_parse(struct sshbuf *b, struct sshkey *key, const u_char *blob,
     size_t blen)
 {
 	u_char *principals = NULL, *critical = NULL, *exts = NULL;
-	u_char *sig_key = NULL, *sig = NULL;
+	u_char *sig_key = NULL, *sig = NULL, digest[SHA256_DIGEST_LENGTH];
 	size_t signed_len, plen, clen, sklen, slen, kidlen, elen;
+	u_int64_t now = 0;
 	struct sshbuf *tmp;
 	char *principal;
 	int ret;
@@ -1625,9 +1723,24 @@ cert_parse(struct sshbuf *b, struct sshkey *key, const u_char *blob,
 		goto out;
 	}
 
+	/* Skip the signature check for a certificate verified before */
+	if (certcache_usable()) {
+		if (SHA256(sshbuf_ptr(key->cert->certblob),
+		    sshbuf_len(key->cert->certblob), digest) == NULL) {
+			ret = SSH_ERR_LIBCRYPTO_ERROR;
+			goto out;
+		}
+		now = time(NULL);
+		if (certcache_lookup(digest, now)) {
+			ret = 0;
+			goto out;
+		}
+	}
 	if ((ret = sshkey_verify(key->cert->signature_key, sig, slen, 
 	    sshbuf_ptr(key->cert->certblob), signed_len, 0)) != 0)
 		goto out;
+	if (certcache_usable())
+		certcache_store(digest, key->cert->valid_before, now);
 	ret = 0;
 
  out:
@@ -1781,6 +1894,97 @@ sshkey_from_blob(const u_char *blob, size_t blen, struct sshkey **keyp)
 	return ret;
 }
 
+/*
+ * Bounded LRU cache of parsed public keys, keyed by the SHA256 digest of
+ * their blob. Parsing validates EC points and certificate signatures,
+ * and the same blob is typically parsed several times per login.
+ * Cached keys are shared by reference: callers must treat them as
+ * read-only and release them with sshkey_free().
+ */
+#define SSHKEY_CACHE_BUCKETS	64
+#define SSHKEY_CACHE_DEFAULT	64
+
+struct sshkey_cache_entry {
+	u_char	digest[SHA256_DIGEST_LENGTH];
+	size_t	blen;
+	struct sshkey *key;
+	LIST_ENTRY(sshkey_cache_entry) hnext;
+	TAILQ_ENTRY(sshkey_cache_entry) lnext;
+};
+
+static LIST_HEAD(, sshkey_cache_entry) keycache_hash[SSHKEY_CACHE_BUCKETS];
+static TAILQ_HEAD(sshkey_cache_lru, sshkey_cache_entry) keycache_lru =
+    TAILQ_HEAD_INITIALIZER(keycache_lru);
+static u_int keycache_len;
+static u_int keycache_max = SSHKEY_CACHE_DEFAULT;
+
+static void
+keycache_evict(struct sshkey_cache_entry *e)
+{
+	LIST_REMOVE(e, hnext);
+	TAILQ_REMOVE(&keycache_lru, e, lnext);
+	keycache_len--;
+	sshkey_free(e->key);
+	bzero(e, sizeof(*e));
+	free(e);
+}
+
+/*
+ * Set the maximum number of cached keys. Zero disables the cache.
+ * Keys still referenced by callers stay valid until they are freed.
+ */
+void
+sshkey_cache_limit(u_int max)
+{
+	keycache_max = max;
+	while (keycache_len > keycache_max)
+		keycache_evict(TAILQ_LAST(&keycache_lru, sshkey_cache_lru));
+}
+
+/* Like sshkey_from_blob(), but returns a shared, read-only key */
+int
+sshkey_from_blob_cached(const u_char *blob, size_t blen, struct sshkey **keyp)
+{
+	struct sshkey_cache_entry *e;
+	u_char digest[SHA256_DIGEST_LENGTH];
+	u_int bucket;
+	int r;
+
+	*keyp = NULL;
+	if (keycache_max == 0)
+		return sshkey_from_blob(blob, blen, keyp);
+	if (SHA256(blob, blen, digest) == NULL)
+		return SSH_ERR_LIBCRYPTO_ERROR;
+	bucket = (digest[0] | digest[1] << 8) % SSHKEY_CACHE_BUCKETS;
+	LIST_FOREACH(e, &keycache_hash[bucket], hnext) {
+		if (e->blen == blen &&
+		    memcmp(e->digest, digest, sizeof(digest)) == 0) {
+			TAILQ_REMOVE(&keycache_lru, e, lnext);
+			TAILQ_INSERT_HEAD(&keycache_lru, e, lnext);
+			e->key->refcnt++;
+			*keyp = e->key;
+			return 0;
+		}
+	}
+	if ((e = calloc(1, sizeof(*e))) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	if ((r = sshkey_from_blob(blob, blen, &e->key)) != 0) {
+		free(e);
+		return r;
+	}
+	memcpy(e->digest, digest, sizeof(e->digest));
+	e->blen = blen;
+	while (keycache_len >= keycache_max)
+		keycache_evict(TAILQ_LAST(&keycache_lru, sshkey_cache_lru));
+	LIST_INSERT_HEAD(&keycache_hash[bucket], e, hnext);
+	TAILQ_INSERT_HEAD(&keycache_lru, e, lnext);
+	keycache_len++;
+	/* one reference for the cache, one for the caller */
+	e->key->refcnt++;
+	*keyp = e->key;
+	return 0;
+}
+
 int
 sshkey_sign(const struct sshkey *key,
     u_char **sigp, size_t *lenp,
@@ -1835,6 +2039,77 @@ sshkey_verify(const struct sshkey *key,
 	}
 }
 
+/*
+ * Do the setup that the first signature by a private key would otherwise
+ * pay for: Montgomery contexts for the RSA and DSA moduli and the table
+ * of generator multiples for ECDSA. RSA blinding is still created on
+ * first use, so that processes forked after this call do not all start
+ * from the same blinding values. Only the first call does any work; it
+ * is not safe to make it while other threads are using the key.
+ */
+int
+sshkey_precompute(struct sshkey *key)
+{
+	BN_CTX *ctx;
+	RSA *rsa;
+	int ret = SSH_ERR_LIBCRYPTO_ERROR;
+
+	if ((key->flags & SSHKEY_FLAG_PRECOMPUTED) != 0)
+		return 0;
+	if ((ctx = BN_CTX_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	switch (key->type) {
+	case KEY_RSA1:
+	case KEY_RSA_CERT_V00:
+	case KEY_RSA_CERT:
+	case KEY_RSA:
+		if ((rsa = key->rsa) == NULL || rsa->n == NULL) {
+			ret = SSH_ERR_INVALID_ARGUMENT;
+			goto out;
+		}
+		if (rsa->p == NULL || rsa->q == NULL)
+			break;
+		rsa->flags |= RSA_FLAG_CACHE_PUBLIC|RSA_FLAG_CACHE_PRIVATE;
+		if (BN_MONT_CTX_set_locked(&rsa->_method_mod_n,
+		    CRYPTO_LOCK_RSA, rsa->n, ctx) == NULL ||
+		    BN_MONT_CTX_set_locked(&rsa->_method_mod_p,
+		    CRYPTO_LOCK_RSA, rsa->p, ctx) == NULL ||
+		    BN_MONT_CTX_set_locked(&rsa->_method_mod_q,
+		    CRYPTO_LOCK_RSA, rsa->q, ctx) == NULL)
+			goto out;
+		break;
+	case KEY_DSA_CERT_V00:
+	case KEY_DSA_CERT:
+	case KEY_DSA:
+		if (key->dsa == NULL || key->dsa->p == NULL) {
+			ret = SSH_ERR_INVALID_ARGUMENT;
+			goto out;
+		}
+		key->dsa->flags |= DSA_FLAG_CACHE_MONT_P;
+		if (BN_MONT_CTX_set_locked(&key->dsa->method_mont_p,
+		    CRYPTO_LOCK_DSA, key->dsa->p, ctx) == NULL)
+			goto out;
+		break;
+	case KEY_ECDSA_CERT:
+	case KEY_ECDSA:
+		if (key->ecdsa == NULL) {
+			ret = SSH_ERR_INVALID_ARGUMENT;
+			goto out;
+		}
+		if (EC_KEY_get0_private_key(key->ecdsa) != NULL &&
+		    EC_KEY_precompute_mult(key->ecdsa, ctx) != 1)
+			goto out;
+		break;
+	default:
+		break;
+	}
+	key->flags |= SSHKEY_FLAG_PRECOMPUTED;
+	ret = 0;
+ out:
+	BN_CTX_free(ctx);
+	return ret;
+}
+
 /* Converts a private to a public key */
 int
 sshkey_demote(const struct sshkey *k, struct sshkey **dkp)
@@ -1845,7 +2120,7 @@ sshkey_demote(const struct sshkey *k, struct sshkey **dkp)
 	if ((pk = calloc(1, sizeof(*pk))) == NULL)
 		return SSH_ERR_ALLOC_FAIL;
 	pk->type = k->type;
-	pk->flags = k->flags;
+	pk->flags = k->flags & ~SSHKEY_FLAG_PRECOMPUTED;
 	pk->ecdsa_nid = k->ecdsa_nid;
 	pk->dsa = NULL;
 	pk->ecdsa = NULL;
@@ -77,6 +77,8 @@ enum sshkey_fp_rep {
 
 /* key is stored in external hardware */
 #define SSHKEY_FLAG_EXT		0x0001
+/* sshkey_precompute() has been done */
+#define SSHKEY_FLAG_PRECOMPUTED	0x0002
 
 #define SSHKEY_CERT_MAX_PRINCIPALS	256
 /* XXX opaquify? */
@@ -102,6 +104,7 @@ struct sshkey {
 	int	 ecdsa_nid;	/* NID of curve */
 	EC_KEY	*ecdsa;
 	struct sshkey_cert *cert;
+	u_int	 refcnt;	/* extra references, see sshkey_from_blob_cached */
 };
 
 struct sshkey	*sshkey_new(int);
@@ -109,6 +112,7 @@ int		 sshkey_add_private(struct sshkey *);
 struct sshkey	*sshkey_new_private(int);
 void		 sshkey_free(struct sshkey *);
 int		 sshkey_demote(const struct sshkey *, struct sshkey **);
+int		 sshkey_precompute(struct sshkey *);
 int		 sshkey_equal_public(const struct sshkey *,
     const struct sshkey *);
 int		 sshkey_equal(const struct sshkey *, const struct sshkey *);
@@ -151,6 +155,10 @@ int		 sshkey_names_valid2(const char *);
 char		*sshkey_alg_list(void);
 
 int	 sshkey_from_blob(const u_char *, size_t, struct sshkey **);
+int	 sshkey_from_blob_cached(const u_char *, size_t, struct sshkey **);
+void	 sshkey_cache_limit(u_int);
+size_t	 sshkey_certcache_size(u_int);
+void	 sshkey_certcache_set(void *, size_t);
 int	 sshkey_to_blob_buf(const struct sshkey *, struct sshbuf *);
 int	 sshkey_to_blob(const struct sshkey *, u_char **, size_t *);
 int	 sshkey_plain_to_blob_buf(const struct sshkey *, struct sshbuf *);
@@ -18,12 +18,14 @@
 
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 #include <sys/tree.h>
 #include <sys/queue.h>
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
@@ -35,6 +37,7 @@
 #include "misc.h"
 #include "log.h"
 #include "xmalloc.h"
+#include "atomicio.h"
 
 #include "krl.h"
 
@@ -95,8 +98,26 @@ struct ssh_krl {
 	struct revoked_blob_tree revoked_keys;
 	struct revoked_blob_tree revoked_sha1s;
 	struct revoked_certs_list revoked_certs;
+	u_int bloom_bits;	/* per item when generating, 0 for none */
+	u_char *bloom;		/* parsed filter, only kept if complete */
+	size_t bloom_len;
+	u_int bloom_nhash;
 };
 
+/*
+ * Bloom filter over the revoked keys, SHA1 fingerprints and certificate
+ * key IDs of a KRL. Items are tagged by kind and the probe positions are
+ * derived from a 64-bit FNV-1a hash of the tagged item by double hashing.
+ * The hash need not resist collisions: a collision only makes a lookup
+ * fall through to the trees, and a filter is only used once every item
+ * of the KRL has been found in it.
+ */
+#define KRL_BLOOM_KEY		'K'
+#define KRL_BLOOM_SHA1		'S'
+#define KRL_BLOOM_KEY_ID	'I'
+#define KRL_BLOOM_MAX_NHASH	32
+#define KRL_BLOOM_MAX_BYTES	(64 * 1024 * 1024)
+
 /* Return equal if a and b overlap */
 static int
 serial_cmp(struct revoked_serial *a, struct revoked_serial *b)
@@ -167,6 +188,7 @@ ssh_krl_free(struct ssh_krl *krl)
 		return;
 
 	free(krl->comment);
+	free(krl->bloom);
 	RB_FOREACH_SAFE(rb, revoked_blob_tree, &krl->revoked_keys, trb) {
 		RB_REMOVE(revoked_blob_tree, &krl->revoked_keys, rb);
 		free(rb->blob);
@@ -189,6 +211,137 @@ ssh_krl_set_version(struct ssh_krl *krl, u_int64_t version)
 	krl->krl_version = version;
 }
 
+/* Request a Bloom filter section with this many bits per revoked item */
+void
+ssh_krl_set_bloom(struct ssh_krl *krl, u_int bits_per_item)
+{
+	krl->bloom_bits = bits_per_item;
+}
+
+static u_int64_t
+krl_bloom_mix(u_int64_t h)
+{
+	/* splitmix64 finaliser, FNV-1a leaves the low bits poorly mixed */
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+static void
+krl_bloom_hash(u_char tag, const u_char *p, size_t len,
+    u_int64_t *h1, u_int64_t *h2)
+{
+	u_int64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	h = (h ^ tag) * 0x100000001b3ULL;
+	for (i = 0; i < len; i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	*h1 = krl_bloom_mix(h);
+	*h2 = krl_bloom_mix(h ^ 0x9e3779b97f4a7c15ULL) | 1;
+}
+
+static void
+krl_bloom_set(u_char *bloom, size_t len, u_int nhash,
+    u_int64_t h1, u_int64_t h2)
+{
+	u_int64_t bit, nbits = (u_int64_t)len * 8;
+	u_int i;
+
+	for (i = 0; i < nhash; i++) {
+		bit = (h1 + i * h2) % nbits;
+		bloom[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+static int
+krl_bloom_test(const u_char *bloom, size_t len, u_int nhash,
+    u_int64_t h1, u_int64_t h2)
+{
+	u_int64_t bit, nbits = (u_int64_t)len * 8;
+	u_int i;
+
+	for (i = 0; i < nhash; i++) {
+		bit = (h1 + i * h2) % nbits;
+		if ((bloom[bit / 8] & (1 << (bit % 8))) == 0)
+			return 0;
+	}
+	return 1;
+}
+
+/* Calls cb for every item the filter must contain */
+static int
+krl_bloom_items(struct ssh_krl *krl, int (*cb)(struct ssh_krl *, u_char,
+    const u_char *, size_t, void *), void *ctx)
+{
+	struct revoked_blob *rb;
+	struct revoked_certs *rc;
+	struct revoked_key_id *rki;
+	int r;
+
+	RB_FOREACH(rb, revoked_blob_tree, &krl->revoked_keys) {
+		if ((r = cb(krl, KRL_BLOOM_KEY, rb->blob, rb->len, ctx)) != 0)
+			return r;
+	}
+	RB_FOREACH(rb, revoked_blob_tree, &krl->revoked_sha1s) {
+		if ((r = cb(krl, KRL_BLOOM_SHA1, rb->blob, rb->len, ctx)) != 0)
+			return r;
+	}
+	/* Key IDs are not bound to their CA, so probes need not encode it */
+	TAILQ_FOREACH(rc, &krl->revoked_certs, entry) {
+		RB_FOREACH(rki, revoked_key_id_tree, &rc->revoked_key_ids) {
+			if ((r = cb(krl, KRL_BLOOM_KEY_ID,
+			    (u_char *)rki->key_id, strlen(rki->key_id),
+			    ctx)) != 0)
+				return r;
+		}
+	}
+	return 0;
+}
+
+static int
+krl_bloom_count_cb(struct ssh_krl *krl, u_char tag, const u_char *p,
+    size_t len, void *ctx)
+{
+	(*(size_t *)ctx)++;
+	return 0;
+}
+
+static int
+krl_bloom_add_cb(struct ssh_krl *krl, u_char tag, const u_char *p,
+    size_t len, void *ctx)
+{
+	u_int64_t h1, h2;
+
+	krl_bloom_hash(tag, p, len, &h1, &h2);
+	krl_bloom_set(krl->bloom, krl->bloom_len, krl->bloom_nhash, h1, h2);
+	return 0;
+}
+
+static int
+krl_bloom_check_cb(struct ssh_krl *krl, u_char tag, const u_char *p,
+    size_t len, void *ctx)
+{
+	u_int64_t h1, h2;
+
+	krl_bloom_hash(tag, p, len, &h1, &h2);
+	if (!krl_bloom_test(krl->bloom, krl->bloom_len, krl->bloom_nhash,
+	    h1, h2))
+		return SSH_ERR_KEY_NOT_FOUND;
+	return 0;
+}
+
+/* Whether the parsed filter may contain the item; 1 without a filter */
+static int
+krl_bloom_may_contain(struct ssh_krl *krl, u_char tag, const u_char *p,
+    size_t len)
+{
+	if (krl->bloom == NULL)
+		return 1;
+	return krl_bloom_check_cb(krl, tag, p, len, NULL) !=
+	    SSH_ERR_KEY_NOT_FOUND;
+}
+
 int
 ssh_krl_set_comment(struct ssh_krl *krl, const char *comment)
 {
@@ -495,26 +648,214 @@ choose_next_state(int current_state, u_int64_t contig, int final,
 	return new_state;
 }
 
+/*
+ * Incremental encoder for the serial number subsections of a single CA.
+ * Ranges are added in ascending order and each one is encoded once the
+ * gap to the next is known, so only the subsection under construction
+ * is held in memory.
+ */
+struct krl_serial_enc {
+	struct sshbuf *out;	/* receives finished subsections */
+	struct sshbuf *sect;	/* subsection under construction */
+	BIGNUM *bitmap;
+	u_int64_t bitmap_off, last;
+	u_int64_t lo, hi;	/* pending range, not yet encoded */
+	int pending, state;
+};
+
+/*
+ * Limits on the size of a single list or bitmap subsection. Bitmaps are
+ * also bound by the largest mpint that sshbuf will parse, counting the
+ * zero byte that precedes a leading set bit.
+ */
+#define KRL_SERIAL_MAX_LIST	(256 * 1024)		/* bytes */
+#define KRL_SERIAL_MAX_SPAN	(SSHBUF_MAX_BIGNUM * 8 - 1) /* bits */
+
+static int
+krl_serial_enc_init(struct krl_serial_enc *e, struct sshbuf *out)
+{
+	bzero(e, sizeof(*e));
+	e->out = out;
+	if ((e->sect = sshbuf_new()) == NULL ||
+	    (e->bitmap = BN_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	return 0;
+}
+
+static void
+krl_serial_enc_free(struct krl_serial_enc *e)
+{
+	sshbuf_free(e->sect);
+	if (e->bitmap != NULL)
+		BN_free(e->bitmap);
+	bzero(e, sizeof(*e));
+}
+
+/* Finish off the subsection under construction, if any */
+static int
+krl_serial_enc_flush(struct krl_serial_enc *e)
+{
+	int r;
+
+	if (e->state == 0)
+		return 0;
+	KRL_DBG(("%s: finish state 0x%02x", __func__, e->state));
+	if (e->state == KRL_SECTION_CERT_SERIAL_BITMAP) {
+		if ((r = sshbuf_put_bignum2(e->sect, e->bitmap)) != 0)
+			return r;
+		BN_clear(e->bitmap);
+	}
+	if ((r = sshbuf_put_u8(e->out, e->state)) != 0 ||
+	    (r = sshbuf_put_stringb(e->out, e->sect)) != 0)
+		return r;
+	sshbuf_reset(e->sect);
+	e->state = 0;
+	return 0;
+}
+
+/* Encode a range, given the gap to the next one unless it is the last */
+static int
+krl_serial_enc_emit(struct krl_serial_enc *e, u_int64_t lo, u_int64_t hi,
+    int final, u_int64_t gap)
+{
+	u_int64_t i, contig = 1 + (hi - lo);
+	int r, next_state, force_new_sect;
+
+	KRL_DBG(("%s: serial %llu:%llu state 0x%02x", __func__,
+	    (long long unsigned)lo, (long long unsigned)hi, e->state));
+
+	/* Choose next state based on the run length and gaps */
+	next_state = choose_next_state(e->state, contig, final,
+	    e->state == 0 ? 0 : lo - e->last, gap, &force_new_sect);
+
+	/* Keep list and bitmap subsections to a bounded size */
+	if ((next_state == KRL_SECTION_CERT_SERIAL_LIST &&
+	    contig > KRL_SERIAL_MAX_LIST / 8) ||
+	    (next_state == KRL_SECTION_CERT_SERIAL_BITMAP &&
+	    contig >= KRL_SERIAL_MAX_SPAN))
+		next_state = KRL_SECTION_CERT_SERIAL_RANGE;
+	if (next_state == e->state && !force_new_sect) {
+		if (e->state == KRL_SECTION_CERT_SERIAL_LIST &&
+		    sshbuf_len(e->sect) + 8 * contig > KRL_SERIAL_MAX_LIST)
+			force_new_sect = 1;
+		else if (e->state == KRL_SECTION_CERT_SERIAL_BITMAP &&
+		    hi - e->bitmap_off >= KRL_SERIAL_MAX_SPAN)
+			force_new_sect = 1;
+	}
+
+	/*
+	 * If the current section is a range section or has a different
+	 * type to the next section, then finish it off now.
+	 */
+	if (e->state != 0 && (force_new_sect || next_state != e->state ||
+	    e->state == KRL_SECTION_CERT_SERIAL_RANGE)) {
+		if ((r = krl_serial_enc_flush(e)) != 0)
+			return r;
+	}
+
+	/* If we are starting a new section then prepare it now */
+	if (e->state == 0) {
+		KRL_DBG(("%s: start state 0x%02x", __func__, next_state));
+		e->state = next_state;
+		if (e->state == KRL_SECTION_CERT_SERIAL_BITMAP) {
+			e->bitmap_off = lo;
+			if ((r = sshbuf_put_u64(e->sect, e->bitmap_off)) != 0)
+				return r;
+		}
+	}
+
+	/* Perform section-specific processing */
+	switch (e->state) {
+	case KRL_SECTION_CERT_SERIAL_LIST:
+		for (i = 0; i < contig; i++) {
+			if ((r = sshbuf_put_u64(e->sect, lo + i)) != 0)
+				return r;
+		}
+		break;
+	case KRL_SECTION_CERT_SERIAL_RANGE:
+		if ((r = sshbuf_put_u64(e->sect, lo)) != 0 ||
+		    (r = sshbuf_put_u64(e->sect, hi)) != 0)
+			return r;
+		break;
+	case KRL_SECTION_CERT_SERIAL_BITMAP:
+		for (i = 0; i < contig; i++) {
+			if (BN_set_bit(e->bitmap,
+			    lo + i - e->bitmap_off) != 1)
+				return SSH_ERR_LIBCRYPTO_ERROR;
+		}
+		break;
+	}
+	e->last = hi;
+	return 0;
+}
+
+/*
+ * Add a range of revoked serials. Ranges that overlap or adjoin the
+ * previous one are merged; one that starts below it begins a new run
+ * of subsections, which is still correct but less compact.
+ */
+static int
+krl_serial_enc_add(struct krl_serial_enc *e, u_int64_t lo, u_int64_t hi)
+{
+	int r;
+
+	if (e->pending && lo >= e->lo && (lo <= e->hi || lo - e->hi == 1)) {
+		e->hi = MAX(e->hi, hi);
+		return 0;
+	}
+	if (e->pending && lo < e->lo) {
+		if ((r = krl_serial_enc_emit(e, e->lo, e->hi, 1, 0)) != 0 ||
+		    (r = krl_serial_enc_flush(e)) != 0)
+			return r;
+	} else if (e->pending) {
+		if ((r = krl_serial_enc_emit(e, e->lo, e->hi, 0,
+		    lo - e->hi)) != 0)
+			return r;
+	}
+	e->lo = lo;
+	e->hi = hi;
+	e->pending = 1;
+	return 0;
+}
+
+/* Encode the pending range and flush the remaining section, if any */
+static int
+krl_serial_enc_finish(struct krl_serial_enc *e)
+{
+	int r;
+
+	if (e->pending) {
+		e->pending = 0;
+		if ((r = krl_serial_enc_emit(e, e->lo, e->hi, 1, 0)) != 0)
+			return r;
+	}
+	return krl_serial_enc_flush(e);
+}
+
 /* Generate a KRL_SECTION_CERTIFICATES KRL section */
 static int
 revoked_certs_generate(struct revoked_certs *rc, struct sshbuf *buf)
 {
-	int final, force_new_sect, r = SSH_ERR_INTERNAL_ERROR;
-	u_int64_t i, contig, gap, last = 0, bitmap_off = 0;
-	struct revoked_serial *rs, *nrs;
+	int r = SSH_ERR_INTERNAL_ERROR;
+	struct revoked_serial *rs;
 	struct revoked_key_id *rki;
-	int next_state, state = 0;
+	struct krl_serial_enc enc;
 	struct sshbuf *sect = NULL;
 	u_char *kblob = NULL;
 	size_t klen;
-	BIGNUM *bitmap = NULL;
+
+	bzero(&enc, sizeof(enc));
 
 	/* Prepare CA scope key blob if we have one supplied */
 	if ((r = sshkey_to_blob(rc->ca_key, &kblob, &klen)) != 0)
 		return r;
 
-	if ((sect = sshbuf_new()) == NULL)
-		return SSH_ERR_ALLOC_FAIL;
+	if ((sect = sshbuf_new()) == NULL) {
+		r = SSH_ERR_ALLOC_FAIL;
+		goto out;
+	}
+	if ((r = krl_serial_enc_init(&enc, buf)) != 0)
+		goto out;
 
 	/* Store the header */
 	if ((r = sshbuf_put_string(buf, kblob, klen)) != 0 ||
@@ -522,118 +863,15 @@ revoked_certs_generate(struct revoked_certs *rc, struct sshbuf *buf)
 		goto out;
 
 	/* Store the revoked serials.  */
-	for (rs = RB_MIN(revoked_serial_tree, &rc->revoked_serials);
-	     rs != NULL;
-	     rs = RB_NEXT(revoked_serial_tree, &rc->revoked_serials, rs)) {
-		KRL_DBG(("%s: serial %llu:%llu state 0x%02x", __func__,
-		    (long long unsigned)rs->lo, (long long unsigned)rs->hi,
-		    state));
-
-		/* Check contiguous length and gap to next section (if any) */
-		nrs = RB_NEXT(revoked_serial_tree, &rc->revoked_serials, rs);
-		final = nrs == NULL;
-		gap = nrs == NULL ? 0 : nrs->lo - rs->hi;
-		contig = 1 + (rs->hi - rs->lo);
-
-		/* Choose next state based on these */
-		next_state = choose_next_state(state, contig, final,
-		    state == 0 ? 0 : rs->lo - last, gap, &force_new_sect);
-
-		/*
-		 * If the current section is a range section or has a different
-		 * type to the next section, then finish it off now.
-		 */
-		if (state != 0 && (force_new_sect || next_state != state ||
-		    state == KRL_SECTION_CERT_SERIAL_RANGE)) {
-			KRL_DBG(("%s: finish state 0x%02x", __func__, state));
-			switch (state) {
-			case KRL_SECTION_CERT_SERIAL_LIST:
-			case KRL_SECTION_CERT_SERIAL_RANGE:
-				break;
-			case KRL_SECTION_CERT_SERIAL_BITMAP:
-				if ((r = sshbuf_put_bignum2(sect, bitmap)) != 0)
-					goto out;
-				BN_free(bitmap);
-				bitmap = NULL;
-				break;
-			}
-			if ((r = sshbuf_put_u8(buf, state)) != 0 ||
-			    (r = sshbuf_put_stringb(buf, sect)) != 0)
-				goto out;
-		}
-
-		/* If we are starting a new section then prepare it now */
-		if (next_state != state || force_new_sect) {
-			KRL_DBG(("%s: start state 0x%02x", __func__,
-			    next_state));
-			state = next_state;
-			sshbuf_reset(sect);
-			switch (state) {
-			case KRL_SECTION_CERT_SERIAL_LIST:
-			case KRL_SECTION_CERT_SERIAL_RANGE:
-				break;
-			case KRL_SECTION_CERT_SERIAL_BITMAP:
-				if ((bitmap = BN_new()) == NULL) {
-					r = SSH_ERR_ALLOC_FAIL;
-					goto out;
-				}
-				bitmap_off = rs->lo;
-				if ((r = sshbuf_put_u64(sect, bitmap_off)) != 0)
-					goto out;
-				break;
-			}
-		}
-
-		/* Perform section-specific processing */
-		switch (state) {
-		case KRL_SECTION_CERT_SERIAL_LIST:
-			for (i = 0; i < contig; i++) {
-				if ((r = sshbuf_put_u64(sect, rs->lo + i)) != 0)
-					goto out;
-			}
-			break;
-		case KRL_SECTION_CERT_SERIAL_RANGE:
-			if ((r = sshbuf_put_u64(sect, rs->lo)) != 0 ||
-			    (r = sshbuf_put_u64(sect, rs->hi)) != 0)
-				goto out;
-			break;
-		case KRL_SECTION_CERT_SERIAL_BITMAP:
-			if (rs->lo - bitmap_off > INT_MAX) {
-				error("%s: insane bitmap gap", __func__);
-				goto out;
-			}
-			for (i = 0; i < contig; i++) {
-				if (BN_set_bit(bitmap,
-				    rs->lo + i - bitmap_off) != 1) {
-					r = SSH_ERR_LIBCRYPTO_ERROR;
-					goto out;
-				}
-			}
-			break;
-		}
-		last = rs->hi;
-	}
-	/* Flush the remaining section, if any */
-	if (state != 0) {
-		KRL_DBG(("%s: serial final flush for state 0x%02x",
-		    __func__, state));
-		switch (state) {
-		case KRL_SECTION_CERT_SERIAL_LIST:
-		case KRL_SECTION_CERT_SERIAL_RANGE:
-			break;
-		case KRL_SECTION_CERT_SERIAL_BITMAP:
-			if ((r = sshbuf_put_bignum2(sect, bitmap)) != 0)
-				goto out;
-			break;
-		}
-		if ((r = sshbuf_put_u8(buf, state)) != 0 ||
-		    (r = sshbuf_put_stringb(buf, sect)) != 0)
+	RB_FOREACH(rs, revoked_serial_tree, &rc->revoked_serials) {
+		if ((r = krl_serial_enc_add(&enc, rs->lo, rs->hi)) != 0)
 			goto out;
 	}
+	if ((r = krl_serial_enc_finish(&enc)) != 0)
+		goto out;
 	KRL_DBG(("%s: serial done ", __func__));
 
 	/* Now output a section for any revocations by key ID */
-	sshbuf_reset(sect);
 	RB_FOREACH(rki, revoked_key_id_tree, &rc->revoked_key_ids) {
 		KRL_DBG(("%s: key ID %s", __func__, rki->key_id));
 		if ((r = sshbuf_put_cstring(sect, rki->key_id)) != 0)
@@ -647,43 +885,43 @@ revoked_certs_generate(struct revoked_certs *rc, struct sshbuf *buf)
 	r = 0;
  out:
 	free(kblob);
-	if (bitmap != NULL)
-		BN_free(bitmap);
+	krl_serial_enc_free(&enc);
 	sshbuf_free(sect);
 	return r;
 }
 
-int
-ssh_krl_to_blob(struct ssh_krl *krl, struct sshbuf *buf,
-    const struct sshkey **sign_keys, u_int nsign_keys)
+static int
+krl_put_header(struct sshbuf *buf, u_int64_t version, u_int64_t date,
+    u_int64_t flags, const char *comment)
+{
+	int r;
+
+	if ((r = sshbuf_put(buf, KRL_MAGIC, sizeof(KRL_MAGIC) - 1)) != 0 ||
+	    (r = sshbuf_put_u32(buf, KRL_FORMAT_VERSION)) != 0 ||
+	    (r = sshbuf_put_u64(buf, version)) != 0 ||
+	    (r = sshbuf_put_u64(buf, date)) != 0 ||
+	    (r = sshbuf_put_u64(buf, flags)) != 0 ||
+	    (r = sshbuf_put_string(buf, NULL, 0)) != 0 ||
+	    (r = sshbuf_put_cstring(buf, comment != NULL ? comment : "")) != 0)
+		return r;
+	return 0;
+}
+
+/* Generate the sections for revoked certificates, keys and hashes */
+static int
+krl_generate_sections(struct ssh_krl *krl, struct sshbuf *buf)
 {
 	int r = SSH_ERR_INTERNAL_ERROR;
 	struct revoked_certs *rc;
 	struct revoked_blob *rb;
 	struct sshbuf *sect = NULL;
-	u_char *kblob = NULL, *sblob = NULL;
-	size_t klen, slen, i;
-
-	if (krl->generated_date == 0)
-		krl->generated_date = time(NULL);
 
 	if ((sect = sshbuf_new()) == NULL)
 		return SSH_ERR_ALLOC_FAIL;
 
-	/* Store the header */
-	if ((r = sshbuf_put(buf, KRL_MAGIC, sizeof(KRL_MAGIC) - 1)) != 0 ||
-	    (r = sshbuf_put_u32(buf, KRL_FORMAT_VERSION)) != 0 ||
-	    (r = sshbuf_put_u64(buf, krl->krl_version)) != 0 ||
-	    (r = sshbuf_put_u64(buf, krl->generated_date)) != 0 ||
-	    (r = sshbuf_put_u64(buf, krl->flags)) != 0 ||
-	    (r = sshbuf_put_string(buf, NULL, 0)) != 0 ||
-	    (r = sshbuf_put_cstring(buf,
-	    krl->comment != NULL ? krl->comment : "")) != 0)
-		goto out;
-
-
 	/* Store sections for revoked certificates */
 	TAILQ_FOREACH(rc, &krl->revoked_certs, entry) {
+		sshbuf_reset(sect);
 		if ((r = revoked_certs_generate(rc, sect)) != 0)
 			goto out;
 		if ((r = sshbuf_put_u8(buf, KRL_SECTION_CERTIFICATES)) != 0 ||
@@ -715,6 +953,62 @@ ssh_krl_to_blob(struct ssh_krl *krl, struct sshbuf *buf,
 		    (r = sshbuf_put_stringb(buf, sect)) != 0)
 			goto out;
 	}
+	r = 0;
+ out:
+	sshbuf_free(sect);
+	return r;
+}
+
+int
+ssh_krl_to_blob(struct ssh_krl *krl, struct sshbuf *buf,
+    const struct sshkey **sign_keys, u_int nsign_keys)
+{
+	int r = SSH_ERR_INTERNAL_ERROR;
+	struct sshbuf *sect = NULL;
+	u_char *kblob = NULL, *sblob = NULL;
+	size_t klen, slen, i, nitems;
+
+	if (krl->generated_date == 0)
+		krl->generated_date = time(NULL);
+
+	if ((sect = sshbuf_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+
+	/* Store the header */
+	if ((r = krl_put_header(buf, krl->krl_version, krl->generated_date,
+	    krl->flags, krl->comment)) != 0)
+		goto out;
+
+	if ((r = krl_generate_sections(krl, buf)) != 0)
+		goto out;
+
+	/* Optional Bloom filter over everything but serials */
+	nitems = 0;
+	if (krl->bloom_bits != 0 &&
+	    (r = krl_bloom_items(krl, krl_bloom_count_cb, &nitems)) != 0)
+		goto out;
+	if (nitems != 0) {
+		free(krl->bloom);
+		krl->bloom_len = MAX(8, (nitems * krl->bloom_bits + 7) / 8);
+		if (krl->bloom_len > KRL_BLOOM_MAX_BYTES)
+			krl->bloom_len = KRL_BLOOM_MAX_BYTES;
+		/* k = ln(2) * bits per item is optimal */
+		krl->bloom_nhash = MIN(KRL_BLOOM_MAX_NHASH,
+		    MAX(1, (krl->bloom_bits * 69 + 50) / 100));
+		if ((krl->bloom = calloc(1, krl->bloom_len)) == NULL) {
+			r = SSH_ERR_ALLOC_FAIL;
+			goto out;
+		}
+		if ((r = krl_bloom_items(krl, krl_bloom_add_cb, NULL)) != 0)
+			goto out;
+		sshbuf_reset(sect);
+		if ((r = sshbuf_put_u32(sect, krl->bloom_nhash)) != 0 ||
+		    (r = sshbuf_put_string(sect, krl->bloom,
+		    krl->bloom_len)) != 0 ||
+		    (r = sshbuf_put_u8(buf, KRL_SECTION_BLOOM_FILTER)) != 0 ||
+		    (r = sshbuf_put_stringb(buf, sect)) != 0)
+			goto out;
+	}
 
 	for (i = 0; i < nsign_keys; i++) {
 		if ((r = sshkey_to_blob(sign_keys[i], &kblob, &klen)) == 0)
@@ -741,7 +1035,254 @@ ssh_krl_to_blob(struct ssh_krl *krl, struct sshbuf *buf,
 	return r;
 }
 
-static void
+/*
+ * Streaming KRL writer for very large numbers of revoked serials. Serials
+ * are encoded as they are added and the KRL is written to a descriptor in
+ * bounded chunks, so memory use does not grow with the number of serials.
+ * Supplying each CA's serials in ascending order gives the same encoding
+ * as ssh_krl_to_blob(). The sections of an existing KRL may be carried
+ * over without parsing them to update it cheaply; repeated sections for a
+ * CA are allowed by the format, so later updates simply add to them.
+ */
+#define KRL_STREAM_MAX_CERTS	(4 * 1024 * 1024)
+#define KRL_STREAM_MAX_OUT	(64 * 1024)
+
+struct ssh_krl_stream {
+	int fd;
+	struct sshbuf *out;		/* not yet written to fd */
+	struct sshbuf *base;		/* sections of the KRL being updated */
+	struct sshbuf *base_bloom;	/* and its Bloom filter section */
+	struct sshkey *ca_key;		/* CA whose serials are being added */
+	u_char *ca_blob;
+	size_t ca_len;
+	struct sshbuf *certs;		/* its subsections not yet in out */
+	struct krl_serial_enc enc;
+};
+
+static int
+krl_stream_write(struct ssh_krl_stream *ks, struct sshbuf *b)
+{
+	if (sshbuf_len(b) == 0)
+		return 0;
+	if (atomicio(vwrite, ks->fd, (void *)sshbuf_ptr(b),
+	    sshbuf_len(b)) != sshbuf_len(b))
+		return SSH_ERR_SYSTEM_ERROR;
+	sshbuf_reset(b);
+	return 0;
+}
+
+/* Move the pending subsections into a KRL_SECTION_CERTIFICATES section */
+static int
+krl_stream_put_certs(struct ssh_krl_stream *ks)
+{
+	int r;
+
+	if (sshbuf_len(ks->certs) == 0)
+		return 0;
+	if ((r = sshbuf_put_u8(ks->out, KRL_SECTION_CERTIFICATES)) != 0 ||
+	    (r = sshbuf_put_u32(ks->out, 4 + ks->ca_len + 4 +
+	    sshbuf_len(ks->certs))) != 0 ||
+	    (r = sshbuf_put_string(ks->out, ks->ca_blob, ks->ca_len)) != 0 ||
+	    (r = sshbuf_put_string(ks->out, NULL, 0)) != 0 ||
+	    (r = sshbuf_putb(ks->out, ks->certs)) != 0)
+		return r;
+	sshbuf_reset(ks->certs);
+	if (sshbuf_len(ks->out) >= KRL_STREAM_MAX_OUT)
+		return krl_stream_write(ks, ks->out);
+	return 0;
+}
+
+static int
+krl_stream_end_ca(struct ssh_krl_stream *ks)
+{
+	int r;
+
+	if (ks->ca_key == NULL)
+		return 0;
+	if ((r = krl_serial_enc_finish(&ks->enc)) != 0 ||
+	    (r = krl_stream_put_certs(ks)) != 0)
+		return r;
+	krl_serial_enc_free(&ks->enc);
+	sshkey_free(ks->ca_key);
+	ks->ca_key = NULL;
+	free(ks->ca_blob);
+	ks->ca_blob = NULL;
+	return 0;
+}
+
+/*
+ * Split an existing KRL into its header fields, the sections to carry
+ * over and its Bloom filter. Signatures are dropped as they no longer hold.
+ */
+static int
+krl_stream_load_base(struct ssh_krl_stream *ks, struct sshbuf *base,
+    u_int64_t *versionp, u_int64_t *flagsp, char **commentp)
+{
+	struct sshbuf *copy;
+	const u_char *p, *blob;
+	size_t blen;
+	u_int64_t generated_date;
+	u_int format_version;
+	u_char type;
+	int r;
+
+	if (sshbuf_len(base) < sizeof(KRL_MAGIC) - 1 ||
+	    memcmp(sshbuf_ptr(base), KRL_MAGIC, sizeof(KRL_MAGIC) - 1) != 0)
+		return SSH_ERR_KRL_BAD_MAGIC;
+	if ((copy = sshbuf_fromb(base)) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	if ((r = sshbuf_consume(copy, sizeof(KRL_MAGIC) - 1)) != 0 ||
+	    (r = sshbuf_get_u32(copy, &format_version)) != 0)
+		goto out;
+	if (format_version != KRL_FORMAT_VERSION) {
+		error("%s: KRL unsupported format version %u",
+		    __func__, format_version);
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	if ((r = sshbuf_get_u64(copy, versionp)) != 0 ||
+	    (r = sshbuf_get_u64(copy, &generated_date)) != 0 ||
+	    (r = sshbuf_get_u64(copy, flagsp)) != 0 ||
+	    (r = sshbuf_skip_string(copy)) != 0 || /* reserved */
+	    (r = sshbuf_get_cstring(copy, commentp, NULL)) != 0)
+		goto out;
+
+	while (sshbuf_len(copy) > 0) {
+		p = sshbuf_ptr(copy);
+		if ((r = sshbuf_get_u8(copy, &type)) != 0 ||
+		    (r = sshbuf_get_string_direct(copy, &blob, &blen)) != 0)
+			goto out;
+		switch (type) {
+		case KRL_SECTION_CERTIFICATES:
+		case KRL_SECTION_EXPLICIT_KEY:
+		case KRL_SECTION_FINGERPRINT_SHA1:
+			r = sshbuf_put(ks->base, p, 1 + 4 + blen);
+			break;
+		case KRL_SECTION_BLOOM_FILTER:
+			sshbuf_reset(ks->base_bloom);
+			r = sshbuf_put(ks->base_bloom, p, 1 + 4 + blen);
+			break;
+		case KRL_SECTION_SIGNATURE:
+			/* Signatures must come last */
+			r = 0;
+			goto out;
+		default:
+			error("Unsupported KRL section %u", type);
+			r = SSH_ERR_INVALID_FORMAT;
+			break;
+		}
+		if (r != 0)
+			goto out;
+	}
+	r = 0;
+ out:
+	sshbuf_free(copy);
+	return r;
+}
+
+/*
+ * Start writing a KRL to fd, optionally updating the KRL in base. A zero
+ * version or NULL comment keeps those of base.
+ */
+int
+ssh_krl_stream_open(int fd, struct sshbuf *base, u_int64_t version,
+    const char *comment, struct ssh_krl_stream **ksp)
+{
+	struct ssh_krl_stream *ks;
+	u_int64_t base_version = 0, flags = 0;
+	char *base_comment = NULL;
+	int r;
+
+	*ksp = NULL;
+	if ((ks = calloc(1, sizeof(*ks))) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	ks->fd = fd;
+	if ((ks->out = sshbuf_new()) == NULL ||
+	    (ks->base = sshbuf_new()) == NULL ||
+	    (ks->base_bloom = sshbuf_new()) == NULL ||
+	    (ks->certs = sshbuf_new()) == NULL) {
+		r = SSH_ERR_ALLOC_FAIL;
+		goto out;
+	}
+	if (base != NULL && (r = krl_stream_load_base(ks, base,
+	    &base_version, &flags, &base_comment)) != 0)
+		goto out;
+	if ((r = krl_put_header(ks->out, version != 0 ? version : base_version,
+	    time(NULL), flags, comment != NULL ? comment : base_comment)) != 0)
+		goto out;
+	*ksp = ks;
+	ks = NULL;
+	r = 0;
+ out:
+	ssh_krl_stream_free(ks);
+	free(base_comment);
+	return r;
+}
+
+/* Revoke a range of serials; see above regarding their order */
+int
+ssh_krl_stream_revoke_serial_range(struct ssh_krl_stream *ks,
+    const struct sshkey *ca_key, u_int64_t lo, u_int64_t hi)
+{
+	int r;
+
+	if (lo > hi || lo == 0)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if (ks->ca_key == NULL || !sshkey_equal(ks->ca_key, ca_key)) {
+		if ((r = krl_stream_end_ca(ks)) != 0 ||
+		    (r = sshkey_from_private(ca_key, &ks->ca_key)) != 0 ||
+		    (r = sshkey_to_blob(ks->ca_key, &ks->ca_blob,
+		    &ks->ca_len)) != 0 ||
+		    (r = krl_serial_enc_init(&ks->enc, ks->certs)) != 0)
+			return r;
+	}
+	if ((r = krl_serial_enc_add(&ks->enc, lo, hi)) != 0)
+		return r;
+	if (sshbuf_len(ks->certs) >= KRL_STREAM_MAX_CERTS)
+		return krl_stream_put_certs(ks);
+	return 0;
+}
+
+/*
+ * Write out the remaining serials, the carried over sections and those of
+ * krl, if not NULL. The Bloom filter of the base KRL is kept only if krl
+ * adds nothing it would have to cover; krl's own filter setting is ignored.
+ */
+int
+ssh_krl_stream_finish(struct ssh_krl_stream *ks, struct ssh_krl *krl)
+{
+	size_t nitems = 0;
+	int r;
+
+	if ((r = krl_stream_end_ca(ks)) != 0 ||
+	    (r = krl_stream_write(ks, ks->out)) != 0 ||
+	    (r = krl_stream_write(ks, ks->base)) != 0)
+		return r;
+	if (krl != NULL &&
+	    ((r = krl_generate_sections(krl, ks->out)) != 0 ||
+	    (r = krl_bloom_items(krl, krl_bloom_count_cb, &nitems)) != 0))
+		return r;
+	if (nitems == 0 && (r = sshbuf_putb(ks->out, ks->base_bloom)) != 0)
+		return r;
+	return krl_stream_write(ks, ks->out);
+}
+
+void
+ssh_krl_stream_free(struct ssh_krl_stream *ks)
+{
+	if (ks == NULL)
+		return;
+	sshbuf_free(ks->out);
+	sshbuf_free(ks->base);
+	sshbuf_free(ks->base_bloom);
+	sshbuf_free(ks->certs);
+	krl_serial_enc_free(&ks->enc);
+	sshkey_free(ks->ca_key);
+	free(ks->ca_blob);
+	free(ks);
+}
+
+static void
 format_timestamp(u_int64_t timestamp, char *ts, size_t nts)
 {
 	time_t t;
@@ -872,7 +1413,7 @@ ssh_krl_from_blob(struct sshbuf *buf, struct ssh_krl **krlp,
 	struct sshkey *key = NULL, **ca_used = NULL;
 	u_char type, *rdata = NULL;
 	const u_char *blob;
-	size_t i, j, sig_off, sects_off, blen, rlen, nca_used = 0;
+	size_t i, j, sig_off, sects_off, blen, rlen, nca_used = 0, nitems;
 	u_int format_version;
 
 	*krlp = krl = NULL;
@@ -995,9 +1536,25 @@ ssh_krl_from_blob(struct sshbuf *buf, struct ssh_krl **krlp,
 				rdata = NULL; /* revoke_blob frees rdata */
 			}
 			break;
+		case KRL_SECTION_BLOOM_FILTER:
+			free(krl->bloom);
+			krl->bloom = NULL;
+			if ((r = sshbuf_get_u32(sect, &krl->bloom_nhash)) != 0 ||
+			    (r = sshbuf_get_string(sect, &krl->bloom,
+			    &krl->bloom_len)) != 0)
+				goto out;
+			if (krl->bloom_nhash == 0 ||
+			    krl->bloom_nhash > KRL_BLOOM_MAX_NHASH ||
+			    krl->bloom_len == 0 ||
+			    krl->bloom_len > KRL_BLOOM_MAX_BYTES) {
+				error("%s: bad Bloom filter", __func__);
+				r = SSH_ERR_INVALID_FORMAT;
+				goto out;
+			}
+			break;
 		case KRL_SECTION_SIGNATURE:
 			/* Handled above, but still need to stay in synch */
-			if ((r = sshbuf_skip_string(copy)) != 0)
+			if ((r = sshbuf_skip_string(buf)) != 0)
 				goto out;
 			sshbuf_free(sect);
 			sect = NULL;
@@ -1016,6 +1573,28 @@ ssh_krl_from_blob(struct sshbuf *buf, struct ssh_krl **krlp,
 		sect = NULL;
 	}
 
+	/*
+	 * A filter that misses any item would let revoked keys through,
+	 * so only use it if it covers everything in the KRL.
+	 */
+	if (krl->bloom != NULL &&
+	    (r = krl_bloom_items(krl, krl_bloom_check_cb, NULL)) != 0) {
+		if (r != SSH_ERR_KEY_NOT_FOUND)
+			goto out;
+		error("KRL Bloom filter is incomplete; ignoring it");
+		free(krl->bloom);
+		krl->bloom = NULL;
+	}
+	if (krl->bloom != NULL) {
+		/* Keep a similar filter if this KRL is updated */
+		nitems = 0;
+		if ((r = krl_bloom_items(krl, krl_bloom_count_cb,
+		    &nitems)) != 0)
+			goto out;
+		krl->bloom_bits = nitems == 0 ? 1 :
+		    MIN(64, MAX(1, krl->bloom_len * 8 / nitems));
+	}
+
 	/* Check that the key(s) used to sign the KRL weren't revoked */
 	sig_seen = 0;
 	for (i = 0; i < nca_used; i++) {
@@ -1083,7 +1662,9 @@ is_key_revoked(struct ssh_krl *krl, const struct sshkey *key)
 	bzero(&rb, sizeof(rb));
 	if ((rb.blob = sshkey_fingerprint_raw(key, SSH_FP_SHA1, &rb.len)) == NULL)
 		return SSH_ERR_ALLOC_FAIL;
-	erb = RB_FIND(revoked_blob_tree, &krl->revoked_sha1s, &rb);
+	erb = NULL;
+	if (krl_bloom_may_contain(krl, KRL_BLOOM_SHA1, rb.blob, rb.len))
+		erb = RB_FIND(revoked_blob_tree, &krl->revoked_sha1s, &rb);
 	free(rb.blob);
 	if (erb != NULL) {
 		KRL_DBG(("%s: revoked by key SHA1", __func__));
@@ -1094,7 +1675,9 @@ is_key_revoked(struct ssh_krl *krl, const struct sshkey *key)
 	bzero(&rb, sizeof(rb));
 	if ((r = sshkey_plain_to_blob(key, &rb.blob, &rb.len)) != 0)
 		return r;
-	erb = RB_FIND(revoked_blob_tree, &krl->revoked_keys, &rb);
+	erb = NULL;
+	if (krl_bloom_may_contain(krl, KRL_BLOOM_KEY, rb.blob, rb.len))
+		erb = RB_FIND(revoked_blob_tree, &krl->revoked_keys, &rb);
 	free(rb.blob);
 	if (erb != NULL) {
 		KRL_DBG(("%s: revoked by explicit key", __func__));
@@ -1114,7 +1697,10 @@ is_key_revoked(struct ssh_krl *krl, const struct sshkey *key)
 	/* Check revocation by cert key ID */
 	bzero(&rki, sizeof(rki));
 	rki.key_id = key->cert->key_id;
-	erki = RB_FIND(revoked_key_id_tree, &rc->revoked_key_ids, &rki);
+	erki = NULL;
+	if (krl_bloom_may_contain(krl, KRL_BLOOM_KEY_ID,
+	    (u_char *)rki.key_id, strlen(rki.key_id)))
+		erki = RB_FIND(revoked_key_id_tree, &rc->revoked_key_ids, &rki);
 	if (erki != NULL) {
 		KRL_DBG(("%s: revoked by key ID", __func__));
 		return SSH_ERR_KEY_REVOKED;
@@ -1156,48 +1742,736 @@ ssh_krl_check_key(struct ssh_krl *krl, const struct sshkey *key)
 	return 0;
 }
 
-/* Returns 0 on success, -1 on error or key revoked, -2 if path is not a KRL */
+/*
+ * Compiled KRLs.
+ *
+ * sshd checks every offered key against its RevokedKeys file. Rather than
+ * loading the file into the trees above on each check, it is read into
+ * memory once and compiled into lookup structures that point into that
+ * copy: sorted serial lists are searched in place, serial ranges are merged
+ * into a sorted array, bitmaps are tested in place and key IDs, keys and
+ * SHA1 fingerprints are kept in hash tables. The file is copied rather
+ * than mapped so that a KRL rewritten in place cannot change or truncate
+ * data that has already been verified.
+ *
+ * The result is cached for as long as the file's device, inode, size and
+ * mtime are unchanged. The cache lives in the process doing the checks,
+ * i.e. one sshd connection, so it saves work when a client offers several
+ * keys but is not shared between connections.
+ */
+
+struct krl_blob {
+	const u_char *p;
+	size_t len;
+};
+
+/* Open-addressed set of blobs in the file data */
+struct krl_blob_set {
+	struct krl_blob *slots;
+	size_t nslots;		/* power of two or zero */
+	size_t n;
+};
+
+struct krl_serial_range {
+	u_int64_t lo, hi;
+};
+
+/* KRL_SECTION_CERT_SERIAL_LIST whose serials are strictly ascending */
+struct krl_serial_list {
+	const u_char *p;	/* big-endian u64s */
+	size_t n;
+};
+
+struct krl_serial_bitmap {
+	u_int64_t lo, hi;
+	const u_char *p;	/* big-endian mpint, bit 0 is serial lo */
+	size_t len;
+	u_int64_t maxhi;	/* of this and all earlier bitmaps */
+};
+
+struct krl_map_ca {
+	u_char *ca_blob;
+	size_t ca_len;
+	struct krl_serial_range *ranges;
+	size_t nranges;
+	struct krl_serial_list *lists;
+	size_t nlists;
+	struct krl_serial_bitmap *bitmaps;
+	size_t nbitmaps;
+	struct krl_blob_set key_ids;
+};
+
+struct krl_map {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	long mtime_nsec;
+	u_char *data;		/* copy of the file */
+	size_t datalen;
+	struct krl_map_ca *cas;
+	size_t ncas;
+	struct krl_blob_set keys;
+	struct krl_blob_set sha1s;
+};
+
+static struct krl_map *krl_map_cache;
+
+static u_int32_t
+krl_blob_hash(const u_char *p, size_t len)
+{
+	u_int32_t h = 2166136261U;	/* FNV-1a */
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static int
+krl_blob_set_grow(struct krl_blob_set *set)
+{
+	struct krl_blob *old = set->slots, *slot;
+	size_t i, oldn = set->nslots;
+
+	set->nslots = oldn == 0 ? 64 : oldn * 2;
+	if ((set->slots = calloc(set->nslots, sizeof(*set->slots))) == NULL) {
+		set->slots = old;
+		set->nslots = oldn;
+		return SSH_ERR_ALLOC_FAIL;
+	}
+	for (i = 0; i < oldn; i++) {
+		if (old[i].p == NULL)
+			continue;
+		slot = &set->slots[krl_blob_hash(old[i].p, old[i].len) &
+		    (set->nslots - 1)];
+		while (slot->p != NULL) {
+			if (++slot == set->slots + set->nslots)
+				slot = set->slots;
+		}
+		*slot = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+static int
+krl_blob_set_find(const struct krl_blob_set *set, const u_char *p,
+    size_t len)
+{
+	struct krl_blob *slot;
+
+	if (set->n == 0)
+		return 0;
+	slot = &set->slots[krl_blob_hash(p, len) & (set->nslots - 1)];
+	while (slot->p != NULL) {
+		if (slot->len == len && memcmp(slot->p, p, len) == 0)
+			return 1;
+		if (++slot == set->slots + set->nslots)
+			slot = set->slots;
+	}
+	return 0;
+}
+
+static int
+krl_blob_set_add(struct krl_blob_set *set, const u_char *p, size_t len)
+{
+	struct krl_blob *slot;
+	int r;
+
+	if (krl_blob_set_find(set, p, len))
+		return 0;
+	/* Keep the load factor at or below one half */
+	if ((set->n + 1) * 2 > set->nslots &&
+	    (r = krl_blob_set_grow(set)) != 0)
+		return r;
+	slot = &set->slots[krl_blob_hash(p, len) & (set->nslots - 1)];
+	while (slot->p != NULL) {
+		if (++slot == set->slots + set->nslots)
+			slot = set->slots;
+	}
+	slot->p = p;
+	slot->len = len;
+	set->n++;
+	return 0;
+}
+
+static int
+krl_serial_range_cmp(const void *a, const void *b)
+{
+	const struct krl_serial_range *ra = a, *rb = b;
+
+	if (ra->lo != rb->lo)
+		return ra->lo < rb->lo ? -1 : 1;
+	return 0;
+}
+
+static int
+krl_serial_bitmap_cmp(const void *a, const void *b)
+{
+	const struct krl_serial_bitmap *ba = a, *bb = b;
+
+	if (ba->lo != bb->lo)
+		return ba->lo < bb->lo ? -1 : 1;
+	return 0;
+}
+
+static void
+krl_map_free(struct krl_map *km)
+{
+	size_t i;
+
+	if (km == NULL)
+		return;
+	for (i = 0; i < km->ncas; i++) {
+		free(km->cas[i].ca_blob);
+		free(km->cas[i].ranges);
+		free(km->cas[i].lists);
+		free(km->cas[i].bitmaps);
+		free(km->cas[i].key_ids.slots);
+	}
+	free(km->cas);
+	free(km->keys.slots);
+	free(km->sha1s.slots);
+	free(km->data);
+	free(km);
+}
+
+static int
+krl_map_add_range(struct krl_map_ca *ca, u_int64_t lo, u_int64_t hi)
+{
+	int r;
+
+	if (lo > hi || lo == 0)
+		return SSH_ERR_INVALID_FORMAT;
+	if ((r = reallocn((void **)&ca->ranges, ca->nranges + 1,
+	    sizeof(*ca->ranges))) != 0)
+		return r;
+	ca->ranges[ca->nranges].lo = lo;
+	ca->ranges[ca->nranges].hi = hi;
+	ca->nranges++;
+	return 0;
+}
+
+/* Sort and coalesce the ranges and bitmaps of a CA once it is complete */
+static void
+krl_map_ca_finish(struct krl_map_ca *ca)
+{
+	size_t i, j;
+
+	if (ca->nranges > 1) {
+		qsort(ca->ranges, ca->nranges, sizeof(*ca->ranges),
+		    krl_serial_range_cmp);
+		for (i = 1, j = 0; i < ca->nranges; i++) {
+			if (ca->ranges[j].hi == (u_int64_t)-1 ||
+			    ca->ranges[i].lo <= ca->ranges[j].hi + 1) {
+				if (ca->ranges[i].hi > ca->ranges[j].hi)
+					ca->ranges[j].hi = ca->ranges[i].hi;
+			} else
+				ca->ranges[++j] = ca->ranges[i];
+		}
+		ca->nranges = j + 1;
+	}
+	if (ca->nbitmaps > 0) {
+		qsort(ca->bitmaps, ca->nbitmaps, sizeof(*ca->bitmaps),
+		    krl_serial_bitmap_cmp);
+		ca->bitmaps[0].maxhi = ca->bitmaps[0].hi;
+		for (i = 1; i < ca->nbitmaps; i++)
+			ca->bitmaps[i].maxhi = MAX(ca->bitmaps[i - 1].maxhi,
+			    ca->bitmaps[i].hi);
+	}
+}
+
+/* Compile a KRL_SECTION_CERTIFICATES section, as parse_revoked_certs() */
+static int
+krl_map_parse_certs(struct krl_map *km, const u_char *data, size_t dlen)
+{
+	struct sshbuf *sect = NULL;
+	struct krl_map_ca *ca;
+	struct sshkey *ca_key = NULL;
+	const u_char *p, *blob;
+	size_t i, len, blen;
+	u_int64_t serial, prev, lo;
+	u_char type;
+	int r;
+
+	if ((sect = sshbuf_from(data, dlen)) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	if ((r = sshbuf_get_string_direct(sect, &blob, &blen)) != 0 ||
+	    (r = sshbuf_skip_string(sect)) != 0) /* reserved */
+		goto out;
+	if ((r = sshkey_from_blob(blob, blen, &ca_key)) != 0)
+		goto out;
+	if ((r = reallocn((void **)&km->cas, km->ncas + 1,
+	    sizeof(*km->cas))) != 0)
+		goto out;
+	ca = &km->cas[km->ncas++];
+	bzero(ca, sizeof(*ca));
+	if ((r = sshkey_plain_to_blob(ca_key, &ca->ca_blob,
+	    &ca->ca_len)) != 0)
+		goto out;
+
+	while (sshbuf_len(sect) > 0) {
+		if ((r = sshbuf_get_u8(sect, &type)) != 0 ||
+		    (r = sshbuf_get_string_direct(sect, &p, &len)) != 0)
+			goto out;
+		KRL_DBG(("%s: subsection type 0x%02x", __func__, type));
+		switch (type) {
+		case KRL_SECTION_CERT_SERIAL_LIST:
+			if (len % 8 != 0) {
+				r = SSH_ERR_INVALID_FORMAT;
+				goto out;
+			}
+			/* Lists in canonical order are searched in place */
+			for (i = 0, prev = 0; i < len / 8; i++) {
+				if ((serial = PEEK_U64(p + i * 8)) <= prev)
+					break;
+				prev = serial;
+			}
+			if (i == len / 8) {
+				if (i == 0)
+					break;
+				if ((r = reallocn((void **)&ca->lists,
+				    ca->nlists + 1, sizeof(*ca->lists))) != 0)
+					goto out;
+				ca->lists[ca->nlists].p = p;
+				ca->lists[ca->nlists].n = i;
+				ca->nlists++;
+				break;
+			}
+			for (i = 0; i < len / 8; i++) {
+				serial = PEEK_U64(p + i * 8);
+				if ((r = krl_map_add_range(ca, serial,
+				    serial)) != 0)
+					goto out;
+			}
+			break;
+		case KRL_SECTION_CERT_SERIAL_RANGE:
+			if (len != 16) {
+				r = SSH_ERR_INVALID_FORMAT;
+				goto out;
+			}
+			if ((r = krl_map_add_range(ca, PEEK_U64(p),
+			    PEEK_U64(p + 8))) != 0)
+				goto out;
+			break;
+		case KRL_SECTION_CERT_SERIAL_BITMAP:
+			if (len < 12 || (blen = PEEK_U32(p + 8)) != len - 12) {
+				r = SSH_ERR_INVALID_FORMAT;
+				goto out;
+			}
+			lo = PEEK_U64(p);
+			p += 12;
+			/* Same checks as sshbuf_get_bignum2() */
+			if (blen != 0 && (*p & 0x80) != 0) {
+				r = SSH_ERR_BIGNUM_IS_NEGATIVE;
+				goto out;
+			}
+			if (blen > SSHBUF_MAX_BIGNUM) {
+				r = SSH_ERR_BIGNUM_TOO_LARGE;
+				goto out;
+			}
+			for (; blen > 0 && *p == 0; p++, blen--)
+				;
+			if (blen == 0)
+				break;
+			/* Index of the most significant set bit */
+			for (serial = (blen - 1) * 8; (*p >> (serial % 8)) > 1;
+			    serial++)
+				;
+			if (lo + serial < lo) {
+				error("%s: bitmap wraps u64", __func__);
+				r = SSH_ERR_INVALID_FORMAT;
+				goto out;
+			}
+			if (lo == 0 && (p[blen - 1] & 1) != 0) {
+				r = SSH_ERR_INVALID_FORMAT;
+				goto out;
+			}
+			if ((r = reallocn((void **)&ca->bitmaps,
+			    ca->nbitmaps + 1, sizeof(*ca->bitmaps))) != 0)
+				goto out;
+			ca->bitmaps[ca->nbitmaps].lo = lo;
+			ca->bitmaps[ca->nbitmaps].hi = lo + serial;
+			ca->bitmaps[ca->nbitmaps].p = p;
+			ca->bitmaps[ca->nbitmaps].len = blen;
+			ca->nbitmaps++;
+			break;
+		case KRL_SECTION_CERT_KEY_ID:
+			while (len > 0) {
+				if (len < 4 || (blen = PEEK_U32(p)) > len - 4 ||
+				    memchr(p + 4, '\0', blen) != NULL) {
+					r = SSH_ERR_INVALID_FORMAT;
+					goto out;
+				}
+				if ((r = krl_blob_set_add(&ca->key_ids, p + 4,
+				    blen)) != 0)
+					goto out;
+				p += 4 + blen;
+				len -= 4 + blen;
+			}
+			break;
+		default:
+			error("Unsupported KRL certificate section %u", type);
+			r = SSH_ERR_INVALID_FORMAT;
+			goto out;
+		}
+	}
+	krl_map_ca_finish(ca);
+	r = 0;
+ out:
+	sshkey_free(ca_key);
+	sshbuf_free(sect);
+	return r;
+}
+
+static int
+krl_map_serial_revoked(const struct krl_map_ca *ca, u_int64_t serial)
+{
+	const struct krl_serial_bitmap *bm;
+	u_int64_t bit;
+	size_t i, lo, hi, mid;
+
+	/* Merged ranges: last one starting at or before serial */
+	for (lo = 0, hi = ca->nranges; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		if (ca->ranges[mid].lo <= serial)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0 && ca->ranges[lo - 1].hi >= serial)
+		return 1;
+
+	/* Sorted lists, in place */
+	for (i = 0; i < ca->nlists; i++) {
+		for (lo = 0, hi = ca->lists[i].n; lo < hi;) {
+			mid = lo + (hi - lo) / 2;
+			if (PEEK_U64(ca->lists[i].p + mid * 8) < serial)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo < ca->lists[i].n &&
+		    PEEK_U64(ca->lists[i].p + lo * 8) == serial)
+			return 1;
+	}
+
+	/* Bitmaps starting at or before serial that may still cover it */
+	for (lo = 0, hi = ca->nbitmaps; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		if (ca->bitmaps[mid].lo <= serial)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (i = lo; i > 0 && ca->bitmaps[i - 1].maxhi >= serial; i--) {
+		bm = &ca->bitmaps[i - 1];
+		if (serial > bm->hi)
+			continue;
+		bit = serial - bm->lo;
+		if ((bm->p[bm->len - 1 - bit / 8] >> (bit % 8)) & 1)
+			return 1;
+	}
+	return 0;
+}
+
+/* As is_key_revoked() */
+static int
+krl_map_key_revoked(const struct krl_map *km, const struct sshkey *key)
+{
+	const struct krl_map_ca *ca;
+	u_char *blob;
+	size_t i, len;
+	int r, found;
+
+	if ((blob = sshkey_fingerprint_raw(key, SSH_FP_SHA1, &len)) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	found = krl_blob_set_find(&km->sha1s, blob, len);
+	free(blob);
+	if (found) {
+		KRL_DBG(("%s: revoked by key SHA1", __func__));
+		return SSH_ERR_KEY_REVOKED;
+	}
+
+	if ((r = sshkey_plain_to_blob(key, &blob, &len)) != 0)
+		return r;
+	found = krl_blob_set_find(&km->keys, blob, len);
+	free(blob);
+	if (found) {
+		KRL_DBG(("%s: revoked by explicit key", __func__));
+		return SSH_ERR_KEY_REVOKED;
+	}
+
+	if (!sshkey_is_cert(key) || km->ncas == 0)
+		return 0;
+
+	if ((r = sshkey_plain_to_blob(key->cert->signature_key,
+	    &blob, &len)) != 0)
+		return r;
+	for (i = 0, found = 0; !found && i < km->ncas; i++) {
+		ca = &km->cas[i];
+		if (ca->ca_len != len || memcmp(ca->ca_blob, blob, len) != 0)
+			continue;
+		if (krl_blob_set_find(&ca->key_ids,
+		    (const u_char *)key->cert->key_id,
+		    strlen(key->cert->key_id))) {
+			KRL_DBG(("%s: revoked by key ID", __func__));
+			found = 1;
+		} else if (!sshkey_cert_is_legacy(key) &&
+		    key->cert->serial != 0 &&
+		    krl_map_serial_revoked(ca, key->cert->serial)) {
+			KRL_DBG(("%s: revoked serial %llu", __func__,
+			    key->cert->serial));
+			found = 1;
+		}
+	}
+	free(blob);
+	return found ? SSH_ERR_KEY_REVOKED : 0;
+}
+
+/* As ssh_krl_check_key() */
+static int
+krl_map_check_key(const struct krl_map *km, const struct sshkey *key)
+{
+	int r;
+
+	if ((r = krl_map_key_revoked(km, key)) != 0)
+		return r;
+	if (sshkey_is_cert(key)) {
+		debug2("%s: checking CA key", __func__);
+		if ((r = krl_map_key_revoked(km,
+		    key->cert->signature_key)) != 0)
+			return r;
+	}
+	return 0;
+}
+
+/*
+ * Read and compile a KRL file. Signatures are verified as in
+ * ssh_krl_from_blob() without a list of trusted signing keys.
+ */
+static int
+krl_map_load(int fd, const struct stat *st, struct krl_map **kmp)
+{
+	struct krl_map *km = NULL;
+	struct sshbuf *buf = NULL;
+	struct sshkey *key = NULL, **ca_used = NULL;
+	const u_char *blob;
+	char timestamp[64], *comment = NULL;
+	u_int64_t krl_version, generated_date, flags;
+	u_int format_version;
+	size_t i, blen, sig_off, sects_off, nca_used = 0;
+	u_char type;
+	int r, sig_seen;
+
+	*kmp = NULL;
+	if (st->st_size < (off_t)sizeof(KRL_MAGIC) - 1)
+		return SSH_ERR_KRL_BAD_MAGIC;
+	if ((uintmax_t)st->st_size > SIZE_MAX)
+		return SSH_ERR_INVALID_FORMAT;
+	if ((km = calloc(1, sizeof(*km))) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	km->datalen = st->st_size;
+	if ((km->data = malloc(km->datalen)) == NULL) {
+		r = SSH_ERR_ALLOC_FAIL;
+		goto out;
+	}
+	if (atomicio(read, fd, km->data, km->datalen) != km->datalen) {
+		r = errno == EPIPE ? SSH_ERR_FILE_CHANGED :
+		    SSH_ERR_SYSTEM_ERROR;
+		goto out;
+	}
+	if (memcmp(km->data, KRL_MAGIC, sizeof(KRL_MAGIC) - 1) != 0) {
+		r = SSH_ERR_KRL_BAD_MAGIC;
+		goto out;
+	}
+	if ((buf = sshbuf_from(km->data, km->datalen)) == NULL) {
+		r = SSH_ERR_ALLOC_FAIL;
+		goto out;
+	}
+	if ((r = sshbuf_consume(buf, sizeof(KRL_MAGIC) - 1)) != 0 ||
+	    (r = sshbuf_get_u32(buf, &format_version)) != 0)
+		goto out;
+	if (format_version != KRL_FORMAT_VERSION) {
+		error("%s: KRL unsupported format version %u",
+		    __func__, format_version);
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	if ((r = sshbuf_get_u64(buf, &krl_version)) != 0 ||
+	    (r = sshbuf_get_u64(buf, &generated_date)) != 0 ||
+	    (r = sshbuf_get_u64(buf, &flags)) != 0 ||
+	    (r = sshbuf_skip_string(buf)) != 0 || /* reserved */
+	    (r = sshbuf_get_cstring(buf, &comment, NULL)) != 0)
+		goto out;
+	format_timestamp(generated_date, timestamp, sizeof(timestamp));
+	debug("KRL version %llu generated at %s%s%s",
+	    (long long unsigned)krl_version, timestamp,
+	    *comment ? ": " : "", comment);
+
+	/* 1st pass: verify signatures before looking at anything else */
+	sects_off = km->datalen - sshbuf_len(buf);
+	sig_seen = 0;
+	while (sshbuf_len(buf) > 0) {
+		if ((r = sshbuf_get_u8(buf, &type)) != 0 ||
+		    (r = sshbuf_get_string_direct(buf, &blob, &blen)) != 0)
+			goto out;
+		if (type != KRL_SECTION_SIGNATURE) {
+			if (sig_seen) {
+				error("KRL contains non-signature section "
+				    "after signature");
+				r = SSH_ERR_INVALID_FORMAT;
+				goto out;
+			}
+			continue;
+		}
+		sig_seen = 1;
+		if ((r = sshkey_from_blob(blob, blen, &key)) != 0)
+			goto out;
+		sig_off = km->datalen - sshbuf_len(buf);
+		if ((r = sshbuf_get_string_direct(buf, &blob, &blen)) != 0)
+			goto out;
+		if ((r = sshkey_verify(key, blob, blen,
+		    km->data, sig_off, 0)) != 0)
+			goto out;
+		if ((r = reallocn((void **)&ca_used, nca_used + 1,
+		    sizeof(*ca_used))) != 0)
+			goto out;
+		ca_used[nca_used++] = key;
+		key = NULL;
+		break;
+	}
+
+	/* 2nd pass: compile the sections */
+	sshbuf_free(buf);
+	if ((buf = sshbuf_from(km->data + sects_off,
+	    km->datalen - sects_off)) == NULL) {
+		r = SSH_ERR_ALLOC_FAIL;
+		goto out;
+	}
+	while (sshbuf_len(buf) > 0) {
+		if ((r = sshbuf_get_u8(buf, &type)) != 0 ||
+		    (r = sshbuf_get_string_direct(buf, &blob, &blen)) != 0)
+			goto out;
+		KRL_DBG(("%s: section 0x%02x", __func__, type));
+		switch (type) {
+		case KRL_SECTION_CERTIFICATES:
+			if ((r = krl_map_parse_certs(km, blob, blen)) != 0)
+				goto out;
+			break;
+		case KRL_SECTION_EXPLICIT_KEY:
+		case KRL_SECTION_FINGERPRINT_SHA1:
+			while (blen > 0) {
+				if (blen < 4 || (i = PEEK_U32(blob)) > blen - 4) {
+					r = SSH_ERR_INVALID_FORMAT;
+					goto out;
+				}
+				if (type == KRL_SECTION_FINGERPRINT_SHA1 &&
+				    i != 20) {
+					error("%s: bad SHA1 length", __func__);
+					r = SSH_ERR_INVALID_FORMAT;
+					goto out;
+				}
+				if ((r = krl_blob_set_add(
+				    type == KRL_SECTION_EXPLICIT_KEY ?
+				    &km->keys : &km->sha1s, blob + 4, i)) != 0)
+					goto out;
+				blob += 4 + i;
+				blen -= 4 + i;
+			}
+			break;
+		case KRL_SECTION_BLOOM_FILTER:
+			/* The hash sets above answer in constant time anyway */
+			break;
+		case KRL_SECTION_SIGNATURE:
+			/* Verified above; skip the signature itself */
+			if ((r = sshbuf_skip_string(buf)) != 0)
+				goto out;
+			break;
+		default:
+			error("Unsupported KRL section %u", type);
+			r = SSH_ERR_INVALID_FORMAT;
+			goto out;
+		}
+	}
+
+	/* Check that the key(s) used to sign the KRL weren't revoked */
+	sig_seen = 0;
+	for (i = 0; i < nca_used; i++) {
+		if ((r = krl_map_check_key(km, ca_used[i])) == 0)
+			sig_seen = 1;
+		else if (r != SSH_ERR_KEY_REVOKED)
+			goto out;
+	}
+	if (nca_used && !sig_seen) {
+		error("All keys used to sign KRL were revoked");
+		r = SSH_ERR_KEY_REVOKED;
+		goto out;
+	}
+
+	km->dev = st->st_dev;
+	km->ino = st->st_ino;
+	km->size = st->st_size;
+	km->mtime = st->st_mtim.tv_sec;
+	km->mtime_nsec = st->st_mtim.tv_nsec;
+	*kmp = km;
+	km = NULL;
+	r = 0;
+ out:
+	krl_map_free(km);
+	for (i = 0; i < nca_used; i++)
+		sshkey_free(ca_used[i]);
+	free(ca_used);
+	sshkey_free(key);
+	free(comment);
+	sshbuf_free(buf);
+	return r;
+}
+
+/*
+ * Returns 0 if the key is not revoked, SSH_ERR_KEY_REVOKED if it is,
+ * SSH_ERR_KRL_BAD_MAGIC if path is not a KRL or another error code.
+ */
 int
 ssh_krl_file_contains_key(const char *path, const struct sshkey *key)
 {
-	struct sshbuf *krlbuf = NULL;
-	struct ssh_krl *krl;
-	int r, revoked, fd;
+	struct krl_map *km = krl_map_cache;
+	struct stat st;
+	int r, fd;
 
 	if (path == NULL)
 		return 0;
 
-	if ((fd = open(path, O_RDONLY)) == -1) {
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
 		error("open %s: %s", path, strerror(errno));
 		error("Revoked keys file not accessible - refusing public key "
 		    "authentication");
+		if (fd != -1)
+			close(fd);
 		return SSH_ERR_SYSTEM_ERROR;
 	}
-	if ((krlbuf = sshbuf_new()) == NULL) {
-		close(fd);
-		return SSH_ERR_ALLOC_FAIL;
-	}
-	if ((r = sshkey_load_file(fd, path, krlbuf)) != 0) {
-		close(fd);
-		sshbuf_free(krlbuf);
-		error("Revoked keys file not readable - refusing public key "
-		    "authentication");
-		return r;
+	if (km == NULL || km->dev != st.st_dev || km->ino != st.st_ino ||
+	    km->size != st.st_size || km->mtime != st.st_mtim.tv_sec ||
+	    km->mtime_nsec != st.st_mtim.tv_nsec) {
+		krl_map_free(krl_map_cache);
+		krl_map_cache = NULL;
+		r = krl_map_load(fd, &st, &km);
+		if (r == SSH_ERR_KRL_BAD_MAGIC) {
+			close(fd);
+			debug3("%s: %s is not a KRL file", __func__, path);
+			return r;
+		} else if (r != 0) {
+			close(fd);
+			error("Invalid KRL, refusing public key "
+			    "authentication");
+			return r;
+		}
+		krl_map_cache = km;
 	}
 	close(fd);
-	if (ssh_krl_from_blob(krlbuf, &krl, NULL, 0) != 0) {
-		sshbuf_free(krlbuf);
-		error("Invalid KRL, refusing public key "
-		    "authentication");
-		return -1;
-	}
-	sshbuf_free(krlbuf);
-	if (krl == NULL) {
-		debug3("%s: %s is not a KRL file", __func__, path);
-		return -2;
-	}
 	debug2("%s: checking KRL %s", __func__, path);
-	revoked = ssh_krl_check_key(krl, key) != 0;
-	ssh_krl_free(krl);
-	return revoked ? -1 : 0;
+	return krl_map_check_key(km, key);
 }
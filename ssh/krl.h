@@ -29,6 +29,7 @@
 #define KRL_SECTION_EXPLICIT_KEY	2
 #define KRL_SECTION_FINGERPRINT_SHA1	3
 #define KRL_SECTION_SIGNATURE		4
+#define KRL_SECTION_BLOOM_FILTER	0x80
 
 /* KRL_SECTION_CERTIFICATES subsection types */
 #define KRL_SECTION_CERT_SERIAL_LIST	0x20
@@ -37,10 +38,12 @@
 #define KRL_SECTION_CERT_KEY_ID		0x23
 
 struct ssh_krl;
+struct ssh_krl_stream;
 
 struct ssh_krl *ssh_krl_init(void);
 void ssh_krl_free(struct ssh_krl *krl);
 void ssh_krl_set_version(struct ssh_krl *krl, u_int64_t version);
+void ssh_krl_set_bloom(struct ssh_krl *krl, u_int bits_per_item);
 void ssh_krl_set_sign_key(struct ssh_krl *krl, const struct sshkey *sign_key);
 int ssh_krl_set_comment(struct ssh_krl *krl, const char *comment);
 int ssh_krl_revoke_cert_by_serial(struct ssh_krl *krl, const struct sshkey *ca_key,
@@ -59,5 +62,12 @@ int ssh_krl_from_blob(struct sshbuf *buf, struct ssh_krl **krlp,
 int ssh_krl_check_key(struct ssh_krl *krl, const struct sshkey *key);
 int ssh_krl_file_contains_key(const char *path, const struct sshkey *key);
 
+int ssh_krl_stream_open(int fd, struct sshbuf *base, u_int64_t version,
+    const char *comment, struct ssh_krl_stream **ksp);
+int ssh_krl_stream_revoke_serial_range(struct ssh_krl_stream *ks,
+    const struct sshkey *ca_key, u_int64_t lo, u_int64_t hi);
+int ssh_krl_stream_finish(struct ssh_krl_stream *ks, struct ssh_krl *krl);
+void ssh_krl_stream_free(struct ssh_krl_stream *ks);
+
 #endif /* _KRL_H */
 
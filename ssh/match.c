@@ -36,6 +36,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/queue.h>
 
 #include <ctype.h>
 #include <stdlib.h>
@@ -44,69 +45,284 @@
 
 #include "match.h"
 
+#define MATCH_SUBPATTERN_MAX	1024	/* Including the terminating \0 */
+#define MATCH_COMPILE_MIN	8	/* Shorter lists are scanned directly */
+#define MATCH_CACHE_SIZE	16
+
+#define MATCH_POSITIVE		0x01
+#define MATCH_NEGATIVE		0x02
+
+struct match_literal {
+	char	*s;
+	int	flags;		/* MATCH_POSITIVE|MATCH_NEGATIVE */
+};
+
+struct match_wildcard {
+	char	*pattern;
+	int	negated;
+};
+
+/*
+ * A compiled pattern list. Subpatterns without wildcards are kept in a
+ * sorted array, so they are all checked by one binary search; only the
+ * ones containing wildcards are matched one at a time.
+ */
+struct match_patterns {
+	char	*list;		/* for the cache */
+	u_int	len;
+	int	dolower;
+	struct match_literal *literals;
+	u_int	nliterals;
+	struct match_wildcard *wildcards;
+	u_int	nwildcards;
+	TAILQ_ENTRY(match_patterns) next;
+};
+
+static TAILQ_HEAD(match_patterns_head, match_patterns) match_cache =
+    TAILQ_HEAD_INITIALIZER(match_cache);
+static u_int match_ncache;
+
 /*
  * Returns true if the given string matches the pattern (which may contain ?
  * and * as wildcards), and zero if it does not match.
+ *
+ * Only the most recent asterisk is ever backtracked to: whatever an earlier
+ * one absorbed cannot change whether the rest matches, so the running time
+ * is bounded by the product of the lengths rather than exponential in the
+ * number of asterisks.
  */
 
 int
 match_pattern(const char *s, const char *pattern)
 {
-	for (;;) {
-		/* If at end of pattern, accept if also at end of string. */
-		if (!*pattern)
-			return !*s;
+	const char *star = NULL, *retry = NULL;
+	int nstar;
 
+	for (;;) {
 		if (*pattern == '*') {
-			/* Skip the asterisk. */
-			pattern++;
+			/* Skip the asterisks. */
+			for (nstar = 0; *pattern == '*'; nstar++)
+				pattern++;
+
+			/*
+			 * As with the recursive matcher this replaces, a run
+			 * of several asterisks needs a character to follow.
+			 */
+			if (nstar > 1 && !*s)
+				goto retry;
 
 			/* If at end of pattern, accept immediately. */
 			if (!*pattern)
 				return 1;
 
-			/* If next character in pattern is known, optimize. */
-			if (*pattern != '?' && *pattern != '*') {
-				/*
-				 * Look instances of the next character in
-				 * pattern, and try to match starting from
-				 * those.
-				 */
-				for (; *s; s++)
-					if (*s == *pattern &&
-					    match_pattern(s + 1, pattern + 1))
-						return 1;
-				/* Failed. */
-				return 0;
-			}
-			/*
-			 * Move ahead one character at a time and try to
-			 * match at each position.
-			 */
-			for (; *s; s++)
-				if (match_pattern(s, pattern))
-					return 1;
-			/* Failed. */
-			return 0;
+			/* Remember where to resume if the rest fails. */
+			star = pattern;
+			retry = s;
+			continue;
 		}
-		/*
-		 * There must be at least one more character in the string.
-		 * If we are at the end, fail.
-		 */
-		if (!*s)
-			return 0;
-
 		/* Check if the next character of the string is acceptable. */
-		if (*pattern != '?' && *pattern != *s)
-			return 0;
+		if (*s && (*pattern == '?' || *pattern == *s)) {
+			s++;
+			pattern++;
+			continue;
+		}
+		/* If at end of pattern, accept if also at end of string. */
+		if (!*pattern && !*s)
+			return 1;
 
-		/* Move to the next character, both in string and in pattern. */
-		s++;
-		pattern++;
+ retry:
+		/* Let the last asterisk absorb one more character and retry. */
+		if (star == NULL || !*retry)
+			return 0;
+		pattern = star;
+		s = ++retry;
 	}
 	/* NOTREACHED */
 }
 
+static int
+match_literal_cmp(const void *a, const void *b)
+{
+	const struct match_literal *la = a, *lb = b;
+
+	return strcmp(la->s, lb->s);
+}
+
+static int
+match_literal_find(const void *key, const void *elem)
+{
+	const struct match_literal *l = elem;
+
+	return strcmp(key, l->s);
+}
+
+void
+match_patterns_free(struct match_patterns *mp)
+{
+	u_int i;
+
+	if (mp == NULL)
+		return;
+	for (i = 0; i < mp->nliterals; i++)
+		free(mp->literals[i].s);
+	for (i = 0; i < mp->nwildcards; i++)
+		free(mp->wildcards[i].pattern);
+	free(mp->literals);
+	free(mp->wildcards);
+	free(mp->list);
+	free(mp);
+}
+
+/*
+ * Compile the first len bytes of a pattern list in the format accepted by
+ * match_pattern_list(). Returns NULL if memory is exhausted or a
+ * subpattern is too long, in which case match_pattern_list() should be
+ * used instead.
+ */
+struct match_patterns *
+match_patterns_compile(const char *pattern, u_int len, int dolower)
+{
+	struct match_patterns *mp;
+	char *sub;
+	void *tmp;
+	u_int i, j, subi;
+	int negated;
+
+	if ((mp = calloc(1, sizeof(*mp))) == NULL)
+		return NULL;
+	mp->len = len;
+	mp->dolower = dolower;
+	if ((mp->list = malloc(len + 1)) == NULL)
+		goto fail;
+	memcpy(mp->list, pattern, len);
+	mp->list[len] = '\0';
+
+	for (i = 0; i < len;) {
+		negated = pattern[i] == '!';
+		if (negated)
+			i++;
+		for (subi = 0; i + subi < len && pattern[i + subi] != ',';
+		    subi++)
+			;
+		if (subi >= MATCH_SUBPATTERN_MAX - 1 ||
+		    (sub = malloc(subi + 1)) == NULL)
+			goto fail;
+		for (j = 0; j < subi; j++, i++)
+			sub[j] = dolower && isupper((u_char)pattern[i]) ?
+			    (char)tolower((u_char)pattern[i]) : pattern[i];
+		sub[subi] = '\0';
+		if (i < len && pattern[i] == ',')
+			i++;
+
+		if (strpbrk(sub, "*?") != NULL) {
+			if ((tmp = realloc(mp->wildcards, (mp->nwildcards + 1) *
+			    sizeof(*mp->wildcards))) == NULL) {
+				free(sub);
+				goto fail;
+			}
+			mp->wildcards = tmp;
+			mp->wildcards[mp->nwildcards].pattern = sub;
+			mp->wildcards[mp->nwildcards++].negated = negated;
+		} else {
+			if ((tmp = realloc(mp->literals, (mp->nliterals + 1) *
+			    sizeof(*mp->literals))) == NULL) {
+				free(sub);
+				goto fail;
+			}
+			mp->literals = tmp;
+			mp->literals[mp->nliterals].s = sub;
+			mp->literals[mp->nliterals++].flags =
+			    negated ? MATCH_NEGATIVE : MATCH_POSITIVE;
+		}
+	}
+
+	/* Sort the literals and merge duplicates */
+	if (mp->nliterals > 1) {
+		qsort(mp->literals, mp->nliterals, sizeof(*mp->literals),
+		    match_literal_cmp);
+		for (i = 1, j = 0; i < mp->nliterals; i++) {
+			if (strcmp(mp->literals[j].s,
+			    mp->literals[i].s) == 0) {
+				mp->literals[j].flags |= mp->literals[i].flags;
+				free(mp->literals[i].s);
+			} else
+				mp->literals[++j] = mp->literals[i];
+		}
+		mp->nliterals = j + 1;
+	}
+	return mp;
+ fail:
+	match_patterns_free(mp);
+	return NULL;
+}
+
+/*
+ * Match a string against a compiled pattern list. Returns -1 if a negated
+ * subpattern matches, 1 if there is a positive match or 0 otherwise.
+ */
+int
+match_patterns_match(const struct match_patterns *mp, const char *string)
+{
+	const struct match_literal *l;
+	const struct match_wildcard *w;
+	int flags = 0;
+	u_int i;
+
+	if (mp->nliterals > 0 && (l = bsearch(string, mp->literals,
+	    mp->nliterals, sizeof(*mp->literals), match_literal_find)) != NULL)
+		flags = l->flags;
+	for (i = 0; i < mp->nwildcards && !(flags & MATCH_NEGATIVE); i++) {
+		w = &mp->wildcards[i];
+		/* Once positive, only a negation can change the result */
+		if (!w->negated && (flags & MATCH_POSITIVE))
+			continue;
+		if (match_pattern(string, w->pattern))
+			flags |= w->negated ? MATCH_NEGATIVE : MATCH_POSITIVE;
+	}
+	if (flags & MATCH_NEGATIVE)
+		return -1;
+	return (flags & MATCH_POSITIVE) ? 1 : 0;
+}
+
+/*
+ * Return a cached compiled form of a pattern list, compiling it if needed.
+ * Returns NULL for short lists, which are quicker to scan, and for lists
+ * that cannot be compiled.
+ */
+static struct match_patterns *
+match_patterns_get(const char *pattern, u_int len, int dolower)
+{
+	struct match_patterns *mp, *last;
+	const char *cp, *end = pattern + len;
+	u_int n;
+
+	for (n = 1, cp = pattern; n < MATCH_COMPILE_MIN &&
+	    (cp = memchr(cp, ',', end - cp)) != NULL; cp++)
+		n++;
+	if (n < MATCH_COMPILE_MIN)
+		return NULL;
+
+	TAILQ_FOREACH(mp, &match_cache, next) {
+		if (mp->len == len && mp->dolower == dolower &&
+		    memcmp(mp->list, pattern, len) == 0) {
+			TAILQ_REMOVE(&match_cache, mp, next);
+			TAILQ_INSERT_HEAD(&match_cache, mp, next);
+			return mp;
+		}
+	}
+	if ((mp = match_patterns_compile(pattern, len, dolower)) == NULL)
+		return NULL;
+	if (match_ncache >= MATCH_CACHE_SIZE) {
+		last = TAILQ_LAST(&match_cache, match_patterns_head);
+		TAILQ_REMOVE(&match_cache, last, next);
+		match_patterns_free(last);
+		match_ncache--;
+	}
+	TAILQ_INSERT_HEAD(&match_cache, mp, next);
+	match_ncache++;
+	return mp;
+}
+
 /*
  * Tries to match the string against the
  * comma-separated sequence of subpatterns (each possibly preceded by ! to
@@ -118,11 +334,15 @@ int
 match_pattern_list(const char *string, const char *pattern, u_int len,
     int dolower)
 {
-	char sub[1024];
+	struct match_patterns *mp;
+	char sub[MATCH_SUBPATTERN_MAX];
 	int negated;
 	int got_positive;
 	u_int i, subi;
 
+	if ((mp = match_patterns_get(pattern, len, dolower)) != NULL)
+		return match_patterns_match(mp, string);
+
 	got_positive = 0;
 	for (i = 0; i < len;) {
 		/* Check if the subpattern is negated. */
@@ -21,6 +21,11 @@ int	 match_host_and_ip(const char *, const char *, const char *);
 int	 match_user(const char *, const char *, const char *, const char *);
 char	*match_list(const char *, const char *, u_int *);
 
+struct match_patterns;
+struct match_patterns *match_patterns_compile(const char *, u_int, int);
+int	 match_patterns_match(const struct match_patterns *, const char *);
+void	 match_patterns_free(struct match_patterns *);
+
 /* addrmatch.c */
 int	 addr_match_list(const char *, const char *);
 int	 addr_match_cidr_list(const char *, const char *);
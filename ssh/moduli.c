@@ -39,11 +39,17 @@
 
 #include <sys/param.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include <openssl/bn.h>
 #include <openssl/dh.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <paths.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -52,8 +58,10 @@
 #include <unistd.h>
 
 #include "xmalloc.h"
+#include "atomicio.h"
 #include "dh.h"
 #include "log.h"
+#include "misc.h"
 
 /*
  * File output defines
@@ -112,6 +120,27 @@
 #define BIT_CLEAR(a,n)	((a)[(n)>>SHIFT_WORD] &= ~(1L << ((n) & 31)))
 #define BIT_SET(a,n)	((a)[(n)>>SHIFT_WORD] |= (1L << ((n) & 31)))
 #define BIT_TEST(a,n)	((a)[(n)>>SHIFT_WORD] & (1L << ((n) & 31)))
+#define BIT_SET_ATOMIC(a,n) \
+	__sync_fetch_and_or(&(a)[(n)>>SHIFT_WORD], (1U << ((n) & 31)))
+
+/*
+ * The large sieve is struck in segments of this many bits (256KB), so
+ * that primes small enough to hit a segment repeatedly do so while it
+ * is in the L2 cache. Larger primes strike the whole sieve directly.
+ */
+#define SEGMENT_BITS	(1UL<<21)
+
+/* Number of medium sized primes collected before a segmented pass */
+#define MEDIUM_BATCH	(8192)
+
+/*
+ * The smallest primes are struck once into a repeating wheel pattern,
+ * which is then copied over the large sieve.  WHEEL_WORDS is the
+ * product of the wheel primes, so the pattern repeats every WHEEL_WORDS
+ * 32-bit words.
+ */
+#define WHEEL_MAXIMUM	(13)
+#define WHEEL_WORDS	(3 * 5 * 7 * 11 * 13)
 
 /*
  * Prime testing defines
@@ -134,10 +163,23 @@ static u_int32_t *SmallSieve, smallbits, smallbase;
 static u_int32_t *LargeSieve, largewords, largetries, largenumbers;
 static u_int32_t largebits, largememory;	/* megabytes */
 static BIGNUM *largebase;
+static int largeshared;		/* LargeSieve is struck by several workers */
 
-int gen_candidates(FILE *, u_int32_t, u_int32_t, BIGNUM *);
+/* wheel pattern for primes up to WHEEL_MAXIMUM */
+static u_int32_t *WheelSieve;
+
+/* medium primes waiting for a segmented pass */
+struct medium_prime {
+	u_int32_t s;		/* the prime */
+	u_int32_t q;		/* next index of a q divisible by s */
+	u_int32_t p;		/* next index of a p divisible by s */
+};
+static struct medium_prime *MediumPrimes;
+static u_int32_t mediumcount;
+
+int gen_candidates(FILE *, u_int32_t, u_int32_t, BIGNUM *, u_int32_t);
 int prime_test(FILE *, FILE *, u_int32_t, u_int32_t, char *, unsigned long,
-    unsigned long);
+    unsigned long, u_int32_t);
 
 /*
  * print moduli out in consistent form,
@@ -171,6 +213,15 @@ qfileout(FILE * ofile, u_int32_t otype, u_int32_t otests, u_int32_t otries,
 }
 
 
+static inline void
+sieve_set(u_int32_t n)
+{
+	if (largeshared)
+		BIT_SET_ATOMIC(LargeSieve, n);
+	else
+		BIT_SET(LargeSieve, n);
+}
+
 /*
  ** Sieve p's and q's with small factors
  */
@@ -199,7 +250,7 @@ sieve_large(u_int32_t s)
 
 		/* Mark all multiples of 2*s */
 		for (u /= 2; u < largebits; u += s)
-			BIT_SET(LargeSieve, u);
+			sieve_set(u);
 	}
 
 	/* r = p mod s */
@@ -223,20 +274,259 @@ sieve_large(u_int32_t s)
 
 		/* Mark all multiples of 4*s */
 		for (u /= 4; u < largebits; u += s)
-			BIT_SET(LargeSieve, u);
+			sieve_set(u);
 	}
 }
 
+/*
+ * Find the first q and p sieve indices divisible by a prime s smaller
+ * than SEGMENT_BITS; the same arithmetic as sieve_large(), but without
+ * striking anything.  An index of largebits means "none".
+ */
+static void
+sieve_first(u_int32_t s, u_int32_t *qp, u_int32_t *pp)
+{
+	u_int32_t r, u;
+
+	largetries++;
+	r = BN_mod_word(largebase, s);
+	u = r == 0 ? 0 : s - r;
+	*qp = largebits;
+	if (u < largebits * 2) {
+		if (u & 0x1)
+			u += s;
+		*qp = u / 2;
+	}
+
+	r = (2 * r + 1) % s;
+	u = r == 0 ? 0 : s - r;
+	*pp = largebits;
+	if (u < largebits * 4) {
+		while (u & 0x3)
+			u += s;
+		*pp = u / 4;
+	}
+}
+
+/*
+ * Strike all pending medium primes, one cache-sized segment of the
+ * large sieve at a time.
+ */
+static void
+sieve_medium_flush(void)
+{
+	struct medium_prime *m;
+	u_int32_t i, j, lo, hi;
+
+	for (lo = 0; lo < largebits && mediumcount > 0; lo += SEGMENT_BITS) {
+		hi = MIN(lo + SEGMENT_BITS, largebits);
+		for (i = 0; i < mediumcount; i++) {
+			m = &MediumPrimes[i];
+			for (j = m->q; j < hi; j += m->s)
+				sieve_set(j);
+			m->q = j;
+			for (j = m->p; j < hi; j += m->s)
+				sieve_set(j);
+			m->p = j;
+		}
+	}
+	mediumcount = 0;
+}
+
+static void
+sieve_prime(u_int32_t s)
+{
+	struct medium_prime *m;
+
+	if (s >= SEGMENT_BITS) {
+		sieve_large(s);
+		return;
+	}
+	debug3("sieve_medium %u", s);
+	m = &MediumPrimes[mediumcount++];
+	m->s = s;
+	sieve_first(s, &m->q, &m->p);
+	if (mediumcount == MEDIUM_BATCH)
+		sieve_medium_flush();
+}
+
+/*
+ * Strike a wheel prime into the wheel pattern.  Since WHEEL_WORDS * 32
+ * is a multiple of s, the pattern stays aligned across repetitions.
+ */
+static void
+sieve_wheel(u_int32_t s)
+{
+	u_int32_t j, q, p, wheelbits = WHEEL_WORDS << SHIFT_WORD;
+
+	debug3("sieve_wheel %u", s);
+	sieve_first(s, &q, &p);
+	for (j = q % s; j < wheelbits; j += s)
+		BIT_SET(WheelSieve, j);
+	for (j = p % s; j < wheelbits; j += s)
+		BIT_SET(WheelSieve, j);
+}
+
+/* Apply the wheel pattern to the whole large sieve */
+static void
+sieve_wheel_fill(void)
+{
+	u_int32_t i, j;
+
+	for (i = 0; i < largewords; i += WHEEL_WORDS) {
+		for (j = 0; j < WHEEL_WORDS && i + j < largewords; j++)
+			LargeSieve[i + j] |= WheelSieve[j];
+	}
+}
+
+/*
+ * Sieve with the small primes (2**16 to 2**32) in blocks of 2**16.
+ * With several workers, worker n takes every nworkers'th block.
+ */
+static void
+sieve_small(u_int32_t worker, u_int32_t nworkers)
+{
+	u_int32_t block, i, r, s, t;
+	u_int32_t smallwords = TINY_NUMBER >> 6;
+
+	/*
+	 * Start the small block search at the next possible prime. To avoid
+	 * fencepost errors, the last pass is skipped.
+	 */
+	for (block = 0, smallbase = TINY_NUMBER + 3;
+	    smallbase < (SMALL_MAXIMUM - TINY_NUMBER);
+	    smallbase += TINY_NUMBER, block++) {
+		if (block % nworkers != worker)
+			continue;
+		for (i = 0; i < tinybits; i++) {
+			if (BIT_TEST(TinySieve, i))
+				continue; /* 2*i+3 is composite */
+
+			/* The next tiny prime */
+			t = 2 * i + 3;
+			r = smallbase % t;
+
+			if (r == 0) {
+				s = 0; /* t divides into smallbase exactly */
+			} else {
+				/* smallbase+s is first entry divisible by t */
+				s = t - r;
+			}
+
+			/*
+			 * The sieve omits even numbers, so ensure that
+			 * smallbase+s is odd. Then, step through the sieve
+			 * in increments of 2*t
+			 */
+			if (s & 1)
+				s += t; /* Make smallbase+s odd, and s even */
+
+			/* Mark all multiples of 2*t */
+			for (s /= 2; s < smallbits; s += t)
+				BIT_SET(SmallSieve, s);
+		}
+
+		/*
+		 * SmallSieve
+		 */
+		for (i = 0; i < smallbits; i++) {
+			if (BIT_TEST(SmallSieve, i))
+				continue; /* 2*i+smallbase is composite */
+
+			/* The next small prime */
+			sieve_prime((2 * i) + smallbase);
+		}
+		sieve_medium_flush();
+
+		memset(SmallSieve, 0, smallwords << SHIFT_BYTE);
+	}
+}
+
+/*
+ * Keep a worker away from its parent's files: whatever it reads or
+ * flushes through an inherited stdio stream, including on exit, goes to
+ * /dev/null instead.  Results only travel over the worker's own pipe or
+ * shared memory.
+ */
+static void
+worker_detach_stdio(FILE *in, FILE *out)
+{
+	int fd;
+
+	if ((fd = open(_PATH_DEVNULL, O_RDWR)) == -1)
+		fatal("open %s: %s", _PATH_DEVNULL, strerror(errno));
+	if (dup2(fd, STDIN_FILENO) == -1 || dup2(fd, STDOUT_FILENO) == -1 ||
+	    (in != NULL && dup2(fd, fileno(in)) == -1) ||
+	    (out != NULL && dup2(fd, fileno(out)) == -1))
+		fatal("dup2: %s", strerror(errno));
+	if (fd > STDERR_FILENO && (in == NULL || fd != fileno(in)) &&
+	    (out == NULL || fd != fileno(out)))
+		close(fd);
+}
+
+/*
+ * Run sieve_small() in nworkers processes sharing LargeSieve.  Bits
+ * are only ever set, so the result does not depend on the order in
+ * which the workers strike them.
+ */
+static int
+sieve_small_parallel(FILE *out, u_int32_t nworkers)
+{
+	pid_t *pids;
+	u_int32_t *tries, i;
+	int status, ret = 0;
+
+	tries = mmap(NULL, nworkers * sizeof(*tries), PROT_READ|PROT_WRITE,
+	    MAP_ANON|MAP_SHARED, -1, 0);
+	if (tries == MAP_FAILED) {
+		error("mmap: %s", strerror(errno));
+		return (-1);
+	}
+	memset(tries, 0, nworkers * sizeof(*tries));
+	pids = xcalloc(nworkers, sizeof(*pids));
+
+	fflush(out);
+	for (i = 0; i < nworkers; i++) {
+		switch ((pids[i] = fork())) {
+		case -1:
+			fatal("fork: %s", strerror(errno));
+		case 0:
+			worker_detach_stdio(NULL, out);
+			largetries = 0;
+			sieve_small(i, nworkers);
+			tries[i] = largetries;
+			_exit(0);
+		default:
+			break;
+		}
+	}
+	for (i = 0; i < nworkers; i++) {
+		while (waitpid(pids[i], &status, 0) == -1) {
+			if (errno != EINTR)
+				fatal("waitpid: %s", strerror(errno));
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			error("sieve worker %ld failed", (long)pids[i]);
+			ret = -1;
+		}
+		largetries += tries[i];
+	}
+	free(pids);
+	munmap(tries, nworkers * sizeof(*tries));
+	return (ret);
+}
+
 /*
  * list candidates for Sophie-Germain primes (where q = (p-1)/2)
  * to standard output.
  * The list is checked against small known primes (less than 2**30).
  */
 int
-gen_candidates(FILE *out, u_int32_t memory, u_int32_t power, BIGNUM *start)
+gen_candidates(FILE *out, u_int32_t memory, u_int32_t power, BIGNUM *start,
+    u_int32_t nworkers)
 {
 	BIGNUM *q;
-	u_int32_t j, r, s, t;
+	u_int32_t j, r, t;
 	u_int32_t smallwords = TINY_NUMBER >> 6;
 	u_int32_t tinywords = TINY_NUMBER >> 6;
 	time_t time_start, time_stop;
@@ -299,11 +589,29 @@ gen_candidates(FILE *out, u_int32_t memory, u_int32_t power, BIGNUM *start)
 	SmallSieve = xcalloc(smallwords, sizeof(u_int32_t));
 	smallbits = smallwords << SHIFT_WORD;
 
+	WheelSieve = xcalloc(WHEEL_WORDS, sizeof(u_int32_t));
+	MediumPrimes = xcalloc(MEDIUM_BATCH, sizeof(*MediumPrimes));
+	mediumcount = 0;
+
 	/*
-	 * dynamically determine available memory
+	 * dynamically determine available memory; workers need to see
+	 * each other's strikes, so share the sieve with them.
 	 */
-	while ((LargeSieve = calloc(largewords, sizeof(u_int32_t))) == NULL)
+	largeshared = nworkers > 1;
+	for (;;) {
+		if (!largeshared) {
+			if ((LargeSieve = calloc(largewords,
+			    sizeof(u_int32_t))) != NULL)
+				break;
+		} else {
+			if ((LargeSieve = mmap(NULL,
+			    largewords * sizeof(u_int32_t),
+			    PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED,
+			    -1, 0)) != MAP_FAILED)
+				break;
+		}
 		largewords -= (1L << (SHIFT_MEGAWORD - 2)); /* 1/4 MB chunks */
+	}
 
 	largebits = largewords << SHIFT_WORD;
 	largenumbers = largebits * 2;	/* even numbers excluded */
@@ -351,64 +659,26 @@ gen_candidates(FILE *out, u_int32_t memory, u_int32_t power, BIGNUM *start)
 		for (j = i + t; j < tinybits; j += t)
 			BIT_SET(TinySieve, j);
 
-		sieve_large(t);
+		if (t <= WHEEL_MAXIMUM)
+			sieve_wheel(t);
+		else
+			sieve_prime(t);
 	}
+	sieve_wheel_fill();
+	sieve_medium_flush();
 
-	/*
-	 * Start the small block search at the next possible prime. To avoid
-	 * fencepost errors, the last pass is skipped.
-	 */
-	for (smallbase = TINY_NUMBER + 3;
-	    smallbase < (SMALL_MAXIMUM - TINY_NUMBER);
-	    smallbase += TINY_NUMBER) {
-		for (i = 0; i < tinybits; i++) {
-			if (BIT_TEST(TinySieve, i))
-				continue; /* 2*i+3 is composite */
-
-			/* The next tiny prime */
-			t = 2 * i + 3;
-			r = smallbase % t;
-
-			if (r == 0) {
-				s = 0; /* t divides into smallbase exactly */
-			} else {
-				/* smallbase+s is first entry divisible by t */
-				s = t - r;
-			}
-
-			/*
-			 * The sieve omits even numbers, so ensure that
-			 * smallbase+s is odd. Then, step through the sieve
-			 * in increments of 2*t
-			 */
-			if (s & 1)
-				s += t; /* Make smallbase+s odd, and s even */
-
-			/* Mark all multiples of 2*t */
-			for (s /= 2; s < smallbits; s += t)
-				BIT_SET(SmallSieve, s);
-		}
-
-		/*
-		 * SmallSieve
-		 */
-		for (i = 0; i < smallbits; i++) {
-			if (BIT_TEST(SmallSieve, i))
-				continue; /* 2*i+smallbase is composite */
-
-			/* The next small prime */
-			sieve_large((2 * i) + smallbase);
-		}
-
-		memset(SmallSieve, 0, smallwords << SHIFT_BYTE);
-	}
+	if (nworkers > 1) {
+		if (sieve_small_parallel(out, nworkers) != 0)
+			ret = -1;
+	} else
+		sieve_small(0, 1);
 
 	time(&time_stop);
 
 	logit("%.24s Sieved with %u small primes in %ld seconds",
 	    ctime(&time_stop), largetries, (long) (time_stop - time_start));
 
-	for (j = r = 0; j < largebits; j++) {
+	for (j = r = 0; ret == 0 && j < largebits; j++) {
 		if (BIT_TEST(LargeSieve, j))
 			continue; /* Definitely composite, skip */
 
@@ -429,7 +699,12 @@ gen_candidates(FILE *out, u_int32_t memory, u_int32_t power, BIGNUM *start)
 
 	time(&time_stop);
 
-	free(LargeSieve);
+	if (largeshared)
+		munmap(LargeSieve, largewords * sizeof(u_int32_t));
+	else
+		free(LargeSieve);
+	free(MediumPrimes);
+	free(WheelSieve);
 	free(SmallSieve);
 	free(TinySieve);
 
@@ -468,6 +743,20 @@ write_checkpoint(char *cpfile, u_int32_t lineno)
 		    strerror(errno));
 }
 
+/*
+ * Record that line lineno and every line before it have been screened and
+ * their results written to out; a resumed run starts after it.  Serial
+ * and parallel screening checkpoint at the same points.
+ */
+static void
+screen_checkpoint(FILE *out, char *cpfile, unsigned long lineno)
+{
+	if (cpfile == NULL)
+		return;
+	fflush(out);
+	write_checkpoint(cpfile, lineno);
+}
+
 static unsigned long
 read_checkpoint(char *cpfile)
 {
@@ -485,30 +774,198 @@ read_checkpoint(char *cpfile)
 }
 
 /*
- * perform a Miller-Rabin primality test
- * on the list of candidates
+ * Outcome of screening a single candidate line
+ */
+#define SCREEN_SKIP	0	/* comment, unusable or unwanted candidate */
+#define SCREEN_FAIL	1	/* possible candidate that is not a safe prime */
+#define SCREEN_SAFE	2	/* safe prime, p holds the modulus */
+
+struct screen_result {
+	u_int32_t tests, tries, size, generator;
+};
+
+/*
+ * perform a Miller-Rabin primality test on a single candidate line
  * (checking both q and p)
- * The result is a list of so-call "safe" primes
  */
-int
-prime_test(FILE *in, FILE *out, u_int32_t trials, u_int32_t generator_wanted,
-    char *checkpoint_file, unsigned long start_lineno, unsigned long num_lines)
+static int
+screen_line(char *lp, u_int32_t count_in, u_int32_t trials,
+    u_int32_t generator_wanted, BIGNUM *p, BIGNUM *q, BN_CTX *ctx,
+    struct screen_result *sr)
 {
-	BIGNUM *q, *p, *a;
-	BN_CTX *ctx;
-	char *cp, *lp;
-	u_int32_t count_in = 0, count_out = 0, count_possible = 0;
+	BIGNUM *a;
+	char *cp;
 	u_int32_t generator_known, in_tests, in_tries, in_type, in_size;
-	unsigned long last_processed = 0, end_lineno;
-	time_t time_start, time_stop;
-	int res;
 
-	if (trials < TRIAL_MINIMUM) {
-		error("Minimum primality trials is %d", TRIAL_MINIMUM);
-		return (-1);
+	if (strlen(lp) < 14 || *lp == '!' || *lp == '#') {
+		debug2("%10u: comment or short line", count_in);
+		return SCREEN_SKIP;
 	}
 
-	time(&time_start);
+	/* XXX - fragile parser */
+	/* time */
+	cp = &lp[14];	/* (skip) */
+
+	/* type */
+	in_type = strtoul(cp, &cp, 10);
+
+	/* tests */
+	in_tests = strtoul(cp, &cp, 10);
+
+	if (in_tests & MODULI_TESTS_COMPOSITE) {
+		debug2("%10u: known composite", count_in);
+		return SCREEN_SKIP;
+	}
+
+	/* tries */
+	in_tries = strtoul(cp, &cp, 10);
+
+	/* size (most significant bit) */
+	in_size = strtoul(cp, &cp, 10);
+
+	/* generator (hex) */
+	generator_known = strtoul(cp, &cp, 16);
+
+	/* Skip white space */
+	cp += strspn(cp, " ");
+
+	/* modulus (hex) */
+	switch (in_type) {
+	case MODULI_TYPE_SOPHIE_GERMAIN:
+		debug2("%10u: (%u) Sophie-Germain", count_in, in_type);
+		a = q;
+		if (BN_hex2bn(&a, cp) == 0)
+			fatal("BN_hex2bn failed");
+		/* p = 2*q + 1 */
+		if (BN_lshift(p, q, 1) == 0)
+			fatal("BN_lshift failed");
+		if (BN_add_word(p, 1) == 0)
+			fatal("BN_add_word failed");
+		in_size += 1;
+		generator_known = 0;
+		break;
+	case MODULI_TYPE_UNSTRUCTURED:
+	case MODULI_TYPE_SAFE:
+	case MODULI_TYPE_SCHNORR:
+	case MODULI_TYPE_STRONG:
+	case MODULI_TYPE_UNKNOWN:
+		debug2("%10u: (%u)", count_in, in_type);
+		a = p;
+		if (BN_hex2bn(&a, cp) == 0)
+			fatal("BN_hex2bn failed");
+		/* q = (p-1) / 2 */
+		if (BN_rshift(q, p, 1) == 0)
+			fatal("BN_rshift failed");
+		break;
+	default:
+		debug2("Unknown prime type");
+		break;
+	}
+
+	/*
+	 * due to earlier inconsistencies in interpretation, check
+	 * the proposed bit size.
+	 */
+	if ((u_int32_t)BN_num_bits(p) != (in_size + 1)) {
+		debug2("%10u: bit size %u mismatch", count_in, in_size);
+		return SCREEN_SKIP;
+	}
+	if (in_size < QSIZE_MINIMUM) {
+		debug2("%10u: bit size %u too short", count_in, in_size);
+		return SCREEN_SKIP;
+	}
+
+	if (in_tests & MODULI_TESTS_MILLER_RABIN)
+		in_tries += trials;
+	else
+		in_tries = trials;
+
+	/*
+	 * guess unknown generator
+	 */
+	if (generator_known == 0) {
+		if (BN_mod_word(p, 24) == 11)
+			generator_known = 2;
+		else if (BN_mod_word(p, 12) == 5)
+			generator_known = 3;
+		else {
+			u_int32_t r = BN_mod_word(p, 10);
+
+			if (r == 3 || r == 7)
+				generator_known = 5;
+		}
+	}
+	/*
+	 * skip tests when desired generator doesn't match
+	 */
+	if (generator_wanted > 0 &&
+	    generator_wanted != generator_known) {
+		debug2("%10u: generator %d != %d",
+		    count_in, generator_known, generator_wanted);
+		return SCREEN_SKIP;
+	}
+
+	/*
+	 * Primes with no known generator are useless for DH, so
+	 * skip those.
+	 */
+	if (generator_known == 0) {
+		debug2("%10u: no known generator", count_in);
+		return SCREEN_SKIP;
+	}
+
+	/*
+	 * The (1/4)^N performance bound on Miller-Rabin is
+	 * extremely pessimistic, so don't spend a lot of time
+	 * really verifying that q is prime until after we know
+	 * that p is also prime. A single pass will weed out the
+	 * vast majority of composite q's.
+	 */
+	if (BN_is_prime_ex(q, 1, ctx, NULL) <= 0) {
+		debug("%10u: q failed first possible prime test",
+		    count_in);
+		return SCREEN_FAIL;
+	}
+
+	/*
+	 * q is possibly prime, so go ahead and really make sure
+	 * that p is prime. If it is, then we can go back and do
+	 * the same for q. If p is composite, chances are that
+	 * will show up on the first Rabin-Miller iteration so it
+	 * doesn't hurt to specify a high iteration count.
+	 */
+	if (!BN_is_prime_ex(p, trials, ctx, NULL)) {
+		debug("%10u: p is not prime", count_in);
+		return SCREEN_FAIL;
+	}
+	debug("%10u: p is almost certainly prime", count_in);
+
+	/* recheck q more rigorously */
+	if (!BN_is_prime_ex(q, trials - 1, ctx, NULL)) {
+		debug("%10u: q is not prime", count_in);
+		return SCREEN_FAIL;
+	}
+	debug("%10u: q is almost certainly prime", count_in);
+
+	sr->tests = in_tests | MODULI_TESTS_MILLER_RABIN;
+	sr->tries = in_tries;
+	sr->size = in_size;
+	sr->generator = generator_known;
+	return SCREEN_SAFE;
+}
+
+static int
+screen_serial(FILE *in, FILE *out, u_int32_t trials,
+    u_int32_t generator_wanted, char *checkpoint_file,
+    unsigned long last_processed, unsigned long end_lineno,
+    u_int32_t *count_possible, u_int32_t *count_out)
+{
+	BIGNUM *q, *p;
+	BN_CTX *ctx;
+	struct screen_result sr;
+	char *lp;
+	u_int32_t count_in = 0;
+	int res = 0;
 
 	if ((p = BN_new()) == NULL)
 		fatal("BN_new failed");
@@ -517,198 +974,369 @@ prime_test(FILE *in, FILE *out, u_int32_t trials, u_int32_t generator_wanted,
 	if ((ctx = BN_CTX_new()) == NULL)
 		fatal("BN_CTX_new failed");
 
-	debug2("%.24s Final %u Miller-Rabin trials (%x generator)",
-	    ctime(&time_start), trials, generator_wanted);
-
-	if (checkpoint_file != NULL)
-		last_processed = read_checkpoint(checkpoint_file);
-	if (start_lineno > last_processed)
-		last_processed = start_lineno;
-	if (num_lines == 0)
-		end_lineno = ULONG_MAX;
-	else
-		end_lineno = last_processed + num_lines;
-	debug2("process line %lu to line %lu", last_processed, end_lineno);
-
-	res = 0;
 	lp = xmalloc(QLINESIZE + 1);
 	while (fgets(lp, QLINESIZE + 1, in) != NULL && count_in < end_lineno) {
 		count_in++;
-		if (checkpoint_file != NULL) {
-			if (count_in <= last_processed) {
-				debug3("skipping line %u, before checkpoint",
-				    count_in);
-				continue;
-			}
-			write_checkpoint(checkpoint_file, count_in);
-		}
-		if (strlen(lp) < 14 || *lp == '!' || *lp == '#') {
-			debug2("%10u: comment or short line", count_in);
-			continue;
-		}
-
-		/* XXX - fragile parser */
-		/* time */
-		cp = &lp[14];	/* (skip) */
-
-		/* type */
-		in_type = strtoul(cp, &cp, 10);
-
-		/* tests */
-		in_tests = strtoul(cp, &cp, 10);
-
-		if (in_tests & MODULI_TESTS_COMPOSITE) {
-			debug2("%10u: known composite", count_in);
+		if (checkpoint_file != NULL && count_in <= last_processed) {
+			debug3("skipping line %u, before checkpoint",
+			    count_in);
 			continue;
 		}
 
-		/* tries */
-		in_tries = strtoul(cp, &cp, 10);
-
-		/* size (most significant bit) */
-		in_size = strtoul(cp, &cp, 10);
-
-		/* generator (hex) */
-		generator_known = strtoul(cp, &cp, 16);
-
-		/* Skip white space */
-		cp += strspn(cp, " ");
-
-		/* modulus (hex) */
-		switch (in_type) {
-		case MODULI_TYPE_SOPHIE_GERMAIN:
-			debug2("%10u: (%u) Sophie-Germain", count_in, in_type);
-			a = q;
-			if (BN_hex2bn(&a, cp) == 0)
-				fatal("BN_hex2bn failed");
-			/* p = 2*q + 1 */
-			if (BN_lshift(p, q, 1) == 0)
-				fatal("BN_lshift failed");
-			if (BN_add_word(p, 1) == 0)
-				fatal("BN_add_word failed");
-			in_size += 1;
-			generator_known = 0;
+		switch (screen_line(lp, count_in, trials, generator_wanted,
+		    p, q, ctx, &sr)) {
+		case SCREEN_SKIP:
 			break;
-		case MODULI_TYPE_UNSTRUCTURED:
-		case MODULI_TYPE_SAFE:
-		case MODULI_TYPE_SCHNORR:
-		case MODULI_TYPE_STRONG:
-		case MODULI_TYPE_UNKNOWN:
-			debug2("%10u: (%u)", count_in, in_type);
-			a = p;
-			if (BN_hex2bn(&a, cp) == 0)
-				fatal("BN_hex2bn failed");
-			/* q = (p-1) / 2 */
-			if (BN_rshift(q, p, 1) == 0)
-				fatal("BN_rshift failed");
+		case SCREEN_FAIL:
+			(*count_possible)++;
 			break;
 		default:
-			debug2("Unknown prime type");
+			(*count_possible)++;
+			if (qfileout(out, MODULI_TYPE_SAFE, sr.tests, sr.tries,
+			    sr.size, sr.generator, p)) {
+				res = -1;
+				break;
+			}
+			(*count_out)++;
 			break;
 		}
+		if (res != 0)
+			break;
+		screen_checkpoint(out, checkpoint_file, count_in);
+	}
 
-		/*
-		 * due to earlier inconsistencies in interpretation, check
-		 * the proposed bit size.
-		 */
-		if ((u_int32_t)BN_num_bits(p) != (in_size + 1)) {
-			debug2("%10u: bit size %u mismatch", count_in, in_size);
-			continue;
-		}
-		if (in_size < QSIZE_MINIMUM) {
-			debug2("%10u: bit size %u too short", count_in, in_size);
-			continue;
-		}
+	free(lp);
+	BN_free(p);
+	BN_free(q);
+	BN_CTX_free(ctx);
 
-		if (in_tests & MODULI_TESTS_MILLER_RABIN)
-			in_tries += trials;
-		else
-			in_tries = trials;
+	return (res);
+}
 
-		/*
-		 * guess unknown generator
-		 */
-		if (generator_known == 0) {
-			if (BN_mod_word(p, 24) == 11)
-				generator_known = 2;
-			else if (BN_mod_word(p, 12) == 5)
-				generator_known = 3;
-			else {
-				u_int32_t r = BN_mod_word(p, 10);
-
-				if (r == 3 || r == 7)
-					generator_known = 5;
+/*
+ * Parallel screening: candidate lines are handed to worker processes
+ * one at a time, results are collected in a window indexed by line
+ * number and emitted strictly in input order, so that the output and
+ * the checkpoints are identical to a serial run.
+ */
+
+/* Number of lines each worker may run ahead of the oldest pending line */
+#define SCREEN_WINDOW	16
+
+struct screen_worker {
+	pid_t	pid;
+	int	fd_job;			/* parent -> worker */
+	int	fd_result;		/* worker -> parent */
+	unsigned long lineno;		/* line being screened, 0 if idle */
+};
+
+struct screen_slot {
+	int	done;
+	int	status;
+	struct screen_result sr;
+	char	*modulus;		/* hex, SCREEN_SAFE only */
+};
+
+/* Simple length-prefixed framing for the worker pipes */
+static int
+screen_msg_send(int fd, const char *msg, size_t len)
+{
+	u_char lenbuf[4];
+
+	put_u32(lenbuf, len);
+	if (atomicio(vwrite, fd, lenbuf, 4) != 4 ||
+	    atomicio(vwrite, fd, (char *)msg, len) != len)
+		return -1;
+	return 0;
+}
+
+static int
+screen_msg_recv(int fd, char *msg, size_t maxlen)
+{
+	u_char lenbuf[4];
+	size_t len;
+
+	if (atomicio(read, fd, lenbuf, 4) != 4)
+		return -1;
+	if ((len = get_u32(lenbuf)) >= maxlen)
+		return -1;
+	if (atomicio(read, fd, msg, len) != len)
+		return -1;
+	msg[len] = '\0';
+	return 0;
+}
+
+static void
+screen_worker_main(int fd_job, int fd_result, u_int32_t trials,
+    u_int32_t generator_wanted)
+{
+	BIGNUM *q, *p;
+	BN_CTX *ctx;
+	struct screen_result sr;
+	char *job, *res, *cp, *hex;
+	unsigned long lineno;
+	int status;
+
+	if ((p = BN_new()) == NULL || (q = BN_new()) == NULL)
+		fatal("BN_new failed");
+	if ((ctx = BN_CTX_new()) == NULL)
+		fatal("BN_CTX_new failed");
+	job = xmalloc(QLINESIZE + 32);
+	res = xmalloc(QLINESIZE + 32);
+
+	while (screen_msg_recv(fd_job, job, QLINESIZE + 32) == 0) {
+		/* "lineno candidate-line" */
+		lineno = strtoul(job, &cp, 10);
+		if (*cp++ != ' ')
+			fatal("%s: malformed job", __func__);
+		status = screen_line(cp, lineno, trials, generator_wanted,
+		    p, q, ctx, &sr);
+		if (status == SCREEN_SAFE) {
+			if ((hex = BN_bn2hex(p)) == NULL)
+				fatal("BN_bn2hex failed");
+			snprintf(res, QLINESIZE + 32, "%lu %d %u %u %u %x %s",
+			    lineno, status, sr.tests, sr.tries, sr.size,
+			    sr.generator, hex);
+			OPENSSL_free(hex);
+		} else
+			snprintf(res, QLINESIZE + 32, "%lu %d", lineno, status);
+		if (screen_msg_send(fd_result, res, strlen(res)) != 0)
+			fatal("%s: write: %s", __func__, strerror(errno));
+	}
+	_exit(0);
+}
+
+static void
+screen_workers_start(FILE *in, FILE *out, struct screen_worker *w,
+    u_int32_t nworkers, u_int32_t trials, u_int32_t generator_wanted)
+{
+	int job[2], result[2];
+	u_int32_t i, j;
+
+	for (i = 0; i < nworkers; i++) {
+		if (pipe(job) == -1 || pipe(result) == -1)
+			fatal("pipe: %s", strerror(errno));
+		switch ((w[i].pid = fork())) {
+		case -1:
+			fatal("fork: %s", strerror(errno));
+		case 0:
+			/* don't keep our siblings' pipes open */
+			for (j = 0; j < i; j++) {
+				close(w[j].fd_job);
+				close(w[j].fd_result);
 			}
+			close(job[1]);
+			close(result[0]);
+			worker_detach_stdio(in, out);
+			screen_worker_main(job[0], result[1], trials,
+			    generator_wanted);
+			/* NOTREACHED */
+		default:
+			close(job[0]);
+			close(result[1]);
+			w[i].fd_job = job[1];
+			w[i].fd_result = result[0];
+			w[i].lineno = 0;
+			break;
 		}
-		/*
-		 * skip tests when desired generator doesn't match
-		 */
-		if (generator_wanted > 0 &&
-		    generator_wanted != generator_known) {
-			debug2("%10u: generator %d != %d",
-			    count_in, generator_known, generator_wanted);
-			continue;
-		}
+	}
+}
 
-		/*
-		 * Primes with no known generator are useless for DH, so
-		 * skip those.
-		 */
-		if (generator_known == 0) {
-			debug2("%10u: no known generator", count_in);
-			continue;
-		}
+static void
+screen_workers_stop(struct screen_worker *w, u_int32_t nworkers, int abort)
+{
+	u_int32_t i;
 
-		count_possible++;
+	for (i = 0; i < nworkers; i++) {
+		close(w[i].fd_job);
+		close(w[i].fd_result);
+		if (abort)
+			kill(w[i].pid, SIGTERM);
+	}
+	for (i = 0; i < nworkers; i++) {
+		while (waitpid(w[i].pid, NULL, 0) == -1 && errno == EINTR)
+			;
+	}
+}
 
-		/*
-		 * The (1/4)^N performance bound on Miller-Rabin is
-		 * extremely pessimistic, so don't spend a lot of time
-		 * really verifying that q is prime until after we know
-		 * that p is also prime. A single pass will weed out the
-		 * vast majority of composite q's.
-		 */
-		if (BN_is_prime_ex(q, 1, ctx, NULL) <= 0) {
-			debug("%10u: q failed first possible prime test",
+static int
+screen_parallel(FILE *in, FILE *out, u_int32_t trials,
+    u_int32_t generator_wanted, char *checkpoint_file,
+    unsigned long last_processed, unsigned long end_lineno,
+    u_int32_t nworkers, u_int32_t *count_possible, u_int32_t *count_out)
+{
+	struct screen_worker *w;
+	struct screen_slot *slots, *s;
+	struct pollfd *pfd;
+	BIGNUM *p = NULL;
+	char *lp, *job, *cp;
+	unsigned long count_in = 0, lineno, next_emit, window;
+	u_int32_t i, n, inflight = 0;
+	int eof = 0, res = 0;
+
+	window = (unsigned long)nworkers * SCREEN_WINDOW;
+	w = xcalloc(nworkers, sizeof(*w));
+	pfd = xcalloc(nworkers, sizeof(*pfd));
+	slots = xcalloc(window, sizeof(*slots));
+	lp = xmalloc(QLINESIZE + 1);
+	job = xmalloc(QLINESIZE + 32);
+
+	/* skip to the checkpoint here, workers only see new lines */
+	if (checkpoint_file != NULL) {
+		while (count_in < last_processed &&
+		    fgets(lp, QLINESIZE + 1, in) != NULL) {
+			count_in++;
+			debug3("skipping line %lu, before checkpoint",
 			    count_in);
-			continue;
 		}
+	}
+	next_emit = count_in + 1;
 
-		/*
-		 * q is possibly prime, so go ahead and really make sure
-		 * that p is prime. If it is, then we can go back and do
-		 * the same for q. If p is composite, chances are that
-		 * will show up on the first Rabin-Miller iteration so it
-		 * doesn't hurt to specify a high iteration count.
-		 */
-		if (!BN_is_prime_ex(p, trials, ctx, NULL)) {
-			debug("%10u: p is not prime", count_in);
-			continue;
+	fflush(out);
+	screen_workers_start(in, out, w, nworkers, trials, generator_wanted);
+
+	for (;;) {
+		/* hand out lines to idle workers */
+		for (i = 0; i < nworkers && !eof; i++) {
+			if (w[i].lineno != 0)
+				continue;
+			if (count_in + 1 - next_emit >= window)
+				break;
+			if (count_in >= end_lineno ||
+			    fgets(lp, QLINESIZE + 1, in) == NULL) {
+				eof = 1;
+				break;
+			}
+			count_in++;
+			n = snprintf(job, QLINESIZE + 32, "%lu %s",
+			    count_in, lp);
+			if (screen_msg_send(w[i].fd_job, job, n) != 0)
+				fatal("%s: write: %s", __func__,
+				    strerror(errno));
+			w[i].lineno = count_in;
+			inflight++;
 		}
-		debug("%10u: p is almost certainly prime", count_in);
+		if (inflight == 0)
+			break;
 
-		/* recheck q more rigorously */
-		if (!BN_is_prime_ex(q, trials - 1, ctx, NULL)) {
-			debug("%10u: q is not prime", count_in);
-			continue;
+		/* wait for results */
+		for (i = 0; i < nworkers; i++) {
+			pfd[i].fd = w[i].lineno != 0 ? w[i].fd_result : -1;
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+		if (poll(pfd, nworkers, INFTIM) == -1) {
+			if (errno == EINTR)
+				continue;
+			fatal("%s: poll: %s", __func__, strerror(errno));
+		}
+		for (i = 0; i < nworkers; i++) {
+			if (pfd[i].revents == 0)
+				continue;
+			if (screen_msg_recv(w[i].fd_result, job,
+			    QLINESIZE + 32) != 0)
+				fatal("%s: worker %ld failed", __func__,
+				    (long)w[i].pid);
+			lineno = strtoul(job, &cp, 10);
+			if (lineno != w[i].lineno)
+				fatal("%s: unexpected result for line %lu",
+				    __func__, lineno);
+			s = &slots[lineno % window];
+			s->status = strtol(cp, &cp, 10);
+			if (s->status == SCREEN_SAFE) {
+				s->sr.tests = strtoul(cp, &cp, 10);
+				s->sr.tries = strtoul(cp, &cp, 10);
+				s->sr.size = strtoul(cp, &cp, 10);
+				s->sr.generator = strtoul(cp, &cp, 16);
+				cp += strspn(cp, " ");
+				s->modulus = xstrdup(cp);
+			}
+			s->done = 1;
+			w[i].lineno = 0;
+			inflight--;
 		}
-		debug("%10u: q is almost certainly prime", count_in);
 
-		if (qfileout(out, MODULI_TYPE_SAFE,
-		    in_tests | MODULI_TESTS_MILLER_RABIN,
-		    in_tries, in_size, generator_known, p)) {
-			res = -1;
-			break;
+		/* emit finished lines in input order */
+		while ((s = &slots[next_emit % window])->done) {
+			if (s->status != SCREEN_SKIP)
+				(*count_possible)++;
+			if (s->status == SCREEN_SAFE) {
+				if (BN_hex2bn(&p, s->modulus) == 0)
+					fatal("BN_hex2bn failed");
+				if (qfileout(out, MODULI_TYPE_SAFE,
+				    s->sr.tests, s->sr.tries, s->sr.size,
+				    s->sr.generator, p)) {
+					res = -1;
+					goto out;
+				}
+				(*count_out)++;
+				free(s->modulus);
+			}
+			screen_checkpoint(out, checkpoint_file, next_emit);
+			memset(s, 0, sizeof(*s));
+			next_emit++;
 		}
+	}
+ out:
+	screen_workers_stop(w, nworkers, res != 0);
+	for (lineno = 0; lineno < window; lineno++)
+		free(slots[lineno].modulus);
+	if (p != NULL)
+		BN_free(p);
+	free(slots);
+	free(pfd);
+	free(w);
+	free(job);
+	free(lp);
+	return res;
+}
+
+/*
+ * perform a Miller-Rabin primality test
+ * on the list of candidates
+ * (checking both q and p)
+ * The result is a list of so-call "safe" primes
+ */
+int
+prime_test(FILE *in, FILE *out, u_int32_t trials, u_int32_t generator_wanted,
+    char *checkpoint_file, unsigned long start_lineno, unsigned long num_lines,
+    u_int32_t nworkers)
+{
+	u_int32_t count_out = 0, count_possible = 0;
+	unsigned long last_processed = 0, end_lineno;
+	time_t time_start, time_stop;
+	int res;
 
-		count_out++;
+	if (trials < TRIAL_MINIMUM) {
+		error("Minimum primality trials is %d", TRIAL_MINIMUM);
+		return (-1);
 	}
 
+	time(&time_start);
+
+	debug2("%.24s Final %u Miller-Rabin trials (%x generator)",
+	    ctime(&time_start), trials, generator_wanted);
+
+	if (checkpoint_file != NULL)
+		last_processed = read_checkpoint(checkpoint_file);
+	if (start_lineno > last_processed)
+		last_processed = start_lineno;
+	if (num_lines == 0)
+		end_lineno = ULONG_MAX;
+	else
+		end_lineno = last_processed + num_lines;
+	debug2("process line %lu to line %lu", last_processed, end_lineno);
+
+	if (nworkers > 1)
+		res = screen_parallel(in, out, trials, generator_wanted,
+		    checkpoint_file, last_processed, end_lineno, nworkers,
+		    &count_possible, &count_out);
+	else
+		res = screen_serial(in, out, trials, generator_wanted,
+		    checkpoint_file, last_processed, end_lineno,
+		    &count_possible, &count_out);
+
 	time(&time_stop);
-	free(lp);
-	BN_free(p);
-	BN_free(q);
-	BN_CTX_free(ctx);
 
 	if (checkpoint_file != NULL)
 		unlink(checkpoint_file);
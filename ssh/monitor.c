@@ -104,6 +104,7 @@ int mm_answer_skeyquery(int, struct sshbuf *);
 int mm_answer_skeyrespond(int, struct sshbuf *);
 int mm_answer_keyallowed(int, struct sshbuf *);
 int mm_answer_keyverify(int, struct sshbuf *);
+int mm_answer_keyallowverify(int, struct sshbuf *);
 int mm_answer_pty(int, struct sshbuf *);
 int mm_answer_pty_cleanup(int, struct sshbuf *);
 int mm_answer_term(int, struct sshbuf *);
@@ -168,6 +169,7 @@ struct mon_table mon_dispatch_proto20[] = {
     {MONITOR_REQ_BSDAUTHRESPOND, MON_AUTH, mm_answer_bsdauthrespond},
     {MONITOR_REQ_KEYALLOWED, MON_ISAUTH, mm_answer_keyallowed},
     {MONITOR_REQ_KEYVERIFY, MON_AUTH, mm_answer_keyverify},
+    {MONITOR_REQ_KEYALLOWVERIFY, MON_AUTH, mm_answer_keyallowverify},
 #ifdef GSSAPI
     {MONITOR_REQ_GSSSETUP, MON_ISAUTH, mm_answer_gss_setup_ctx},
     {MONITOR_REQ_GSSSTEP, MON_ISAUTH, mm_answer_gss_accept_ctx},
@@ -876,25 +878,23 @@ mm_answer_bsdauthrespond(int sock, struct sshbuf *m)
 	return (authok != 0);
 }
 
-int
-mm_answer_keyallowed(int sock, struct sshbuf *m)
+/*
+ * Decide whether a key may be used and remember it for a following
+ * signature check. Takes ownership of cuser, chost and blob.
+ */
+static int
+monitor_key_allowed(enum mm_keytype type, char *cuser, char *chost,
+    u_char *blob, size_t bloblen, int log_failure)
 {
 	struct sshkey *key;
-	char *cuser, *chost;
-	u_char *blob;
-	size_t bloblen;
-	enum mm_keytype type = 0;
 	int r, allowed = 0;
 
-	debug3("%s entering", __func__);
-
-	if ((r = sshbuf_get_u32(m, &type)) != 0 ||
-	    (r = sshbuf_get_cstring(m, &cuser, NULL)) != 0 ||
-	    (r = sshbuf_get_cstring(m, &chost, NULL)) != 0 ||
-	    (r = sshbuf_get_string(m, &blob, &bloblen)) != 0)
-		fatal("%s: buffer error: %s", __func__, ssh_err(r));
-
-	if ((r = sshkey_from_blob(blob, bloblen, &key)) != 0)
+	/* protocol 1 host keys are modified below and cannot be shared */
+	if (type == MM_RSAHOSTKEY)
+		r = sshkey_from_blob(blob, bloblen, &key);
+	else
+		r = sshkey_from_blob_cached(blob, bloblen, &key);
+	if (r != 0)
 		fatal("%s: cannot parse key: %s", __func__, ssh_err(r));
 
 	if ((compat20 && type == MM_RSAHOSTKEY) ||
@@ -949,7 +949,8 @@ mm_answer_keyallowed(int sock, struct sshbuf *m)
 		hostbased_chost = chost;
 	} else {
 		/* Log failed attempt */
-		auth_log(authctxt, 0, 0, auth_method, NULL);
+		if (log_failure)
+			auth_log(authctxt, 0, 0, auth_method, NULL);
 		free(blob);
 		free(cuser);
 		free(chost);
@@ -957,6 +958,27 @@ mm_answer_keyallowed(int sock, struct sshbuf *m)
 
 	debug3("%s: key %p is %s",
 	    __func__, key, allowed ? "allowed" : "not allowed");
+	return allowed;
+}
+
+int
+mm_answer_keyallowed(int sock, struct sshbuf *m)
+{
+	char *cuser, *chost;
+	u_char *blob;
+	size_t bloblen;
+	enum mm_keytype type = 0;
+	int r, allowed;
+
+	debug3("%s entering", __func__);
+
+	if ((r = sshbuf_get_u32(m, &type)) != 0 ||
+	    (r = sshbuf_get_cstring(m, &cuser, NULL)) != 0 ||
+	    (r = sshbuf_get_cstring(m, &chost, NULL)) != 0 ||
+	    (r = sshbuf_get_string(m, &blob, &bloblen)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+	allowed = monitor_key_allowed(type, cuser, chost, blob, bloblen, 1);
 
 	sshbuf_reset(m);
 	if ((r = sshbuf_put_u32(m, allowed)) != 0 ||
@@ -1115,24 +1137,22 @@ monitor_valid_hostbasedblob(u_char *data, u_int datalen, char *cuser,
 	return (fail == 0);
 }
 
-int
-mm_answer_keyverify(int sock, struct sshbuf *m)
+/*
+ * Check a signature by the key that was last allowed. Takes ownership of
+ * its arguments and returns the result of sshkey_verify().
+ */
+static int
+monitor_key_verify(u_char *blob, size_t bloblen, u_char *signature,
+    size_t signaturelen, u_char *data, size_t datalen)
 {
 	struct sshkey *key;
-	u_char *signature, *data, *blob;
-	size_t signaturelen, datalen, bloblen;
 	int r, ret, valid_data = 0;
 
-	if ((r = sshbuf_get_string(m, &blob, &bloblen)) != 0 ||
-	    (r = sshbuf_get_string(m, &signature, &signaturelen)) != 0 ||
-	    (r = sshbuf_get_string(m, &data, &datalen)) != 0)
-		fatal("%s: buffer error: %s", __func__, ssh_err(r));
-
 	if (hostbased_cuser == NULL || hostbased_chost == NULL ||
 	  !monitor_allowed_key(blob, bloblen))
 		fatal("%s: bad key, not previously allowed", __func__);
 
-	if ((r = sshkey_from_blob(blob, bloblen, &key)) != 0)
+	if ((r = sshkey_from_blob_cached(blob, bloblen, &key)) != 0)
 		fatal("%s: bad public key blob: %s", __func__, ssh_err(r));
 
 	switch (key_blobtype) {
@@ -1153,7 +1173,7 @@ mm_answer_keyverify(int sock, struct sshbuf *m)
 	ret = sshkey_verify(key, signature, signaturelen, data, datalen,
 	    active_state->compat);
 	debug3("%s: key %p signature %s",
-	    __func__, key, (r == 0) ? "verified" : "unverified");
+	    __func__, key, (ret == 0) ? "verified" : "unverified");
 
 	sshkey_free(key);
 	free(blob);
@@ -1163,6 +1183,23 @@ mm_answer_keyverify(int sock, struct sshbuf *m)
 	auth_method = key_blobtype == MM_USERKEY ? "publickey" : "hostbased";
 
 	monitor_reset_key_state();
+	return ret;
+}
+
+int
+mm_answer_keyverify(int sock, struct sshbuf *m)
+{
+	u_char *signature, *data, *blob;
+	size_t signaturelen, datalen, bloblen;
+	int r, ret;
+
+	if ((r = sshbuf_get_string(m, &blob, &bloblen)) != 0 ||
+	    (r = sshbuf_get_string(m, &signature, &signaturelen)) != 0 ||
+	    (r = sshbuf_get_string(m, &data, &datalen)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+	ret = monitor_key_verify(blob, bloblen, signature, signaturelen,
+	    data, datalen);
 
 	sshbuf_reset(m);
 	
@@ -1173,6 +1210,55 @@ mm_answer_keyverify(int sock, struct sshbuf *m)
 	return ret == 0;
 }
 
+/*
+ * A KEYALLOWED and KEYVERIFY in one round trip, for clients that send
+ * a signature without asking whether the key is acceptable first.
+ */
+int
+mm_answer_keyallowverify(int sock, struct sshbuf *m)
+{
+	char *cuser, *chost;
+	u_char *signature, *data, *blob, *vblob;
+	size_t signaturelen, datalen, bloblen;
+	enum mm_keytype type = 0;
+	int r, allowed, ret = SSH_ERR_KEY_NOT_FOUND;
+
+	debug3("%s entering", __func__);
+
+	if ((r = sshbuf_get_u32(m, &type)) != 0 ||
+	    (r = sshbuf_get_cstring(m, &cuser, NULL)) != 0 ||
+	    (r = sshbuf_get_cstring(m, &chost, NULL)) != 0 ||
+	    (r = sshbuf_get_string(m, &blob, &bloblen)) != 0 ||
+	    (r = sshbuf_get_string(m, &signature, &signaturelen)) != 0 ||
+	    (r = sshbuf_get_string(m, &data, &datalen)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	if (type != MM_USERKEY && type != MM_HOSTKEY)
+		fatal("%s: bad key type %d", __func__, type);
+
+	/* The saved copy is compared against by the verify step */
+	vblob = xmalloc(bloblen);
+	memcpy(vblob, blob, bloblen);
+	/* a refused key is logged by the monitor loop */
+	allowed = monitor_key_allowed(type, cuser, chost, blob, bloblen, 0);
+	if (allowed)
+		ret = monitor_key_verify(vblob, bloblen, signature,
+		    signaturelen, data, datalen);
+	else {
+		free(vblob);
+		free(signature);
+		free(data);
+	}
+
+	sshbuf_reset(m);
+	if ((r = sshbuf_put_u32(m, allowed)) != 0 ||
+	    (r = sshbuf_put_u32(m, forced_command != NULL)) != 0 ||
+	    (r = sshbuf_put_u32(m, ret)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	mm_request_send(sock, MONITOR_ANS_KEYALLOWVERIFY, m);
+
+	return allowed && ret == 0;
+}
+
 static void
 mm_record_login(Session *s, struct passwd *pw)
 {
@@ -1239,12 +1325,16 @@ mm_answer_pty(int sock, struct sshbuf *m)
 	if (dup2(s->ttyfd, 0) == -1)
 		fatal("%s: dup2", __func__);
 
-	mm_record_login(s, authctxt->pw);
+	/* save previous login details before writing new */
+	store_lastlog_message(authctxt->pw->pw_name, authctxt->pw->pw_uid);
 
-	/* Now we can close the file descriptor again */
-	close(0);
+	if (!options.defer_login_records) {
+		mm_record_login(s, authctxt->pw);
+		/* Now we can close the file descriptor again */
+		close(0);
+	}
 
-	/* send messages generated by record_login */
+	/* send messages generated by store_lastlog_message */
 	if ((r = sshbuf_put_stringb(m, loginmsg)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 	sshbuf_reset(loginmsg);
@@ -1255,6 +1345,12 @@ mm_answer_pty(int sock, struct sshbuf *m)
 	    mm_send_fd(sock, s->ttyfd) == -1)
 		fatal("%s: send fds failed", __func__);
 
+	/* The child has its pty; the tty is still on fd 0 for ttyslot */
+	if (options.defer_login_records) {
+		mm_record_login(s, authctxt->pw);
+		close(0);
+	}
+
 	/* make sure nothing uses fd 0 */
 	if ((fd0 = open(_PATH_DEVNULL, O_RDONLY)) < 0)
 		fatal("%s: open(/dev/null): %s", __func__, strerror(errno));
@@ -61,6 +61,7 @@ enum monitor_reqtype {
 	MONITOR_REQ_JPAKE_STEP2 = 56, MONITOR_ANS_JPAKE_STEP2 = 57,
 	MONITOR_REQ_JPAKE_KEY_CONFIRM = 58, MONITOR_ANS_JPAKE_KEY_CONFIRM = 59,
 	MONITOR_REQ_JPAKE_CHECK_CONFIRM = 60, MONITOR_ANS_JPAKE_CHECK_CONFIRM = 61,
+	MONITOR_REQ_KEYALLOWVERIFY = 62, MONITOR_ANS_KEYALLOWVERIFY = 63,
 };
 
 struct sshbuf;
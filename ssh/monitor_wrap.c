@@ -123,14 +123,18 @@ mm_request_send(int sock, enum monitor_reqtype type, struct sshbuf *m)
 {
 	size_t mlen = sshbuf_len(m);
 	u_char buf[5];
+	struct iovec iov[2];
 
 	debug3("%s entering: type %d", __func__, type);
 
 	put_u32(buf, mlen + 1);
 	buf[4] = (u_char) type;		/* 1st byte of payload is mesg-type */
-	if (atomicio(vwrite, sock, buf, sizeof(buf)) != sizeof(buf))
-		fatal("%s: write: %s", __func__, strerror(errno));
-	if (atomicio(vwrite, sock, (u_char *)sshbuf_ptr(m), mlen) != mlen)
+	/* One write, so the peer is woken once per message */
+	iov[0].iov_base = buf;
+	iov[0].iov_len = sizeof(buf);
+	iov[1].iov_base = (u_char *)sshbuf_ptr(m);
+	iov[1].iov_len = mlen;
+	if (atomiciov(writev, sock, iov, 2) != sizeof(buf) + mlen)
 		fatal("%s: write: %s", __func__, strerror(errno));
 }
 
@@ -465,6 +469,79 @@ mm_key_allowed(enum mm_keytype type, char *user, char *host,
 	return (allowed);
 }
 
+/*
+ * Ask whether a key is allowed and check its signature in a single
+ * request, saving a round trip to the monitor.
+ */
+static int
+mm_key_allowed_verify(enum mm_keytype type, const char *user,
+    const char *host, struct sshkey *key, const u_char *sig, size_t siglen,
+    const u_char *data, size_t datalen)
+{
+	struct sshbuf *m;
+	u_char *blob;
+	size_t len;
+	int r;
+	u_int allowed = 0, have_forced = 0, verified;
+
+	debug3("%s entering", __func__);
+
+	if (datalen > SSH_KEY_MAX_SIGN_DATA_SIZE)
+		fatal("%s: datalen too large: %zu", __func__, datalen);
+	if ((r = sshkey_to_blob(key, &blob, &len)) != 0) {
+		error("%s: key_to_blob: %s", __func__, ssh_err(r));
+		return (0);
+	}
+
+	if ((m = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_put_u32(m, type)) != 0 ||
+	    (r = sshbuf_put_cstring(m, user ? user : "")) != 0 ||
+	    (r = sshbuf_put_cstring(m, host ? host : "")) != 0 ||
+	    (r = sshbuf_put_string(m, blob, len)) != 0 ||
+	    (r = sshbuf_put_string(m, sig, siglen)) != 0 ||
+	    (r = sshbuf_put_string(m, data, datalen)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	free(blob);
+
+	mm_request_send(pmonitor->m_recvfd, MONITOR_REQ_KEYALLOWVERIFY, m);
+
+	debug3("%s: waiting for MONITOR_ANS_KEYALLOWVERIFY", __func__);
+	mm_request_receive_expect(pmonitor->m_recvfd,
+	    MONITOR_ANS_KEYALLOWVERIFY, m);
+
+	if ((r = sshbuf_get_u32(m, &allowed)) != 0 ||
+	    (r = sshbuf_get_u32(m, &have_forced)) != 0 ||
+	    (r = sshbuf_get_u32(m, &verified)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+	/* fake forced command */
+	auth_clear_options();
+	forced_command = have_forced ? xstrdup("true") : NULL;
+
+	sshbuf_free(m);
+
+	return (allowed && verified == 0);
+}
+
+int
+mm_user_key_allowed_verify(struct passwd *pw, struct sshkey *key,
+    const u_char *sig, size_t siglen, const u_char *data, size_t datalen,
+    u_int compat)
+{
+	return (mm_key_allowed_verify(MM_USERKEY, NULL, NULL, key,
+	    sig, siglen, data, datalen));
+}
+
+int
+mm_hostbased_key_allowed_verify(struct passwd *pw, const char *user,
+    char *host, struct sshkey *key, const u_char *sig, size_t siglen,
+    const u_char *data, size_t datalen, u_int compat)
+{
+	return (mm_key_allowed_verify(MM_HOSTKEY, user, host, key,
+	    sig, siglen, data, datalen));
+}
+
 /*
  * This key verify needs to send the key type along, because the
  * privileged parent makes the decision if the key is allowed
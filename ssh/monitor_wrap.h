@@ -48,6 +48,10 @@ int mm_auth_password(struct authctxt *, char *);
 int mm_key_allowed(enum mm_keytype, char *, char *, struct sshkey *);
 int mm_user_key_allowed(struct passwd *, struct sshkey *);
 int mm_hostbased_key_allowed(struct passwd *, char *, char *, struct sshkey *);
+int mm_user_key_allowed_verify(struct passwd *, struct sshkey *,
+    const u_char *, size_t, const u_char *, size_t, u_int);
+int mm_hostbased_key_allowed_verify(struct passwd *, const char *, char *,
+    struct sshkey *, const u_char *, size_t, const u_char *, size_t, u_int);
 int mm_auth_rhosts_rsa_key_allowed(struct passwd *, char *, char *,
     struct sshkey *);
 int mm_sshkey_verify(struct sshkey *, u_char *, size_t,
@@ -136,3 +136,12 @@
 
 /* for passwd change */
 #define _PATH_PASSWD_PROG		"/usr/bin/passwd"
+
+/* Output of AuthorizedKeysCommand shared between sshd processes */
+#define _PATH_SSH_KEYS_COMMAND_CACHE	"/var/db/sshd_keys_command"
+
+/* Group memberships of users shared between sshd processes */
+#define _PATH_SSH_GROUP_CACHE		"/var/db/sshd_groups"
+
+/* Reverse lookups of client addresses shared between sshd processes */
+#define _PATH_SSH_DNS_CACHE		"/var/db/sshd_dns"
@@ -0,0 +1,384 @@
+/* $OpenBSD$ */
+/*
+ * Cache of group lookups for sshd.
+ *
+ * With a directory service behind getgrouplist() and getgrgid(), resolving
+ * a user's groups can take far longer than the rest of a login. Group
+ * lists are kept for a configurable time, in memory for the last user and
+ * in a root-only directory, one file per user, so that later connections
+ * can use them; the files are removed when the server is restarted with
+ * SIGHUP. Password entries are not cached: sshd handles one connection
+ * per process, and sharing them would mean writing out password hashes.
+ * Only the fact that a user name is unknown is, which saves scans for
+ * common names from reaching the directory service on every attempt; it
+ * is kept for at most PWCACHE_UNKNOWN_TTL so that new users can log in
+ * soon after they are created.
+ *
+ * Placed in the public domain
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include "xmalloc.h"
+#include "log.h"
+#include "atomicio.h"
+#include "misc.h"
+#include "pathnames.h"
+#include "sshbuf.h"
+#include "err.h"
+#include "pwcache.h"
+
+#define PWCACHE_MAGIC		0x5353484752505301ULL	/* "SSHGRPS\1" */
+#define PWCACHE_UNKNOWN_MAGIC	0x53534855534e4b01ULL	/* "SSHUSNK\1" */
+#define PWCACHE_UNKNOWN_TTL	60
+#define PWCACHE_MAX_FILE	(256 * 1024)
+
+static u_int pwcache_ttl;
+
+/* The group list of the last user asked for */
+static struct {
+	u_char	 digest[SHA256_DIGEST_LENGTH];
+	char	**names;
+	int	 n;
+	time_t	 fetched;
+} grcache;
+
+/* Keep group lists for ttl seconds; 0 disables the cache */
+void
+pwcache_init(u_int ttl)
+{
+	pwcache_ttl = ttl;
+}
+
+static int
+pwcache_fresh(time_t fetched, time_t now, u_int ttl)
+{
+	return fetched <= now && (u_int64_t)(now - fetched) < ttl;
+}
+
+static void
+pwcache_digest(const char *user, gid_t base, u_char *digest)
+{
+	struct sshbuf *b;
+	int r;
+
+	if ((b = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_put_cstring(b, user)) != 0 ||
+	    (r = sshbuf_put_u32(b, (u_int32_t)base)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	SHA256(sshbuf_ptr(b), sshbuf_len(b), digest);
+	sshbuf_free(b);
+}
+
+/* Unknown users are keyed by name alone, which no group list key matches */
+static void
+pwcache_unknown_digest(const char *user, u_char *digest)
+{
+	struct sshbuf *b;
+	int r;
+
+	if ((b = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_put_cstring(b, user)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	SHA256(sshbuf_ptr(b), sshbuf_len(b), digest);
+	sshbuf_free(b);
+}
+
+static void
+pwcache_path(const u_char *digest, char *path, size_t len)
+{
+	size_t i, l;
+
+	l = strlcpy(path, _PATH_SSH_GROUP_CACHE "/", len);
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		l += snprintf(path + l, len - l, "%02x", digest[i]);
+}
+
+static void
+grcache_clear(void)
+{
+	int i;
+
+	for (i = 0; i < grcache.n; i++)
+		free(grcache.names[i]);
+	free(grcache.names);
+	grcache.names = NULL;
+	grcache.n = 0;
+	grcache.fetched = 0;
+}
+
+static void
+grcache_set(const u_char *digest, time_t fetched, char * const *names,
+    int n)
+{
+	int i;
+
+	grcache_clear();
+	memcpy(grcache.digest, digest, sizeof(grcache.digest));
+	grcache.names = xcalloc(n + 1, sizeof(*grcache.names));
+	for (i = 0; i < n; i++)
+		grcache.names[i] = xstrdup(names[i]);
+	grcache.n = n;
+	grcache.fetched = fetched;
+}
+
+/*
+ * Read the shared file for digest, if it is root-only and still fresh, and
+ * return its contents after the header in a new buffer.
+ */
+static struct sshbuf *
+pwcache_read(const u_char *digest, u_int64_t want_magic, time_t now,
+    u_int ttl, time_t *fetchedp)
+{
+	char path[sizeof(_PATH_SSH_GROUP_CACHE) + SHA256_DIGEST_LENGTH * 2 + 1];
+	struct sshbuf *b = NULL;
+	struct stat st;
+	u_int64_t magic, fetched;
+	u_char *p;
+	int fd;
+
+	pwcache_path(digest, path, sizeof(path));
+	if ((fd = open(path, O_RDONLY|O_NOFOLLOW|O_NONBLOCK)) == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    st.st_uid != 0 || (st.st_mode & 077) != 0 || st.st_nlink != 1 ||
+	    st.st_size > PWCACHE_MAX_FILE)
+		goto fail;
+	if ((b = sshbuf_new()) == NULL ||
+	    sshbuf_reserve(b, st.st_size, &p) != 0 ||
+	    atomicio(read, fd, p, st.st_size) != (size_t)st.st_size)
+		goto fail;
+	if (sshbuf_get_u64(b, &magic) != 0 ||
+	    sshbuf_get_u64(b, &fetched) != 0 || magic != want_magic ||
+	    sshbuf_len(b) < SHA256_DIGEST_LENGTH ||
+	    memcmp(sshbuf_ptr(b), digest, SHA256_DIGEST_LENGTH) != 0 ||
+	    sshbuf_consume(b, SHA256_DIGEST_LENGTH) != 0)
+		goto fail;
+	if (!pwcache_fresh((time_t)fetched, now, ttl))
+		goto fail;
+	close(fd);
+	*fetchedp = (time_t)fetched;
+	return b;
+ fail:
+	sshbuf_free(b);
+	close(fd);
+	return NULL;
+}
+
+/* Load the shared file for digest into grcache if it is still fresh */
+static int
+pwcache_load(const u_char *digest, time_t now, int max)
+{
+	struct sshbuf *b;
+	time_t fetched;
+	u_int32_t n = 0, i;
+	char **names = NULL;
+	int ret = -1;
+
+	if ((b = pwcache_read(digest, PWCACHE_MAGIC, now, pwcache_ttl,
+	    &fetched)) == NULL)
+		return -1;
+	if (sshbuf_get_u32(b, &n) != 0 || n > (u_int32_t)max)
+		goto out;
+	names = xcalloc(n + 1, sizeof(*names));
+	for (i = 0; i < n; i++) {
+		if (sshbuf_get_cstring(b, &names[i], NULL) != 0)
+			goto out;
+	}
+	if (sshbuf_len(b) != 0)
+		goto out;
+	grcache_set(digest, fetched, names, n);
+	ret = 0;
+ out:
+	if (names != NULL) {
+		for (i = 0; i < n && names[i] != NULL; i++)
+			free(names[i]);
+		free(names);
+	}
+	sshbuf_free(b);
+	return ret;
+}
+
+/* Share b, which starts with the header for digest, with later connections */
+static void
+pwcache_write(const u_char *digest, struct sshbuf *b)
+{
+	char path[sizeof(_PATH_SSH_GROUP_CACHE) + SHA256_DIGEST_LENGTH * 2 + 1];
+	char tmp[sizeof(path) + 11];
+	struct stat st;
+	int fd;
+
+	/* Only the privileged sshd may share its results */
+	if (geteuid() != 0)
+		return;
+	if (mkdir(_PATH_SSH_GROUP_CACHE, 0700) == -1 && errno != EEXIST) {
+		debug("%s: mkdir %s: %s", __func__, _PATH_SSH_GROUP_CACHE,
+		    strerror(errno));
+		return;
+	}
+	if (lstat(_PATH_SSH_GROUP_CACHE, &st) == -1 || !S_ISDIR(st.st_mode) ||
+	    st.st_uid != 0 || (st.st_mode & 077) != 0) {
+		error("%s: bad ownership or modes for directory %s",
+		    __func__, _PATH_SSH_GROUP_CACHE);
+		return;
+	}
+	pwcache_path(digest, path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1) {
+		debug("%s: mkstemp %s: %s", __func__, tmp, strerror(errno));
+		return;
+	}
+	if (atomicio(vwrite, fd, (void *)sshbuf_ptr(b),
+	    sshbuf_len(b)) != sshbuf_len(b) || close(fd) != 0 ||
+	    rename(tmp, path) == -1) {
+		debug("%s: write %s: %s", __func__, path, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+/*
+ * Copy the cached group names of user, whose primary group is base, to
+ * names. Returns their number, or -1 if the groups have to be looked up.
+ */
+int
+pwcache_groups_get(const char *user, gid_t base, char **names, int max)
+{
+	u_char digest[SHA256_DIGEST_LENGTH];
+	time_t now;
+	int i;
+
+	if (pwcache_ttl == 0)
+		return -1;
+	pwcache_digest(user, base, digest);
+	now = time(NULL);
+	if (grcache.names == NULL ||
+	    memcmp(grcache.digest, digest, sizeof(digest)) != 0 ||
+	    !pwcache_fresh(grcache.fetched, now, pwcache_ttl)) {
+		if (pwcache_load(digest, now, max) != 0)
+			return -1;
+	}
+	if (grcache.n > max)
+		return -1;
+	for (i = 0; i < grcache.n; i++)
+		names[i] = xstrdup(grcache.names[i]);
+	debug3("%s: %d cached groups for %s", __func__, grcache.n, user);
+	return grcache.n;
+}
+
+/* Remember the groups that were looked up for user */
+void
+pwcache_groups_put(const char *user, gid_t base, char * const *names, int n)
+{
+	u_char digest[SHA256_DIGEST_LENGTH];
+	struct sshbuf *b;
+	time_t now;
+	int i, r;
+
+	if (pwcache_ttl == 0)
+		return;
+	pwcache_digest(user, base, digest);
+	now = time(NULL);
+	grcache_set(digest, now, names, n);
+
+	if ((b = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_put_u64(b, PWCACHE_MAGIC)) != 0 ||
+	    (r = sshbuf_put_u64(b, (u_int64_t)now)) != 0 ||
+	    (r = sshbuf_put(b, digest, sizeof(digest))) != 0 ||
+	    (r = sshbuf_put_u32(b, n)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	for (i = 0; i < n; i++) {
+		if ((r = sshbuf_put_cstring(b, names[i])) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	}
+	pwcache_write(digest, b);
+	sshbuf_free(b);
+}
+
+static u_int
+pwcache_unknown_ttl(void)
+{
+	return MIN(pwcache_ttl, PWCACHE_UNKNOWN_TTL);
+}
+
+/* Returns 1 if user was recently found not to exist, 0 otherwise */
+int
+pwcache_user_unknown(const char *user)
+{
+	u_char digest[SHA256_DIGEST_LENGTH];
+	struct sshbuf *b;
+	time_t fetched;
+	int ret;
+
+	if (pwcache_ttl == 0)
+		return 0;
+	pwcache_unknown_digest(user, digest);
+	if ((b = pwcache_read(digest, PWCACHE_UNKNOWN_MAGIC, time(NULL),
+	    pwcache_unknown_ttl(), &fetched)) == NULL)
+		return 0;
+	ret = sshbuf_len(b) == 0;
+	sshbuf_free(b);
+	if (ret)
+		debug3("%s: %s cached as unknown", __func__, user);
+	return ret;
+}
+
+/* Remember that getpwnam() did not find user */
+void
+pwcache_user_unknown_put(const char *user)
+{
+	u_char digest[SHA256_DIGEST_LENGTH];
+	struct sshbuf *b;
+	int r;
+
+	if (pwcache_ttl == 0)
+		return;
+	pwcache_unknown_digest(user, digest);
+	if ((b = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_put_u64(b, PWCACHE_UNKNOWN_MAGIC)) != 0 ||
+	    (r = sshbuf_put_u64(b, (u_int64_t)time(NULL))) != 0 ||
+	    (r = sshbuf_put(b, digest, sizeof(digest))) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	pwcache_write(digest, b);
+	sshbuf_free(b);
+}
+
+/* Forget everything, including the files shared between processes */
+void
+pwcache_flush(void)
+{
+	char path[MAXPATHLEN];
+	struct dirent *dp;
+	DIR *dirp;
+
+	grcache_clear();
+
+	if ((dirp = opendir(_PATH_SSH_GROUP_CACHE)) == NULL)
+		return;
+	while ((dp = readdir(dirp)) != NULL) {
+		if (dp->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", _PATH_SSH_GROUP_CACHE,
+		    dp->d_name);
+		if (unlink(path) == -1)
+			debug("%s: unlink %s: %s", __func__, path,
+			    strerror(errno));
+	}
+	closedir(dirp);
+}
@@ -0,0 +1,16 @@
+/* $OpenBSD$ */
+/*
+ * Placed in the public domain
+ */
+
+#ifndef PWCACHE_H
+#define PWCACHE_H
+
+void		 pwcache_init(u_int);
+int		 pwcache_groups_get(const char *, gid_t, char **, int);
+void		 pwcache_groups_put(const char *, gid_t, char * const *, int);
+int		 pwcache_user_unknown(const char *);
+void		 pwcache_user_unknown_put(const char *);
+void		 pwcache_flush(void);
+
+#endif
@@ -22,9 +22,11 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <util.h>
@@ -41,6 +43,8 @@
 #include "misc.h"
 #include "kex.h"
 #include "mac.h"
+#include "sshbuf.h"
+#include "atomicio.h"
 
 /* Format of the configuration file:
 
@@ -128,7 +132,7 @@ typedef enum {
 	oAddressFamily, oGssAuthentication, oGssDelegateCreds,
 	oServerAliveInterval, oServerAliveCountMax, oIdentitiesOnly,
 	oSendEnv, oControlPath, oControlMaster, oControlPersist,
-	oHashKnownHosts,
+	oHashKnownHosts, oKnownHostsIndex, oConfigIndex,
 	oTunnel, oTunnelDevice, oLocalCommand, oPermitLocalCommand,
 	oVisualHostKey, oUseRoaming, oZeroKnowledgePasswordAuthentication,
 	oKexAlgorithms, oIPQoS, oRequestTTY, oIgnoreUnknown,
@@ -228,6 +232,8 @@ static struct {
 	{ "controlmaster", oControlMaster },
 	{ "controlpersist", oControlPersist },
 	{ "hashknownhosts", oHashKnownHosts },
+	{ "knownhostsindex", oKnownHostsIndex },
+	{ "configindex", oConfigIndex },
 	{ "tunnel", oTunnel },
 	{ "tunneldevice", oTunnelDevice },
 	{ "localcommand", oLocalCommand },
@@ -973,6 +979,14 @@ parse_int:
 		intptr = &options->hash_known_hosts;
 		goto parse_flag;
 
+	case oKnownHostsIndex:
+		intptr = &options->known_hosts_index;
+		goto parse_flag;
+
+	case oConfigIndex:
+		intptr = &options->config_index;
+		goto parse_flag;
+
 	case oTunnel:
 		intptr = &options->tun_open;
 		arg = strdelim(&s);
@@ -1088,10 +1102,371 @@ parse_int:
 }
 
 
+#define READCONF_INDEX_MAGIC	0x5353484346494458ULL	/* "SSHCFIDX" */
+#define READCONF_INDEX_VERSION	1
+#define READCONF_INDEX_SUFFIX	".idx"
+#define READCONF_INDEX_MAX	(16 * 1024 * 1024)
+
+/*
+ * Index of the Host blocks of a configuration file. The literal names on
+ * Host lines are kept in a sorted table; blocks with a wildcard pattern
+ * may match any host. Blocks that can't match are skipped entirely when
+ * the file is read with an index.
+ */
+struct readconf_block {
+	off_t		offset;		/* of the Host line */
+	u_int		linenum;
+};
+
+struct readconf_name {
+	char		*name;
+	u_int		block;
+};
+
+struct readconf_index {
+	struct stat	st;		/* of the indexed file */
+	struct readconf_block *blocks;
+	u_int		nblocks;
+	struct readconf_name *names;
+	u_int		nnames;
+	u_int		*wild;		/* blocks with wildcard patterns */
+	u_int		nwild;
+};
+
+static void
+readconf_index_free(struct readconf_index *idx)
+{
+	u_int i;
+
+	if (idx == NULL)
+		return;
+	for (i = 0; i < idx->nnames; i++)
+		free(idx->names[i].name);
+	free(idx->names);
+	free(idx->blocks);
+	free(idx->wild);
+	free(idx);
+}
+
+static int
+readconf_index_name_cmp(const void *a, const void *b)
+{
+	const struct readconf_name *na = a, *nb = b;
+	int r;
+
+	if ((r = strcmp(na->name, nb->name)) != 0)
+		return r;
+	if (na->block != nb->block)
+		return na->block < nb->block ? -1 : 1;
+	return 0;
+}
+
+static int
+readconf_index_u_int_cmp(const void *a, const void *b)
+{
+	u_int ua = *(const u_int *)a, ub = *(const u_int *)b;
+
+	if (ua != ub)
+		return ua < ub ? -1 : 1;
+	return 0;
+}
+
+/* Record line, which starts at offset, if it is a Host line */
+static void
+readconf_index_add_line(struct readconf_index *idx, const char *line,
+    off_t offset, int linenum)
+{
+	char *cp, *s, *arg;
+	u_int block;
+	int wild = 0;
+
+	cp = s = xstrdup(line);
+	if ((arg = strdelim(&s)) != NULL && *arg == '\0')
+		arg = strdelim(&s);
+	if (arg == NULL || strcasecmp(arg, "host") != 0) {
+		free(cp);
+		return;
+	}
+	block = idx->nblocks;
+	idx->blocks = xrealloc(idx->blocks, idx->nblocks + 1,
+	    sizeof(*idx->blocks));
+	idx->blocks[block].offset = offset;
+	idx->blocks[block].linenum = linenum;
+	idx->nblocks++;
+	while ((arg = strdelim(&s)) != NULL && *arg != '\0') {
+		/* Negated patterns can only stop a block from matching */
+		if (*arg == '!')
+			continue;
+		if (strpbrk(arg, "*?") != NULL) {
+			wild = 1;
+			continue;
+		}
+		idx->names = xrealloc(idx->names, idx->nnames + 1,
+		    sizeof(*idx->names));
+		idx->names[idx->nnames].name = xstrdup(arg);
+		idx->names[idx->nnames++].block = block;
+	}
+	if (wild) {
+		idx->wild = xrealloc(idx->wild, idx->nwild + 1,
+		    sizeof(*idx->wild));
+		idx->wild[idx->nwild++] = block;
+	}
+	free(cp);
+}
+
+static struct readconf_index *
+readconf_index_load(const char *filename, const struct stat *fst)
+{
+	struct readconf_index *idx = NULL;
+	struct sshbuf *b = NULL;
+	struct stat st;
+	char *ipath;
+	u_char *cp;
+	u_int64_t magic, dev, ino, size, mtime, offset;
+	u_int32_t version, nsec, linenum, block, i;
+	int fd, r;
+
+	xasprintf(&ipath, "%s%s", filename, READCONF_INDEX_SUFFIX);
+	fd = open(ipath, O_RDONLY|O_NOFOLLOW|O_NONBLOCK);
+	free(ipath);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    (st.st_uid != 0 && st.st_uid != getuid()) ||
+	    (st.st_mode & 022) != 0 || st.st_size > 1024 * 1024 * 1024)
+		goto out;
+	if ((b = sshbuf_new()) == NULL ||
+	    sshbuf_reserve(b, st.st_size, &cp) != 0 ||
+	    atomicio(read, fd, cp, st.st_size) != (size_t)st.st_size)
+		goto out;
+	if ((r = sshbuf_get_u64(b, &magic)) != 0 ||
+	    (r = sshbuf_get_u32(b, &version)) != 0 ||
+	    (r = sshbuf_get_u64(b, &dev)) != 0 ||
+	    (r = sshbuf_get_u64(b, &ino)) != 0 ||
+	    (r = sshbuf_get_u64(b, &mtime)) != 0 ||
+	    (r = sshbuf_get_u32(b, &nsec)) != 0 ||
+	    (r = sshbuf_get_u64(b, &size)) != 0)
+		goto out;
+	if (magic != READCONF_INDEX_MAGIC ||
+	    version != READCONF_INDEX_VERSION ||
+	    dev != (u_int64_t)fst->st_dev || ino != (u_int64_t)fst->st_ino ||
+	    mtime != (u_int64_t)fst->st_mtim.tv_sec ||
+	    nsec != (u_int32_t)fst->st_mtim.tv_nsec ||
+	    size != (u_int64_t)fst->st_size) {
+		debug3("%s: %s: stale index", __func__, filename);
+		goto out;
+	}
+	idx = xcalloc(1, sizeof(*idx));
+
+	if (sshbuf_get_u32(b, &idx->nblocks) != 0 ||
+	    idx->nblocks > READCONF_INDEX_MAX)
+		goto fail;
+	idx->blocks = xcalloc(idx->nblocks + 1, sizeof(*idx->blocks));
+	for (i = 0; i < idx->nblocks; i++) {
+		if (sshbuf_get_u64(b, &offset) != 0 ||
+		    sshbuf_get_u32(b, &linenum) != 0 || offset >= size ||
+		    (i > 0 && (offset <= (u_int64_t)idx->blocks[i - 1].offset ||
+		    linenum <= idx->blocks[i - 1].linenum)))
+			goto fail;
+		idx->blocks[i].offset = offset;
+		idx->blocks[i].linenum = linenum;
+	}
+
+	if (sshbuf_get_u32(b, &idx->nnames) != 0 ||
+	    idx->nnames > READCONF_INDEX_MAX)
+		goto fail;
+	idx->names = xcalloc(idx->nnames + 1, sizeof(*idx->names));
+	for (i = 0; i < idx->nnames; i++) {
+		if (sshbuf_get_cstring(b, &idx->names[i].name, NULL) != 0) {
+			idx->nnames = i;
+			goto fail;
+		}
+		if (sshbuf_get_u32(b, &block) != 0 || block >= idx->nblocks) {
+			idx->nnames = i + 1;
+			goto fail;
+		}
+		idx->names[i].block = block;
+		/* lookups depend on the sort order */
+		if (i > 0 && readconf_index_name_cmp(&idx->names[i - 1],
+		    &idx->names[i]) >= 0) {
+			idx->nnames = i + 1;
+			goto fail;
+		}
+	}
+
+	if (sshbuf_get_u32(b, &idx->nwild) != 0 ||
+	    idx->nwild > idx->nblocks)
+		goto fail;
+	idx->wild = xcalloc(idx->nwild + 1, sizeof(*idx->wild));
+	for (i = 0; i < idx->nwild; i++) {
+		if (sshbuf_get_u32(b, &idx->wild[i]) != 0 ||
+		    idx->wild[i] >= idx->nblocks ||
+		    (i > 0 && idx->wild[i] <= idx->wild[i - 1]))
+			goto fail;
+	}
+	if (sshbuf_len(b) != 0)
+		goto fail;
+	memcpy(&idx->st, fst, sizeof(idx->st));
+	debug3("%s: %s: loaded index of %u blocks", __func__, filename,
+	    idx->nblocks);
+	goto out;
+ fail:
+	debug("%s: %s: corrupt index", __func__, filename);
+	readconf_index_free(idx);
+	idx = NULL;
+ out:
+	close(fd);
+	sshbuf_free(b);
+	return idx;
+}
+
+static void
+readconf_index_save(const struct readconf_index *idx, const char *filename)
+{
+	struct sshbuf *b;
+	char *ipath = NULL, *tmp = NULL;
+	u_int i;
+	int fd, r;
+
+	if ((b = sshbuf_new()) == NULL)
+		return;
+	if ((r = sshbuf_put_u64(b, READCONF_INDEX_MAGIC)) != 0 ||
+	    (r = sshbuf_put_u32(b, READCONF_INDEX_VERSION)) != 0 ||
+	    (r = sshbuf_put_u64(b, idx->st.st_dev)) != 0 ||
+	    (r = sshbuf_put_u64(b, idx->st.st_ino)) != 0 ||
+	    (r = sshbuf_put_u64(b, idx->st.st_mtim.tv_sec)) != 0 ||
+	    (r = sshbuf_put_u32(b, idx->st.st_mtim.tv_nsec)) != 0 ||
+	    (r = sshbuf_put_u64(b, idx->st.st_size)) != 0 ||
+	    (r = sshbuf_put_u32(b, idx->nblocks)) != 0)
+		goto out;
+	for (i = 0; i < idx->nblocks; i++) {
+		if ((r = sshbuf_put_u64(b, idx->blocks[i].offset)) != 0 ||
+		    (r = sshbuf_put_u32(b, idx->blocks[i].linenum)) != 0)
+			goto out;
+	}
+	if ((r = sshbuf_put_u32(b, idx->nnames)) != 0)
+		goto out;
+	for (i = 0; i < idx->nnames; i++) {
+		if ((r = sshbuf_put_cstring(b, idx->names[i].name)) != 0 ||
+		    (r = sshbuf_put_u32(b, idx->names[i].block)) != 0)
+			goto out;
+	}
+	if ((r = sshbuf_put_u32(b, idx->nwild)) != 0)
+		goto out;
+	for (i = 0; i < idx->nwild; i++) {
+		if ((r = sshbuf_put_u32(b, idx->wild[i])) != 0)
+			goto out;
+	}
+	xasprintf(&ipath, "%s%s", filename, READCONF_INDEX_SUFFIX);
+	xasprintf(&tmp, "%s.XXXXXXXXXX", ipath);
+	if ((fd = mkstemp(tmp)) == -1) {
+		debug("%s: mkstemp %s: %s", __func__, tmp, strerror(errno));
+		goto out;
+	}
+	if (atomicio(vwrite, fd, (void *)sshbuf_ptr(b),
+	    sshbuf_len(b)) != sshbuf_len(b) || close(fd) != 0 ||
+	    rename(tmp, ipath) == -1) {
+		debug("%s: write %s: %s", __func__, ipath, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+	debug3("%s: saved index %s", __func__, ipath);
+ out:
+	free(ipath);
+	free(tmp);
+	sshbuf_free(b);
+}
+
+/*
+ * Returns the sorted, unique numbers of the blocks whose Host line may
+ * match host in *blocksp.
+ */
+static void
+readconf_index_lookup(const struct readconf_index *idx, const char *host,
+    u_int **blocksp, u_int *nblocksp)
+{
+	u_int *blocks, n = 0, i, j, lo, hi, mid;
+
+	blocks = xcalloc(idx->nwild + 1, sizeof(*blocks));
+	memcpy(blocks, idx->wild, idx->nwild * sizeof(*blocks));
+	n = idx->nwild;
+
+	/* Find the first name >= host */
+	for (lo = 0, hi = idx->nnames; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(idx->names[mid].name, host) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (i = lo; i < idx->nnames &&
+	    strcmp(idx->names[i].name, host) == 0; i++) {
+		blocks = xrealloc(blocks, n + 1, sizeof(*blocks));
+		blocks[n++] = idx->names[i].block;
+	}
+	if (n > 1) {
+		qsort(blocks, n, sizeof(*blocks), readconf_index_u_int_cmp);
+		for (i = 1, j = 0; i < n; i++) {
+			if (blocks[i] != blocks[j])
+				blocks[++j] = blocks[i];
+		}
+		n = j + 1;
+	}
+	*blocksp = blocks;
+	*nblocksp = n;
+}
+
+/* Process the lines of f from start up to end */
+static int
+read_config_range(FILE *f, off_t start, off_t end, int linenum,
+    const char *host, Options *options, const char *filename, int *activep,
+    int flags)
+{
+	char line[1024];
+	int bad_options = 0;
+
+	if (fseeko(f, start, SEEK_SET) == -1)
+		fatal("%s: seek: %s", filename, strerror(errno));
+	while (ftello(f) < end && fgets(line, sizeof(line), f)) {
+		linenum++;
+		if (process_config_line(options, host, line, filename, linenum,
+		    activep, flags & SSHCONF_USERCONF) != 0)
+			bad_options++;
+	}
+	return bad_options;
+}
+
+/* Process the blocks of f whose Host line may match host */
+static int
+read_config_blocks(FILE *f, off_t size, const struct readconf_index *idx,
+    const char *host, Options *options, const char *filename, int *activep,
+    int flags)
+{
+	u_int *blocks, nblocks, i;
+	off_t offset, end;
+	int bad_options = 0;
+
+	readconf_index_lookup(idx, host, &blocks, &nblocks);
+	for (i = 0; i < nblocks; i++) {
+		offset = idx->blocks[blocks[i]].offset;
+		end = blocks[i] + 1 < idx->nblocks ?
+		    idx->blocks[blocks[i] + 1].offset : size;
+		bad_options += read_config_range(f, offset, end,
+		    idx->blocks[blocks[i]].linenum - 1, host, options,
+		    filename, activep, flags);
+	}
+	free(blocks);
+	return bad_options;
+}
+
 /*
  * Reads the config file and modifies the options accordingly.  Options
  * should already be initialized before this call.  This never returns if
  * there is an error.  If the file does not exist, this returns 0.
+ *
+ * If ConfigIndex is in effect by the first Host line and a current index
+ * of the file exists, only the blocks whose Host line may match are read
+ * from there on. The file was checked in full when the index was made.
  */
 
 int
@@ -1102,15 +1477,16 @@ read_config_file(const char *filename, const char *host, Options *options,
 	char line[1024];
 	int active, linenum;
 	int bad_options = 0;
+	struct readconf_index *idx, *saved;
+	struct stat sb;
+	off_t offset;
 
 	if ((f = fopen(filename, "r")) == NULL)
 		return 0;
 
+	if (fstat(fileno(f), &sb) == -1)
+		fatal("fstat %s: %s", filename, strerror(errno));
 	if (flags & SSHCONF_CHECKPERM) {
-		struct stat sb;
-
-		if (fstat(fileno(f), &sb) == -1)
-			fatal("fstat %s: %s", filename, strerror(errno));
 		if (((sb.st_uid != 0 && sb.st_uid != getuid()) ||
 		    (sb.st_mode & 022) != 0))
 			fatal("Bad owner or permissions on %s", filename);
@@ -1123,14 +1499,46 @@ read_config_file(const char *filename, const char *host, Options *options,
 	 * on/off by Host specifications.
 	 */
 	active = 1;
+	idx = xcalloc(1, sizeof(*idx));
 	linenum = 0;
-	while (fgets(line, sizeof(line), f)) {
+	for (;;) {
+		if ((offset = ftello(f)) == -1 ||
+		    fgets(line, sizeof(line), f) == NULL)
+			break;
 		/* Update line number counter. */
 		linenum++;
+		readconf_index_add_line(idx, line, offset, linenum);
+		/* Switch to a saved index, if wanted, at the first Host line */
+		if (idx->nblocks == 1 && idx->blocks[0].linenum == linenum &&
+		    options->config_index == 1 && S_ISREG(sb.st_mode) &&
+		    (saved = readconf_index_load(filename, &sb)) != NULL) {
+			if (saved->nblocks > 0 &&
+			    saved->blocks[0].offset == offset &&
+			    saved->blocks[0].linenum == (u_int)linenum) {
+				bad_options += read_config_blocks(f, sb.st_size,
+				    saved, host, options, filename, &active,
+				    flags);
+				readconf_index_free(saved);
+				goto done;
+			}
+			debug("%s: %s: index does not match file", __func__,
+			    filename);
+			readconf_index_free(saved);
+		}
 		if (process_config_line(options, host, line, filename, linenum,
 		    &active, flags & SSHCONF_USERCONF) != 0)
 			bad_options++;
 	}
+	if (bad_options == 0 && options->config_index == 1 &&
+	    S_ISREG(sb.st_mode)) {
+		memcpy(&idx->st, &sb, sizeof(idx->st));
+		if (idx->nnames > 1)
+			qsort(idx->names, idx->nnames, sizeof(*idx->names),
+			    readconf_index_name_cmp);
+		readconf_index_save(idx, filename);
+	}
+ done:
+	readconf_index_free(idx);
 	fclose(f);
 	if (bad_options > 0)
 		fatal("%s: terminating, %d bad configuration options",
@@ -1215,6 +1623,8 @@ initialize_options(Options * options)
 	options->control_persist = -1;
 	options->control_persist_timeout = 0;
 	options->hash_known_hosts = -1;
+	options->known_hosts_index = -1;
+	options->config_index = -1;
 	options->tun_open = -1;
 	options->tun_local = -1;
 	options->tun_remote = -1;
@@ -1356,6 +1766,10 @@ fill_default_options(Options * options)
 	}
 	if (options->hash_known_hosts == -1)
 		options->hash_known_hosts = 0;
+	if (options->known_hosts_index == -1)
+		options->known_hosts_index = 0;
+	if (options->config_index == -1)
+		options->config_index = 0;
 	if (options->tun_open == -1)
 		options->tun_open = SSH_TUNMODE_NO;
 	if (options->tun_local == -1)
@@ -125,6 +125,8 @@ typedef struct {
 	int     control_persist_timeout; /* ControlPersist timeout (seconds) */
 
 	int	hash_known_hosts;
+	int	known_hosts_index;
+	int	config_index;	/* Save index of ssh_config files */
 
 	int	tun_open;	/* tun(4) */
 	int     tun_local;	/* force tun device (optional) */
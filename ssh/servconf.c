@@ -80,6 +80,7 @@ initialize_server_options(ServerOptions *options)
 	options->ignore_user_known_hosts = -1;
 	options->print_motd = -1;
 	options->print_lastlog = -1;
+	options->defer_login_records = -1;
 	options->x11_forwarding = -1;
 	options->x11_display_offset = -1;
 	options->x11_use_localhost = -1;
@@ -123,13 +124,22 @@ initialize_server_options(ServerOptions *options)
 	options->max_startups_begin = -1;
 	options->max_startups_rate = -1;
 	options->max_startups = -1;
+	options->per_source_rate = -1;
+	options->per_source_burst = -1;
+	options->per_source_masklen_ipv4 = -1;
+	options->per_source_masklen_ipv6 = -1;
 	options->max_authtries = -1;
 	options->max_sessions = -1;
 	options->banner = NULL;
 	options->use_dns = -1;
+	options->dns_timeout = -1;
+	options->dns_cache_time = -1;
 	options->client_alive_interval = -1;
 	options->client_alive_count_max = -1;
 	options->num_authkeys_files = 0;
+	options->authorized_keys_index = -1;
+	options->cert_cache_size = -1;
+	options->prefork_workers = -1;
 	options->num_accept_env = 0;
 	options->permit_tun = -1;
 	options->num_permitted_opens = -1;
@@ -137,6 +147,8 @@ initialize_server_options(ServerOptions *options)
 	options->chroot_directory = NULL;
 	options->authorized_keys_command = NULL;
 	options->authorized_keys_command_user = NULL;
+	options->authorized_keys_command_cache_time = -1;
+	options->user_cache_time = -1;
 	options->zero_knowledge_password_authentication = -1;
 	options->revoked_keys_file = NULL;
 	options->trusted_user_ca_keys = NULL;
@@ -188,6 +200,8 @@ fill_default_server_options(ServerOptions *options)
 		options->print_motd = 1;
 	if (options->print_lastlog == -1)
 		options->print_lastlog = 1;
+	if (options->defer_login_records == -1)
+		options->defer_login_records = 0;
 	if (options->x11_forwarding == -1)
 		options->x11_forwarding = 0;
 	if (options->x11_display_offset == -1)
@@ -256,12 +270,24 @@ fill_default_server_options(ServerOptions *options)
 		options->max_startups_rate = 30;		/* 30% */
 	if (options->max_startups_begin == -1)
 		options->max_startups_begin = 10;
+	if (options->per_source_rate == -1)
+		options->per_source_rate = 0;
+	if (options->per_source_burst == -1)
+		options->per_source_burst = options->per_source_rate;
+	if (options->per_source_masklen_ipv4 == -1)
+		options->per_source_masklen_ipv4 = 32;
+	if (options->per_source_masklen_ipv6 == -1)
+		options->per_source_masklen_ipv6 = 128;
 	if (options->max_authtries == -1)
 		options->max_authtries = DEFAULT_AUTH_FAIL_MAX;
 	if (options->max_sessions == -1)
 		options->max_sessions = DEFAULT_SESSIONS_MAX;
 	if (options->use_dns == -1)
 		options->use_dns = 1;
+	if (options->dns_timeout == -1)
+		options->dns_timeout = 0;
+	if (options->dns_cache_time == -1)
+		options->dns_cache_time = 0;
 	if (options->client_alive_interval == -1)
 		options->client_alive_interval = 0;
 	if (options->client_alive_count_max == -1)
@@ -272,6 +298,16 @@ fill_default_server_options(ServerOptions *options)
 		options->authorized_keys_files[options->num_authkeys_files++] =
 		    xstrdup(_PATH_SSH_USER_PERMITTED_KEYS2);
 	}
+	if (options->authorized_keys_index == -1)
+		options->authorized_keys_index = 0;
+	if (options->cert_cache_size == -1)
+		options->cert_cache_size = 0;
+	if (options->prefork_workers == -1)
+		options->prefork_workers = 0;
+	if (options->authorized_keys_command_cache_time == -1)
+		options->authorized_keys_command_cache_time = 0;
+	if (options->user_cache_time == -1)
+		options->user_cache_time = 0;
 	if (options->permit_tun == -1)
 		options->permit_tun = SSH_TUNMODE_NO;
 	if (options->zero_knowledge_password_authentication == -1)
@@ -298,7 +334,7 @@ typedef enum {
 	sKerberosTgtPassing, sChallengeResponseAuthentication,
 	sPasswordAuthentication, sKbdInteractiveAuthentication,
 	sListenAddress, sAddressFamily,
-	sPrintMotd, sPrintLastLog, sIgnoreRhosts,
+	sPrintMotd, sPrintLastLog, sDeferLoginRecords, sIgnoreRhosts,
 	sX11Forwarding, sX11DisplayOffset, sX11UseLocalhost,
 	sStrictModes, sEmptyPasswd, sTCPKeepAlive,
 	sPermitUserEnvironment, sUseLogin, sAllowTcpForwarding, sCompression,
@@ -306,9 +342,11 @@ typedef enum {
 	sIgnoreUserKnownHosts, sCiphers, sMacs, sProtocol, sPidFile,
 	sGatewayPorts, sPubkeyAuthentication, sXAuthLocation, sSubsystem,
 	sMaxStartups, sMaxAuthTries, sMaxSessions,
-	sBanner, sUseDNS, sHostbasedAuthentication,
+	sBanner, sUseDNS, sDNSTimeout, sDNSCacheTime, sHostbasedAuthentication,
 	sHostbasedUsesNameFromPacketOnly, sClientAliveInterval,
-	sClientAliveCountMax, sAuthorizedKeysFile,
+	sClientAliveCountMax, sAuthorizedKeysFile, sAuthorizedKeysIndex,
+	sCertificateCacheSize, sPreforkWorkers,
+	sPerSourceRate, sPerSourceNetBlockSize,
 	sGssAuthentication, sGssCleanupCreds, sAcceptEnv, sPermitTunnel,
 	sMatch, sPermitOpen, sForceCommand, sChrootDirectory,
 	sUsePrivilegeSeparation, sAllowAgentForwarding,
@@ -316,6 +354,7 @@ typedef enum {
 	sRevokedKeys, sTrustedUserCAKeys, sAuthorizedPrincipalsFile,
 	sKexAlgorithms, sIPQoS, sVersionAddendum,
 	sAuthorizedKeysCommand, sAuthorizedKeysCommandUser,
+	sAuthorizedKeysCommandCacheTime, sUserCacheTime,
 	sAuthenticationMethods,
 	sDeprecated, sUnsupported
 } ServerOpCodes;
@@ -381,6 +420,7 @@ static struct {
 	{ "addressfamily", sAddressFamily, SSHCFG_GLOBAL },
 	{ "printmotd", sPrintMotd, SSHCFG_GLOBAL },
 	{ "printlastlog", sPrintLastLog, SSHCFG_GLOBAL },
+	{ "deferloginrecords", sDeferLoginRecords, SSHCFG_GLOBAL },
 	{ "ignorerhosts", sIgnoreRhosts, SSHCFG_GLOBAL },
 	{ "ignoreuserknownhosts", sIgnoreUserKnownHosts, SSHCFG_GLOBAL },
 	{ "x11forwarding", sX11Forwarding, SSHCFG_ALL },
@@ -411,12 +451,19 @@ static struct {
 	{ "maxsessions", sMaxSessions, SSHCFG_ALL },
 	{ "banner", sBanner, SSHCFG_ALL },
 	{ "usedns", sUseDNS, SSHCFG_GLOBAL },
+	{ "dnstimeout", sDNSTimeout, SSHCFG_GLOBAL },
+	{ "dnscachetime", sDNSCacheTime, SSHCFG_GLOBAL },
 	{ "verifyreversemapping", sDeprecated, SSHCFG_GLOBAL },
 	{ "reversemappingcheck", sDeprecated, SSHCFG_GLOBAL },
 	{ "clientaliveinterval", sClientAliveInterval, SSHCFG_GLOBAL },
 	{ "clientalivecountmax", sClientAliveCountMax, SSHCFG_GLOBAL },
 	{ "authorizedkeysfile", sAuthorizedKeysFile, SSHCFG_ALL },
 	{ "authorizedkeysfile2", sDeprecated, SSHCFG_ALL },
+	{ "authorizedkeysindex", sAuthorizedKeysIndex, SSHCFG_GLOBAL },
+	{ "certificatecachesize", sCertificateCacheSize, SSHCFG_GLOBAL },
+	{ "preforkworkers", sPreforkWorkers, SSHCFG_GLOBAL },
+	{ "persourcerate", sPerSourceRate, SSHCFG_GLOBAL },
+	{ "persourcenetblocksize", sPerSourceNetBlockSize, SSHCFG_GLOBAL },
 	{ "useprivilegeseparation", sUsePrivilegeSeparation, SSHCFG_GLOBAL},
 	{ "acceptenv", sAcceptEnv, SSHCFG_ALL },
 	{ "permittunnel", sPermitTunnel, SSHCFG_ALL },
@@ -432,6 +479,8 @@ static struct {
 	{ "ipqos", sIPQoS, SSHCFG_ALL },
 	{ "authorizedkeyscommand", sAuthorizedKeysCommand, SSHCFG_ALL },
 	{ "authorizedkeyscommanduser", sAuthorizedKeysCommandUser, SSHCFG_ALL },
+	{ "authorizedkeyscommandcachetime", sAuthorizedKeysCommandCacheTime, SSHCFG_ALL },
+	{ "usercachetime", sUserCacheTime, SSHCFG_GLOBAL },
 	{ "versionaddendum", sVersionAddendum, SSHCFG_GLOBAL },
 	{ "authenticationmethods", sAuthenticationMethods, SSHCFG_ALL },
 	{ NULL, sBadOption, 0 }
@@ -552,6 +601,12 @@ get_connection_info(int populate, int use_dns)
  * processed and actioned until EOF or another Match block unsets it.  Any
  * options set are copied into the main server config.
  *
+ * To avoid reparsing the whole file for every connection, the Match blocks
+ * are also compiled at startup by compile_server_match_config().  Each
+ * block keeps its parsed criteria and the text of its directives, and only
+ * the directives of blocks that match are processed.  sshd -T checks that
+ * both methods give the same result.
+ *
  * Potential additions/improvements:
  *  - Add Match support for pre-kex directives, eg Protocol, Ciphers.
  *
@@ -570,19 +625,63 @@ get_connection_info(int populate, int use_dns)
  *		PermittedChannelRequests session,forwarded-tcpip
  */
 
+/* Match attributes */
+#define MATCH_USER		1
+#define MATCH_GROUP		2
+#define MATCH_HOST		3
+#define MATCH_ADDRESS		4
+#define MATCH_LOCALADDRESS	5
+#define MATCH_LOCALPORT		6
+
+struct match_criterion {
+	int	attrib;		/* MATCH_* */
+	char	*arg;
+	int	port;		/* for MATCH_LOCALPORT */
+	struct match_patterns *patterns; /* for MATCH_USER and MATCH_HOST */
+};
+
+/*
+ * A Match block, compiled once: its criteria and the text of the
+ * directives that follow it, which are only processed when the block
+ * matches.
+ */
+struct match_block {
+	int	line;		/* of the Match directive */
+	struct match_criterion *criteria;
+	u_int	ncriteria;
+	char	*body;
+};
+
+static struct match_block *match_blocks;
+static u_int num_match_blocks;
+static int match_blocks_compiled;
+
+/* Group membership of the user, looked up at most once per evaluation */
+struct match_groups {
+	int	loaded;
+	int	ngroups;	/* -1 if the user does not exist */
+};
+
 static int
-match_cfg_line_group(const char *grps, int line, const char *user)
+match_cfg_line_group(const char *grps, int line, const char *user,
+    struct match_groups *mg)
 {
-	int result = 0;
 	struct passwd *pw;
 
 	if (user == NULL)
-		goto out;
+		return 0;
 
-	if ((pw = getpwnam(user)) == NULL) {
+	if (!mg->loaded) {
+		mg->loaded = 1;
+		if ((pw = getpwnam(user)) == NULL)
+			mg->ngroups = -1;
+		else
+			mg->ngroups = ga_init(pw->pw_name, pw->pw_gid);
+	}
+	if (mg->ngroups == -1) {
 		debug("Can't match group at line %d because user %.100s does "
 		    "not exist", line, user);
-	} else if (ga_init(pw->pw_name, pw->pw_gid) == 0) {
+	} else if (mg->ngroups == 0) {
 		debug("Can't Match group because user %.100s not in any group "
 		    "at line %d", user, line);
 	} else if (ga_match_pattern_list(grps) != 1) {
@@ -591,80 +690,156 @@ match_cfg_line_group(const char *grps, int line, const char *user)
 	} else {
 		debug("user %.100s matched group list %.100s at line %d", user,
 		    grps, line);
-		result = 1;
+		return 1;
 	}
-out:
-	ga_free();
-	return result;
+	return 0;
+}
+
+static void
+match_groups_free(struct match_groups *mg)
+{
+	if (mg->loaded)
+		ga_free();
+	mg->loaded = 0;
+}
+
+static void
+match_block_free(struct match_block *mb)
+{
+	u_int i;
+
+	for (i = 0; i < mb->ncriteria; i++) {
+		free(mb->criteria[i].arg);
+		match_patterns_free(mb->criteria[i].patterns);
+	}
+	free(mb->criteria);
+	free(mb->body);
+	memset(mb, 0, sizeof(*mb));
 }
 
 /*
- * All of the attributes on a single Match line are ANDed together, so we need
- * to check every * attribute and set the result to zero if any attribute does
- * not match.
+ * Parse the criteria of a Match line into mb. Returns 0 on success or -1
+ * if the criteria are invalid.
  */
 static int
-match_cfg_line(char **condition, int line, struct connection_info *ci)
+match_cfg_compile(char **condition, int line, struct match_block *mb)
 {
-	int result = 1, port;
+	struct match_criterion *mc;
 	char *arg, *attrib, *cp = *condition;
-	size_t len;
-
-	if (ci == NULL)
-		debug3("checking syntax for 'Match %s'", cp);
-	else
-		debug3("checking match for '%s' user %s host %s addr %s "
-		    "laddr %s lport %d", cp, ci->user ? ci->user : "(null)",
-		    ci->host ? ci->host : "(null)",
-		    ci->address ? ci->address : "(null)",
-		    ci->laddress ? ci->laddress : "(null)", ci->lport);
+	int type, port = 0;
 
+	memset(mb, 0, sizeof(*mb));
+	mb->line = line;
 	while ((attrib = strdelim(&cp)) && *attrib != '\0') {
 		if ((arg = strdelim(&cp)) == NULL || *arg == '\0') {
 			error("Missing Match criteria for %s", attrib);
-			return -1;
+			goto fail;
 		}
-		len = strlen(arg);
-		if (strcasecmp(attrib, "user") == 0) {
+		if (strcasecmp(attrib, "user") == 0)
+			type = MATCH_USER;
+		else if (strcasecmp(attrib, "group") == 0)
+			type = MATCH_GROUP;
+		else if (strcasecmp(attrib, "host") == 0)
+			type = MATCH_HOST;
+		else if (strcasecmp(attrib, "address") == 0)
+			type = MATCH_ADDRESS;
+		else if (strcasecmp(attrib, "localaddress") == 0)
+			type = MATCH_LOCALADDRESS;
+		else if (strcasecmp(attrib, "localport") == 0) {
+			type = MATCH_LOCALPORT;
+			if ((port = a2port(arg)) == -1) {
+				error("Invalid LocalPort '%s' on Match line",
+				    arg);
+				goto fail;
+			}
+		} else {
+			error("Unsupported Match attribute %s", attrib);
+			goto fail;
+		}
+		mb->criteria = xrealloc(mb->criteria, mb->ncriteria + 1,
+		    sizeof(*mb->criteria));
+		mc = &mb->criteria[mb->ncriteria++];
+		mc->attrib = type;
+		mc->arg = xstrdup(arg);
+		mc->port = port;
+		/* NULL if it can't be compiled; matched as text instead */
+		mc->patterns = NULL;
+		if (type == MATCH_USER || type == MATCH_HOST)
+			mc->patterns = match_patterns_compile(arg, strlen(arg),
+			    type == MATCH_HOST);
+	}
+	*condition = cp;
+	return 0;
+ fail:
+	match_block_free(mb);
+	return -1;
+}
+
+/*
+ * All of the attributes on a single Match line are ANDed together, so we need
+ * to check every * attribute and set the result to zero if any attribute does
+ * not match.
+ */
+static int
+match_cfg_eval(const struct match_block *mb, struct connection_info *ci,
+    struct match_groups *mg)
+{
+	const struct match_criterion *mc;
+	int result = 1, line = mb->line;
+	u_int i;
+
+	for (i = 0; i < mb->ncriteria; i++) {
+		mc = &mb->criteria[i];
+		switch (mc->attrib) {
+		case MATCH_USER:
 			if (ci == NULL || ci->user == NULL) {
 				result = 0;
 				continue;
 			}
-			if (match_pattern_list(ci->user, arg, len, 0) != 1)
+			if ((mc->patterns != NULL ?
+			    match_patterns_match(mc->patterns, ci->user) :
+			    match_pattern_list(ci->user, mc->arg,
+			    strlen(mc->arg), 0)) != 1)
 				result = 0;
 			else
 				debug("user %.100s matched 'User %.100s' at "
-				    "line %d", ci->user, arg, line);
-		} else if (strcasecmp(attrib, "group") == 0) {
-			if (ci == NULL || ci->user == NULL) {
+				    "line %d", ci->user, mc->arg, line);
+			break;
+		case MATCH_GROUP:
+			if (ci == NULL || ci->user == NULL || result == 0) {
+				/* Skip the group lookup if already failed */
 				result = 0;
 				continue;
 			}
-			switch (match_cfg_line_group(arg, line, ci->user)) {
-			case -1:
-				return -1;
-			case 0:
+			if (match_cfg_line_group(mc->arg, line, ci->user,
+			    mg) == 0)
 				result = 0;
-			}
-		} else if (strcasecmp(attrib, "host") == 0) {
+			break;
+		case MATCH_HOST:
 			if (ci == NULL || ci->host == NULL) {
 				result = 0;
 				continue;
 			}
-			if (match_hostname(ci->host, arg, len) != 1)
+			if ((mc->patterns != NULL ?
+			    match_patterns_match(mc->patterns, ci->host) :
+			    match_hostname(ci->host, mc->arg,
+			    strlen(mc->arg))) != 1)
 				result = 0;
 			else
 				debug("connection from %.100s matched 'Host "
-				    "%.100s' at line %d", ci->host, arg, line);
-		} else if (strcasecmp(attrib, "address") == 0) {
+				    "%.100s' at line %d", ci->host, mc->arg,
+				    line);
+			break;
+		case MATCH_ADDRESS:
 			if (ci == NULL || ci->address == NULL) {
 				result = 0;
 				continue;
 			}
-			switch (addr_match_list(ci->address, arg)) {
+			switch (addr_match_list(ci->address, mc->arg)) {
 			case 1:
 				debug("connection from %.100s matched 'Address "
-				    "%.100s' at line %d", ci->address, arg, line);
+				    "%.100s' at line %d", ci->address, mc->arg,
+				    line);
 				break;
 			case 0:
 			case -1:
@@ -673,16 +848,17 @@ match_cfg_line(char **condition, int line, struct connection_info *ci)
 			case -2:
 				return -1;
 			}
-		} else if (strcasecmp(attrib, "localaddress") == 0){
+			break;
+		case MATCH_LOCALADDRESS:
 			if (ci == NULL || ci->laddress == NULL) {
 				result = 0;
 				continue;
 			}
-			switch (addr_match_list(ci->laddress, arg)) {
+			switch (addr_match_list(ci->laddress, mc->arg)) {
 			case 1:
 				debug("connection from %.100s matched "
 				    "'LocalAddress %.100s' at line %d",
-				    ci->laddress, arg, line);
+				    ci->laddress, mc->arg, line);
 				break;
 			case 0:
 			case -1:
@@ -691,31 +867,50 @@ match_cfg_line(char **condition, int line, struct connection_info *ci)
 			case -2:
 				return -1;
 			}
-		} else if (strcasecmp(attrib, "localport") == 0) {
-			if ((port = a2port(arg)) == -1) {
-				error("Invalid LocalPort '%s' on Match line",
-				    arg);
-				return -1;
-			}
+			break;
+		case MATCH_LOCALPORT:
 			if (ci == NULL || ci->lport == 0) {
 				result = 0;
 				continue;
 			}
 			/* TODO support port lists */
-			if (port == ci->lport)
+			if (mc->port == ci->lport)
 				debug("connection from %.100s matched "
 				    "'LocalPort %d' at line %d",
-				    ci->laddress, port, line);
+				    ci->laddress, mc->port, line);
 			else
 				result = 0;
-		} else {
-			error("Unsupported Match attribute %s", attrib);
-			return -1;
+			break;
 		}
 	}
 	if (ci != NULL)
 		debug3("match %sfound", result ? "" : "not ");
-	*condition = cp;
+	return result;
+}
+
+static int
+match_cfg_line(char **condition, int line, struct connection_info *ci)
+{
+	struct match_block mb;
+	struct match_groups mg;
+	char *cp = *condition;
+	int result;
+
+	if (ci == NULL)
+		debug3("checking syntax for 'Match %s'", cp);
+	else
+		debug3("checking match for '%s' user %s host %s addr %s "
+		    "laddr %s lport %d", cp, ci->user ? ci->user : "(null)",
+		    ci->host ? ci->host : "(null)",
+		    ci->address ? ci->address : "(null)",
+		    ci->laddress ? ci->laddress : "(null)", ci->lport);
+
+	if (match_cfg_compile(condition, line, &mb) != 0)
+		return -1;
+	memset(&mg, 0, sizeof(mg));
+	result = match_cfg_eval(&mb, ci, &mg);
+	match_groups_free(&mg);
+	match_block_free(&mb);
 	return result;
 }
 
@@ -864,6 +1059,10 @@ process_server_config_line(ServerOptions *options, char *line,
 		intptr = &options->key_regeneration_time;
 		goto parse_time;
 
+	case sUserCacheTime:
+		intptr = &options->user_cache_time;
+		goto parse_time;
+
 	case sListenAddress:
 		arg = strdelim(&cp);
 		if (arg == NULL || *arg == '\0')
@@ -1043,6 +1242,10 @@ process_server_config_line(ServerOptions *options, char *line,
 		intptr = &options->print_lastlog;
 		goto parse_flag;
 
+	case sDeferLoginRecords:
+		intptr = &options->defer_login_records;
+		goto parse_flag;
+
 	case sX11Forwarding:
 		intptr = &options->x11_forwarding;
 		goto parse_flag;
@@ -1124,6 +1327,18 @@ process_server_config_line(ServerOptions *options, char *line,
 		intptr = &options->use_dns;
 		goto parse_flag;
 
+	case sDNSTimeout:
+		intptr = &options->dns_timeout;
+		goto parse_time;
+
+	case sDNSCacheTime:
+		intptr = &options->dns_cache_time;
+		goto parse_time;
+
+	case sAuthorizedKeysIndex:
+		intptr = &options->authorized_keys_index;
+		goto parse_flag;
+
 	case sLogFacility:
 		log_facility_ptr = &options->log_facility;
 		arg = strdelim(&cp);
@@ -1314,6 +1529,49 @@ process_server_config_line(ServerOptions *options, char *line,
 			options->max_startups = options->max_startups_begin;
 		break;
 
+	case sPerSourceRate:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: Missing PerSourceRate spec.",
+			    filename, linenum);
+		if (strcmp(arg, "none") == 0) {
+			if (*activep && options->per_source_rate == -1)
+				options->per_source_rate = 0;
+			break;
+		}
+		if ((n = sscanf(arg, "%d:%d", &value, &value2)) == 1)
+			value2 = value;
+		else if (n != 2)
+			fatal("%s line %d: Illegal PerSourceRate spec.",
+			    filename, linenum);
+		if (value < 1 || value2 < 1)
+			fatal("%s line %d: Illegal PerSourceRate spec.",
+			    filename, linenum);
+		if (*activep && options->per_source_rate == -1) {
+			options->per_source_rate = value;
+			options->per_source_burst = value2;
+		}
+		break;
+
+	case sPerSourceNetBlockSize:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: Missing PerSourceNetBlockSize spec.",
+			    filename, linenum);
+		if ((n = sscanf(arg, "%d:%d", &value, &value2)) == 1)
+			value2 = 128;
+		else if (n != 2)
+			fatal("%s line %d: Illegal PerSourceNetBlockSize spec.",
+			    filename, linenum);
+		if (value < 0 || value > 32 || value2 < 0 || value2 > 128)
+			fatal("%s line %d: Illegal PerSourceNetBlockSize spec.",
+			    filename, linenum);
+		if (*activep && options->per_source_masklen_ipv4 == -1) {
+			options->per_source_masklen_ipv4 = value;
+			options->per_source_masklen_ipv6 = value2;
+		}
+		break;
+
 	case sMaxAuthTries:
 		intptr = &options->max_authtries;
 		goto parse_int;
@@ -1322,6 +1580,25 @@ process_server_config_line(ServerOptions *options, char *line,
 		intptr = &options->max_sessions;
 		goto parse_int;
 
+	case sPreforkWorkers:
+		intptr = &options->prefork_workers;
+		goto parse_int;
+
+	case sCertificateCacheSize:
+		intptr = &options->cert_cache_size;
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: missing integer value.",
+			    filename, linenum);
+		value = atoi(arg);
+		if (value < 0 || value > MAX_CERT_CACHE_SIZE)
+			fatal("%s line %d: certificate cache size must be "
+			    "between 0 and %d.", filename, linenum,
+			    MAX_CERT_CACHE_SIZE);
+		if (*activep && *intptr == -1)
+			*intptr = value;
+		break;
+
 	case sBanner:
 		charptr = &options->banner;
 		goto parse_filename;
@@ -1531,6 +1808,19 @@ process_server_config_line(ServerOptions *options, char *line,
 			*charptr = xstrdup(arg);
 		break;
 
+	case sAuthorizedKeysCommandCacheTime:
+		intptr = &options->authorized_keys_command_cache_time;
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: missing time value.",
+			    filename, linenum);
+		if ((value = convtime(arg)) == -1)
+			fatal("%s line %d: invalid time value.",
+			    filename, linenum);
+		if (*activep && *intptr == -1)
+			*intptr = value;
+		break;
+
 	case sAuthenticationMethods:
 		if (*activep && options->num_auth_methods == 0) {
 			while ((arg = strdelim(&cp)) && *arg != '\0') {
@@ -1609,6 +1899,109 @@ load_server_config(const char *filename, struct sshbuf *conf)
 	debug2("%s: done config len = %zu", __func__, sshbuf_len(conf));
 }
 
+/*
+ * Compile the Match blocks of conf, which must already have been checked
+ * by parse_server_config().
+ */
+void
+compile_server_match_config(struct sshbuf *conf)
+{
+	struct match_block mb;
+	struct sshbuf *body;
+	char *cp, *arg = NULL, *line, *obuf, *cbuf, *lbuf;
+	int r, inblock = 0, linenum = 0;
+	u_int i;
+
+	for (i = 0; i < num_match_blocks; i++)
+		match_block_free(&match_blocks[i]);
+	free(match_blocks);
+	match_blocks = NULL;
+	num_match_blocks = 0;
+
+	if ((body = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	obuf = cbuf = xstrdup((const char *)sshbuf_ptr(conf));
+	for (;;) {
+		line = strsep(&cbuf, "\n");
+		linenum++;
+		lbuf = cp = line == NULL ? NULL : xstrdup(line);
+		if (cp != NULL && (arg = strdelim(&cp)) != NULL &&
+		    *arg == '\0')
+			arg = strdelim(&cp);
+		if (line == NULL || (arg != NULL &&
+		    strcasecmp(arg, "match") == 0)) {
+			/* Finish the previous block */
+			if (inblock) {
+				if ((r = sshbuf_put_u8(body, 0)) != 0)
+					fatal("%s: buffer error: %s",
+					    __func__, ssh_err(r));
+				mb.body = xstrdup((const char *)
+				    sshbuf_ptr(body));
+				match_blocks = xrealloc(match_blocks,
+				    num_match_blocks + 1,
+				    sizeof(*match_blocks));
+				match_blocks[num_match_blocks++] = mb;
+				sshbuf_reset(body);
+			}
+			if (line == NULL)
+				break;
+			if (match_cfg_compile(&cp, linenum, &mb) != 0)
+				fatal("line %d: Bad Match condition", linenum);
+			inblock = 1;
+		} else if (inblock) {
+			/* Keep blank lines so that line numbers still work */
+			if ((r = sshbuf_put(body, line, strlen(line))) != 0 ||
+			    (r = sshbuf_put_u8(body, '\n')) != 0)
+				fatal("%s: buffer error: %s", __func__,
+				    ssh_err(r));
+		}
+		free(lbuf);
+	}
+	free(obuf);
+	sshbuf_free(body);
+	match_blocks_compiled = 1;
+	debug2("%s: %u Match blocks", __func__, num_match_blocks);
+}
+
+/* Process the directives of the compiled Match blocks that match */
+static void
+apply_match_blocks(ServerOptions *options,
+    struct connection_info *connectinfo)
+{
+	struct match_block *mb;
+	struct match_groups mg;
+	char *cp, *obuf, *cbuf;
+	int active, linenum, bad_options = 0;
+	u_int i;
+
+	memset(&mg, 0, sizeof(mg));
+	for (i = 0; i < num_match_blocks; i++) {
+		mb = &match_blocks[i];
+		debug3("checking match for block at line %d", mb->line);
+		switch (match_cfg_eval(mb, connectinfo, &mg)) {
+		case -1:
+			fatal("reprocess config line %d: Bad Match condition",
+			    mb->line);
+		case 0:
+			continue;
+		}
+		obuf = cbuf = xstrdup(mb->body);
+		active = 1;
+		linenum = mb->line + 1;
+		while ((cp = strsep(&cbuf, "\n")) != NULL) {
+			if (process_server_config_line(options, cp,
+			    "reprocess config", linenum++, &active,
+			    connectinfo) != 0)
+				bad_options++;
+		}
+		free(obuf);
+	}
+	match_groups_free(&mg);
+	if (bad_options > 0)
+		fatal("reprocess config: terminating, %d bad configuration "
+		    "options", bad_options);
+}
+
 void
 parse_server_match_config(ServerOptions *options,
    struct connection_info *connectinfo)
@@ -1616,7 +2009,10 @@ parse_server_match_config(ServerOptions *options,
 	ServerOptions mo;
 
 	initialize_server_options(&mo);
-	parse_server_config(&mo, "reprocess config", cfg, connectinfo);
+	if (match_blocks_compiled)
+		apply_match_blocks(&mo, connectinfo);
+	else
+		parse_server_config(&mo, "reprocess config", cfg, connectinfo);
 	copy_set_server_options(options, &mo, 0);
 }
 
@@ -1687,36 +2083,38 @@ int server_match_spec_complete(struct connection_info *ci)
  * array values that are not used pre-authentication, because any that we
  * do use must be explictly sent in mm_getpwnamallow().
  */
+#define COPY_MATCH_INT_OPTS() do { \
+		M_CP_INTOPT(password_authentication); \
+		M_CP_INTOPT(gss_authentication); \
+		M_CP_INTOPT(rsa_authentication); \
+		M_CP_INTOPT(pubkey_authentication); \
+		M_CP_INTOPT(kerberos_authentication); \
+		M_CP_INTOPT(hostbased_authentication); \
+		M_CP_INTOPT(hostbased_uses_name_from_packet_only); \
+		M_CP_INTOPT(kbd_interactive_authentication); \
+		M_CP_INTOPT(zero_knowledge_password_authentication); \
+		M_CP_INTOPT(permit_root_login); \
+		M_CP_INTOPT(permit_empty_passwd); \
+		M_CP_INTOPT(allow_tcp_forwarding); \
+		M_CP_INTOPT(allow_agent_forwarding); \
+		M_CP_INTOPT(permit_tun); \
+		M_CP_INTOPT(gateway_ports); \
+		M_CP_INTOPT(x11_display_offset); \
+		M_CP_INTOPT(x11_forwarding); \
+		M_CP_INTOPT(x11_use_localhost); \
+		M_CP_INTOPT(max_sessions); \
+		M_CP_INTOPT(max_authtries); \
+		M_CP_INTOPT(ip_qos_interactive); \
+		M_CP_INTOPT(ip_qos_bulk); \
+		M_CP_INTOPT(rekey_limit); \
+		M_CP_INTOPT(rekey_interval); \
+		M_CP_INTOPT(authorized_keys_command_cache_time); \
+	} while (0)
+
 void
 copy_set_server_options(ServerOptions *dst, ServerOptions *src, int preauth)
 {
-	M_CP_INTOPT(password_authentication);
-	M_CP_INTOPT(gss_authentication);
-	M_CP_INTOPT(rsa_authentication);
-	M_CP_INTOPT(pubkey_authentication);
-	M_CP_INTOPT(kerberos_authentication);
-	M_CP_INTOPT(hostbased_authentication);
-	M_CP_INTOPT(hostbased_uses_name_from_packet_only);
-	M_CP_INTOPT(kbd_interactive_authentication);
-	M_CP_INTOPT(zero_knowledge_password_authentication);
-	M_CP_STROPT(authorized_keys_command);
-	M_CP_STROPT(authorized_keys_command_user);
-	M_CP_INTOPT(permit_root_login);
-	M_CP_INTOPT(permit_empty_passwd);
-
-	M_CP_INTOPT(allow_tcp_forwarding);
-	M_CP_INTOPT(allow_agent_forwarding);
-	M_CP_INTOPT(permit_tun);
-	M_CP_INTOPT(gateway_ports);
-	M_CP_INTOPT(x11_display_offset);
-	M_CP_INTOPT(x11_forwarding);
-	M_CP_INTOPT(x11_use_localhost);
-	M_CP_INTOPT(max_sessions);
-	M_CP_INTOPT(max_authtries);
-	M_CP_INTOPT(ip_qos_interactive);
-	M_CP_INTOPT(ip_qos_bulk);
-	M_CP_INTOPT(rekey_limit);
-	M_CP_INTOPT(rekey_interval);
+	COPY_MATCH_INT_OPTS();
 
 	/* See comment in servconf.h */
 	COPY_MATCH_STRING_OPTS();
@@ -1736,6 +2134,61 @@ copy_set_server_options(ServerOptions *dst, ServerOptions *src, int preauth)
 #undef M_CP_STROPT
 #undef M_CP_STRARRAYOPT
 
+/* Comparison of the options set by Match, for verify_server_match_config */
+#define M_CP_INTOPT(n) do {\
+	if (a->n != b->n) { \
+		error("Match option %s differs", #n); \
+		ret = -1; \
+	} \
+} while (0)
+#define M_CP_STROPT(n) do {\
+	if ((a->n == NULL) != (b->n == NULL) || \
+	    (a->n != NULL && strcmp(a->n, b->n) != 0)) { \
+		error("Match option %s differs", #n); \
+		ret = -1; \
+	} \
+} while(0)
+#define M_CP_STRARRAYOPT(n, num_n) do {\
+	for (i = 0; a->num_n == b->num_n && i < a->num_n; i++) \
+		if (strcmp(a->n[i], b->n[i]) != 0) \
+			break; \
+	if (a->num_n != b->num_n || i != a->num_n) { \
+		error("Match option %s differs", #n); \
+		ret = -1; \
+	} \
+} while(0)
+
+/*
+ * Check that the compiled Match blocks set the same options as reprocessing
+ * the configuration text for connectinfo. Returns 0 if they agree or -1
+ * otherwise.
+ */
+int
+verify_server_match_config(struct connection_info *connectinfo)
+{
+	ServerOptions text, compiled, *a = &text, *b = &compiled;
+	u_int i;
+	int ret = 0;
+
+	if (!match_blocks_compiled)
+		return 0;
+	initialize_server_options(&text);
+	parse_server_config(&text, "reprocess config", cfg, connectinfo);
+	initialize_server_options(&compiled);
+	apply_match_blocks(&compiled, connectinfo);
+
+	COPY_MATCH_INT_OPTS();
+	COPY_MATCH_STRING_OPTS();
+	M_CP_STROPT(adm_forced_command);
+	M_CP_STROPT(chroot_directory);
+	return ret;
+}
+
+#undef M_CP_INTOPT
+#undef M_CP_STROPT
+#undef M_CP_STRARRAYOPT
+#undef COPY_MATCH_INT_OPTS
+
 void
 parse_server_config(ServerOptions *options, const char *filename,
     struct sshbuf *conf, struct connection_info *connectinfo)
@@ -1900,7 +2353,14 @@ dump_config(ServerOptions *o)
 	dump_cfg_int(sX11DisplayOffset, o->x11_display_offset);
 	dump_cfg_int(sMaxAuthTries, o->max_authtries);
 	dump_cfg_int(sMaxSessions, o->max_sessions);
+	dump_cfg_int(sCertificateCacheSize, o->cert_cache_size);
+	dump_cfg_int(sPreforkWorkers, o->prefork_workers);
 	dump_cfg_int(sClientAliveInterval, o->client_alive_interval);
+	dump_cfg_int(sAuthorizedKeysCommandCacheTime,
+	    o->authorized_keys_command_cache_time);
+	dump_cfg_int(sUserCacheTime, o->user_cache_time);
+	dump_cfg_int(sDNSTimeout, o->dns_timeout);
+	dump_cfg_int(sDNSCacheTime, o->dns_cache_time);
 	dump_cfg_int(sClientAliveCountMax, o->client_alive_count_max);
 
 	/* formatted integer arguments */
@@ -1934,6 +2394,7 @@ dump_config(ServerOptions *o)
 	    o->challenge_response_authentication);
 	dump_cfg_fmtint(sPrintMotd, o->print_motd);
 	dump_cfg_fmtint(sPrintLastLog, o->print_lastlog);
+	dump_cfg_fmtint(sDeferLoginRecords, o->defer_login_records);
 	dump_cfg_fmtint(sX11Forwarding, o->x11_forwarding);
 	dump_cfg_fmtint(sX11UseLocalhost, o->x11_use_localhost);
 	dump_cfg_fmtint(sStrictModes, o->strict_modes);
@@ -1944,6 +2405,7 @@ dump_config(ServerOptions *o)
 	dump_cfg_fmtint(sCompression, o->compression);
 	dump_cfg_fmtint(sGatewayPorts, o->gateway_ports);
 	dump_cfg_fmtint(sUseDNS, o->use_dns);
+	dump_cfg_fmtint(sAuthorizedKeysIndex, o->authorized_keys_index);
 	dump_cfg_fmtint(sAllowTcpForwarding, o->allow_tcp_forwarding);
 	dump_cfg_fmtint(sUsePrivilegeSeparation, use_privsep);
 
@@ -1989,6 +2451,13 @@ dump_config(ServerOptions *o)
 
 	printf("maxstartups %d:%d:%d\n", o->max_startups_begin,
 	    o->max_startups_rate, o->max_startups);
+	if (o->per_source_rate == 0)
+		printf("persourcerate none\n");
+	else
+		printf("persourcerate %d:%d\n", o->per_source_rate,
+		    o->per_source_burst);
+	printf("persourcenetblocksize %d:%d\n", o->per_source_masklen_ipv4,
+	    o->per_source_masklen_ipv6);
 
 	for (i = 0; tunmode_desc[i].val != -1; i++)
 		if (tunmode_desc[i].val == o->permit_tun) {
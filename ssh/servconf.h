@@ -29,6 +29,7 @@
 #define MAX_MATCH_GROUPS	256	/* Max # of groups for Match. */
 #define MAX_AUTHKEYS_FILES	256	/* Max # of authorized_keys files. */
 #define MAX_AUTH_METHODS	256	/* Max # of AuthenticationMethods. */
+#define MAX_CERT_CACHE_SIZE	(1024 * 1024) /* Max # of cached certificates. */
 
 /* permit_root_login */
 #define	PERMIT_NOT_SET		-1
@@ -76,6 +77,8 @@ typedef struct {
 						 * for RhostsRsaAuth */
 	int     print_motd;	/* If true, print /etc/motd. */
 	int	print_lastlog;	/* If true, print lastlog */
+	int	defer_login_records;	/* Write login records after
+					 * the session starts */
 	int     x11_forwarding;	/* If true, permit inet (spoofing) X11 fwd. */
 	int     x11_display_offset;	/* What DISPLAY number to start
 					 * searching at */
@@ -144,10 +147,16 @@ typedef struct {
 	int	max_startups_begin;
 	int	max_startups_rate;
 	int	max_startups;
+	int	per_source_rate;	/* Connections per second per source */
+	int	per_source_burst;
+	int	per_source_masklen_ipv4;
+	int	per_source_masklen_ipv6;
 	int	max_authtries;
 	int	max_sessions;
 	char   *banner;			/* SSH-2 banner message */
 	int	use_dns;
+	int	dns_timeout;		/* Seconds to wait for lookups */
+	int	dns_cache_time;		/* Seconds to reuse lookups */
 	int	client_alive_interval;	/*
 					 * poke the client this often to
 					 * see if it's still there
@@ -160,6 +169,10 @@ typedef struct {
 
 	u_int num_authkeys_files;	/* Files containing public keys */
 	char   *authorized_keys_files[MAX_AUTHKEYS_FILES];
+	int	authorized_keys_index;	/* Save key indexes next to files */
+	int	cert_cache_size;	/* Verified certificates shared by
+					 * connections */
+	int	prefork_workers;	/* Idle re-executed sshd processes */
 
 	char   *adm_forced_command;
 
@@ -173,6 +186,10 @@ typedef struct {
 	char   *authorized_principals_file;
 	char   *authorized_keys_command;
 	char   *authorized_keys_command_user;
+	int	authorized_keys_command_cache_time;	/* Seconds to reuse
+							 * command output */
+	int	user_cache_time;	/* Seconds to reuse user and
+					 * group lookups */
 
 	int64_t rekey_limit;
 	int	rekey_interval;
@@ -225,7 +242,9 @@ int	 process_server_config_line(ServerOptions *, char *, const char *, int,
 void	 load_server_config(const char *, struct sshbuf *);
 void	 parse_server_config(ServerOptions *, const char *, struct sshbuf *,
 	     struct connection_info *);
+void	 compile_server_match_config(struct sshbuf *);
 void	 parse_server_match_config(ServerOptions *, struct connection_info *);
+int	 verify_server_match_config(struct connection_info *);
 int	 parse_server_match_testspec(struct connection_info *, char *);
 int	 server_match_spec_complete(struct connection_info *);
 void	 copy_set_server_options(ServerOptions *, ServerOptions *, int);
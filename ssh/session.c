@@ -115,6 +115,11 @@ static void do_authenticated2(struct ssh *);
 
 static int session_pty_req(Session *);
 
+struct session_spawn;
+static struct session_spawn *session_spawn_prepare(Session *, const char *);
+static void session_spawn_exec(struct session_spawn *, int, int, int);
+static void session_spawn_free(struct session_spawn *);
+
 /* import */
 extern ServerOptions options;
 extern char *__progname;
@@ -453,6 +458,7 @@ do_authenticated1(struct ssh *ssh)
 int
 do_exec_no_pty(Session *s, const char *command)
 {
+	struct session_spawn *sp;
 	pid_t pid;
 #ifdef USE_PIPES
 	int pin[2], pout[2], perr[2];
@@ -502,10 +508,12 @@ do_exec_no_pty(Session *s, const char *command)
 
 	session_proctitle(s);
 
-	/* Fork the child. */
-	switch ((pid = fork())) {
+	/* Fork the child, or borrow our memory if it will exec right away. */
+	sp = session_spawn_prepare(s, command);
+	switch ((pid = sp != NULL ? vfork() : fork())) {
 	case -1:
 		error("%s: fork: %.100s", __func__, strerror(errno));
+		session_spawn_free(sp);
 #ifdef USE_PIPES
 		close(pin[0]);
 		close(pin[1]);
@@ -521,6 +529,14 @@ do_exec_no_pty(Session *s, const char *command)
 #endif
 		return -1;
 	case 0:
+		if (sp != NULL) {
+#ifdef USE_PIPES
+			session_spawn_exec(sp, pin[0], pout[1], perr[1]);
+#else
+			session_spawn_exec(sp, inout[0], inout[0], err[0]);
+#endif
+			/* NOTREACHED */
+		}
 		is_child = 1;
 
 		/* Child.  Reinitialize the log since the pid has changed. */
@@ -579,6 +595,7 @@ do_exec_no_pty(Session *s, const char *command)
 	default:
 		break;
 	}
+	session_spawn_free(sp);
 
 	s->pid = pid;
 	/* Set interactive/non-interactive mode. */
@@ -803,11 +820,14 @@ do_login(Session *s, const char *command)
 	}
 
 	/* Record that there was a login on that tty from the remote host. */
-	if (!use_privsep)
+	if (!use_privsep) {
+		/* save previous login details before writing new */
+		store_lastlog_message(pw->pw_name, pw->pw_uid);
 		record_login(pid, s->tty, pw->pw_name, pw->pw_uid,
 		    get_remote_name_or_ip(utmp_len,
 		    options.use_dns),
 		    (struct sockaddr *)&from, fromlen);
+	}
 
 	if (check_quietlogin(s, command))
 		return;
@@ -994,19 +1014,19 @@ do_setup_env(Session *s, const char *shell)
 
 	/* Set custom environment options from RSA authentication. */
 	if (!options.use_login) {
-		while (custom_environment) {
-			struct envstring *ce = custom_environment;
-			char *str = ce->s;
+		struct envstring *ce;
+		char *str;
 
+		/* Leave the list intact, this may run in the server itself */
+		for (ce = custom_environment; ce != NULL; ce = ce->next) {
+			str = xstrdup(ce->s);
 			for (i = 0; str[i] != '=' && str[i]; i++)
 				;
 			if (str[i] == '=') {
 				str[i] = 0;
 				child_set_env(&env, &envsize, str, str + i + 1);
 			}
-			custom_environment = ce->next;
-			free(ce->s);
-			free(ce);
+			free(str);
 		}
 	}
 
@@ -1128,22 +1148,33 @@ do_rc_files(Session *s, const char *shell)
 	}
 }
 
-static void
-do_nologin(struct passwd *pw)
+/* Return the nologin file that keeps pw out, or NULL if there is none */
+static char *
+nologin_path(struct passwd *pw)
 {
-	FILE *f = NULL;
-	char buf[1024], *nl, *def_nl = _PATH_NOLOGIN;
+	char *nl, *def_nl = _PATH_NOLOGIN;
 	struct stat sb;
 
 	if (login_getcapbool(lc, "ignorenologin", 0) || pw->pw_uid == 0)
-		return;
+		return NULL;
 	nl = login_getcapstr(lc, "nologin", def_nl, def_nl);
 
 	if (stat(nl, &sb) == -1) {
 		if (nl != def_nl)
 			free(nl);
-		return;
+		return NULL;
 	}
+	return nl == def_nl ? xstrdup(nl) : nl;
+}
+
+static void
+do_nologin(struct passwd *pw)
+{
+	FILE *f = NULL;
+	char buf[1024], *nl;
+
+	if ((nl = nologin_path(pw)) == NULL)
+		return;
 
 	/* /etc/nologin exists.  Print its contents if we can and exit. */
 	logit("User %.100s not allowed because %s exists", pw->pw_name, nl);
@@ -1508,6 +1539,139 @@ do_child(Session *s, const char *command)
 	exit(1);
 }
 
+/*
+ * A command that can be started with vfork(): everything do_child() would
+ * do before execve() has been done in advance, or is a system call.
+ */
+struct session_spawn {
+	char	*shell;
+	char	*argv[4];
+	char   **env;
+	char	*home;
+	char	*nohome_msg;	/* printed if home is unavailable, or NULL */
+	int	 requirehome;
+};
+
+/*
+ * Prepare to start command for s without copying the server, or return
+ * NULL if do_child() has work to do in the new process: changing user or
+ * root directory, running rc files, login(1), internal sftp and the like.
+ * Once authenticated with privilege separation, the server already runs
+ * as the user, so non-interactive commands usually qualify.
+ */
+static struct session_spawn *
+session_spawn_prepare(Session *s, const char *command)
+{
+	struct session_spawn *sp;
+	struct passwd *pw = s->pw;
+	struct stat st;
+	const char *shell, *shell0;
+	char *nl, buf[MAXPATHLEN];
+
+	if (command == NULL || s->ttyfd != -1 || options.use_login ||
+	    s->authctxt->force_pwchange ||
+	    s->is_subsystem == SUBSYSTEM_INT_SFTP ||
+	    s->is_subsystem == SUBSYSTEM_INT_SFTP_ERROR ||
+	    s->display != NULL)
+		return NULL;
+	if (getuid() != pw->pw_uid || geteuid() != pw->pw_uid ||
+	    (options.chroot_directory != NULL &&
+	    strcasecmp(options.chroot_directory, "none") != 0))
+		return NULL;
+#ifdef KRB5
+	if (options.kerberos_get_afs_token)
+		return NULL;
+#endif
+	if ((nl = nologin_path(pw)) != NULL) {
+		free(nl);
+		return NULL;
+	}
+	snprintf(buf, sizeof(buf), "%s/%s", pw->pw_dir, _PATH_SSH_USER_RC);
+	if (stat(buf, &st) == 0 || stat(_PATH_SSH_SYSTEM_RC, &st) == 0)
+		return NULL;
+
+	sp = xcalloc(1, sizeof(*sp));
+	shell = (pw->pw_shell[0] == '\0') ? _PATH_BSHELL : pw->pw_shell;
+	sp->env = do_setup_env(s, shell);
+	sp->shell = login_getcapstr(lc, "shell", (char *)shell, (char *)shell);
+	if (sp->shell == shell)
+		sp->shell = xstrdup(shell);
+	if ((shell0 = strrchr(sp->shell, '/')) != NULL)
+		shell0++;
+	else
+		shell0 = sp->shell;
+	sp->argv[0] = xstrdup(shell0);
+	sp->argv[1] = xstrdup("-c");
+	sp->argv[2] = xstrdup(command);
+	sp->argv[3] = NULL;
+	sp->home = xstrdup(pw->pw_dir);
+	sp->requirehome = login_getcapbool(lc, "requirehome", 0);
+	xasprintf(&sp->nohome_msg, "Could not chdir to home directory %s: ",
+	    pw->pw_dir);
+	debug("%s: starting \"%.100s\" without fork", __func__, command);
+	return sp;
+}
+
+static void
+spawn_write(const char *msg)
+{
+	(void)write(STDERR_FILENO, msg, strlen(msg));
+}
+
+/*
+ * The vfork() child: it shares memory with the server, so only system
+ * calls are made here, and it must not return.
+ */
+static void
+session_spawn_exec(struct session_spawn *sp, int fdin, int fdout, int fderr)
+{
+	struct sigaction sa;
+
+	(void)setsid();
+	if (dup2(fdin, STDIN_FILENO) < 0 || dup2(fdout, STDOUT_FILENO) < 0 ||
+	    dup2(fderr, STDERR_FILENO) < 0)
+		_exit(1);
+	closefrom(STDERR_FILENO + 1);
+
+	if (chdir(sp->home) < 0) {
+		spawn_write(sp->nohome_msg);
+		spawn_write(strerror(errno));
+		spawn_write("\n");
+		if (sp->requirehome)
+			_exit(1);
+	}
+
+	/* restore SIGPIPE for child */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	execve(sp->shell, sp->argv, sp->env);
+	spawn_write(sp->shell);
+	spawn_write(": ");
+	spawn_write(strerror(errno));
+	spawn_write("\n");
+	_exit(1);
+}
+
+static void
+session_spawn_free(struct session_spawn *sp)
+{
+	u_int i;
+
+	if (sp == NULL)
+		return;
+	for (i = 0; sp->env[i] != NULL; i++)
+		free(sp->env[i]);
+	free(sp->env);
+	for (i = 0; sp->argv[i] != NULL; i++)
+		free(sp->argv[i]);
+	free(sp->shell);
+	free(sp->home);
+	free(sp->nohome_msg);
+	free(sp);
+}
+
 void
 session_unused(int id)
 {
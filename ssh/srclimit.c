@@ -0,0 +1,229 @@
+/* $OpenBSD$ */
+/*
+ * Per-source admission control for the sshd listener.
+ *
+ * Every source network (the address masked to a configurable prefix
+ * length) has a token bucket that refills at a fixed rate. A connection
+ * takes one token and is refused if none is left, before the listener
+ * forks for it. The buckets live in a hash table of fixed size: a bucket
+ * that has refilled completely carries no state and may be reused, and
+ * when the probed slots are all busy the least recently used one is.
+ *
+ * Placed in the public domain
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "xmalloc.h"
+#include "log.h"
+#include "srclimit.h"
+
+#define SRCLIMIT_ENTRIES	4096	/* power of two */
+#define SRCLIMIT_PROBE		8
+#define SRCLIMIT_SCALE		1000	/* tokens are kept in thousandths */
+
+struct srclimit_entry {
+	int		af;		/* 0 if unused */
+	u_char		addr[16];	/* masked address */
+	u_int64_t	tokens;
+	u_int64_t	last;		/* msec, of the last connection */
+	u_int		accepted;
+	u_int		refused;
+};
+
+static struct srclimit_entry *srclimit_table;
+static u_int64_t srclimit_rate;		/* tokens per second */
+static u_int64_t srclimit_burst;	/* scaled */
+static int srclimit_masklen_ipv4, srclimit_masklen_ipv6;
+static u_int32_t srclimit_seed;
+
+static u_int64_t
+srclimit_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		fatal("%s: clock_gettime: %s", __func__, strerror(errno));
+	return (u_int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Allow rate connections per second from each source network, and up to
+ * burst at once. A rate of 0 disables the check.
+ */
+void
+srclimit_init(int rate, int burst, int masklen_ipv4, int masklen_ipv6)
+{
+	if (rate <= 0)
+		return;
+	srclimit_table = xcalloc(SRCLIMIT_ENTRIES, sizeof(*srclimit_table));
+	srclimit_rate = rate;
+	srclimit_burst = (u_int64_t)burst * SRCLIMIT_SCALE;
+	srclimit_masklen_ipv4 = masklen_ipv4;
+	srclimit_masklen_ipv6 = masklen_ipv6;
+	srclimit_seed = arc4random();
+	debug("%s: %d/s burst %d per /%d or /%d", __func__, rate, burst,
+	    masklen_ipv4, masklen_ipv6);
+}
+
+static void
+srclimit_mask(u_char *addr, size_t len, int masklen)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (masklen >= 8)
+			masklen -= 8;
+		else {
+			addr[i] &= masklen == 0 ? 0 : 0xff << (8 - masklen);
+			masklen = 0;
+		}
+	}
+}
+
+static u_int32_t
+srclimit_hash(int af, const u_char *addr)
+{
+	u_int32_t h = srclimit_seed ^ (u_int32_t)af;
+	size_t i;
+
+	/* FNV-1a, keyed with a random seed */
+	for (i = 0; i < 16; i++) {
+		h ^= addr[i];
+		h *= 16777619;
+	}
+	return h;
+}
+
+/* Tokens in the bucket of e, including those accrued since its use */
+static u_int64_t
+srclimit_tokens(const struct srclimit_entry *e, u_int64_t now)
+{
+	u_int64_t tokens = e->tokens;
+
+	if (now > e->last)
+		tokens += (now - e->last) * srclimit_rate *
+		    SRCLIMIT_SCALE / 1000;
+	return tokens > srclimit_burst ? srclimit_burst : tokens;
+}
+
+/* An unused slot is reused first, then a full bucket, then the LRU one */
+static int
+srclimit_reusable(const struct srclimit_entry *e, u_int64_t now)
+{
+	if (e->af == 0)
+		return 2;
+	return srclimit_tokens(e, now) >= srclimit_burst;
+}
+
+static struct srclimit_entry *
+srclimit_lookup(int af, const u_char *addr, u_int64_t now)
+{
+	struct srclimit_entry *e, *victim = NULL;
+	u_int32_t h = srclimit_hash(af, addr);
+	int r, vr = -1;
+	u_int i;
+
+	for (i = 0; i < SRCLIMIT_PROBE; i++) {
+		e = &srclimit_table[(h + i) & (SRCLIMIT_ENTRIES - 1)];
+		if (e->af == af && memcmp(e->addr, addr, sizeof(e->addr)) == 0)
+			return e;
+		r = srclimit_reusable(e, now);
+		if (r > vr || (r == 0 && vr == 0 && e->last < victim->last)) {
+			victim = e;
+			vr = r;
+		}
+	}
+	if (vr == 0)
+		debug3("%s: evicting busy source", __func__);
+	memset(victim, 0, sizeof(*victim));
+	victim->af = af;
+	memcpy(victim->addr, addr, sizeof(victim->addr));
+	victim->tokens = srclimit_burst;
+	victim->last = now;
+	return victim;
+}
+
+/*
+ * Returns 1 if a connection from addr may proceed and 0 if its source
+ * has used up its share.
+ */
+int
+srclimit_check_allow(const struct sockaddr *sa, socklen_t salen)
+{
+	struct srclimit_entry *e;
+	u_char addr[16];
+	u_int64_t now;
+
+	if (srclimit_table == NULL)
+		return 1;
+	memset(addr, 0, sizeof(addr));
+	switch (sa->sa_family) {
+	case AF_INET:
+		if (salen < sizeof(struct sockaddr_in))
+			return 1;
+		memcpy(addr, &((const struct sockaddr_in *)sa)->sin_addr, 4);
+		srclimit_mask(addr, 4, srclimit_masklen_ipv4);
+		break;
+	case AF_INET6:
+		if (salen < sizeof(struct sockaddr_in6))
+			return 1;
+		memcpy(addr, &((const struct sockaddr_in6 *)sa)->sin6_addr,
+		    16);
+		srclimit_mask(addr, 16, srclimit_masklen_ipv6);
+		break;
+	default:
+		return 1;
+	}
+	now = srclimit_now();
+	e = srclimit_lookup(sa->sa_family, addr, now);
+	e->tokens = srclimit_tokens(e, now);
+	e->last = now;
+	if (e->tokens < SRCLIMIT_SCALE) {
+		e->refused++;
+		return 0;
+	}
+	e->tokens -= SRCLIMIT_SCALE;
+	e->accepted++;
+	return 1;
+}
+
+/* Log the counters of every source in the table */
+void
+srclimit_dump(void)
+{
+	struct srclimit_entry *e;
+	char ntop[NI_MAXHOST];
+	u_int64_t now, tokens;
+	u_int i, n = 0;
+
+	if (srclimit_table == NULL)
+		return;
+	now = srclimit_now();
+	for (i = 0; i < SRCLIMIT_ENTRIES; i++) {
+		e = &srclimit_table[i];
+		if (e->af == 0)
+			continue;
+		tokens = srclimit_tokens(e, now);
+		n++;
+		if (inet_ntop(e->af, e->addr, ntop, sizeof(ntop)) == NULL)
+			strlcpy(ntop, "?", sizeof(ntop));
+		logit("source %s/%d: %u accepted, %u refused, %llu.%03llu "
+		    "tokens", ntop, e->af == AF_INET ?
+		    srclimit_masklen_ipv4 : srclimit_masklen_ipv6,
+		    e->accepted, e->refused,
+		    (unsigned long long)(tokens / SRCLIMIT_SCALE),
+		    (unsigned long long)(tokens % SRCLIMIT_SCALE));
+	}
+	logit("%u sources tracked", n);
+}
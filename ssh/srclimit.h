@@ -0,0 +1,13 @@
+/* $OpenBSD$ */
+/*
+ * Placed in the public domain
+ */
+
+#ifndef SRCLIMIT_H
+#define SRCLIMIT_H
+
+void	 srclimit_init(int, int, int, int);
+int	 srclimit_check_allow(const struct sockaddr *, socklen_t);
+void	 srclimit_dump(void);
+
+#endif
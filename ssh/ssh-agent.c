@@ -350,7 +350,7 @@ process_sign_request2(SocketEntry *e)
 	if (flags & SSH_AGENT_OLD_SIGNATURE)
 		compat = SSH_BUG_SIGBLOB;
 
-	if ((ok = sshkey_from_blob(blob, blen, &key)) != 0)
+	if ((ok = sshkey_from_blob_cached(blob, blen, &key)) != 0)
 		error("%s: cannot parse key blob: %s", __func__, ssh_err(ok));
 	else {
 		Identity *id = lookup_identity(key, 2);
@@ -409,7 +409,7 @@ process_remove_identity(SocketEntry *e, int version)
 	case 2:
 		if ((r = sshbuf_get_string(e->request, &blob, &blen)) != 0)
 			fatal("%s: buffer error: %s", __func__, ssh_err(r));
-		if ((r = sshkey_from_blob(blob, blen, &key)) != 0)
+		if ((r = sshkey_from_blob_cached(blob, blen, &key)) != 0)
 			error("%s: sshkey_from_blob failed: %s",
 			    __func__, ssh_err(r));
 		free(blob);
@@ -105,6 +105,12 @@ char *ca_key_path = NULL;
 /* Certificate serial number */
 unsigned long long cert_serial = 0;
 
+/* Bits per revoked item in the KRL Bloom filter, 0 for none */
+u_int krl_bloom_bits = 0;
+
+/* Encode KRL serials as they are read rather than collecting them first */
+int krl_stream = 0;
+
 /* Key type when certifying */
 u_int cert_key_type = SSH2_CERT_TYPE_USER;
 
@@ -152,9 +158,9 @@ extern char *__progname;
 char hostname[MAXHOSTNAMELEN];
 
 /* moduli.c */
-int gen_candidates(FILE *, u_int32_t, u_int32_t, BIGNUM *);
+int gen_candidates(FILE *, u_int32_t, u_int32_t, BIGNUM *, u_int32_t);
 int prime_test(FILE *, FILE *, u_int32_t, u_int32_t, char *, unsigned long,
-    unsigned long);
+    unsigned long, u_int32_t);
 
 static void
 type_bits_valid(int type, u_int32_t *bitsp)
@@ -1016,6 +1022,8 @@ do_known_hosts(struct passwd *pw, const char *name)
 	char line[16*1024], tmp[MAXPATHLEN], old[MAXPATHLEN];
 	int c, skip = 0, inplace = 0, num = 0, invalid = 0, has_unhashed = 0;
 	int ca, r;
+	u_long *lines = NULL;
+	u_int nlines = 0, l = 0;
 
 	if (!have_identity) {
 		cp = tilde_expand_filename(_PATH_SSH_USER_HOSTFILE, pw->pw_uid);
@@ -1028,6 +1036,13 @@ do_known_hosts(struct passwd *pw, const char *name)
 	if ((in = fopen(identity_file, "r")) == NULL)
 		fatal("%s: %s: %s", __progname, identity_file, strerror(errno));
 
+	/* When only searching, the index tells which lines to look at */
+	if (find_host && !delete_host) {
+		if (hostfile_find_lines(identity_file, name,
+		    &lines, &nlines) != 0)
+			lines = NULL;
+	}
+
 	/*
 	 * Find hosts goes to stdout, hash and deletions happen in-place
 	 * A corner case is ssh-keygen -HF foo, which should go to stdout
@@ -1061,6 +1076,12 @@ do_known_hosts(struct passwd *pw, const char *name)
 			skip = 0;
 			continue;
 		}
+		if (lines != NULL) {
+			while (l < nlines && lines[l] < (u_long)num)
+				l++;
+			if (l == nlines || lines[l] != (u_long)num)
+				continue;
+		}
 		*cp = '\0';
 
 		/* Skip leading whitespace, empty and comment lines. */
@@ -1181,6 +1202,7 @@ do_known_hosts(struct passwd *pw, const char *name)
 		sshkey_free(pub);
 	}
 	fclose(in);
+	free(lines);
 
 	if (invalid) {
 		fprintf(stderr, "%s is not a valid known_hosts file.\n",
@@ -1943,19 +1965,44 @@ do_show_cert(struct passwd *pw)
 	exit(0);
 }
 
+/*
+ * Read a whole KRL into b. Unlike sshkey_load_file() the size is limited
+ * only by that of a sshbuf, as KRLs revoking many serials can grow well
+ * beyond any key file.
+ */
+static void
+read_krl_file(const char *path, struct sshbuf *b)
+{
+	u_char buf[8192];
+	struct stat st;
+	size_t len;
+	int r, fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+		fatal("open %s: %s", path, strerror(errno));
+	for (;;) {
+		if ((len = atomicio(read, fd, buf, sizeof(buf))) == 0) {
+			if (errno == EPIPE)
+				break;
+			fatal("read %s: %s", path, strerror(errno));
+		}
+		if ((r = sshbuf_put(b, buf, len)) != 0)
+			fatal("Unable to load KRL: %s", ssh_err(r));
+	}
+	if (S_ISREG(st.st_mode) && st.st_size != (off_t)sshbuf_len(b))
+		fatal("Unable to load KRL: %s", ssh_err(SSH_ERR_FILE_CHANGED));
+	close(fd);
+}
+
 static void
 load_krl(const char *path, struct ssh_krl **krlp)
 {
 	struct sshbuf *krlbuf;
-	int r, fd;
+	int r;
 
 	if ((krlbuf = sshbuf_new()) == NULL)
 		fatal("sshbuf_new failed");
-	if ((fd = open(path, O_RDONLY)) == -1)
-		fatal("open %s: %s", path, strerror(errno));
-	if ((r = sshkey_load_file(fd, path, krlbuf)) != 0)
-		fatal("Unable to load KRL: %s", ssh_err(r));
-	close(fd);
+	read_krl_file(path, krlbuf);
 	/* XXX check sigs */
 	if ((r = ssh_krl_from_blob(krlbuf, krlp, NULL, 0)) != 0 ||
 	    *krlp == NULL)
@@ -1965,7 +2012,7 @@ load_krl(const char *path, struct ssh_krl **krlp)
 
 static void
 update_krl_from_file(struct passwd *pw, const char *file,
-    const struct sshkey *ca, struct ssh_krl *krl)
+    const struct sshkey *ca, struct ssh_krl *krl, struct ssh_krl_stream *ks)
 {
 	struct sshkey *key = NULL;
 	u_long lnum = 0;
@@ -2037,10 +2084,15 @@ update_krl_from_file(struct passwd *pw, const char *file,
 					    (unsigned long long)serial,
 					    (unsigned long long)serial2);
 			}
-			if (ssh_krl_revoke_cert_by_serial_range(krl,
-			    ca, serial, serial2) != 0) {
-				fatal("%s: revoke serial failed",
-				    __func__);
+			if (ks != NULL)
+				r = ssh_krl_stream_revoke_serial_range(ks,
+				    ca, serial, serial2);
+			else
+				r = ssh_krl_revoke_cert_by_serial_range(krl,
+				    ca, serial, serial2);
+			if (r != 0) {
+				fatal("%s: revoke serial failed: %s",
+				    __func__, ssh_err(r));
 			}
 		} else if (strncasecmp(cp, "id:", 3) == 0) {
 			if (ca == NULL) {
@@ -2088,6 +2140,63 @@ update_krl_from_file(struct passwd *pw, const char *file,
 	free(path);
 }
 
+/*
+ * Generate a KRL with serials encoded as they are read, so that very long
+ * sorted serial lists need not be held in memory. An existing KRL is
+ * extended with new sections instead of being parsed and rebuilt.
+ */
+static void
+gen_krl_stream(struct passwd *pw, int updating, const struct sshkey *ca,
+    int argc, char **argv)
+{
+	struct ssh_krl *krl;
+	struct ssh_krl_stream *ks;
+	struct sshbuf *base = NULL;
+	char tmp[MAXPATHLEN];
+	int fd, i, r;
+
+	if (krl_bloom_bits != 0)
+		fatal("Bloom filters cannot be used with streamed KRLs");
+	if (updating) {
+		if ((base = sshbuf_new()) == NULL)
+			fatal("sshbuf_new failed");
+		read_krl_file(identity_file, base);
+	}
+	if (strlcpy(tmp, identity_file, sizeof(tmp)) >= sizeof(tmp) ||
+	    strlcat(tmp, ".XXXXXXXXXX", sizeof(tmp)) >= sizeof(tmp))
+		fatal("KRL path too long");
+	if ((fd = mkstemp(tmp)) == -1)
+		fatal("mkstemp: %s", strerror(errno));
+	if (fchmod(fd, 0644) == -1) {
+		r = errno;
+		unlink(tmp);
+		fatal("fchmod %s: %s", tmp, strerror(r));
+	}
+	if ((r = ssh_krl_stream_open(fd, base, cert_serial,
+	    identity_comment, &ks)) != 0) {
+		unlink(tmp);
+		fatal("Invalid KRL file: %s", ssh_err(r));
+	}
+	sshbuf_free(base);
+	if ((krl = ssh_krl_init()) == NULL)
+		fatal("couldn't create KRL");
+
+	for (i = 0; i < argc; i++)
+		update_krl_from_file(pw, argv[i], ca, krl, ks);
+
+	if ((r = ssh_krl_stream_finish(ks, krl)) != 0) {
+		unlink(tmp);
+		fatal("Couldn't generate KRL: %s", ssh_err(r));
+	}
+	if (close(fd) == -1 || rename(tmp, identity_file) == -1) {
+		r = errno;
+		unlink(tmp);
+		fatal("write %s: %s", identity_file, strerror(r));
+	}
+	ssh_krl_stream_free(ks);
+	ssh_krl_free(krl);
+}
+
 static void
 do_gen_krl(struct passwd *pw, int updating, int argc, char **argv)
 {
@@ -2095,7 +2204,7 @@ do_gen_krl(struct passwd *pw, int updating, int argc, char **argv)
 	struct stat sb;
 	struct sshkey *ca = NULL;
 	int fd, i, r;
-	char *tmp;
+	char *tmp, path[MAXPATHLEN];
 	struct sshbuf *kbuf;
 
 	if (*identity_file == '\0')
@@ -2115,6 +2224,13 @@ do_gen_krl(struct passwd *pw, int updating, int argc, char **argv)
 		free(tmp);
 	}
 
+	if (krl_stream) {
+		gen_krl_stream(pw, updating, ca, argc, argv);
+		if (ca != NULL)
+			sshkey_free(ca);
+		return;
+	}
+
 	if (updating)
 		load_krl(identity_file, &krl);
 	else if ((krl = ssh_krl_init()) == NULL)
@@ -2124,20 +2240,30 @@ do_gen_krl(struct passwd *pw, int updating, int argc, char **argv)
 		ssh_krl_set_version(krl, cert_serial);
 	if (identity_comment != NULL)
 		ssh_krl_set_comment(krl, identity_comment);
+	if (krl_bloom_bits != 0)
+		ssh_krl_set_bloom(krl, krl_bloom_bits);
 
 	for (i = 0; i < argc; i++)
-		update_krl_from_file(pw, argv[i], ca, krl);
+		update_krl_from_file(pw, argv[i], ca, krl, NULL);
 
 	if ((kbuf = sshbuf_new()) == NULL)
 		fatal("sshbuf_new failed");
 	if (ssh_krl_to_blob(krl, kbuf, NULL, 0) != 0)
 		fatal("Couldn't generate KRL");
-	if ((fd = open(identity_file, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1)
-		fatal("open %s: %s", identity_file, strerror(errno));
-	if (atomicio(vwrite, fd, (void *)sshbuf_ptr(kbuf), sshbuf_len(kbuf)) !=
-	    sshbuf_len(kbuf))
-		fatal("write %s: %s", identity_file, strerror(errno));
-	close(fd);
+	/* Replace the KRL atomically; sshd may be reading it */
+	if (strlcpy(path, identity_file, sizeof(path)) >= sizeof(path) ||
+	    strlcat(path, ".XXXXXXXXXX", sizeof(path)) >= sizeof(path))
+		fatal("KRL path too long");
+	if ((fd = mkstemp(path)) == -1)
+		fatal("mkstemp: %s", strerror(errno));
+	if (fchmod(fd, 0644) == -1 ||
+	    atomicio(vwrite, fd, (void *)sshbuf_ptr(kbuf), sshbuf_len(kbuf)) !=
+	    sshbuf_len(kbuf) || close(fd) == -1 ||
+	    rename(path, identity_file) == -1) {
+		r = errno;
+		unlink(path);
+		fatal("write %s: %s", identity_file, strerror(r));
+	}
 	sshbuf_free(kbuf);
 	ssh_krl_free(krl);
 	if (ca != NULL)
@@ -2220,6 +2346,7 @@ usage(void)
 	fprintf(stderr, "  -V from:to  Specify certificate validity interval.\n");
 	fprintf(stderr, "  -v          Verbose.\n");
 	fprintf(stderr, "  -W gen      Generator to use for generating DH-GEX moduli.\n");
+	fprintf(stderr, "  -w workers  Number of worker processes for DH-GEX moduli.\n");
 	fprintf(stderr, "  -y          Read private key file and print public key.\n");
 	fprintf(stderr, "  -z serial   Specify a serial number.\n");
 
@@ -2239,7 +2366,7 @@ main(int argc, char **argv)
 	struct passwd *pw;
 	struct stat st;
 	int r, opt, type, fd;
-	u_int32_t memory = 0, generator_wanted = 0, trials = 100;
+	u_int32_t memory = 0, generator_wanted = 0, trials = 100, workers = 1;
 	int do_gen_candidates = 0, do_screen_candidates = 0;
 	int gen_all_hostkeys = 0, gen_krl = 0, update_krl = 0, check_krl = 0;
 	unsigned long start_lineno = 0, lines_to_process = 0;
@@ -2268,7 +2395,7 @@ main(int argc, char **argv)
 	}
 
 	while ((opt = getopt(argc, argv, "ABHLQXceghiklpquvxy"
-	    "C:D:F:G:I:J:K:M:N:O:P:R:S:T:V:W:a:b:f:g:j:m:n:r:s:t:z:")) != -1) {
+	    "C:D:F:G:I:J:K:M:N:O:P:R:S:T:V:W:a:b:f:g:j:m:n:r:s:t:w:z:")) != -1) {
 		switch (opt) {
 		case 'A':
 			gen_all_hostkeys = 1;
@@ -2351,7 +2478,16 @@ main(int argc, char **argv)
 			check_krl = 1;
 			break;
 		case 'O':
-			add_cert_option(optarg);
+			if (strncasecmp(optarg, "bloom=", 6) == 0) {
+				krl_bloom_bits = (u_int)strtonum(optarg + 6,
+				    1, 64, &errstr);
+				if (errstr)
+					fatal("Bloom filter bits %s %s",
+					    optarg + 6, errstr);
+			} else if (strcasecmp(optarg, "stream") == 0)
+				krl_stream = 1;
+			else
+				add_cert_option(optarg);
 			break;
 		case 'C':
 			identity_comment = optarg;
@@ -2416,6 +2552,12 @@ main(int argc, char **argv)
 				fatal("Invalid number of trials: %s (%s)",
 					optarg, errstr);
 			break;
+		case 'w':
+			workers = (u_int32_t)strtonum(optarg, 1, 1024, &errstr);
+			if (errstr)
+				fatal("Number of workers is %s: %s",
+				    errstr, optarg);
+			break;
 		case 'M':
 			memory = (u_int32_t)strtonum(optarg, 1, UINT_MAX, &errstr);
 			if (errstr)
@@ -2549,7 +2691,7 @@ main(int argc, char **argv)
 		}
 		if (bits == 0)
 			bits = DEFAULT_BITS;
-		if (gen_candidates(out, memory, bits, start) != 0)
+		if (gen_candidates(out, memory, bits, start, workers) != 0)
 			fatal("modulus candidate generation failed");
 
 		return (0);
@@ -2573,7 +2715,7 @@ main(int argc, char **argv)
 			    out_file, strerror(errno));
 		}
 		if (prime_test(in, out, trials, generator_wanted, checkpoint,
-		    start_lineno, lines_to_process) != 0)
+		    start_lineno, lines_to_process, workers) != 0)
 			fatal("modulus screening failed");
 		return (0);
 	}
@@ -86,6 +86,7 @@
 #include "log.h"
 #include "readconf.h"
 #include "sshconnect.h"
+#include "hostfile.h"
 #include "misc.h"
 #include "kex.h"
 #include "mac.h"
@@ -717,6 +718,7 @@ main(int ac, char **av)
 	fill_default_options(&options);
 
 	channel_set_af(options.address_family);
+	hostfile_index_persist(options.known_hosts_index);
 
 	/* reinit */
 	log_init(argv0, options.log_level, SYSLOG_FACILITY_USER, !use_syslog);
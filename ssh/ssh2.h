@@ -102,6 +102,11 @@
 #define SSH2_MSG_KEX_ECDH_INIT				30
 #define SSH2_MSG_KEX_ECDH_REPLY				31
 
+/* ticket-sha256@openssh.com; TICKET_NEW follows the server's NEWKEYS */
+#define SSH2_MSG_KEX_TICKET_INIT			30
+#define SSH2_MSG_KEX_TICKET_REPLY			31
+#define SSH2_MSG_KEX_TICKET_NEW				49
+
 /* user authentication: generic */
 
 #define SSH2_MSG_USERAUTH_REQUEST			50
@@ -97,6 +97,7 @@ ssh_init(struct ssh **sshp, int is_server, struct kex_params *kex_params)
 		ssh->kex->kex[KEX_DH_GEX_SHA1] = kexgex_server;
 		ssh->kex->kex[KEX_DH_GEX_SHA256] = kexgex_server;
 		ssh->kex->kex[KEX_ECDH_SHA2] = kexecdh_server;
+		ssh->kex->kex[KEX_TICKET] = kexticket_server;
 		ssh->kex->load_host_public_key=&_ssh_host_public_key;
 		ssh->kex->load_host_private_key=&_ssh_host_private_key;
 	} else {
@@ -105,6 +106,7 @@ ssh_init(struct ssh **sshp, int is_server, struct kex_params *kex_params)
 		ssh->kex->kex[KEX_DH_GEX_SHA1] = kexgex_client;
 		ssh->kex->kex[KEX_DH_GEX_SHA256] = kexgex_client;
 		ssh->kex->kex[KEX_ECDH_SHA2] = kexecdh_client;
+		ssh->kex->kex[KEX_TICKET] = kexticket_client;
 		ssh->kex->verify_host_key =&_ssh_verify_host_key;
 	}
 	*sshp = ssh;
@@ -196,6 +198,70 @@ ssh_set_verify_host_key_callback(struct ssh *ssh,
 	return 0;
 }
 
+int
+ssh_set_ticket_key(struct ssh *ssh, const u_char *key, size_t keylen,
+    u_int lifetime)
+{
+	struct kex_ticket_key *tk;
+	u_char digest[EVP_MAX_MD_SIZE];
+
+	if (ssh->kex == NULL || !ssh->kex->server ||
+	    keylen != KEX_TICKET_KEY_LEN || lifetime == 0)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if ((tk = calloc(1, sizeof(*tk))) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	/* tickets are tagged with a key name so old keys fail cheaply */
+	if (EVP_Digest(key, keylen, digest, NULL, EVP_sha256(), NULL) != 1) {
+		free(tk);
+		return SSH_ERR_LIBCRYPTO_ERROR;
+	}
+	memcpy(tk->name, digest, sizeof(tk->name));
+	memcpy(tk->key, key, sizeof(tk->key));
+	tk->lifetime = lifetime;
+	if (ssh->kex->ticket_key != NULL) {
+		bzero(ssh->kex->ticket_key, sizeof(*ssh->kex->ticket_key));
+		free(ssh->kex->ticket_key);
+	}
+	ssh->kex->ticket_key = tk;
+	return kex_ticket_offer(ssh->kex, 0);
+}
+
+int
+ssh_set_ticket(struct ssh *ssh, const struct sshbuf *ticket)
+{
+	const u_char *blob, *secret;
+	size_t len;
+	u_int64_t expiry;
+	int r;
+
+	if (ssh->kex == NULL || ssh->kex->server)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if (ticket == NULL) {
+		ssh->kex->ticket_resume = 0;
+		return kex_ticket_offer(ssh->kex, 0);
+	}
+	if ((r = kex_ticket_parse(ticket, &blob, &len, &secret, &expiry)) != 0)
+		return r;
+	if (ssh->kex->ticket == NULL &&
+	    (ssh->kex->ticket = sshbuf_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	sshbuf_reset(ssh->kex->ticket);
+	if ((r = sshbuf_putb(ssh->kex->ticket, ticket)) != 0)
+		return r;
+	ssh->kex->ticket_resume = 1;
+	return kex_ticket_offer(ssh->kex, 1);
+}
+
+int
+ssh_get_ticket(struct ssh *ssh, struct sshbuf *ticket)
+{
+	if (ssh->kex == NULL || ssh->kex->server)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if (ssh->kex->ticket == NULL || sshbuf_len(ssh->kex->ticket) == 0)
+		return SSH_ERR_TICKET_INVALID;
+	return sshbuf_putb(ticket, ssh->kex->ticket);
+}
+
 int
 ssh_input_append(struct ssh *ssh, const u_char *data, size_t len)
 {
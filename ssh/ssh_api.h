@@ -71,6 +71,35 @@ int	ssh_add_hostkey(struct ssh *ssh, struct sshkey *key);
 int	ssh_set_verify_host_key_callback(struct ssh *ssh,
     int (*cb)(struct sshkey *, struct ssh *));
 
+/*
+ * ssh_set_ticket_key() enables session resumption on the server side.
+ * after every key exchange the server issues the client a ticket,
+ * encrypted with the given KEX_TICKET_KEY_LEN byte key, that stays valid
+ * for 'lifetime' seconds. all servers that should accept a ticket need
+ * to share the key.
+ * ssh_set_ticket_key() needs to be called before ssh_packet_next().
+ */
+int	ssh_set_ticket_key(struct ssh *ssh, const u_char *key, size_t keylen,
+    u_int lifetime);
+
+/*
+ * ssh_set_ticket() offers session resumption on the client side.
+ * a ticket previously obtained by ssh_get_ticket() replaces the DH
+ * exchange and host key signature of the initial key exchange. if the
+ * ticket is NULL, the client only asks for a ticket to be issued.
+ * if the server rejects the ticket it disconnects with
+ * SSH_ERR_TICKET_INVALID and the client should retry without it.
+ * ssh_set_ticket() needs to be called before ssh_packet_next().
+ */
+int	ssh_set_ticket(struct ssh *ssh, const struct sshbuf *ticket);
+
+/*
+ * ssh_get_ticket() appends the most recent ticket issued by the server
+ * to the given buffer. the ticket contains the resumption secret and
+ * must be stored as carefully as a private key.
+ */
+int	ssh_get_ticket(struct ssh *ssh, struct sshbuf *ticket);
+
 /*
  * ssh_packet_next() advances to the next input packet and returns
  * the packet type in typep.
@@ -44,6 +44,8 @@
 
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/event.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <sys/tree.h>
 #include <sys/stat.h>
@@ -101,8 +103,11 @@
 #include "ssh-gss.h"
 #endif
 #include "monitor_wrap.h"
+#include "monitor_fdpass.h"
 #include "roaming.h"
 #include "ssh-sandbox.h"
+#include "srclimit.h"
+#include "pwcache.h"
 #include "version.h"
 #include "err.h"
 
@@ -121,7 +126,8 @@ int deny_severity = LOG_WARNING;
 #define REEXEC_DEVCRYPTO_RESERVED_FD	(STDERR_FILENO + 1)
 #define REEXEC_STARTUP_PIPE_FD		(STDERR_FILENO + 2)
 #define REEXEC_CONFIG_PASS_FD		(STDERR_FILENO + 3)
-#define REEXEC_MIN_FREE_FD		(STDERR_FILENO + 4)
+#define REEXEC_CERTCACHE_FD		(STDERR_FILENO + 4)
+#define REEXEC_MIN_FREE_FD		(STDERR_FILENO + 5)
 
 extern char *__progname;
 
@@ -202,6 +208,7 @@ static volatile sig_atomic_t key_do_regen = 0;
 /* This is set to true when a signal is received. */
 static volatile sig_atomic_t received_sighup = 0;
 static volatile sig_atomic_t received_sigterm = 0;
+static volatile sig_atomic_t received_siginfo = 0;
 
 /* session identifier, used by RSA-auth */
 u_char session_id[16];
@@ -217,6 +224,55 @@ u_int utmp_len = MAXHOSTNAMELEN;
 int *startup_pipes = NULL;
 int startup_pipe;		/* in child */
 
+/* Stack of unused startup_pipes slots */
+static int *startup_free = NULL;
+static int startup_nfree = 0;
+
+/*
+ * kqueue of the listener. Events carry the startup_pipes slot of a
+ * pipe, or one of the tags below.
+ */
+#define ACCEPT_TAG_LISTEN	(-1)
+#define ACCEPT_TAG_PREFORK	(-2)
+#define ACCEPT_EVENTS		64	/* events handled per wakeup */
+static int accept_kq = -1;
+
+/* Backing file of the verified certificate cache, in the listener */
+static int certcache_fd = -1;
+
+/*
+ * Re-executed sshd processes that have loaded their configuration and
+ * host keys and wait for the listener to pass them a connection.
+ */
+struct prefork_worker {
+	pid_t	pid;
+	int	fd;			/* control socket, -1 if slot unused */
+	int	ready;
+	struct timeval started;
+};
+static struct prefork_worker *prefork_workers = NULL;
+static int prefork_nworkers = 0;
+static char **prefork_argv;
+static int prefork_worker_flag = 0;	/* in worker */
+static struct {
+	u_int	spawned;
+	u_int	handed;		/* connections passed to a worker */
+	u_int	forked;		/* connections without a worker */
+	u_int	nready;
+	u_int64_t ready_usec;	/* total time from fork to ready */
+} prefork_stats;
+
+/*
+ * Workers that die before becoming ready are respawned after a delay
+ * that doubles with each consecutive failure; the pool is given up
+ * after PREFORK_MAX_FAILURES of them.
+ */
+#define PREFORK_BACKOFF_MIN	1	/* seconds */
+#define PREFORK_BACKOFF_MAX	60
+#define PREFORK_MAX_FAILURES	8
+static u_int prefork_failures = 0;	/* consecutive */
+static time_t prefork_respawn_at = 0;	/* no spawns before, if set */
+
 /* variables used for privilege separation */
 int use_privsep = -1;
 struct monitor *pmonitor = NULL;
@@ -289,6 +345,8 @@ sighup_restart(void)
 	logit("Received SIGHUP; restarting.");
 	close_listen_socks();
 	close_startup_pipes();
+	pwcache_flush();
+	canohost_dns_flush();
 	alarm(0);  /* alarm timer persists across exec */
 	signal(SIGHUP, SIG_IGN); /* will be restored after exec */
 	execv(saved_argv[0], saved_argv);
@@ -297,6 +355,16 @@ sighup_restart(void)
 	exit(1);
 }
 
+/*
+ * SIGINFO makes the listener log its per-source admission counters.
+ */
+/*ARGSUSED*/
+static void
+siginfo_handler(int sig)
+{
+	received_siginfo = 1;
+}
+
 /*
  * Generic signal handler for terminating signals in the master daemon.
  */
@@ -628,6 +696,36 @@ privsep_preauth_child(void)
 #endif
 }
 
+/*
+ * Set up the reverse lookup helper started by canohost_dns_start(): it
+ * needs neither the host keys nor root. It is not chrooted, as it must
+ * read the resolver configuration.
+ */
+static int
+dns_helper_setup(void)
+{
+	gid_t gidset[1];
+	struct passwd *pw;
+
+	destroy_sensitive_data();
+	if (getuid() != 0)
+		return 0;
+	if ((pw = getpwnam(SSH_PRIVSEP_USER)) == NULL) {
+		error("Privilege separation user %s does not exist",
+		    SSH_PRIVSEP_USER);
+		return -1;
+	}
+	memset(pw->pw_passwd, 0, strlen(pw->pw_passwd));
+	endpwent();
+	gidset[0] = pw->pw_gid;
+	if (setgroups(1, gidset) < 0) {
+		error("setgroups: %.100s", strerror(errno));
+		return -1;
+	}
+	permanently_set_uid(pw);
+	return 0;
+}
+
 static int
 privsep_preauth(struct authctxt *authctxt)
 {
@@ -923,6 +1021,7 @@ send_rexec_state(int fd, struct sshbuf *conf)
 	 *	bignum	iqmp			"
 	 *	bignum	p			"
 	 *	bignum	q			"
+	 *	u_int	certcache_follows	(on REEXEC_CERTCACHE_FD)
 	 */
 	if ((m = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
@@ -949,6 +1048,9 @@ send_rexec_state(int fd, struct sshbuf *conf)
 	} else if ((r = sshbuf_put_u32(m, 0)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 
+	if ((r = sshbuf_put_u32(m, certcache_fd != -1)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
 	if (ssh_msg_send(fd, 0, m) == -1)
 		fatal("%s: ssh_msg_send failed", __func__);
 
@@ -965,7 +1067,7 @@ recv_rexec_state(int fd, struct sshbuf *conf)
 	size_t len;
 	int r;
 	u_char ver;
-	u_int key_follows;
+	u_int key_follows, certcache_follows;
 
 	debug3("%s: entering fd = %d", __func__, fd);
 
@@ -1007,11 +1109,401 @@ recv_rexec_state(int fd, struct sshbuf *conf)
 		    sensitive_data.server_key->rsa)) != 0)
 			fatal("generate RSA parameters failed: %s", ssh_err(r));
 	}
+	if ((r = sshbuf_get_u32(m, &certcache_follows)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	if (certcache_follows) {
+		if (certcache_fd != -1)
+			close(certcache_fd);
+		certcache_fd = REEXEC_CERTCACHE_FD;
+	}
 	sshbuf_free(m);
 
 	debug3("%s: done", __func__);
 }
 
+/*
+ * Create the table of certificates with verified signatures that the
+ * connections share. It is an unlinked file so that it survives re-exec.
+ */
+static void
+certcache_create(void)
+{
+	char path[] = "/tmp/sshd.certcache.XXXXXXXXXX";
+	int fd;
+
+	if (options.cert_cache_size == 0)
+		return;
+	if ((fd = mkstemp(path)) == -1) {
+		error("%s: mkstemp: %s", __func__, strerror(errno));
+		return;
+	}
+	unlink(path);
+	/* Keep clear of the descriptors set up for re-exec */
+	if (fd < REEXEC_MIN_FREE_FD) {
+		certcache_fd = fcntl(fd, F_DUPFD, REEXEC_MIN_FREE_FD);
+		close(fd);
+	} else
+		certcache_fd = fd;
+	if (certcache_fd == -1 || ftruncate(certcache_fd,
+	    sshkey_certcache_size(options.cert_cache_size)) == -1) {
+		error("%s: %s", __func__, strerror(errno));
+		if (certcache_fd != -1)
+			close(certcache_fd);
+		certcache_fd = -1;
+		return;
+	}
+	/* Children get it by dup2; don't keep old caches across SIGHUP */
+	fcntl(certcache_fd, F_SETFD, FD_CLOEXEC);
+	debug("%s: %d entries", __func__, options.cert_cache_size);
+}
+
+/*
+ * Map the certificate cache into a new connection and close the file.
+ * The mapping is not inherited by the unprivileged and session processes
+ * that the connection forks, so only privileged code may add to it.
+ */
+static void
+certcache_attach(int fd)
+{
+	struct stat st;
+	size_t len = sshkey_certcache_size(options.cert_cache_size);
+	void *mem;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    st.st_uid != 0 || st.st_size != (off_t)len) {
+		debug("%s: no usable cache", __func__);
+		close(fd);
+		return;
+	}
+	mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		error("%s: mmap: %s", __func__, strerror(errno));
+		return;
+	}
+	if (minherit(mem, len, MAP_INHERIT_NONE) == -1) {
+		error("%s: minherit: %s", __func__, strerror(errno));
+		munmap(mem, len);
+		return;
+	}
+	sshkey_certcache_set(mem, len);
+}
+
+/* Have the accept loop wake up when fd becomes readable */
+static int
+accept_watch(int fd, intptr_t tag)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, (void *)tag);
+	if (kevent(accept_kq, &kev, 1, NULL, 0, NULL) == -1) {
+		error("%s: kevent: %s", __func__, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void
+prefork_init(void)
+{
+	int i;
+
+	if (options.prefork_workers <= 0)
+		return;
+	if (!rexec_flag || debug_flag) {
+		logit("PreforkWorkers disabled: re-exec is not in use");
+		return;
+	}
+	if (options.protocol & SSH_PROTO_1) {
+		logit("PreforkWorkers disabled: not supported with protocol 1");
+		return;
+	}
+	prefork_nworkers = MIN(options.prefork_workers, options.max_startups);
+	prefork_workers = xcalloc(prefork_nworkers, sizeof(*prefork_workers));
+	for (i = 0; i < prefork_nworkers; i++)
+		prefork_workers[i].fd = -1;
+	prefork_argv = xcalloc(rexec_argc + 3, sizeof(char *));
+	for (i = 0; i < rexec_argc; i++)
+		prefork_argv[i] = saved_argv[i];
+	prefork_argv[rexec_argc] = "-R";
+	prefork_argv[rexec_argc + 1] = "-W";
+	prefork_argv[rexec_argc + 2] = NULL;
+	debug("%s: %d workers", __func__, prefork_nworkers);
+}
+
+static void
+prefork_close(struct prefork_worker *w)
+{
+	if (w->fd != -1)
+		close(w->fd);
+	w->fd = -1;
+	w->pid = -1;
+	w->ready = 0;
+}
+
+/* Close the control sockets of all workers, in a forked child */
+static void
+prefork_close_all(void)
+{
+	int i;
+
+	for (i = 0; i < prefork_nworkers; i++)
+		if (prefork_workers[i].fd != -1)
+			close(prefork_workers[i].fd);
+	free(prefork_workers);
+	prefork_workers = NULL;
+	prefork_nworkers = 0;
+}
+
+static void
+prefork_title(void)
+{
+	int i, idle = 0, ready = 0;
+
+	for (i = 0; i < prefork_nworkers; i++) {
+		if (prefork_workers[i].fd == -1)
+			continue;
+		idle++;
+		if (prefork_workers[i].ready)
+			ready++;
+	}
+	setproctitle("[listener] prefork %d/%d ready, %u passed, %u forked, "
+	    "%llums avg startup", ready, idle, prefork_stats.handed,
+	    prefork_stats.forked, prefork_stats.nready == 0 ? 0ULL :
+	    (unsigned long long)(prefork_stats.ready_usec /
+	    prefork_stats.nready / 1000));
+}
+
+/* A worker could not be started or died before it was ready */
+static void
+prefork_failed(void)
+{
+	time_t delay;
+	int i;
+
+	if (++prefork_failures >= PREFORK_MAX_FAILURES) {
+		error("PreforkWorkers disabled: workers failed to start %u "
+		    "times in a row", prefork_failures);
+		for (i = 0; i < prefork_nworkers; i++) {
+			if (prefork_workers[i].fd == -1)
+				continue;
+			kill(prefork_workers[i].pid, SIGTERM);
+			prefork_close(&prefork_workers[i]);
+		}
+		free(prefork_workers);
+		prefork_workers = NULL;
+		prefork_nworkers = 0;
+		setproctitle("%s", "[listener]");
+		return;
+	}
+	delay = MIN(PREFORK_BACKOFF_MAX,
+	    PREFORK_BACKOFF_MIN << (prefork_failures - 1));
+	prefork_respawn_at = monotime() + delay;
+	logit("Prefork worker failed to start; retrying in %lds",
+	    (long)delay);
+}
+
+/* The kevent timeout needed to respawn workers after a backoff */
+static struct timespec *
+prefork_timeout(struct timespec *ts)
+{
+	time_t now;
+
+	if (prefork_nworkers == 0 || prefork_respawn_at == 0)
+		return NULL;
+	now = monotime();
+	ts->tv_sec = prefork_respawn_at > now ? prefork_respawn_at - now : 0;
+	ts->tv_nsec = 0;
+	return ts;
+}
+
+/* Start a worker: fork and re-execute like a connection child would */
+static int
+prefork_spawn(struct prefork_worker *w)
+{
+	int ctl[2], config_s[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctl) == -1) {
+		error("%s: socketpair: %s", __func__, strerror(errno));
+		return -1;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, config_s) == -1) {
+		error("%s: socketpair: %s", __func__, strerror(errno));
+		close(ctl[0]);
+		close(ctl[1]);
+		return -1;
+	}
+	if ((pid = fork()) == -1) {
+		error("%s: fork: %s", __func__, strerror(errno));
+		close(ctl[0]);
+		close(ctl[1]);
+		close(config_s[0]);
+		close(config_s[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		close(ctl[0]);
+		close(config_s[0]);
+		close_startup_pipes();
+		close_listen_socks();
+		prefork_close_all();
+		close(accept_kq);
+		if (setsid() < 0)
+			error("setsid: %.100s", strerror(errno));
+		dup2(ctl[1], STDIN_FILENO);
+		close(ctl[1]);
+		close(REEXEC_STARTUP_PIPE_FD);
+		dup2(config_s[1], REEXEC_CONFIG_PASS_FD);
+		close(config_s[1]);
+		if (certcache_fd == -1)
+			close(REEXEC_CERTCACHE_FD);
+		else
+			dup2(certcache_fd, REEXEC_CERTCACHE_FD);
+		execv(rexec_argv[0], prefork_argv);
+		error("rexec of %s failed: %s", rexec_argv[0], strerror(errno));
+		_exit(1);
+	}
+	close(ctl[1]);
+	close(config_s[1]);
+	send_rexec_state(config_s[0], cfg);
+	close(config_s[0]);
+	fcntl(ctl[0], F_SETFD, FD_CLOEXEC);
+
+	w->pid = pid;
+	w->fd = ctl[0];
+	w->ready = 0;
+	gettimeofday(&w->started, NULL);
+	if (accept_watch(w->fd, ACCEPT_TAG_PREFORK) != 0) {
+		kill(pid, SIGTERM);
+		prefork_close(w);
+		return -1;
+	}
+	prefork_stats.spawned++;
+	debug("Started prefork worker %ld.", (long)pid);
+	return 0;
+}
+
+/*
+ * Keep the pool filled, but never hold more workers than there are
+ * connection slots left under MaxStartups.
+ */
+static void
+prefork_fill(int startups)
+{
+	int i, live = 0, want;
+
+	if (prefork_respawn_at != 0) {
+		if (monotime() < prefork_respawn_at)
+			return;
+		prefork_respawn_at = 0;
+	}
+	for (i = 0; i < prefork_nworkers; i++)
+		if (prefork_workers[i].fd != -1)
+			live++;
+	want = MIN(prefork_nworkers, options.max_startups - startups);
+	for (i = 0; i < prefork_nworkers && live < want; i++) {
+		if (prefork_workers[i].fd != -1)
+			continue;
+		if (prefork_spawn(&prefork_workers[i]) != 0) {
+			prefork_failed();
+			break;
+		}
+		live++;
+	}
+}
+
+/* Workers write one byte once ready; anything else means they died */
+static void
+prefork_check(int fd)
+{
+	struct prefork_worker *w;
+	struct timeval now, elapsed;
+	u_char c;
+	int i, was_ready;
+
+	for (i = 0; i < prefork_nworkers; i++) {
+		w = &prefork_workers[i];
+		if (w->fd == -1 || w->fd != fd)
+			continue;
+		if (w->ready || read(w->fd, &c, 1) != 1) {
+			debug("Prefork worker %ld exited.", (long)w->pid);
+			was_ready = w->ready;
+			prefork_close(w);
+			if (!was_ready)
+				prefork_failed();
+			continue;
+		}
+		w->ready = 1;
+		prefork_failures = 0;
+		gettimeofday(&now, NULL);
+		timersub(&now, &w->started, &elapsed);
+		prefork_stats.nready++;
+		prefork_stats.ready_usec +=
+		    (u_int64_t)elapsed.tv_sec * 1000000 + elapsed.tv_usec;
+		debug2("Prefork worker %ld ready after %ld.%03lds",
+		    (long)w->pid, (long)elapsed.tv_sec,
+		    (long)elapsed.tv_usec / 1000);
+	}
+}
+
+/*
+ * Pass a connection and its startup pipe to a worker, preferring one
+ * that is ready. Returns -1 if the listener has to fork for it instead.
+ */
+static int
+prefork_handoff(int sock, int pipe_fd)
+{
+	struct prefork_worker *w = NULL;
+	int i;
+
+	for (i = 0; i < prefork_nworkers; i++) {
+		if (prefork_workers[i].fd == -1)
+			continue;
+		if (w == NULL || (!w->ready && prefork_workers[i].ready))
+			w = &prefork_workers[i];
+	}
+	if (w == NULL) {
+		if (prefork_nworkers > 0)
+			prefork_stats.forked++;
+		return -1;
+	}
+	if (mm_send_fd(w->fd, sock) == -1 || mm_send_fd(w->fd, pipe_fd) == -1) {
+		error("%s: could not pass connection to worker %ld",
+		    __func__, (long)w->pid);
+		kill(w->pid, SIGTERM);
+		prefork_close(w);
+		prefork_stats.forked++;
+		return -1;
+	}
+	debug("Passed connection to prefork worker %ld.", (long)w->pid);
+	prefork_close(w);
+	prefork_stats.handed++;
+	return 0;
+}
+
+/*
+ * In a worker: report that configuration and host keys are loaded, then
+ * wait for the listener to pass a connection and its startup pipe.
+ */
+static void
+prefork_worker_wait(int *sock_in, int *sock_out)
+{
+	u_char c = 0;
+
+	setproctitle("%s", "[prefork]");
+	if (atomicio(vwrite, STDIN_FILENO, &c, 1) != 1)
+		exit(0);
+	/* The listener exited or restarted without using this worker */
+	if (recv(STDIN_FILENO, &c, 1, MSG_PEEK) <= 0)
+		exit(0);
+	if ((*sock_in = mm_receive_fd(STDIN_FILENO)) == -1 ||
+	    (startup_pipe = mm_receive_fd(STDIN_FILENO)) == -1)
+		fatal("%s: could not receive connection", __func__);
+	*sock_out = *sock_in;
+	debug("%s: received connection", __func__);
+}
+
 /* Accept a connection from inetd */
 static void
 server_accept_inetd(int *sock_in, int *sock_out)
@@ -1021,10 +1513,14 @@ server_accept_inetd(int *sock_in, int *sock_out)
 	startup_pipe = -1;
 	if (rexeced_flag) {
 		close(REEXEC_CONFIG_PASS_FD);
-		*sock_in = *sock_out = dup(STDIN_FILENO);
-		if (!debug_flag) {
-			startup_pipe = dup(REEXEC_STARTUP_PIPE_FD);
-			close(REEXEC_STARTUP_PIPE_FD);
+		if (prefork_worker_flag)
+			prefork_worker_wait(sock_in, sock_out);
+		else {
+			*sock_in = *sock_out = dup(STDIN_FILENO);
+			if (!debug_flag) {
+				startup_pipe = dup(REEXEC_STARTUP_PIPE_FD);
+				close(REEXEC_STARTUP_PIPE_FD);
+			}
 		}
 	} else {
 		*sock_in = dup(STDIN_FILENO);
@@ -1116,28 +1612,39 @@ server_listen(void)
 /*
  * The main TCP accept loop. Note that, for the non-debug case, returns
  * from this function are in a forked subprocess.
+ *
+ * The listener waits on a kqueue, so a wakeup costs the same however
+ * many unauthenticated connections are outstanding.
  */
 static void
 server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 {
-	fd_set *fdset;
-	int i, j, ret, maxfd;
-	int key_used = 0, startups = 0;
+	struct kevent events[ACCEPT_EVENTS];
+	struct timespec ts;
+	int i, n, nev, slot;
+	int key_used = 0, startups = 0, handed;
 	int startup_p[2] = { -1 , -1 };
+	intptr_t tag;
 	struct sockaddr_storage from;
 	socklen_t fromlen;
 	pid_t pid;
 
-	/* setup fd set for accept */
-	fdset = NULL;
-	maxfd = 0;
+	if ((accept_kq = kqueue()) == -1)
+		fatal("kqueue: %s", strerror(errno));
+	fcntl(accept_kq, F_SETFD, FD_CLOEXEC);
 	for (i = 0; i < num_listen_socks; i++)
-		if (listen_socks[i] > maxfd)
-			maxfd = listen_socks[i];
+		if (accept_watch(listen_socks[i], ACCEPT_TAG_LISTEN) != 0)
+			fatal("Cannot wait for connections");
 	/* pipes connected to unauthenticated childs */
 	startup_pipes = xcalloc(options.max_startups, sizeof(int));
-	for (i = 0; i < options.max_startups; i++)
+	startup_free = xcalloc(options.max_startups, sizeof(int));
+	for (i = 0; i < options.max_startups; i++) {
 		startup_pipes[i] = -1;
+		startup_free[startup_nfree++] = options.max_startups - 1 - i;
+	}
+	prefork_init();
+	srclimit_init(options.per_source_rate, options.per_source_burst,
+	    options.per_source_masklen_ipv4, options.per_source_masklen_ipv6);
 
 	/*
 	 * Stay listening for connections until the system crashes or
@@ -1146,21 +1653,15 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 	for (;;) {
 		if (received_sighup)
 			sighup_restart();
-		if (fdset != NULL)
-			free(fdset);
-		fdset = (fd_set *)xcalloc(howmany(maxfd + 1, NFDBITS),
-		    sizeof(fd_mask));
-
-		for (i = 0; i < num_listen_socks; i++)
-			FD_SET(listen_socks[i], fdset);
-		for (i = 0; i < options.max_startups; i++)
-			if (startup_pipes[i] != -1)
-				FD_SET(startup_pipes[i], fdset);
-
-		/* Wait in select until there is a connection. */
-		ret = select(maxfd+1, fdset, NULL, NULL, NULL);
-		if (ret < 0 && errno != EINTR)
-			error("select: %.100s", strerror(errno));
+		prefork_fill(startups);
+		if (prefork_nworkers > 0)
+			prefork_title();
+
+		/* Wait until there is a connection. */
+		nev = kevent(accept_kq, NULL, 0, events, ACCEPT_EVENTS,
+		    prefork_timeout(&ts));
+		if (nev < 0 && errno != EINTR)
+			error("kevent: %.100s", strerror(errno));
 		if (received_sigterm) {
 			logit("Received signal %d; terminating.",
 			    (int) received_sigterm);
@@ -1173,27 +1674,35 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 			key_used = 0;
 			key_do_regen = 0;
 		}
-		if (ret < 0)
+		if (received_siginfo) {
+			received_siginfo = 0;
+			srclimit_dump();
+		}
+		if (nev < 0)
 			continue;
 
-		for (i = 0; i < options.max_startups; i++)
-			if (startup_pipes[i] != -1 &&
-			    FD_ISSET(startup_pipes[i], fdset)) {
-				/*
-				 * the read end of the pipe is ready
-				 * if the child has closed the pipe
-				 * after successful authentication
-				 * or if the child has died
-				 */
-				close(startup_pipes[i]);
-				startup_pipes[i] = -1;
-				startups--;
-			}
-		for (i = 0; i < num_listen_socks; i++) {
-			if (!FD_ISSET(listen_socks[i], fdset))
+		for (n = 0; n < nev; n++) {
+			tag = (intptr_t)events[n].udata;
+			if (tag == ACCEPT_TAG_PREFORK)
+				prefork_check((int)events[n].ident);
+			if (tag < 0 || startup_pipes[tag] == -1)
+				continue;
+			/*
+			 * the read end of the pipe is ready
+			 * if the child has closed the pipe
+			 * after successful authentication
+			 * or if the child has died
+			 */
+			close(startup_pipes[tag]);
+			startup_pipes[tag] = -1;
+			startup_free[startup_nfree++] = (int)tag;
+			startups--;
+		}
+		for (n = 0; n < nev && num_listen_socks >= 0; n++) {
+			if ((intptr_t)events[n].udata != ACCEPT_TAG_LISTEN)
 				continue;
 			fromlen = sizeof(from);
-			*newsock = accept(listen_socks[i],
+			*newsock = accept((int)events[n].ident,
 			    (struct sockaddr *)&from, &fromlen);
 			if (*newsock < 0) {
 				if (errno != EINTR && errno != EWOULDBLOCK &&
@@ -1204,6 +1713,12 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 					usleep(100 * 1000);
 				continue;
 			}
+			/* Refuse sources over their rate before any work */
+			if (!srclimit_check_allow((struct sockaddr *)&from,
+			    fromlen)) {
+				close(*newsock);
+				continue;
+			}
 			if (unset_nonblock(*newsock) == -1) {
 				close(*newsock);
 				continue;
@@ -1213,12 +1728,21 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 				close(*newsock);
 				continue;
 			}
-			if (pipe(startup_p) == -1) {
+			if (startup_nfree == 0 || pipe(startup_p) == -1) {
 				close(*newsock);
 				continue;
 			}
+			slot = startup_free[startup_nfree - 1];
+			if (accept_watch(startup_p[0], slot) != 0) {
+				close(*newsock);
+				close(startup_p[0]);
+				close(startup_p[1]);
+				continue;
+			}
+			handed = !debug_flag &&
+			    prefork_handoff(*newsock, startup_p[1]) == 0;
 
-			if (rexec_flag && socketpair(AF_UNIX,
+			if (!handed && rexec_flag && socketpair(AF_UNIX,
 			    SOCK_STREAM, 0, config_s) == -1) {
 				error("reexec socketpair: %s",
 				    strerror(errno));
@@ -1228,14 +1752,14 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 				continue;
 			}
 
-			for (j = 0; j < options.max_startups; j++)
-				if (startup_pipes[j] == -1) {
-					startup_pipes[j] = startup_p[0];
-					if (maxfd < startup_p[0])
-						maxfd = startup_p[0];
-					startups++;
-					break;
-				}
+			startup_nfree--;
+			startup_pipes[slot] = startup_p[0];
+			startups++;
+			if (handed) {
+				close(startup_p[1]);
+				close(*newsock);
+				continue;
+			}
 
 			/*
 			 * Got connection.  Fork a child to handle it, unless
@@ -1249,6 +1773,7 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 				 */
 				debug("Server will not fork when running in debugging mode.");
 				close_listen_socks();
+				close(accept_kq);
 				*sock_in = *newsock;
 				*sock_out = *newsock;
 				close(startup_p[0]);
@@ -1279,6 +1804,8 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 				startup_pipe = startup_p[1];
 				close_startup_pipes();
 				close_listen_socks();
+				prefork_close_all();
+				close(accept_kq);
 				*sock_in = *newsock;
 				*sock_out = *newsock;
 				log_init(__progname,
@@ -1365,7 +1892,7 @@ main(int ac, char **av)
 	initialize_server_options(&options);
 
 	/* Parse command-line arguments. */
-	while ((opt = getopt(ac, av, "f:p:b:k:h:g:u:o:C:dDeE:iqrtQRT46")) != -1) {
+	while ((opt = getopt(ac, av, "f:p:b:k:h:g:u:o:C:dDeE:iqrtQRTW46")) != -1) {
 		switch (opt) {
 		case '4':
 			options.address_family = AF_INET;
@@ -1410,6 +1937,9 @@ main(int ac, char **av)
 			rexeced_flag = 1;
 			inetd_flag = 1;
 			break;
+		case 'W':
+			prefork_worker_flag = 1;
+			break;
 		case 'Q':
 			/* ignored */
 			break;
@@ -1537,9 +2067,11 @@ main(int ac, char **av)
 
 	parse_server_config(&options, rexeced_flag ? "rexec" : config_file_name,
 	    cfg, NULL);
+	compile_server_match_config(cfg);
 
 	/* Fill in default values for those options not explicitly set. */
 	fill_default_server_options(&options);
+	pwcache_init(options.user_cache_time);
 
 	/* challenge-response is implemented via keyboard interactive */
 	if (options.challenge_response_authentication)
@@ -1598,6 +2130,15 @@ main(int ac, char **av)
 			sensitive_data.host_keys[i] = NULL;
 			continue;
 		}
+		/*
+		 * Only worth it where the keys outlive one connection: a
+		 * listener whose children do not re-exec, or a prefork
+		 * worker. Re-exec'd and inetd children load them afresh.
+		 */
+		if ((prefork_worker_flag || (!rexec_flag && !inetd_flag)) &&
+		    (r = sshkey_precompute(key)) != 0)
+			error("Could not prepare host key \"%s\": %s",
+			    options.host_key_files[i], ssh_err(r));
 		sensitive_data.host_keys[i] = key;
 		switch (key->type) {
 		case KEY_RSA1:
@@ -1707,8 +2248,12 @@ main(int ac, char **av)
 	}
 
 	if (test_flag > 1) {
-		if (server_match_spec_complete(connection_info) == 1)
+		if (server_match_spec_complete(connection_info) == 1) {
+			if (verify_server_match_config(connection_info) != 0)
+				fatal("Compiled Match blocks do not agree with "
+				    "the configuration file");
 			parse_server_match_config(&options, connection_info);
+		}
 		dump_config(&options);
 	}
 
@@ -1772,6 +2317,7 @@ main(int ac, char **av)
 		server_accept_inetd(&sock_in, &sock_out);
 	} else {
 		server_listen();
+		certcache_create();
 
 		if (options.protocol & SSH_PROTO_1)
 			generate_ephemeral_server_key();
@@ -1780,6 +2326,7 @@ main(int ac, char **av)
 		signal(SIGCHLD, main_sigchld_handler);
 		signal(SIGTERM, sigterm_handler);
 		signal(SIGQUIT, sigterm_handler);
+		signal(SIGINFO, siginfo_handler);
 
 		/*
 		 * Write out the pid file after the sigterm handler
@@ -1829,6 +2376,10 @@ main(int ac, char **av)
 		close(config_s[1]);
 		if (startup_pipe != -1)
 			close(startup_pipe);
+		if (certcache_fd == -1)
+			close(REEXEC_CERTCACHE_FD);
+		else
+			dup2(certcache_fd, REEXEC_CERTCACHE_FD);
 
 		execv(rexec_argv[0], rexec_argv);
 
@@ -1853,6 +2404,11 @@ main(int ac, char **av)
 		    sock_in, sock_out, newsock, startup_pipe, config_s[0]);
 	}
 
+	if (certcache_fd != -1) {
+		certcache_attach(certcache_fd);
+		certcache_fd = -1;
+	}
+
 	/* Executed child processes don't need these. */
 	fcntl(sock_out, F_SETFD, FD_CLOEXEC);
 	fcntl(sock_in, F_SETFD, FD_CLOEXEC);
@@ -1868,6 +2424,7 @@ main(int ac, char **av)
 	signal(SIGTERM, SIG_DFL);
 	signal(SIGQUIT, SIG_DFL);
 	signal(SIGCHLD, SIG_DFL);
+	signal(SIGINFO, SIG_DFL);
 
 	/*
 	 * Register our connection.  This turns encryption off because we do
@@ -1899,6 +2456,11 @@ main(int ac, char **av)
 	 */
 	remote_ip = ssh_remote_ipaddr(ssh);
 
+	/* Look up the client's name while the protocol exchange runs */
+	if (options.use_dns)
+		canohost_dns_start(options.dns_timeout,
+		    options.dns_cache_time, dns_helper_setup);
+
 #ifdef LIBWRAP
 	/* Check whether logins are denied from this host. */
 	if (ssh_packet_connection_is_on_socket(ssh)) {
@@ -109,9 +109,9 @@ get_last_login_time(uid_t uid, const char *logname,
 
 /*
  * Generate and store last login message.  This must be done before
- * login_login() is called and lastlog is updated.
+ * record_login() is called and lastlog is updated.
  */
-static void
+void
 store_lastlog_message(const char *user, uid_t uid)
 {
 	char *time_string, hostname[MAXHOSTNAMELEN] = "";
@@ -151,9 +151,6 @@ record_login(pid_t pid, const char *tty, const char *user, uid_t uid,
 	char *lastlog;
 	struct utmp u;
 
-	/* save previous login details before writing new */
-	store_lastlog_message(user, uid);
-
 	/* Construct an utmp/wtmp entry. */
 	memset(&u, 0, sizeof(u));
 	strncpy(u.ut_line, tty + 5, sizeof(u.ut_line));
@@ -17,3 +17,4 @@ record_login(pid_t, const char *, const char *, uid_t,
     const char *, struct sockaddr *, socklen_t);
 void	 record_logout(pid_t, const char *);
 time_t	 get_last_login_time(uid_t, const char *, char *, size_t);
+void	 store_lastlog_message(const char *, uid_t);
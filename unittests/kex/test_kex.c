@@ -11,6 +11,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "test_helper.h"
 
@@ -159,6 +160,174 @@ do_kex_with_key(char *kex, int key_type, int bits)
 	TEST_DONE();
 }
 
+/* Make a client ticket look as though its lifetime has run out */
+static void
+expire_ticket(struct sshbuf *ticket)
+{
+	u_char *p;
+
+	ASSERT_SIZE_T_GE(sshbuf_len(ticket), 8);
+	p = sshbuf_mutable_ptr(ticket);
+	ASSERT_PTR_NE(p, NULL);
+	POKE_U64(p + sshbuf_len(ticket) - 8, (u_int64_t)time(NULL) - 1);
+}
+
+static void
+do_kex_ticket(int key_type, int bits)
+{
+	struct ssh *client = NULL, *server = NULL;
+	struct ssh *client2 = NULL, *server2 = NULL, *server3 = NULL;
+	struct ssh *client3 = NULL, *server4 = NULL;
+	struct ssh *client4 = NULL, *server5 = NULL;
+	struct sshkey *private, *public;
+	struct sshbuf *ticket, *expired;
+	u_char key[KEX_TICKET_KEY_LEN], badkey[KEX_TICKET_KEY_LEN];
+	int r;
+
+	TEST_START("ticket setup");
+	memset(key, 'k', sizeof(key));
+	memset(badkey, 'b', sizeof(badkey));
+	ASSERT_INT_EQ(sshkey_generate(key_type, bits, &private), 0);
+	ASSERT_INT_EQ(sshkey_from_private(private, &public), 0);
+	ASSERT_INT_EQ(ssh_init(&client, 0, NULL), 0);
+	ASSERT_INT_EQ(ssh_init(&server, 1, NULL), 0);
+	ASSERT_INT_EQ(ssh_add_hostkey(server, private), 0);
+	ASSERT_INT_EQ(ssh_add_hostkey(client, public), 0);
+	ASSERT_INT_EQ(ssh_set_ticket_key(server, key, sizeof(key), 60), 0);
+	ASSERT_INT_EQ(ssh_set_ticket(client, NULL), 0);
+	TEST_DONE();
+
+	TEST_START("ticket issued after full kex");
+	run_kex(client, server);
+	ASSERT_INT_EQ(do_send_and_receive(server, client), 0);
+	ASSERT_U_INT_NE(client->kex->kex_type, KEX_TICKET);
+	ticket = sshbuf_new();
+	ASSERT_PTR_NE(ticket, NULL);
+	ASSERT_INT_EQ(ssh_get_ticket(client, ticket), 0);
+	ASSERT_SIZE_T_GT(sshbuf_len(ticket), 0);
+	TEST_DONE();
+
+	TEST_START("resume with ticket");
+	ASSERT_INT_EQ(ssh_init(&client2, 0, NULL), 0);
+	ASSERT_INT_EQ(ssh_init(&server2, 1, NULL), 0);
+	ASSERT_INT_EQ(ssh_add_hostkey(server2, private), 0);
+	ASSERT_INT_EQ(ssh_set_ticket_key(server2, key, sizeof(key), 60), 0);
+	ASSERT_INT_EQ(ssh_set_ticket(client2, ticket), 0);
+	run_kex(client2, server2);
+	ASSERT_U_INT_EQ(client2->kex->kex_type, KEX_TICKET);
+	ASSERT_U_INT_EQ(server2->kex->kex_type, KEX_TICKET);
+	ASSERT_INT_EQ(do_send_and_receive(server2, client2), 0);
+	sshbuf_reset(ticket);
+	ASSERT_INT_EQ(ssh_get_ticket(client2, ticket), 0);
+	TEST_DONE();
+
+	TEST_START("rekeying resumed session");
+	ASSERT_INT_EQ(kex_send_kexinit(client2), 0);
+	run_kex(client2, server2);
+	ASSERT_U_INT_NE(client2->kex->kex_type, KEX_TICKET);
+	ASSERT_U_INT_NE(server2->kex->kex_type, KEX_TICKET);
+	ASSERT_INT_EQ(do_send_and_receive(server2, client2), 0);
+	ASSERT_INT_EQ(kex_send_kexinit(server2), 0);
+	run_kex(client2, server2);
+	ASSERT_U_INT_NE(client2->kex->kex_type, KEX_TICKET);
+	ASSERT_U_INT_NE(server2->kex->kex_type, KEX_TICKET);
+	ASSERT_INT_EQ(do_send_and_receive(server2, client2), 0);
+	TEST_DONE();
+
+	TEST_START("full kex once ticket has expired");
+	ASSERT_INT_EQ(ssh_init(&client3, 0, NULL), 0);
+	ASSERT_INT_EQ(ssh_init(&server4, 1, NULL), 0);
+	ASSERT_INT_EQ(ssh_add_hostkey(server4, private), 0);
+	ASSERT_INT_EQ(ssh_add_hostkey(client3, public), 0);
+	ASSERT_INT_EQ(ssh_set_ticket_key(server4, key, sizeof(key), 60), 0);
+	ASSERT_INT_EQ(ssh_set_ticket(client3, ticket), 0);
+	/* the ticket expires between ssh_set_ticket() and the kex */
+	expire_ticket(client3->kex->ticket);
+	run_kex(client3, server4);
+	ASSERT_U_INT_NE(client3->kex->kex_type, KEX_TICKET);
+	ASSERT_U_INT_NE(server4->kex->kex_type, KEX_TICKET);
+	ASSERT_INT_EQ(do_send_and_receive(server4, client3), 0);
+	expired = sshbuf_new();
+	ASSERT_PTR_NE(expired, NULL);
+	ASSERT_INT_EQ(ssh_get_ticket(client3, expired), 0);
+	/* a ticket from the new kex, not the expired one */
+	ASSERT_SIZE_T_EQ(sshbuf_len(expired), sshbuf_len(ticket));
+	ASSERT_MEM_NE(sshbuf_ptr(expired), sshbuf_ptr(ticket),
+	    sshbuf_len(ticket));
+	TEST_DONE();
+
+	TEST_START("ticket name not configurable");
+	ASSERT_INT_EQ(kex_names_valid(KEX_TICKET_SHA256), 0);
+	ASSERT_INT_EQ(kex_names_valid("ecdh-sha2-nistp256,"
+	    KEX_TICKET_SHA256), 0);
+	ASSERT_INT_EQ(kex_names_valid("ecdh-sha2-nistp256"), 1);
+	TEST_DONE();
+
+	TEST_START("resuming client, server without ticket key");
+	ASSERT_INT_EQ(ssh_init(&client4, 0, NULL), 0);
+	ASSERT_INT_EQ(ssh_init(&server5, 1, NULL), 0);
+	ASSERT_INT_EQ(ssh_add_hostkey(server5, private), 0);
+	ASSERT_INT_EQ(ssh_add_hostkey(client4, public), 0);
+	ASSERT_INT_EQ(ssh_set_ticket(client4, ticket), 0);
+	run_kex(client4, server5);
+	ASSERT_INT_EQ(client4->kex->ticket_ok, 0);
+	ASSERT_U_INT_NE(client4->kex->kex_type, KEX_TICKET);
+	ASSERT_U_INT_NE(server5->kex->kex_type, KEX_TICKET);
+	TEST_DONE();
+
+	TEST_START("ticket negotiated without ticket handler");
+	ssh_free(client4);
+	ssh_free(server5);
+	ASSERT_INT_EQ(ssh_init(&client4, 0, NULL), 0);
+	ASSERT_INT_EQ(ssh_init(&server5, 1, NULL), 0);
+	ASSERT_INT_EQ(ssh_add_hostkey(server5, private), 0);
+	ASSERT_INT_EQ(ssh_set_ticket_key(server5, key, sizeof(key), 60), 0);
+	ASSERT_INT_EQ(ssh_set_ticket(client4, ticket), 0);
+	/* as in a server that never installed the ticket methods */
+	server5->kex->kex[KEX_TICKET] = NULL;
+	r = 0;
+	while (!server5->kex->done || !client4->kex->done) {
+		if ((r = do_send_and_receive(server5, client4)) != 0 ||
+		    (r = do_send_and_receive(client4, server5)) != 0)
+			break;
+	}
+	ASSERT_INT_EQ(r, SSH_ERR_NO_KEX_ALG_MATCH);
+	TEST_DONE();
+
+	TEST_START("ticket rejected with wrong key");
+	ssh_free(client2);
+	ASSERT_INT_EQ(ssh_init(&client2, 0, NULL), 0);
+	ASSERT_INT_EQ(ssh_init(&server3, 1, NULL), 0);
+	ASSERT_INT_EQ(ssh_add_hostkey(server3, private), 0);
+	ASSERT_INT_EQ(ssh_set_ticket_key(server3, badkey, sizeof(badkey),
+	    60), 0);
+	ASSERT_INT_EQ(ssh_set_ticket(client2, ticket), 0);
+	r = 0;
+	while (!server3->kex->done || !client2->kex->done) {
+		if ((r = do_send_and_receive(server3, client2)) != 0 ||
+		    (r = do_send_and_receive(client2, server3)) != 0)
+			break;
+	}
+	ASSERT_INT_EQ(r, SSH_ERR_TICKET_INVALID);
+	TEST_DONE();
+
+	TEST_START("ticket cleanup");
+	sshbuf_free(ticket);
+	sshbuf_free(expired);
+	sshkey_free(private);
+	sshkey_free(public);
+	ssh_free(client);
+	ssh_free(server);
+	ssh_free(client2);
+	ssh_free(server2);
+	ssh_free(server3);
+	ssh_free(client3);
+	ssh_free(server4);
+	ssh_free(client4);
+	ssh_free(server5);
+	TEST_DONE();
+}
+
 static void
 do_kex(char *kex)
 {
@@ -177,4 +346,5 @@ kex_tests(void)
 	do_kex("diffie-hellman-group-exchange-sha1");
 	do_kex("diffie-hellman-group14-sha1");
 	do_kex("diffie-hellman-group1-sha1");
+	do_kex_ticket(KEY_ECDSA, 256);
 }
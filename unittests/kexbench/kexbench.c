@@ -0,0 +1,432 @@
+/* 	$OpenBSD$ */
+/*
+ * Benchmark in-process key exchanges: handshakes/sec, latency
+ * percentiles and rekey cost per (kex, hostkey, cipher) combination.
+ *
+ * Placed in the public domain
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#include "err.h"
+#include "ssh_api.h"
+#include "sshbuf.h"
+#include "packet.h"
+#include "myproposal.h"
+
+#define DEFAULT_KEX	KEX_DEFAULT_KEX
+#define DEFAULT_HOSTKEY	"rsa:2048,dsa:1024,ecdsa:256"
+#define DEFAULT_CIPHER	"aes128-ctr"
+#define MAX_THREADS	256
+
+extern char *__progname;
+
+struct bench_params {
+	char	*kex;
+	char	*cipher;
+	struct sshkey *private;
+	struct sshkey *public;
+	u_int	count;		/* handshakes per thread */
+	u_int	rekeys;		/* rekeys per handshake */
+};
+
+struct bench_result {
+	double	*hs_lat;	/* per handshake latency (usec) */
+	double	*rk_lat;	/* per rekey latency (usec) */
+	u_int	nhs;
+	u_int	nrk;
+	int	error;
+};
+
+struct bench_thread {
+	pthread_t	tid;
+	struct bench_params *params;
+	struct bench_result result;
+};
+
+static pthread_mutex_t *ssl_locks;
+
+static void
+ssl_locking_cb(int mode, int n, const char *file, int line)
+{
+	if (mode & CRYPTO_LOCK)
+		pthread_mutex_lock(&ssl_locks[n]);
+	else
+		pthread_mutex_unlock(&ssl_locks[n]);
+}
+
+static void
+ssl_threadid_cb(CRYPTO_THREADID *id)
+{
+	CRYPTO_THREADID_set_numeric(id, (unsigned long)pthread_self());
+}
+
+/* libcrypto needs lock callbacks before it is used from several threads */
+static void
+ssl_thread_setup(void)
+{
+	int i, n = CRYPTO_num_locks();
+
+	if ((ssl_locks = calloc(n, sizeof(*ssl_locks))) == NULL) {
+		fprintf(stderr, "%s: calloc failed\n", __func__);
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		pthread_mutex_init(&ssl_locks[i], NULL);
+	CRYPTO_THREADID_set_callback(ssl_threadid_cb);
+	CRYPTO_set_locking_callback(ssl_locking_cb);
+}
+
+static double
+elapsed_usec(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e6 +
+	    (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static int
+do_send_and_receive(struct ssh *from, struct ssh *to)
+{
+	u_char type;
+	size_t len;
+	const u_char *buf;
+	int r;
+
+	for (;;) {
+		if ((r = ssh_packet_next(from, &type)) != 0)
+			return r;
+		if (type != 0)
+			return 0;
+		buf = ssh_output_ptr(from, &len);
+		if (len == 0)
+			return 0;
+		if ((r = ssh_output_consume(from, len)) != 0 ||
+		    (r = ssh_input_append(to, buf, len)) != 0)
+			return r;
+	}
+}
+
+static int
+run_kex(struct ssh *client, struct ssh *server)
+{
+	int r = 0;
+
+	while (!server->kex->done || !client->kex->done) {
+		if ((r = do_send_and_receive(server, client)) != 0 ||
+		    (r = do_send_and_receive(client, server)) != 0)
+			return r;
+	}
+	return 0;
+}
+
+/* Perform one full handshake, optionally followed by client rekeys */
+static int
+do_handshake(struct bench_params *p, struct bench_result *res)
+{
+	struct ssh *client = NULL, *server = NULL;
+	struct kex_params kex_params;
+	struct timespec start, end;
+	u_int i;
+	int r;
+
+	memcpy(kex_params.proposal, myproposal, sizeof(myproposal));
+	kex_params.proposal[PROPOSAL_KEX_ALGS] = p->kex;
+	kex_params.proposal[PROPOSAL_ENC_ALGS_CTOS] = p->cipher;
+	kex_params.proposal[PROPOSAL_ENC_ALGS_STOC] = p->cipher;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((r = ssh_init(&client, 0, &kex_params)) != 0 ||
+	    (r = ssh_init(&server, 1, &kex_params)) != 0 ||
+	    (r = ssh_add_hostkey(server, p->private)) != 0 ||
+	    (r = ssh_add_hostkey(client, p->public)) != 0 ||
+	    (r = run_kex(client, server)) != 0)
+		goto out;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	res->hs_lat[res->nhs++] = elapsed_usec(&start, &end);
+
+	for (i = 0; i < p->rekeys; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if ((r = kex_send_kexinit(client)) != 0 ||
+		    (r = run_kex(client, server)) != 0)
+			goto out;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		res->rk_lat[res->nrk++] = elapsed_usec(&start, &end);
+	}
+ out:
+	if (client != NULL)
+		ssh_free(client);
+	if (server != NULL)
+		ssh_free(server);
+	return r;
+}
+
+static void *
+bench_thread(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct bench_params *p = t->params;
+	u_int i;
+
+	for (i = 0; i < p->count; i++) {
+		if ((t->result.error = do_handshake(p,
+		    &t->result)) != 0)
+			break;
+	}
+	return NULL;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : (x > y);
+}
+
+static double
+percentile(const double *v, u_int n, u_int pct)
+{
+	u_int i;
+
+	if (n == 0)
+		return 0;
+	i = ((u_int64_t)n * pct + 99) / 100;
+	return v[i == 0 ? 0 : i - 1];
+}
+
+static void
+report(const char *what, double *v, u_int n)
+{
+	qsort(v, n, sizeof(*v), cmp_double);
+	printf(" %s p50 %.0f p90 %.0f p99 %.0f max %.0f us",
+	    what, percentile(v, n, 50), percentile(v, n, 90),
+	    percentile(v, n, 99), n ? v[n - 1] : 0);
+}
+
+static int
+run_bench(struct bench_params *p, const char *keyspec, u_int nthreads)
+{
+	struct bench_thread *threads;
+	struct timespec start, end;
+	double *hs_all = NULL, *rk_all = NULL, secs;
+	u_int i, nhs = 0, nrk = 0;
+	int r, ret = -1;
+
+	if ((threads = calloc(nthreads, sizeof(*threads))) == NULL)
+		goto out;
+	for (i = 0; i < nthreads; i++) {
+		threads[i].params = p;
+		if ((threads[i].result.hs_lat = calloc(p->count,
+		    sizeof(double))) == NULL ||
+		    (threads[i].result.rk_lat = calloc((size_t)p->count *
+		    p->rekeys + 1, sizeof(double))) == NULL)
+			goto out;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nthreads; i++) {
+		if ((r = pthread_create(&threads[i].tid, NULL, bench_thread,
+		    &threads[i])) != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(r));
+			exit(1);
+		}
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i].tid, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = elapsed_usec(&start, &end) / 1e6;
+
+	if ((hs_all = calloc((size_t)p->count * nthreads,
+	    sizeof(double))) == NULL ||
+	    (rk_all = calloc((size_t)p->count * p->rekeys * nthreads + 1,
+	    sizeof(double))) == NULL)
+		goto out;
+	for (i = 0; i < nthreads; i++) {
+		if (threads[i].result.error != 0) {
+			fprintf(stderr, "%s %s %s: %s\n", p->kex, keyspec,
+			    p->cipher, ssh_err(threads[i].result.error));
+			goto out;
+		}
+		memcpy(hs_all + nhs, threads[i].result.hs_lat,
+		    threads[i].result.nhs * sizeof(double));
+		nhs += threads[i].result.nhs;
+		memcpy(rk_all + nrk, threads[i].result.rk_lat,
+		    threads[i].result.nrk * sizeof(double));
+		nrk += threads[i].result.nrk;
+	}
+
+	printf("%s %s %s threads %u: %u hs in %.2fs %.1f hs/s",
+	    p->kex, keyspec, p->cipher, nthreads, nhs, secs,
+	    secs > 0 ? nhs / secs : 0);
+	report("hs", hs_all, nhs);
+	if (nrk > 0)
+		report("rekey", rk_all, nrk);
+	printf("\n");
+	ret = 0;
+ out:
+	if (threads != NULL) {
+		for (i = 0; i < nthreads; i++) {
+			free(threads[i].result.hs_lat);
+			free(threads[i].result.rk_lat);
+		}
+		free(threads);
+	}
+	free(hs_all);
+	free(rk_all);
+	return ret;
+}
+
+/* Parse a "type[:bits]" host key specification */
+static int
+parse_keyspec(const char *spec, int *typep, u_int *bitsp)
+{
+	char *cp, *type;
+	const char *errstr;
+	int ret = -1;
+
+	if ((type = strdup(spec)) == NULL)
+		return -1;
+	*bitsp = 0;
+	if ((cp = strchr(type, ':')) != NULL) {
+		*cp++ = '\0';
+		*bitsp = strtonum(cp, 1, 16384, &errstr);
+		if (errstr != NULL)
+			goto out;
+	}
+	if (strcmp(type, "rsa") == 0) {
+		*typep = KEY_RSA;
+		if (*bitsp == 0)
+			*bitsp = 2048;
+	} else if (strcmp(type, "dsa") == 0) {
+		*typep = KEY_DSA;
+		if (*bitsp == 0)
+			*bitsp = 1024;
+	} else if (strcmp(type, "ecdsa") == 0) {
+		*typep = KEY_ECDSA;
+		if (*bitsp == 0)
+			*bitsp = 256;
+	} else
+		goto out;
+	ret = 0;
+ out:
+	free(type);
+	return ret;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: %s [-c ciphers] [-h hostkeys] [-k kexes] [-n count]\n"
+	    "       %*s [-r rekeys] [-t threads]\n",
+	    __progname, (int)strlen(__progname), "");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_params p;
+	char *kexes = DEFAULT_KEX, *hostkeys = DEFAULT_HOSTKEY;
+	char *ciphers = DEFAULT_CIPHER;
+	char *kl, *hl, *cl, *kcp, *hcp, *ccp, *kex, *hk, *cipher;
+	const char *errstr;
+	u_int bits, nthreads = 1;
+	int ch, r, type, ret = 0;
+
+	memset(&p, 0, sizeof(p));
+	p.count = 100;
+	while ((ch = getopt(argc, argv, "c:h:k:n:r:t:")) != -1) {
+		switch (ch) {
+		case 'c':
+			ciphers = optarg;
+			break;
+		case 'h':
+			hostkeys = optarg;
+			break;
+		case 'k':
+			kexes = optarg;
+			break;
+		case 'n':
+			p.count = strtonum(optarg, 1, 10000000, &errstr);
+			if (errstr != NULL)
+				usage();
+			break;
+		case 'r':
+			p.rekeys = strtonum(optarg, 0, 100000, &errstr);
+			if (errstr != NULL)
+				usage();
+			break;
+		case 't':
+			nthreads = strtonum(optarg, 1, MAX_THREADS, &errstr);
+			if (errstr != NULL)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc != optind)
+		usage();
+	/* ssh_init() would do this lazily, but not in a thread-safe way */
+	OpenSSL_add_all_algorithms();
+	if (nthreads > 1)
+		ssl_thread_setup();
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	if ((hl = strdup(hostkeys)) == NULL) {
+		fprintf(stderr, "strdup failed\n");
+		exit(1);
+	}
+	for (hcp = hl; (hk = strsep(&hcp, ",")) != NULL && *hk != '\0';) {
+		if (parse_keyspec(hk, &type, &bits) != 0) {
+			fprintf(stderr, "invalid host key \"%s\"\n", hk);
+			exit(1);
+		}
+		/* Once, before the threads start sharing the key */
+		if ((r = sshkey_generate(type, bits, &p.private)) != 0 ||
+		    (r = sshkey_precompute(p.private)) != 0 ||
+		    (r = sshkey_from_private(p.private, &p.public)) != 0) {
+			fprintf(stderr, "generate %s: %s\n", hk, ssh_err(r));
+			exit(1);
+		}
+		if ((kl = strdup(kexes)) == NULL) {
+			fprintf(stderr, "strdup failed\n");
+			exit(1);
+		}
+		for (kcp = kl; (kex = strsep(&kcp, ",")) != NULL &&
+		    *kex != '\0';) {
+			p.kex = kex;
+			if ((cl = strdup(ciphers)) == NULL) {
+				fprintf(stderr, "strdup failed\n");
+				exit(1);
+			}
+			for (ccp = cl; (cipher = strsep(&ccp, ",")) != NULL &&
+			    *cipher != '\0';) {
+				p.cipher = cipher;
+				if (run_bench(&p, hk, nthreads) != 0)
+					ret = 1;
+			}
+			free(cl);
+		}
+		free(kl);
+		sshkey_free(p.private);
+		sshkey_free(p.public);
+		p.private = p.public = NULL;
+	}
+	free(hl);
+	return ret;
+}
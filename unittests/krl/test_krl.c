@@ -0,0 +1,558 @@
+/* 	$OpenBSD$ */
+/*
+ * Regress test for KRL checking: the compiled KRL that sshd reads with
+ * ssh_krl_file_contains_key() must give the same answers as a KRL parsed
+ * by ssh_krl_from_blob() and checked with ssh_krl_check_key().
+ *
+ * Placed in the public domain
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_helper.h"
+
+#include "err.h"
+#include "ssh2.h"
+#include "key.h"
+#include "sshbuf.h"
+#include "krl.h"
+
+void krl_tests(void);
+
+/* Keys and certificates checked against every KRL, in this order */
+enum {
+	P_SERIAL1, P_SERIAL3, P_SERIAL5, P_SERIAL9, P_SERIAL20, P_SERIAL21,
+	P_SERIAL100, P_SERIAL150, P_SERIAL200, P_SERIAL201, P_SERIAL1000,
+	P_SERIAL1001, P_SERIAL1003, P_SERIAL1010, P_SERIAL1011, P_KEYID,
+	P_SERIAL0, P_OTHERCA, P_EXPLICIT, P_SHA1, P_PLAIN, P_EXPLICIT_CERT,
+	P_MAX
+};
+
+static struct sshkey *ca, *other_ca, *user, *explicit, *sha1;
+static struct sshkey *probes[P_MAX];
+static char tmpdir[PATH_MAX];
+static u_int nfiles;
+
+static struct sshkey *
+make_cert(struct sshkey *key, struct sshkey *signer, u_int64_t serial,
+    const char *key_id)
+{
+	struct sshkey *k;
+
+	ASSERT_INT_EQ(sshkey_demote(key, &k), 0);
+	ASSERT_INT_EQ(sshkey_to_certified(k, 0), 0);
+	k->cert->type = SSH2_CERT_TYPE_USER;
+	k->cert->serial = serial;
+	k->cert->key_id = strdup(key_id);
+	ASSERT_PTR_NE(k->cert->key_id, NULL);
+	k->cert->valid_before = 0xffffffffffffffffULL;
+	ASSERT_INT_EQ(sshkey_certify(k, signer), 0);
+	return k;
+}
+
+static void
+make_probes(void)
+{
+	static const u_int64_t serials[] = {
+		1, 3, 5, 9, 20, 21, 100, 150, 200, 201,
+		1000, 1001, 1003, 1010, 1011
+	};
+	u_int i;
+
+	ASSERT_INT_EQ(sshkey_generate(KEY_ECDSA, 256, &ca), 0);
+	ASSERT_INT_EQ(sshkey_generate(KEY_ECDSA, 256, &other_ca), 0);
+	ASSERT_INT_EQ(sshkey_generate(KEY_ECDSA, 256, &user), 0);
+	ASSERT_INT_EQ(sshkey_generate(KEY_ECDSA, 256, &explicit), 0);
+	ASSERT_INT_EQ(sshkey_generate(KEY_ECDSA, 256, &sha1), 0);
+	for (i = 0; i < sizeof(serials) / sizeof(*serials); i++)
+		probes[P_SERIAL1 + i] = make_cert(user, ca, serials[i], "user");
+	probes[P_KEYID] = make_cert(user, ca, 7777, "revoked-id");
+	probes[P_SERIAL0] = make_cert(user, ca, 0, "user");
+	probes[P_OTHERCA] = make_cert(user, other_ca, 1, "revoked-id");
+	ASSERT_INT_EQ(sshkey_demote(explicit, &probes[P_EXPLICIT]), 0);
+	ASSERT_INT_EQ(sshkey_demote(sha1, &probes[P_SHA1]), 0);
+	ASSERT_INT_EQ(sshkey_demote(user, &probes[P_PLAIN]), 0);
+	probes[P_EXPLICIT_CERT] = make_cert(explicit, ca, 42, "user");
+}
+
+static struct sshbuf *
+krl_new(void)
+{
+	struct sshbuf *b;
+
+	ASSERT_PTR_NE(b = sshbuf_new(), NULL);
+	ASSERT_INT_EQ(sshbuf_put(b, KRL_MAGIC, sizeof(KRL_MAGIC) - 1), 0);
+	ASSERT_INT_EQ(sshbuf_put_u32(b, KRL_FORMAT_VERSION), 0);
+	ASSERT_INT_EQ(sshbuf_put_u64(b, 1), 0);		/* KRL version */
+	ASSERT_INT_EQ(sshbuf_put_u64(b, 0), 0);		/* generated */
+	ASSERT_INT_EQ(sshbuf_put_u64(b, 0), 0);		/* flags */
+	ASSERT_INT_EQ(sshbuf_put_string(b, NULL, 0), 0);	/* reserved */
+	ASSERT_INT_EQ(sshbuf_put_cstring(b, "test"), 0);	/* comment */
+	return b;
+}
+
+/* Appends a section or subsection and frees its contents */
+static void
+put_section(struct sshbuf *b, u_char type, struct sshbuf *sect)
+{
+	ASSERT_INT_EQ(sshbuf_put_u8(b, type), 0);
+	ASSERT_INT_EQ(sshbuf_put_stringb(b, sect), 0);
+	sshbuf_free(sect);
+}
+
+/* Starts a KRL_SECTION_CERTIFICATES section for a CA */
+static struct sshbuf *
+certs_new(const struct sshkey *signer)
+{
+	struct sshbuf *b;
+	u_char *blob;
+	size_t len;
+
+	ASSERT_PTR_NE(b = sshbuf_new(), NULL);
+	ASSERT_INT_EQ(sshkey_plain_to_blob(signer, &blob, &len), 0);
+	ASSERT_INT_EQ(sshbuf_put_string(b, blob, len), 0);
+	ASSERT_INT_EQ(sshbuf_put_string(b, NULL, 0), 0);	/* reserved */
+	free(blob);
+	return b;
+}
+
+static void
+put_serials(struct sshbuf *certs, const u_int64_t *serials, size_t n)
+{
+	struct sshbuf *b;
+	size_t i;
+
+	ASSERT_PTR_NE(b = sshbuf_new(), NULL);
+	for (i = 0; i < n; i++)
+		ASSERT_INT_EQ(sshbuf_put_u64(b, serials[i]), 0);
+	put_section(certs, KRL_SECTION_CERT_SERIAL_LIST, b);
+}
+
+static void
+put_range(struct sshbuf *certs, u_int64_t lo, u_int64_t hi)
+{
+	struct sshbuf *b;
+
+	ASSERT_PTR_NE(b = sshbuf_new(), NULL);
+	ASSERT_INT_EQ(sshbuf_put_u64(b, lo), 0);
+	ASSERT_INT_EQ(sshbuf_put_u64(b, hi), 0);
+	put_section(certs, KRL_SECTION_CERT_SERIAL_RANGE, b);
+}
+
+/* The bitmap is the raw mpint, so that malformed ones can be written */
+static void
+put_bitmap(struct sshbuf *certs, u_int64_t lo, const u_char *bits,
+    size_t len)
+{
+	struct sshbuf *b;
+
+	ASSERT_PTR_NE(b = sshbuf_new(), NULL);
+	ASSERT_INT_EQ(sshbuf_put_u64(b, lo), 0);
+	ASSERT_INT_EQ(sshbuf_put_string(b, bits, len), 0);
+	put_section(certs, KRL_SECTION_CERT_SERIAL_BITMAP, b);
+}
+
+static void
+put_key_id(struct sshbuf *certs, const char *key_id, size_t len)
+{
+	struct sshbuf *b;
+
+	ASSERT_PTR_NE(b = sshbuf_new(), NULL);
+	ASSERT_INT_EQ(sshbuf_put_string(b, key_id, len), 0);
+	put_section(certs, KRL_SECTION_CERT_KEY_ID, b);
+}
+
+static void
+put_explicit(struct sshbuf *krl, const struct sshkey *key)
+{
+	struct sshbuf *b;
+	u_char *blob;
+	size_t len;
+
+	ASSERT_PTR_NE(b = sshbuf_new(), NULL);
+	ASSERT_INT_EQ(sshkey_plain_to_blob(key, &blob, &len), 0);
+	ASSERT_INT_EQ(sshbuf_put_string(b, blob, len), 0);
+	free(blob);
+	put_section(krl, KRL_SECTION_EXPLICIT_KEY, b);
+}
+
+static void
+put_sha1(struct sshbuf *krl, const struct sshkey *key, size_t len)
+{
+	struct sshbuf *b;
+	u_char *fp;
+	size_t fplen;
+
+	ASSERT_PTR_NE(fp = sshkey_fingerprint_raw(key, SSH_FP_SHA1, &fplen),
+	    NULL);
+	ASSERT_SIZE_T_GE(fplen, len);
+	ASSERT_PTR_NE(b = sshbuf_new(), NULL);
+	ASSERT_INT_EQ(sshbuf_put_string(b, fp, len), 0);
+	free(fp);
+	put_section(krl, KRL_SECTION_FINGERPRINT_SHA1, b);
+}
+
+/*
+ * Each KRL goes in a new file, so that the single entry cache of
+ * ssh_krl_file_contains_key() can not confuse two of them.
+ */
+static void
+write_krl(const struct sshbuf *krl, char *path, size_t len)
+{
+	int fd;
+
+	snprintf(path, len, "%s/krl.%u", tmpdir, nfiles++);
+	ASSERT_INT_NE(fd = open(path, O_WRONLY|O_CREAT|O_EXCL, 0600), -1);
+	ASSERT_SIZE_T_EQ((size_t)write(fd, sshbuf_ptr(krl), sshbuf_len(krl)),
+	    sshbuf_len(krl));
+	ASSERT_INT_EQ(close(fd), 0);
+}
+
+/* Checks every probe against both parsers; revoked[] ends with -1 */
+static void
+check_krl(struct sshbuf *krl, const int *revoked)
+{
+	struct ssh_krl *k = NULL;
+	struct sshbuf *copy;
+	char path[PATH_MAX];
+	int i, j, expect, r;
+
+	write_krl(krl, path, sizeof(path));
+	ASSERT_PTR_NE(copy = sshbuf_fromb(krl), NULL);
+	ASSERT_INT_EQ(ssh_krl_from_blob(copy, &k, NULL, 0), 0);
+	ASSERT_PTR_NE(k, NULL);
+	for (i = 0; i < P_MAX; i++) {
+		for (expect = 0, j = 0; revoked[j] != -1; j++) {
+			if (revoked[j] == i)
+				expect = SSH_ERR_KEY_REVOKED;
+		}
+		r = ssh_krl_check_key(k, probes[i]);
+		ASSERT_INT_EQ(r, expect);
+		ASSERT_INT_EQ(ssh_krl_file_contains_key(path, probes[i]), r);
+	}
+	ssh_krl_free(k);
+	sshbuf_free(copy);
+	sshbuf_free(krl);
+}
+
+/* Both parsers must refuse a malformed KRL */
+static void
+check_bad_krl(struct sshbuf *krl)
+{
+	struct ssh_krl *k = NULL;
+	struct sshbuf *copy;
+	char path[PATH_MAX];
+	int r;
+
+	write_krl(krl, path, sizeof(path));
+	ASSERT_PTR_NE(copy = sshbuf_fromb(krl), NULL);
+	ASSERT_INT_NE(ssh_krl_from_blob(copy, &k, NULL, 0), 0);
+	ASSERT_PTR_EQ(k, NULL);
+	r = ssh_krl_file_contains_key(path, probes[P_PLAIN]);
+	ASSERT_INT_NE(r, 0);
+	ASSERT_INT_NE(r, SSH_ERR_KRL_BAD_MAGIC);
+	sshbuf_free(copy);
+	sshbuf_free(krl);
+}
+
+/* Returns the filter bytes of the Bloom filter section of a KRL */
+static u_char *
+bloom_filter(struct sshbuf *krl, size_t *lenp)
+{
+	struct sshbuf *b;
+	const u_char *p;
+	size_t len, off = 0;
+	u_char type;
+
+	ASSERT_PTR_NE(b = sshbuf_fromb(krl), NULL);
+	ASSERT_INT_EQ(sshbuf_consume(b, sizeof(KRL_MAGIC) - 1 + 4 + 3 * 8), 0);
+	ASSERT_INT_EQ(sshbuf_skip_string(b), 0);	/* reserved */
+	ASSERT_INT_EQ(sshbuf_skip_string(b), 0);	/* comment */
+	while (sshbuf_len(b) > 0) {
+		ASSERT_INT_EQ(sshbuf_get_u8(b, &type), 0);
+		ASSERT_INT_EQ(sshbuf_get_string_direct(b, &p, &len), 0);
+		if (type != KRL_SECTION_BLOOM_FILTER)
+			continue;
+		/* skip nhash and the filter length */
+		ASSERT_SIZE_T_GT(len, 8);
+		off = p + 8 - sshbuf_ptr(krl);
+		*lenp = len - 8;
+	}
+	sshbuf_free(b);
+	ASSERT_SIZE_T_NE(off, 0);
+	return sshbuf_mutable_ptr(krl) + off;
+}
+
+/* A KRL with one certificates section holding one subsection */
+static struct sshbuf *
+bad_certs(struct sshbuf *certs)
+{
+	struct sshbuf *krl = krl_new();
+
+	put_section(krl, KRL_SECTION_CERTIFICATES, certs);
+	return krl;
+}
+
+void
+krl_tests(void)
+{
+	struct ssh_krl *k;
+	struct sshbuf *krl, *certs, *b, *bloomkrl;
+	static const u_int64_t sorted[] = { 1, 5, 9 };
+	static const u_int64_t unsorted[] = { 20, 3 };
+	static const u_int64_t odd[] = { 200, 100, 201 };
+	static const u_int64_t zero[] = { 5, 0 };
+	static const u_char bitmap[] = { 0x04, 0x09 };	/* 1000, 1003, 1010 */
+	static const u_char negative[] = { 0x80, 0x01 };
+	static const u_char lowbit[] = { 0x01 };
+	static const int bloom_revoked[] = { P_SERIAL100, P_SERIAL150,
+	    P_SERIAL200, P_KEYID, P_EXPLICIT, P_SHA1, P_EXPLICIT_CERT, -1 };
+	char path[PATH_MAX];
+	u_char *filter;
+	size_t len;
+	u_int i;
+
+	TEST_START("krl setup");
+	make_probes();
+	strlcpy(tmpdir, "/tmp/test_krl.XXXXXXXX", sizeof(tmpdir));
+	ASSERT_PTR_NE(mkdtemp(tmpdir), NULL);
+	TEST_DONE();
+
+	TEST_START("krl empty");
+	check_krl(krl_new(), (const int []){ -1 });
+	TEST_DONE();
+
+	TEST_START("krl serial lists");
+	krl = krl_new();
+	certs = certs_new(ca);
+	put_serials(certs, sorted, 3);
+	put_serials(certs, unsorted, 2);
+	put_serials(certs, NULL, 0);
+	put_section(krl, KRL_SECTION_CERTIFICATES, certs);
+	check_krl(krl, (const int []){ P_SERIAL1, P_SERIAL3, P_SERIAL5,
+	    P_SERIAL9, P_SERIAL20, -1 });
+	TEST_DONE();
+
+	TEST_START("krl serial ranges");
+	krl = krl_new();
+	certs = certs_new(ca);
+	put_range(certs, 140, 200);
+	put_range(certs, 100, 150);
+	put_range(certs, 1000, 1000);
+	put_section(krl, KRL_SECTION_CERTIFICATES, certs);
+	check_krl(krl, (const int []){ P_SERIAL100, P_SERIAL150,
+	    P_SERIAL200, P_SERIAL1000, -1 });
+	TEST_DONE();
+
+	TEST_START("krl serial bitmap");
+	krl = krl_new();
+	certs = certs_new(ca);
+	put_bitmap(certs, 1000, bitmap, sizeof(bitmap));
+	put_bitmap(certs, 5, NULL, 0);
+	put_section(krl, KRL_SECTION_CERTIFICATES, certs);
+	check_krl(krl, (const int []){ P_SERIAL1000, P_SERIAL1003,
+	    P_SERIAL1010, -1 });
+	TEST_DONE();
+
+	TEST_START("krl serial mixed");
+	krl = krl_new();
+	certs = certs_new(ca);
+	put_serials(certs, odd, 3);
+	put_bitmap(certs, 993, bitmap, sizeof(bitmap));
+	put_range(certs, 1, 3);
+	put_section(krl, KRL_SECTION_CERTIFICATES, certs);
+	/* the same CA again, in a second section */
+	certs = certs_new(ca);
+	put_range(certs, 1011, 1011);
+	put_section(krl, KRL_SECTION_CERTIFICATES, certs);
+	check_krl(krl, (const int []){ P_SERIAL1, P_SERIAL3, P_SERIAL100,
+	    P_SERIAL200, P_SERIAL201, P_SERIAL1003, P_SERIAL1011, -1 });
+	TEST_DONE();
+
+	TEST_START("krl key ids");
+	krl = krl_new();
+	certs = certs_new(ca);
+	put_key_id(certs, "revoked-id", 10);
+	put_key_id(certs, "", 0);
+	put_section(krl, KRL_SECTION_CERTIFICATES, certs);
+	check_krl(krl, (const int []){ P_KEYID, -1 });
+	TEST_DONE();
+
+	TEST_START("krl other CA");
+	krl = krl_new();
+	certs = certs_new(other_ca);
+	put_key_id(certs, "revoked-id", 10);
+	put_section(krl, KRL_SECTION_CERTIFICATES, certs);
+	check_krl(krl, (const int []){ P_OTHERCA, -1 });
+	TEST_DONE();
+
+	TEST_START("krl explicit keys");
+	krl = krl_new();
+	put_explicit(krl, explicit);
+	check_krl(krl, (const int []){ P_EXPLICIT, P_EXPLICIT_CERT, -1 });
+	TEST_DONE();
+
+	TEST_START("krl SHA1 fingerprints");
+	krl = krl_new();
+	put_sha1(krl, sha1, 20);
+	check_krl(krl, (const int []){ P_SHA1, -1 });
+	TEST_DONE();
+
+	TEST_START("krl revoked CA");
+	krl = krl_new();
+	put_explicit(krl, ca);
+	check_krl(krl, (const int []){ P_SERIAL1, P_SERIAL3, P_SERIAL5,
+	    P_SERIAL9, P_SERIAL20, P_SERIAL21, P_SERIAL100, P_SERIAL150,
+	    P_SERIAL200, P_SERIAL201, P_SERIAL1000, P_SERIAL1001,
+	    P_SERIAL1003, P_SERIAL1010, P_SERIAL1011, P_KEYID, P_SERIAL0,
+	    P_EXPLICIT_CERT, -1 });
+	TEST_DONE();
+
+	TEST_START("krl all sections");
+	krl = krl_new();
+	certs = certs_new(ca);
+	put_serials(certs, sorted, 3);
+	put_range(certs, 100, 200);
+	put_bitmap(certs, 1000, bitmap, sizeof(bitmap));
+	put_key_id(certs, "revoked-id", 10);
+	put_section(krl, KRL_SECTION_CERTIFICATES, certs);
+	put_explicit(krl, explicit);
+	put_sha1(krl, sha1, 20);
+	check_krl(krl, (const int []){ P_SERIAL1, P_SERIAL5, P_SERIAL9,
+	    P_SERIAL100, P_SERIAL150, P_SERIAL200, P_SERIAL1000,
+	    P_SERIAL1003, P_SERIAL1010, P_KEYID, P_EXPLICIT, P_SHA1,
+	    P_EXPLICIT_CERT, -1 });
+	TEST_DONE();
+
+	TEST_START("krl Bloom filter");
+	ASSERT_PTR_NE(k = ssh_krl_init(), NULL);
+	ssh_krl_set_bloom(k, 16);
+	ASSERT_INT_EQ(ssh_krl_revoke_key_explicit(k, explicit), 0);
+	ASSERT_INT_EQ(ssh_krl_revoke_key_sha1(k, sha1), 0);
+	ASSERT_INT_EQ(ssh_krl_revoke_cert_by_key_id(k, ca, "revoked-id"), 0);
+	ASSERT_INT_EQ(ssh_krl_revoke_cert_by_serial_range(k, ca, 100, 200), 0);
+	ASSERT_PTR_NE(bloomkrl = sshbuf_new(), NULL);
+	ASSERT_INT_EQ(ssh_krl_to_blob(k, bloomkrl, NULL, 0), 0);
+	ssh_krl_free(k);
+	ASSERT_PTR_NE(krl = sshbuf_fromb(bloomkrl), NULL);
+	check_krl(krl, bloom_revoked);
+	TEST_DONE();
+
+	TEST_START("krl Bloom filter incomplete");
+	filter = bloom_filter(bloomkrl, &len);
+	memset(filter, 0, len);
+	ASSERT_PTR_NE(krl = sshbuf_fromb(bloomkrl), NULL);
+	check_krl(krl, bloom_revoked);
+	TEST_DONE();
+
+	TEST_START("krl Bloom filter full");
+	memset(filter, 0xff, len);
+	ASSERT_PTR_NE(krl = sshbuf_fromb(bloomkrl), NULL);
+	check_krl(krl, bloom_revoked);
+	sshbuf_free(bloomkrl);
+	TEST_DONE();
+
+	TEST_START("krl malformed serial list");
+	certs = certs_new(ca);
+	ASSERT_PTR_NE(b = sshbuf_new(), NULL);
+	ASSERT_INT_EQ(sshbuf_put_u64(b, 1), 0);
+	ASSERT_INT_EQ(sshbuf_put_u32(b, 2), 0);
+	put_section(certs, KRL_SECTION_CERT_SERIAL_LIST, b);
+	check_bad_krl(bad_certs(certs));
+	certs = certs_new(ca);
+	put_serials(certs, zero, 2);
+	check_bad_krl(bad_certs(certs));
+	TEST_DONE();
+
+	TEST_START("krl malformed serial range");
+	certs = certs_new(ca);
+	ASSERT_PTR_NE(b = sshbuf_new(), NULL);
+	ASSERT_INT_EQ(sshbuf_put_u64(b, 1), 0);
+	put_section(certs, KRL_SECTION_CERT_SERIAL_RANGE, b);
+	check_bad_krl(bad_certs(certs));
+	certs = certs_new(ca);
+	put_range(certs, 200, 100);
+	check_bad_krl(bad_certs(certs));
+	certs = certs_new(ca);
+	put_range(certs, 0, 100);
+	check_bad_krl(bad_certs(certs));
+	TEST_DONE();
+
+	TEST_START("krl malformed serial bitmap");
+	certs = certs_new(ca);
+	put_bitmap(certs, 1000, negative, sizeof(negative));
+	check_bad_krl(bad_certs(certs));
+	certs = certs_new(ca);
+	put_bitmap(certs, 0, lowbit, sizeof(lowbit));
+	check_bad_krl(bad_certs(certs));
+	certs = certs_new(ca);
+	put_bitmap(certs, 0xfffffffffffffffcULL, bitmap, sizeof(bitmap));
+	check_bad_krl(bad_certs(certs));
+	certs = certs_new(ca);
+	ASSERT_PTR_NE(b = sshbuf_new(), NULL);
+	ASSERT_INT_EQ(sshbuf_put_u64(b, 1000), 0);
+	ASSERT_INT_EQ(sshbuf_put_string(b, bitmap, sizeof(bitmap)), 0);
+	ASSERT_INT_EQ(sshbuf_put_u8(b, 0), 0);	/* trailing garbage */
+	put_section(certs, KRL_SECTION_CERT_SERIAL_BITMAP, b);
+	check_bad_krl(bad_certs(certs));
+	TEST_DONE();
+
+	TEST_START("krl malformed key id");
+	certs = certs_new(ca);
+	put_key_id(certs, "revoked\0id", 10);
+	check_bad_krl(bad_certs(certs));
+	certs = certs_new(ca);
+	ASSERT_PTR_NE(b = sshbuf_new(), NULL);
+	ASSERT_INT_EQ(sshbuf_put_u32(b, 10), 0);
+	ASSERT_INT_EQ(sshbuf_put(b, "revoked", 7), 0);
+	put_section(certs, KRL_SECTION_CERT_KEY_ID, b);
+	check_bad_krl(bad_certs(certs));
+	TEST_DONE();
+
+	TEST_START("krl malformed sections");
+	certs = certs_new(ca);
+	ASSERT_PTR_NE(b = sshbuf_new(), NULL);
+	put_section(certs, 0x30, b);	/* unknown subsection */
+	check_bad_krl(bad_certs(certs));
+	krl = krl_new();
+	ASSERT_PTR_NE(b = sshbuf_new(), NULL);
+	put_section(krl, 9, b);		/* unknown section */
+	check_bad_krl(krl);
+	krl = krl_new();
+	put_sha1(krl, sha1, 19);
+	check_bad_krl(krl);
+	krl = krl_new();
+	ASSERT_PTR_NE(b = sshbuf_new(), NULL);
+	ASSERT_INT_EQ(sshbuf_put_u32(b, 100), 0);
+	ASSERT_INT_EQ(sshbuf_put(b, "short", 5), 0);
+	put_section(krl, KRL_SECTION_EXPLICIT_KEY, b);
+	check_bad_krl(krl);
+	krl = krl_new();
+	ASSERT_INT_EQ(sshbuf_put_u8(krl, KRL_SECTION_EXPLICIT_KEY), 0);
+	ASSERT_INT_EQ(sshbuf_put_u32(krl, 100), 0);	/* truncated */
+	check_bad_krl(krl);
+	TEST_DONE();
+
+	TEST_START("krl cleanup");
+	for (i = 0; i < nfiles; i++) {
+		snprintf(path, sizeof(path), "%s/krl.%u", tmpdir, i);
+		ASSERT_INT_EQ(unlink(path), 0);
+	}
+	ASSERT_INT_EQ(rmdir(tmpdir), 0);
+	for (i = 0; i < P_MAX; i++)
+		sshkey_free(probes[i]);
+	sshkey_free(ca);
+	sshkey_free(other_ca);
+	sshkey_free(user);
+	sshkey_free(explicit);
+	sshkey_free(sha1);
+	TEST_DONE();
+}
@@ -0,0 +1,21 @@
+/* 	$OpenBSD$ */
+/*
+ * Regress test for krl.h key revocation list API
+ *
+ * Placed in the public domain
+ */
+
+#include <openssl/evp.h>
+
+#include "test_helper.h"
+
+void krl_tests(void);
+
+void
+tests(void)
+{
+	OpenSSL_add_all_algorithms();
+	ERR_load_CRYPTO_strings();
+
+	krl_tests();
+}
@@ -0,0 +1,251 @@
+/* 	$OpenBSD$ */
+/*
+ * Regress test for match.c pattern matching
+ *
+ * Placed in the public domain
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test_helper.h"
+
+#include "match.h"
+
+void match_tests(void);
+
+struct match_case {
+	const char *pattern, *string;
+};
+
+static void
+onerror(void *mc)
+{
+	fprintf(stderr, "Failed matching \"%s\" against \"%s\"\n",
+	    ((struct match_case *)mc)->string,
+	    ((struct match_case *)mc)->pattern);
+}
+
+/* The recursive matcher that match_pattern() replaced */
+static int
+ref_match_pattern(const char *s, const char *pattern)
+{
+	for (;;) {
+		if (!*pattern)
+			return !*s;
+		if (*pattern == '*') {
+			pattern++;
+			if (!*pattern)
+				return 1;
+			if (*pattern != '?' && *pattern != '*') {
+				for (; *s; s++)
+					if (*s == *pattern &&
+					    ref_match_pattern(s + 1,
+					    pattern + 1))
+						return 1;
+				return 0;
+			}
+			for (; *s; s++)
+				if (ref_match_pattern(s, pattern))
+					return 1;
+			return 0;
+		}
+		if (!*s)
+			return 0;
+		if (*pattern != '?' && *pattern != *s)
+			return 0;
+		s++;
+		pattern++;
+	}
+}
+
+/* The list scanner that match_pattern_list() falls back to */
+static int
+ref_match_list(const char *s, const char *list, int dolower)
+{
+	char sub[256];
+	u_int i, subi, len = strlen(list);
+	int negated, ret = 0;
+
+	for (i = 0; i < len;) {
+		if ((negated = list[i] == '!'))
+			i++;
+		for (subi = 0; i < len && list[i] != ','; subi++, i++)
+			sub[subi] = dolower ?
+			    tolower((u_char)list[i]) : list[i];
+		sub[subi] = '\0';
+		if (i < len && list[i] == ',')
+			i++;
+		if (ref_match_pattern(s, sub)) {
+			if (negated)
+				return -1;
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
+/* Fill buf with the n'th string of length len over the alphabet */
+static void
+nth_string(char *buf, const char *alphabet, u_int len, u_int n)
+{
+	u_int i, nalpha = strlen(alphabet);
+
+	for (i = 0; i < len; i++, n /= nalpha)
+		buf[i] = alphabet[n % nalpha];
+	buf[len] = '\0';
+}
+
+static u_int
+npow(u_int base, u_int exp)
+{
+	u_int r = 1;
+
+	while (exp-- > 0)
+		r *= base;
+	return r;
+}
+
+static const char *list_subpatterns[] = {
+	"a", "b", "ab", "a*", "*b", "?", "a?b", "**", "*", "A", "aB*", "",
+	"!a", "!*b", "!?", "!ab", "!", "!A*",
+};
+static const char *list_strings[] = {
+	"", "a", "b", "ab", "ba", "aab", "abb", "A", "ab*",
+};
+
+void
+match_tests(void)
+{
+	char pattern[8], string[8], list[256], big[256];
+	struct match_patterns *mp;
+	struct match_case mc;
+	u_int plen, slen, np, ns, i, j, n, seed;
+	int dolower, r;
+
+	memset(&mc, 0, sizeof(mc));
+	TEST_ONERROR(onerror, &mc);
+
+	TEST_START("match_pattern basics");
+	ASSERT_INT_EQ(match_pattern("", ""), 1);
+	ASSERT_INT_EQ(match_pattern("a", ""), 0);
+	ASSERT_INT_EQ(match_pattern("", "*"), 1);
+	ASSERT_INT_EQ(match_pattern("", "**"), 0);
+	ASSERT_INT_EQ(match_pattern("", "?"), 0);
+	ASSERT_INT_EQ(match_pattern("abc", "*"), 1);
+	ASSERT_INT_EQ(match_pattern("abc", "a*"), 1);
+	ASSERT_INT_EQ(match_pattern("abc", "*c"), 1);
+	ASSERT_INT_EQ(match_pattern("abc", "*b"), 0);
+	ASSERT_INT_EQ(match_pattern("abc", "a?c"), 1);
+	ASSERT_INT_EQ(match_pattern("ac", "a?c"), 0);
+	ASSERT_INT_EQ(match_pattern("abc", "???"), 1);
+	ASSERT_INT_EQ(match_pattern("abc", "????"), 0);
+	ASSERT_INT_EQ(match_pattern("abc", "*?"), 1);
+	ASSERT_INT_EQ(match_pattern("a", "a**"), 0);
+	ASSERT_INT_EQ(match_pattern("ab", "a**"), 1);
+	ASSERT_INT_EQ(match_pattern("host.example.com", "*.example.com"), 1);
+	ASSERT_INT_EQ(match_pattern("example.com", "*.example.com"), 0);
+	ASSERT_INT_EQ(match_pattern("a.b.example.com", "*.?.example.*"), 1);
+	TEST_DONE();
+
+	TEST_START("match_pattern against recursive matcher");
+	for (plen = 0; plen <= 5; plen++) {
+		np = npow(4, plen);
+		for (i = 0; i < np; i++) {
+			nth_string(pattern, "ab*?", plen, i);
+			for (slen = 0; slen <= 4; slen++) {
+				ns = npow(2, slen);
+				for (j = 0; j < ns; j++) {
+					nth_string(string, "ab", slen, j);
+					mc.pattern = pattern;
+					mc.string = string;
+					ASSERT_INT_EQ(match_pattern(string,
+					    pattern),
+					    ref_match_pattern(string, pattern));
+				}
+			}
+		}
+	}
+	TEST_DONE();
+
+	TEST_START("match_pattern pathological backtracking");
+	/* Exponential for a matcher that backtracks into every asterisk */
+	memset(big, 'a', 200);
+	big[200] = '\0';
+	ASSERT_INT_EQ(match_pattern(big,
+	    "*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*b"), 0);
+	ASSERT_INT_EQ(match_pattern(big,
+	    "*?*?*?*?*?*?*?*?*?*?*?*?*?*?*?*?*?*?*?*?b"), 0);
+	ASSERT_INT_EQ(match_pattern(big, "**********************b"), 0);
+	ASSERT_INT_EQ(match_pattern(big,
+	    "*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a"), 1);
+	big[199] = 'b';
+	ASSERT_INT_EQ(match_pattern(big,
+	    "*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*b"), 1);
+	TEST_DONE();
+
+	TEST_START("match_pattern_list negation and empty patterns");
+	ASSERT_INT_EQ(match_pattern_list("a", "", 0, 0), 0);
+	ASSERT_INT_EQ(match_pattern_list("", "", 0, 0), 0);
+	ASSERT_INT_EQ(match_pattern_list("", "a,,b", 4, 0), 1);
+	ASSERT_INT_EQ(match_pattern_list("", "a,!", 3, 0), -1);
+	ASSERT_INT_EQ(match_pattern_list("a", "a,!", 3, 0), 1);
+	ASSERT_INT_EQ(match_pattern_list("ab", "a*,!*b", 6, 0), -1);
+	ASSERT_INT_EQ(match_pattern_list("ab", "!*b,a*", 6, 0), -1);
+	ASSERT_INT_EQ(match_pattern_list("aa", "!*b,a*", 6, 0), 1);
+	ASSERT_INT_EQ(match_pattern_list("ba", "!*b,a*", 6, 0), 0);
+	ASSERT_INT_EQ(match_hostname("host.example.com",
+	    "*.EXAMPLE.com,!bad.example.com", 30), 1);
+	ASSERT_INT_EQ(match_hostname("bad.example.com",
+	    "*.EXAMPLE.com,!bad.example.com", 30), -1);
+	TEST_DONE();
+
+	TEST_START("match_patterns_compile against list scanner");
+	for (dolower = 0; dolower <= 1; dolower++) {
+		seed = 1;
+		for (n = 0; n < 2000; n++) {
+			list[0] = '\0';
+			for (i = 0; i < 1 + n % 12; i++) {
+				seed = seed * 1103515245 + 12345;
+				if (i > 0)
+					strlcat(list, ",", sizeof(list));
+				strlcat(list, list_subpatterns[(seed >> 16) %
+				    (sizeof(list_subpatterns) /
+				    sizeof(*list_subpatterns))], sizeof(list));
+			}
+			ASSERT_PTR_NE(mp = match_patterns_compile(list,
+			    strlen(list), dolower), NULL);
+			for (j = 0; j < sizeof(list_strings) /
+			    sizeof(*list_strings); j++) {
+				mc.pattern = list;
+				mc.string = list_strings[j];
+				r = ref_match_list(list_strings[j], list,
+				    dolower);
+				ASSERT_INT_EQ(match_patterns_match(mp,
+				    list_strings[j]), r);
+				/* Compiled and cached from 8 subpatterns */
+				ASSERT_INT_EQ(match_pattern_list(
+				    list_strings[j], list, strlen(list),
+				    dolower), r);
+			}
+			match_patterns_free(mp);
+		}
+	}
+	TEST_DONE();
+
+	TEST_START("match_pattern_list cache keyed on length");
+	strlcpy(list, "a,b,c,d,e,f,g,h,i", sizeof(list));
+	ASSERT_INT_EQ(match_pattern_list("i", list, strlen(list), 0), 1);
+	ASSERT_INT_EQ(match_pattern_list("i", list, strlen(list) - 2, 0), 0);
+	ASSERT_INT_EQ(match_pattern_list("i", list, strlen(list), 0), 1);
+	ASSERT_INT_EQ(match_pattern_list("I", list, strlen(list), 0), 0);
+	strlcpy(list, "A,B,C,D,E,F,G,H,I", sizeof(list));
+	ASSERT_INT_EQ(match_pattern_list("i", list, strlen(list), 1), 1);
+	ASSERT_INT_EQ(match_pattern_list("i", list, strlen(list), 0), 0);
+	TEST_DONE();
+}
@@ -0,0 +1,14 @@
+/* 	$OpenBSD$ */
+/*
+ * Placed in the public domain
+ */
+
+#include "test_helper.h"
+
+void match_tests(void);
+
+void
+tests(void)
+{
+	match_tests();
+}
@@ -0,0 +1,195 @@
+/* 	$OpenBSD$ */
+/*
+ * Benchmark starting commands the way sshd does for non-interactive
+ * sessions: launches/sec and latency percentiles for fork() and vfork()
+ * from a process of a given size.
+ *
+ * Placed in the public domain
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <paths.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_COMMAND	"true"
+#define DEFAULT_METHODS	"fork,vfork"
+#define DEFAULT_HEAP	16		/* MB */
+
+extern char *__progname;
+extern char **environ;
+
+static double
+elapsed_usec(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e6 +
+	    (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : (x > y);
+}
+
+static double
+percentile(const double *v, u_int n, u_int pct)
+{
+	u_int i;
+
+	if (n == 0)
+		return 0;
+	i = ((u_int64_t)n * pct + 99) / 100;
+	return v[i == 0 ? 0 : i - 1];
+}
+
+/* Start argv as session.c does, "shell -c command", and wait for it */
+static int
+launch(int use_vfork, char * const *argv)
+{
+	pid_t pid;
+	int status;
+
+	if ((pid = use_vfork ? vfork() : fork()) == -1) {
+		fprintf(stderr, "%s: %s\n", use_vfork ? "vfork" : "fork",
+		    strerror(errno));
+		return -1;
+	}
+	if (pid == 0) {
+		execve(_PATH_BSHELL, argv, environ);
+		_exit(127);
+	}
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			fprintf(stderr, "waitpid: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "command failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+run_bench(const char *method, char * const *argv, u_int count, u_int heap)
+{
+	struct timespec start, end, t0, t1;
+	double *lat, secs;
+	u_int i;
+	int use_vfork, ret = -1;
+
+	if (strcmp(method, "fork") == 0)
+		use_vfork = 0;
+	else if (strcmp(method, "vfork") == 0)
+		use_vfork = 1;
+	else {
+		fprintf(stderr, "unknown method \"%s\"\n", method);
+		return -1;
+	}
+	if ((lat = calloc(count, sizeof(*lat))) == NULL)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (launch(use_vfork, argv) != 0)
+			goto out;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		lat[i] = elapsed_usec(&t0, &t1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = elapsed_usec(&start, &end) / 1e6;
+
+	qsort(lat, count, sizeof(*lat), cmp_double);
+	printf("%s heap %uMB: %u launches in %.2fs %.1f/s"
+	    " p50 %.0f p90 %.0f p99 %.0f max %.0f us\n",
+	    method, heap, count, secs, secs > 0 ? count / secs : 0,
+	    percentile(lat, count, 50), percentile(lat, count, 90),
+	    percentile(lat, count, 99), lat[count - 1]);
+	ret = 0;
+ out:
+	free(lat);
+	return ret;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: %s [-c command] [-m megabytes] [-n count] [-p methods]\n",
+	    __progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	char *command = DEFAULT_COMMAND, *methods = DEFAULT_METHODS;
+	char *ml, *mcp, *method, *ballast, *cargv[4];
+	const char *errstr;
+	u_int count = 1000, heap = DEFAULT_HEAP;
+	int ch, ret = 0;
+
+	while ((ch = getopt(argc, argv, "c:m:n:p:")) != -1) {
+		switch (ch) {
+		case 'c':
+			command = optarg;
+			break;
+		case 'm':
+			heap = strtonum(optarg, 0, 65536, &errstr);
+			if (errstr != NULL)
+				usage();
+			break;
+		case 'n':
+			count = strtonum(optarg, 1, 10000000, &errstr);
+			if (errstr != NULL)
+				usage();
+			break;
+		case 'p':
+			methods = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc != optind)
+		usage();
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	/* Stand in for the memory of a post-authentication sshd */
+	if (heap > 0) {
+		if ((ballast = malloc((size_t)heap << 20)) == NULL) {
+			fprintf(stderr, "malloc failed\n");
+			exit(1);
+		}
+		memset(ballast, 'x', (size_t)heap << 20);
+	}
+
+	cargv[0] = "sh";
+	cargv[1] = "-c";
+	cargv[2] = command;
+	cargv[3] = NULL;
+	if ((ml = strdup(methods)) == NULL) {
+		fprintf(stderr, "strdup failed\n");
+		exit(1);
+	}
+	for (mcp = ml; (method = strsep(&mcp, ",")) != NULL &&
+	    *method != '\0';) {
+		if (run_bench(method, cargv, count, heap) != 0)
+			ret = 1;
+	}
+	free(ml);
+	return ret;
+}
@@ -16,20 +16,63 @@
 #include <openssl/ec.h>
 #include <openssl/rsa.h>
 #include <openssl/dsa.h>
+#include <openssl/sha.h>
 
 #include "test_helper.h"
 
 #include "err.h"
+#include "ssh2.h"
 #define SSHBUF_INTERNAL 1	/* access internals for testing */
 #include "key.h"
 
 
 void sshkey_tests(void);
 
+static void
+precompute_and_sign(struct sshkey *k)
+{
+	struct sshkey *pub;
+	u_char data[] = "precompute", *sig;
+	size_t siglen;
+
+	ASSERT_INT_EQ(sshkey_precompute(k), 0);
+	ASSERT_INT_NE(k->flags & SSHKEY_FLAG_PRECOMPUTED, 0);
+	ASSERT_INT_EQ(sshkey_precompute(k), 0);
+	ASSERT_INT_EQ(sshkey_sign(k, &sig, &siglen, data, sizeof(data), 0), 0);
+	ASSERT_INT_EQ(sshkey_demote(k, &pub), 0);
+	ASSERT_INT_EQ(pub->flags & SSHKEY_FLAG_PRECOMPUTED, 0);
+	ASSERT_INT_EQ(sshkey_precompute(pub), 0);
+	ASSERT_INT_EQ(sshkey_verify(pub, sig, siglen, data, sizeof(data), 0),
+	    0);
+	sig[siglen - 1] ^= 0x01;
+	ASSERT_INT_NE(sshkey_verify(pub, sig, siglen, data, sizeof(data), 0),
+	    0);
+	sshkey_free(pub);
+	free(sig);
+}
+
+/* The certcache entry for a certificate blob, or NULL if there is none */
+static u_char *
+certcache_entry(u_char *cache, size_t len, const u_char *blob, size_t blen)
+{
+	u_char digest[SHA256_DIGEST_LENGTH];
+	size_t i, esize = sshkey_certcache_size(1);
+
+	ASSERT_PTR_NE(SHA256(blob, blen, digest), NULL);
+	for (i = 0; i + esize <= len; i += esize) {
+		if (memcmp(cache + i, digest, sizeof(digest)) == 0)
+			return cache + i;
+	}
+	return NULL;
+}
+
 void
 sshkey_tests(void)
 {
-	struct sshkey *k1, *kr, *kd, *ke;
+	struct sshkey *k1, *k2, *kr, *kd, *ke;
+	u_char *blob, *entry;
+	size_t blen;
+	u_char certcache[1024], saved[1024], zero[1024];
 
 	TEST_START("new invalid");
 	k1 = sshkey_new(-42);
@@ -211,6 +254,97 @@ sshkey_tests(void)
 	sshkey_free(k1);
 	TEST_DONE();
 
+	TEST_START("from_blob_cached shares parsed keys");
+	ASSERT_INT_EQ(sshkey_to_blob(ke, &blob, &blen), 0);
+	ASSERT_INT_EQ(sshkey_from_blob_cached(blob, blen, &k1), 0);
+	ASSERT_INT_EQ(sshkey_from_blob_cached(blob, blen, &k2), 0);
+	ASSERT_PTR_EQ(k1, k2);
+	ASSERT_INT_EQ(sshkey_equal(ke, k1), 1);
+	sshkey_free(k2);
+	ASSERT_INT_EQ(sshkey_equal(ke, k1), 1);
+	TEST_DONE();
+
+	TEST_START("from_blob_cached eviction keeps references valid");
+	sshkey_cache_limit(0);
+	ASSERT_INT_EQ(sshkey_equal(ke, k1), 1);
+	ASSERT_INT_EQ(sshkey_from_blob_cached(blob, blen, &k2), 0);
+	ASSERT_PTR_NE(k1, k2);
+	ASSERT_INT_EQ(sshkey_equal(k1, k2), 1);
+	sshkey_free(k1);
+	sshkey_free(k2);
+	sshkey_cache_limit(64);
+	free(blob);
+	TEST_DONE();
+
+	TEST_START("certcache remembers verified certificates");
+	memset(certcache, 0, sizeof(certcache));
+	memset(zero, 0, sizeof(zero));
+	sshkey_certcache_set(certcache, sizeof(certcache));
+	ASSERT_INT_EQ(sshkey_demote(ke, &k1), 0);
+	ASSERT_INT_EQ(sshkey_to_certified(k1, 0), 0);
+	k1->cert->type = SSH2_CERT_TYPE_USER;
+	k1->cert->key_id = strdup("certcache");
+	ASSERT_PTR_NE(k1->cert->key_id, NULL);
+	k1->cert->valid_before = 0xffffffffffffffffULL;
+	ASSERT_INT_EQ(sshkey_certify(k1, kd), 0);
+	ASSERT_INT_EQ(sshkey_to_blob(k1, &blob, &blen), 0);
+	ASSERT_INT_EQ(sshkey_from_blob(blob, blen, &k2), 0);
+	ASSERT_INT_EQ(sshkey_equal(k1, k2), 1);
+	sshkey_free(k2);
+	ASSERT_INT_NE(memcmp(certcache, zero, sizeof(certcache)), 0);
+	entry = certcache_entry(certcache, sizeof(certcache), blob, blen);
+	ASSERT_PTR_NE(entry, NULL);
+	memcpy(saved, certcache, sizeof(certcache));
+	ASSERT_INT_EQ(sshkey_from_blob(blob, blen, &k2), 0);
+	ASSERT_INT_EQ(sshkey_equal(k1, k2), 1);
+	sshkey_free(k2);
+	ASSERT_INT_EQ(memcmp(certcache, saved, sizeof(certcache)), 0);
+	TEST_DONE();
+
+	/*
+	 * Point the entry at a certificate with a broken signature: it can
+	 * only be accepted if its signature is not checked again.
+	 */
+	TEST_START("certcache skips verification on a hit");
+	blob[blen - 1] ^= 0x01;
+	ASSERT_INT_NE(sshkey_from_blob(blob, blen, &k2), 0);
+	ASSERT_INT_EQ(memcmp(certcache, saved, sizeof(certcache)), 0);
+	ASSERT_PTR_NE(SHA256(blob, blen, entry), NULL);
+	ASSERT_INT_EQ(sshkey_from_blob(blob, blen, &k2), 0);
+	sshkey_free(k2);
+	TEST_DONE();
+
+	TEST_START("certcache misses on a changed signature");
+	memcpy(saved, certcache, sizeof(certcache));
+	blob[blen - 1] ^= 0x03;
+	ASSERT_INT_NE(sshkey_from_blob(blob, blen, &k2), 0);
+	ASSERT_INT_EQ(memcmp(certcache, saved, sizeof(certcache)), 0);
+	/* The original now misses too, but verifies and is stored again */
+	blob[blen - 1] ^= 0x02;
+	ASSERT_PTR_EQ(certcache_entry(certcache, sizeof(certcache),
+	    blob, blen), NULL);
+	ASSERT_INT_EQ(sshkey_from_blob(blob, blen, &k2), 0);
+	ASSERT_INT_EQ(sshkey_equal(k1, k2), 1);
+	sshkey_free(k2);
+	ASSERT_PTR_NE(certcache_entry(certcache, sizeof(certcache),
+	    blob, blen), NULL);
+	sshkey_certcache_set(NULL, 0);
+	sshkey_free(k1);
+	free(blob);
+	TEST_DONE();
+
+	TEST_START("precompute KEY_RSA");
+	precompute_and_sign(kr);
+	TEST_DONE();
+
+	TEST_START("precompute KEY_DSA");
+	precompute_and_sign(kd);
+	TEST_DONE();
+
+	TEST_START("precompute KEY_ECDSA");
+	precompute_and_sign(ke);
+	TEST_DONE();
+
 	sshkey_free(kr);
 	sshkey_free(kd);
 	sshkey_free(ke);